@@ -0,0 +1,53 @@
+/* Device attributes that can be tested in conditions. */
+static struct {unsigned int id; char *name;} sisAttrTab[] = {
+{0x00, "Manufacturer"},
+{0x01, "ManufacturerHardwareRev"},
+{0x02, "ManufacturerSoftwareRev"},
+{0x03, "ManufacturerSoftwareBuild"},
+{0x04, "Model"},
+{0x05, "MachineUID"},
+{0x06, "DeviceFamily"},
+{0x07, "DeviceFamilyRev"},
+{0x08, "CPU type"},
+{0x09, "CPU arch"},
+{0x0a, "CPU ABI"},
+{0x0b, "CPU speed"},
+{0x0e, "System Tick Period"},
+{0x0f, "Total RAM"},
+{0x10, "Free RAM"},
+{0x11, "Total ROM"},
+{0x12, "Memory Page Size"},
+{0x15, "Power backup"},
+{0x18, "Keyboard"},
+{0x19, "Keyboard device key"},
+{0x1a, "Keyboard application key"},
+{0x1b, "Keyboard click"},
+{0x1e, "Keyboard clickVolMax"},
+{0x1f, "Screen width pixel"},
+{0x20, "Screen height pixel"},
+{0x21, "Screen width twips"},
+{0x22, "Screen height twips"},
+{0x23, "Display colors"},
+{0x26, "Display max contrast"},
+{0x27, "Backlight"},
+{0x29, "Pen"},
+{0x2a, "PenX"},
+{0x2b, "PenY"},
+{0x2c, "Pen display on"},
+{0x2d, "Pen click"},
+{0x30, "Pen volume max"},
+{0x31, "Mouse"},
+{0x32, "MouseX"},
+{0x33, "MouseY"},
+{0x37, "Mouse buttons"},
+{0x3a, "Case switch"},
+{0x3d, "Leds"},
+{0x3f, "Integrated phone"},
+{0x41, "Display brightness max"},
+{0x42, "Keyboard backlight state"},
+{0x43, "Accessory power"},
+{0x59, "Number of supported HAL attributes"},
+{0x1000, "Machine language"},
+{0x1001, "Remote install"},
+{0, NULL}
+};
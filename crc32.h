@@ -0,0 +1,12 @@
+/* crc32.h -- CRC-32 (IEEE 802.3, the one used by zip and gzip).
+ * This software is released under the GPL license
+ * see the COPYING file for more information */
+
+#ifndef __CRC32_H
+#define __CRC32_H
+
+#include <stddef.h>
+
+unsigned int crc32Update(unsigned int crc, const unsigned char *p, size_t len);
+
+#endif /* __CRC32_H */
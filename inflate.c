@@ -0,0 +1,366 @@
+/* inflate.c -- self-contained zlib stream decoder (RFC 1950/1951).
+ * This software is released under the GPL license
+ * see the COPYING file for more information
+ *
+ * A one-shot decoder: the whole compressed stream is in memory, and the
+ * output buffer is large enough for the uncompressed data, that SIS
+ * packages record in the file table. This makes the decoder very simple,
+ * as back references are always inside the output buffer itself.
+ *
+ * Huffman codes are decoded with a table indexed by the next FASTBITS
+ * bits of the input, that resolves almost every symbol with a single
+ * lookup. Longer codes are decoded one bit at a time using the canonical
+ * code counts, like the reference decoder puff.c does. */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "inflate.h"
+
+#define MAXBITS 15              /* longest deflate code */
+#define MAXLCODES 286           /* literal/length codes */
+#define MAXDCODES 30            /* distance codes */
+#define FIXLCODES 288           /* literal/length codes of fixed blocks */
+#define FASTBITS 10
+#define FASTSIZE (1<<FASTBITS)
+
+struct huffman {
+    unsigned short fast[FASTSIZE];      /* (length << 9) | symbol, or 0 */
+    unsigned short count[MAXBITS+1];    /* codes of every length */
+    unsigned short symbol[FIXLCODES];   /* symbols sorted by code */
+};
+
+struct state {
+    const unsigned char *in, *inend;
+    unsigned char *out, *outstart, *outend;
+    uint64_t bitbuf;
+    int bitcnt;
+    int pad;                /* zero bytes added past the end of input */
+};
+
+static const unsigned short lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char lext[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short dbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const unsigned char dext[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* Fill the bit buffer. Past the end of the input zero bytes are added,
+ * so that the decoder never needs to check for the end of the input in
+ * the inner loops: a truncated stream is detected later looking at how
+ * many of these bytes were actually used. */
+static void refill(struct state *s)
+{
+    while (s->bitcnt <= 56) {
+        if (s->in < s->inend) {
+            s->bitbuf |= (uint64_t)*s->in++ << s->bitcnt;
+        } else {
+            s->pad++;
+        }
+        s->bitcnt += 8;
+    }
+}
+
+/* True if bits past the end of the input were consumed. */
+static int overrun(struct state *s)
+{
+    return s->pad*8 > s->bitcnt;
+}
+
+static unsigned int getbits(struct state *s, int n)
+{
+    unsigned int val;
+
+    if (n == 0) return 0;
+    if (s->bitcnt < n) refill(s);
+    val = s->bitbuf & ((1U << n)-1);
+    s->bitbuf >>= n;
+    s->bitcnt -= n;
+    return val;
+}
+
+/* Give back to the input the whole bytes still in the bit buffer, after
+ * discarding the bits up to the next byte boundary. */
+static void byteAlign(struct state *s)
+{
+    int bytes = s->bitcnt/8 - s->pad;
+
+    if (bytes > 0) s->in -= bytes;
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+    s->pad = 0;
+}
+
+static unsigned int reverse(unsigned int code, int len)
+{
+    unsigned int rev = 0;
+
+    while (len--) {
+        rev = (rev << 1) | (code & 1);
+        code >>= 1;
+    }
+    return rev;
+}
+
+/* Build the decoding tables for the code lengths 'length[0..n-1]'.
+ * Returns 0 for a complete code, a negative value if the code is over
+ * subscribed, and a positive value if it is incomplete. */
+static int buildHuffman(struct huffman *h, const unsigned char *length, int n)
+{
+    unsigned short offs[MAXBITS+1];
+    unsigned int code, rev;
+    int sym, len, left, i, idx;
+
+    memset(h->count, 0, sizeof(h->count));
+    for (sym = 0; sym < n; sym++) h->count[length[sym]]++;
+    memset(h->fast, 0, sizeof(h->fast));
+    if (h->count[0] == n) return 0; /* No codes: complete, but unusable. */
+
+    left = 1;
+    for (len = 1; len <= MAXBITS; len++) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0) return left;
+    }
+    offs[1] = 0;
+    for (len = 1; len < MAXBITS; len++)
+        offs[len+1] = offs[len]+h->count[len];
+    for (sym = 0; sym < n; sym++)
+        if (length[sym]) h->symbol[offs[length[sym]]++] = sym;
+
+    /* Codes are assigned in order of length and symbol, and are stored
+     * in the stream starting from the most significant bit. */
+    code = 0;
+    idx = 0;
+    for (len = 1; len <= FASTBITS; len++) {
+        for (i = 0; i < h->count[len]; i++) {
+            sym = h->symbol[idx++];
+            for (rev = reverse(code, len); rev < FASTSIZE; rev += 1U << len)
+                h->fast[rev] = (len << 9) | sym;
+            code++;
+        }
+        code <<= 1;
+    }
+    return left;
+}
+
+static int decodeSlow(struct state *s, struct huffman *h)
+{
+    int code = 0, first = 0, index = 0, count, len;
+
+    for (len = 1; len <= MAXBITS; len++) {
+        code |= s->bitbuf & 1;
+        s->bitbuf >>= 1;
+        s->bitcnt--;
+        count = h->count[len];
+        if (code-count < first) return h->symbol[index+(code-first)];
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static int decode(struct state *s, struct huffman *h)
+{
+    unsigned int e;
+
+    if (s->bitcnt < MAXBITS) refill(s);
+    e = h->fast[s->bitbuf & (FASTSIZE-1)];
+    if (e) {
+        s->bitbuf >>= e >> 9;
+        s->bitcnt -= e >> 9;
+        return e & 511;
+    }
+    return decodeSlow(s, h);
+}
+
+static int stored(struct state *s)
+{
+    unsigned int len, nlen;
+
+    byteAlign(s);
+    if (s->inend-s->in < 4) return INFLATE_ERR_DATA;
+    len = s->in[0] | (s->in[1] << 8);
+    nlen = s->in[2] | (s->in[3] << 8);
+    s->in += 4;
+    if (len != (~nlen & 0xffff)) return INFLATE_ERR_DATA;
+    if ((size_t)(s->inend-s->in) < len) return INFLATE_ERR_DATA;
+    if ((size_t)(s->outend-s->out) < len) return INFLATE_ERR_SPACE;
+    memcpy(s->out, s->in, len);
+    s->out += len;
+    s->in += len;
+    return INFLATE_OK;
+}
+
+static int codes(struct state *s, struct huffman *lencode, struct huffman *distcode)
+{
+    unsigned char *from;
+    unsigned int len, dist;
+    int sym;
+
+    while (1) {
+        sym = decode(s, lencode);
+        if (sym < 256) {
+            if (sym < 0) return INFLATE_ERR_DATA;
+            if (s->out == s->outend) return INFLATE_ERR_SPACE;
+            *s->out++ = sym;
+        } else if (sym == 256) {
+            break;
+        } else {
+            sym -= 257;
+            if (sym >= 29) return INFLATE_ERR_DATA;
+            len = lbase[sym]+getbits(s, lext[sym]);
+            sym = decode(s, distcode);
+            if (sym < 0 || sym >= 30) return INFLATE_ERR_DATA;
+            dist = dbase[sym]+getbits(s, dext[sym]);
+            if (dist > (size_t)(s->out-s->outstart)) return INFLATE_ERR_DATA;
+            if ((size_t)(s->outend-s->out) < len) return INFLATE_ERR_SPACE;
+            from = s->out-dist;
+            if (dist >= len) {
+                memcpy(s->out, from, len);
+                s->out += len;
+            } else {
+                while (len--) *s->out++ = *from++;
+            }
+        }
+        if (overrun(s)) return INFLATE_ERR_DATA;
+    }
+    return INFLATE_OK;
+}
+
+static int fixed(struct state *s)
+{
+    struct huffman lencode, distcode;
+    unsigned char length[FIXLCODES];
+    int sym;
+
+    for (sym = 0; sym < 144; sym++) length[sym] = 8;
+    for (; sym < 256; sym++) length[sym] = 9;
+    for (; sym < 280; sym++) length[sym] = 7;
+    for (; sym < FIXLCODES; sym++) length[sym] = 8;
+    buildHuffman(&lencode, length, FIXLCODES);
+    for (sym = 0; sym < MAXDCODES; sym++) length[sym] = 5;
+    buildHuffman(&distcode, length, MAXDCODES);
+    return codes(s, &lencode, &distcode);
+}
+
+static int dynamic(struct state *s)
+{
+    static const unsigned char order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    struct huffman lencode, distcode;
+    unsigned char length[MAXLCODES+MAXDCODES];
+    int nlen, ndist, ncode, index, sym, len, err;
+
+    nlen = getbits(s, 5)+257;
+    ndist = getbits(s, 5)+1;
+    ncode = getbits(s, 4)+4;
+    if (nlen > MAXLCODES || ndist > MAXDCODES) return INFLATE_ERR_DATA;
+
+    /* Code length code lengths, then the code lengths themselves. */
+    memset(length, 0, sizeof(length));
+    for (index = 0; index < ncode; index++)
+        length[order[index]] = getbits(s, 3);
+    if (buildHuffman(&lencode, length, 19) != 0) return INFLATE_ERR_DATA;
+    index = 0;
+    while (index < nlen+ndist) {
+        sym = decode(s, &lencode);
+        if (sym < 0) return INFLATE_ERR_DATA;
+        if (sym < 16) {
+            length[index++] = sym;
+            continue;
+        }
+        len = 0;
+        if (sym == 16) {
+            if (index == 0) return INFLATE_ERR_DATA;
+            len = length[index-1];
+            sym = 3+getbits(s, 2);
+        } else if (sym == 17) {
+            sym = 3+getbits(s, 3);
+        } else {
+            sym = 11+getbits(s, 7);
+        }
+        if (index+sym > nlen+ndist) return INFLATE_ERR_DATA;
+        while (sym--) length[index++] = len;
+    }
+    if (length[256] == 0) return INFLATE_ERR_DATA; /* No end of block. */
+    if (overrun(s)) return INFLATE_ERR_DATA;
+
+    /* Incomplete codes are only allowed with a single code. */
+    err = buildHuffman(&lencode, length, nlen);
+    if (err < 0 || (err > 0 && nlen-lencode.count[0] != 1))
+        return INFLATE_ERR_DATA;
+    err = buildHuffman(&distcode, length+nlen, ndist);
+    if (err < 0 || (err > 0 && ndist-distcode.count[0] != 1))
+        return INFLATE_ERR_DATA;
+    return codes(s, &lencode, &distcode);
+}
+
+static uint32_t adler32(const unsigned char *p, size_t len)
+{
+    uint32_t a = 1, b = 0;
+    size_t n;
+
+    while (len) {
+        n = len < 5552 ? len : 5552; /* Largest n without overflows. */
+        len -= n;
+        while (n--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+/* Uncompress the zlib stream 'src' into 'dst', storing the number of
+ * bytes produced into '*produced'. Returns INFLATE_OK on success, or one
+ * of the INFLATE_ERR_* codes. */
+int sisInflate(unsigned char *dst, size_t dstlen, const unsigned char *src, size_t srclen, size_t *produced)
+{
+    struct state s;
+    int last, type, err = INFLATE_OK;
+    uint32_t check;
+
+    *produced = 0;
+    /* zlib header: deflate method, no preset dictionary. */
+    if (srclen < 6 || (src[0] & 0x0f) != 8 || (src[0] >> 4) > 7 ||
+        ((src[0] << 8) | src[1]) % 31 || (src[1] & 0x20))
+        return INFLATE_ERR_DATA;
+
+    memset(&s, 0, sizeof(s));
+    s.in = src+2;
+    s.inend = src+srclen;
+    s.out = s.outstart = dst;
+    s.outend = dst+dstlen;
+    do {
+        last = getbits(&s, 1);
+        type = getbits(&s, 2);
+        switch(type) {
+        case 0: err = stored(&s); break;
+        case 1: err = fixed(&s); break;
+        case 2: err = dynamic(&s); break;
+        default: err = INFLATE_ERR_DATA; break;
+        }
+        if (err == INFLATE_OK && overrun(&s)) err = INFLATE_ERR_DATA;
+    } while (!last && err == INFLATE_OK);
+    *produced = s.out-dst;
+    if (err != INFLATE_OK) return err;
+
+    /* Adler-32 of the uncompressed data, most significant byte first. */
+    byteAlign(&s);
+    if (s.inend-s.in < 4) return INFLATE_ERR_DATA;
+    check = ((uint32_t)s.in[0] << 24) | (s.in[1] << 16) | (s.in[2] << 8) | s.in[3];
+    if (check != adler32(dst, *produced)) return INFLATE_ERR_DATA;
+    return INFLATE_OK;
+}
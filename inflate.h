@@ -0,0 +1,16 @@
+/* inflate.h -- self-contained zlib stream decoder (RFC 1950/1951).
+ * This software is released under the GPL license
+ * see the COPYING file for more information */
+
+#ifndef __INFLATE_H
+#define __INFLATE_H
+
+#include <stddef.h>
+
+#define INFLATE_OK 0
+#define INFLATE_ERR_DATA 1      /* corrupted or truncated stream */
+#define INFLATE_ERR_SPACE 2     /* the output does not fit in 'dstlen' */
+
+int sisInflate(unsigned char *dst, size_t dstlen, const unsigned char *src, size_t srclen, size_t *produced);
+
+#endif /* __INFLATE_H */
@@ -0,0 +1,490 @@
+/* microbench.c -- fixed iteration benchmarks of the sisopen inner kernels.
+ * This software is released under the GPL license
+ * see the COPYING file for more information
+ *
+ * sisopen.c is included here, so that its static functions can be called
+ * directly. Every benchmark is fed from buffers built in memory, runs a
+ * fixed number of iterations and is repeated a few times keeping the best
+ * run, then one CSV line is written with the time and cycles per call:
+ *
+ *     ./mbench > base.csv
+ *     ./mbench --compare base.csv [--threshold 10]
+ *
+ * In compare mode every benchmark also found in the baseline is flagged
+ * as a regression when it is more than 'threshold' percent slower, and
+ * the exit code is 1 if there is at least one. */
+
+#define main sisopenMain
+#include "sisopen.c"
+#undef main
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define mbCycles() __rdtsc()
+#else
+#define mbCycles() 0ULL     /* only the time is meaningful */
+#endif
+
+#ifdef NOZLIB
+#error "microbench needs zlib to build its compressed payloads"
+#endif
+
+#define MB_REPEAT 5                 /* runs of every benchmark, best kept */
+#define MB_THRESHOLD 10.0           /* default regression threshold, % */
+#define MB_MAXBENCH 64
+
+struct mbResult {
+    char name[64];
+    long iterations;
+    double ns;                      /* per iteration */
+    double cycles;                  /* per iteration */
+};
+
+static struct mbResult mbResults[MB_MAXBENCH];
+static int mbNumResults = 0;
+static FILE *mbNull;                /* sink for the rendered output */
+static char mbErr[SISOPEN_ERRLEN];
+
+static double mbClock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+static void mbFail(char *name)
+{
+    fprintf(stderr, "%s: %s\n", name, mbErr);
+    exit(1);
+}
+
+/* Run 'fn' for 'iterations' times MB_REPEAT times, after a short warm up,
+ * recording the best run. */
+static void mbRun(char *name, long iterations, void (*fn)(void *arg, long iterations), void *arg)
+{
+    struct mbResult *res = &mbResults[mbNumResults++];
+    unsigned long long c;
+    double t;
+    int j;
+
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    res->iterations = iterations;
+    res->ns = res->cycles = 0;
+    fn(arg, iterations/10+1);
+    for (j = 0; j < MB_REPEAT; j++) {
+        t = mbClock();
+        c = mbCycles();
+        fn(arg, iterations);
+        c = mbCycles()-c;
+        t = mbClock()-t;
+        if (j == 0 || t/iterations < res->ns) {
+            res->ns = t/iterations;
+            res->cycles = (double)c/iterations;
+        }
+    }
+}
+
+/* Append the UTF-16 version of 's' to 'buf', returning its length. */
+static int mbUnicode(unsigned char *buf, char *s)
+{
+    int j;
+
+    for (j = 0; s[j]; j++) {
+        buf[j*2] = s[j];
+        buf[j*2+1] = 0;
+    }
+    return j*2;
+}
+
+static void mbPut32(unsigned char *p, unsigned int v)
+{
+    p[0] = v&0xff;
+    p[1] = (v>>8)&0xff;
+    p[2] = (v>>16)&0xff;
+    p[3] = (v>>24)&0xff;
+}
+
+/* ------------------------------ Name decoding ----------------------------- */
+
+struct mbNames {
+    unsigned char src[256];
+    char dst[256];
+    int len;
+};
+
+static void mbUni2ascii(void *arg, long iterations)
+{
+    struct mbNames *n = arg;
+    long j;
+
+    for (j = 0; j < iterations; j++) {
+        memcpy(n->dst, n->src, n->len);
+        uni2ascii(n->dst, n->len);
+    }
+}
+
+/* ----------------------------- Package loading ----------------------------
+ * An EPOC release 6 package with a single language and 'files' simple
+ * file records, whose names follow the file table. Payloads are never
+ * read, so their offsets don't need to be valid. */
+
+struct mbPackage {
+    unsigned char *buf;
+    long len;
+};
+
+static void mbBuildPackage(struct mbPackage *p, int files)
+{
+    unsigned char *buf, *rec;
+    char name[64];
+    int j, hdrlen = sizeof(struct sishdr), reclen = 48, pos, len;
+
+    buf = calloc(1, hdrlen+2+files*(reclen+256));
+    mbPut32(buf, 0x10201a7a);
+    mbPut32(buf+4, SIS_UID2_EPOC6);
+    mbPut32(buf+8, SIS_UID3);
+    buf[18] = 1;                                /* languages */
+    buf[20] = files&0xff;                       /* files */
+    buf[21] = files>>8;
+    mbPut32(buf+offsetof(struct sishdr, langoff), hdrlen);
+    mbPut32(buf+offsetof(struct sishdr, fileoff), hdrlen+2);
+    buf[hdrlen] = 1;                            /* UK English */
+    pos = hdrlen+2+files*reclen;
+    for (j = 0; j < files; j++) {
+        rec = buf+hdrlen+2+j*reclen;
+        mbPut32(rec, SIS_FILE_SIMPLE);
+        snprintf(name, sizeof(name), "C:\\build\\epoc32\\release\\file%04d.dll", j);
+        len = mbUnicode(buf+pos, name);
+        mbPut32(rec+12, len);
+        mbPut32(rec+16, pos);
+        pos += len;
+        snprintf(name, sizeof(name), "!:\\sys\\bin\\file%04d.dll", j);
+        len = mbUnicode(buf+pos, name);
+        mbPut32(rec+20, len);
+        mbPut32(rec+24, pos);
+        pos += len;
+        mbPut32(rec+28, 1000);                  /* len */
+        mbPut32(rec+32, 0);                     /* offset */
+        mbPut32(rec+36, 4000);                  /* original len */
+    }
+    p->buf = buf;
+    p->len = pos;
+}
+
+static void mbLoad(void *arg, long iterations)
+{
+    struct mbPackage *p = arg;
+    struct sispkg pkg;
+    struct sisfile sf;
+    long j;
+
+    for (j = 0; j < iterations; j++) {
+        sisMemInit(&sf, p->buf, p->len);
+        if (sisLoad(&pkg, "mbench", &sf, mbErr, sizeof(mbErr)))
+            mbFail("sisLoad");
+        sisFree(&pkg);
+    }
+}
+
+/* ------------------------------- Conditions -------------------------------
+ * A chain of 'depth' AND nodes, each one with a comparison on the left,
+ * like the long machine UID lists of packages targeting many phones,
+ * preceded by its length as in if/else if records. */
+
+static void mbBuildCondition(struct mbPackage *p, int depth)
+{
+    unsigned char *buf, *q;
+    int j;
+
+    buf = calloc(1, 4+(depth+1)*32);
+    q = buf+4;
+    for (j = 0; j <= depth; j++) {
+        if (j < depth) {
+            mbPut32(q, SIS_COND_AND);
+            q += 4;
+        }
+        mbPut32(q, SIS_COND_EQ);
+        mbPut32(q+4, SIS_COND_ATTRIBUTE);
+        mbPut32(q+8, 0x05);                     /* MachineUID */
+        mbPut32(q+16, SIS_COND_NUMBER);
+        mbPut32(q+20, 0x101f4fc3+j);
+        q += 28;
+    }
+    mbPut32(buf, q-buf-4);
+    p->buf = buf;
+    p->len = q-buf;
+}
+
+static void mbFreeCondition(struct sisrecord *r)
+{
+    int i;
+
+    for (i = 0; i < r->numcondnodes; i++) free(r->condnodes[i].str);
+    free(r->condnodes);
+    free(r->cond);
+}
+
+/* Parsing and rendering, as done when the file table is loaded. */
+static void mbConditional(void *arg, long iterations)
+{
+    struct mbPackage *p = arg;
+    struct sisrecord r;
+    struct sisfile sf;
+    long j;
+
+    for (j = 0; j < iterations; j++) {
+        memset(&r, 0, sizeof(r));
+        sisMemInit(&sf, p->buf, p->len);
+        if (conditional(&sf, &r, mbErr, sizeof(mbErr)))
+            mbFail("conditional");
+        mbFreeCondition(&r);
+    }
+}
+
+/* Evaluation on a device where the last comparison is the false one. */
+static void mbCondEval(void *arg, long iterations)
+{
+    struct mbPackage *p = arg;
+    struct sisdevice dev;
+    struct sisrecord r;
+    struct sisfile sf;
+    char item[64];
+    long j;
+
+    memset(&r, 0, sizeof(r));
+    memset(&dev, 0, sizeof(dev));
+    sisMemInit(&sf, p->buf, p->len);
+    snprintf(item, sizeof(item), "MachineUID=0x101f4fc3");
+    if (conditional(&sf, &r, mbErr, sizeof(mbErr)) ||
+        deviceSet(&dev, item, mbErr, sizeof(mbErr))) mbFail("condEval");
+    for (j = 0; j < iterations; j++) {
+        if (condEval(r.condnodes, r.numcondnodes, deviceLookup, &dev) == -1)
+            mbFail("condEval");
+    }
+    mbFreeCondition(&r);
+    free(dev.ids);
+    free(dev.values);
+}
+
+/* --------------------------------- Options -------------------------------- */
+
+static void mbBuildOptions(struct mbPackage *p, int numopt)
+{
+    unsigned char *buf;
+    char name[64];
+    int j, pos = 4+numopt*8+16;
+
+    buf = calloc(1, pos+numopt*128);
+    mbPut32(buf, numopt);
+    for (j = 0; j < numopt; j++) {
+        snprintf(name, sizeof(name), "Install optional component %d", j);
+        mbPut32(buf+4+j*8, mbUnicode(buf+pos, name));
+        mbPut32(buf+8+j*8, pos);
+        pos += strlen(name)*2;
+    }
+    p->buf = buf;
+    p->len = pos;
+}
+
+static void mbOptions(void *arg, long iterations)
+{
+    struct mbPackage *p = arg;
+    struct sisrecord r;
+    struct sisfile sf;
+    unsigned int i;
+    long j;
+
+    for (j = 0; j < iterations; j++) {
+        memset(&r, 0, sizeof(r));
+        sisMemInit(&sf, p->buf, p->len);
+        if (optionsFile(&sf, &r, mbErr, sizeof(mbErr)))
+            mbFail("optionsFile");
+        for (i = 0; i < r.numopt; i++) free(r.opt[i]);
+        free(r.opt);
+    }
+}
+
+/* -------------------------------- Payloads --------------------------------
+ * A compressed payload of 'size' bytes that looks like code: short
+ * random runs of a small alphabet, compressing about 3:1. */
+
+struct mbPayload {
+    struct sispkg pkg;
+    struct sisfile sf;
+    unsigned char *buf;
+    unsigned int len, origlen;
+};
+
+static void mbBuildPayload(struct mbPayload *p, unsigned int size)
+{
+    unsigned char *data = malloc(size);
+    uLongf clen = compressBound(size);
+    unsigned int j, seed = 1;
+
+    for (j = 0; j < size; j++) {
+        seed = seed*1103515245+12345;
+        data[j] = (seed>>24)%24 < 16 ?
+            (unsigned char)"\x00\x01\x08\xff"[(seed>>16)&3] :
+            'A'+(seed>>16)%32;
+    }
+    p->buf = malloc(clen);
+    if (compress2(p->buf, &clen, data, size, 6) != Z_OK) {
+        fprintf(stderr, "compress2 failed\n");
+        exit(1);
+    }
+    free(data);
+    p->len = clen;
+    p->origlen = size;
+    memset(&p->pkg, 0, sizeof(p->pkg));
+    sisMemInit(&p->sf, p->buf, p->len);
+    p->pkg.filename = "mbench";
+    p->pkg.sf = &p->sf;
+}
+
+static int mbDiscard(void *privdata, unsigned char *buf, size_t len, char *err, int errlen)
+{
+    SIS_NOTUSED(privdata);
+    SIS_NOTUSED(buf);
+    SIS_NOTUSED(len);
+    SIS_NOTUSED(err);
+    SIS_NOTUSED(errlen);
+    return 0;
+}
+
+static void mbInflate(void *arg, long iterations)
+{
+    struct mbPayload *p = arg;
+    long j;
+
+    for (j = 0; j < iterations; j++) {
+        if (sisPayload(&p->pkg, p->len, p->origlen, 0, NULL, mbDiscard,
+            NULL, mbErr, sizeof(mbErr))) mbFail("sisPayload");
+    }
+}
+
+/* extractFile() as with --manifest, hashing the payload: the memo is
+ * dropped every time, otherwise only the first call would inflate. */
+static void mbExtract(void *arg, long iterations)
+{
+    struct mbPayload *p = arg;
+    long j;
+
+    manifestFp = mbNull;
+    for (j = 0; j < iterations; j++) {
+        if (extractFile(&p->pkg, 0, -1, p->len, p->origlen, 0,
+            "!:\\sys\\bin\\mbench.dll", mbErr, sizeof(mbErr)))
+            mbFail("extractFile");
+        memoFree(&p->pkg);
+    }
+    manifestFp = NULL;
+}
+
+/* ------------------------------- Reporting -------------------------------- */
+
+static void mbReport(FILE *fp)
+{
+    int j;
+
+    fprintf(fp, "name,iterations,ns_per_op,cycles_per_op\n");
+    for (j = 0; j < mbNumResults; j++) {
+        struct mbResult *res = &mbResults[j];
+
+        fprintf(fp, "%s,%ld,%.2f,%.1f\n", res->name, res->iterations,
+            res->ns, res->cycles);
+    }
+}
+
+/* Compare with the baseline CSV 'filename'. Returns the number of
+ * regressions, or -1 if the baseline can't be read. */
+static int mbCompare(char *filename, double threshold)
+{
+    char line[256], name[64];
+    double ns, cycles, change;
+    long iterations;
+    int j, regressions = 0;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    printf("name,iterations,ns_per_op,cycles_per_op,base_ns_per_op,change_pct,status\n");
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%63[^,],%ld,%lf,%lf", name, &iterations, &ns,
+            &cycles) != 4) continue;
+        for (j = 0; j < mbNumResults; j++) {
+            struct mbResult *res = &mbResults[j];
+
+            if (strcmp(res->name, name)) continue;
+            change = ns > 0 ? (res->ns-ns)*100/ns : 0;
+            printf("%s,%ld,%.2f,%.1f,%.2f,%+.1f,%s\n", res->name,
+                res->iterations, res->ns, res->cycles, ns, change,
+                change > threshold ? "REGRESSION" : "ok");
+            if (change > threshold) regressions++;
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    static unsigned int sizes[] = {1024, 65536, 1048576};
+    struct mbNames names;
+    struct mbPackage pkg16, pkg256, cond8, cond64, opts;
+    struct mbPayload payload;
+    double threshold = MB_THRESHOLD;
+    char *baseline = NULL, name[64];
+    int j, regressions;
+
+    for (j = 1; j < argc; j++) {
+        if (!strcmp(argv[j], "--compare") && j+1 < argc) {
+            baseline = argv[++j];
+        } else if (!strcmp(argv[j], "--threshold") && j+1 < argc) {
+            threshold = atof(argv[++j]);
+        } else {
+            fprintf(stderr, "Usage: %s [--compare baseline.csv] [--threshold percent]\n", argv[0]);
+            exit(1);
+        }
+    }
+    guessEndianess();
+    if ((mbNull = fopen("/dev/null", "w")) == NULL) {
+        perror("/dev/null");
+        exit(1);
+    }
+
+    names.len = mbUnicode(names.src, "!:\\system\\apps\\Application\\Application.app");
+    mbRun("uni2ascii", 2000000, mbUni2ascii, &names);
+    mbBuildPackage(&pkg16, 16);
+    mbRun("sisLoad_16files", 100000, mbLoad, &pkg16);
+    mbBuildPackage(&pkg256, 256);
+    mbRun("sisLoad_256files", 5000, mbLoad, &pkg256);
+    mbBuildCondition(&cond8, 8);
+    mbRun("conditional_depth8", 200000, mbConditional, &cond8);
+    mbRun("condEval_depth8", 1000000, mbCondEval, &cond8);
+    mbBuildCondition(&cond64, 64);
+    mbRun("conditional_depth64", 20000, mbConditional, &cond64);
+    mbRun("condEval_depth64", 200000, mbCondEval, &cond64);
+    mbBuildOptions(&opts, 8);
+    mbRun("optionsFile_8options", 200000, mbOptions, &opts);
+    for (j = 0; j < (int)(sizeof(sizes)/sizeof(sizes[0])); j++) {
+        long iterations = 16*1048576/sizes[j];
+
+        mbBuildPayload(&payload, sizes[j]);
+        snprintf(name, sizeof(name), "inflate_%u", sizes[j]);
+        mbRun(name, iterations, mbInflate, &payload);
+        snprintf(name, sizeof(name), "extractFile_%u", sizes[j]);
+        mbRun(name, iterations/4, mbExtract, &payload);
+        free(payload.buf);
+    }
+
+    if (baseline == NULL) {
+        mbReport(stdout);
+        return 0;
+    }
+    regressions = mbCompare(baseline, threshold);
+    if (regressions == -1) return 2;
+    if (regressions) fprintf(stderr, "%d benchmark(s) slower than the baseline by more than %.1f%%\n", regressions, threshold);
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+/* rsa.c -- RSA PKCS#1 v1.5 signature verification (RFC 8017).
+ * This software is released under the GPL license
+ * see the COPYING file for more information
+ *
+ * Only the public key operation is needed to verify a signature: s^e mod n
+ * is computed with Montgomery multiplication on little endian arrays of 32
+ * bit words, then compared with the expected encoding of the digest. There
+ * is nothing secret here, so no effort is made to run in constant time. */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "rsa.h"
+
+#define RSA_WORDS (RSA_MAX_BITS/32)
+
+/* DER encoding of the AlgorithmIdentifier and digest header that precedes
+ * the digest in the signed block, by RSA_HASH_*. */
+static const unsigned char sha1Prefix[] = {
+    0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2b, 0x0e, 0x03, 0x02, 0x1a, 0x05,
+    0x00, 0x04, 0x14
+};
+static const unsigned char sha256Prefix[] = {
+    0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03,
+    0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20
+};
+
+/* Big endian bytes to 's' words, failing if they don't fit. */
+static int rsaLoad(uint32_t *a, int s, const unsigned char *p, size_t len)
+{
+    size_t j;
+
+    while (len && *p == 0) {
+        p++;
+        len--;
+    }
+    if (len > (size_t)s*4) return 1;
+    memset(a, 0, sizeof(uint32_t)*s);
+    for (j = 0; j < len; j++)
+        a[j/4] |= (uint32_t)p[len-1-j] << ((j%4)*8);
+    return 0;
+}
+
+/* Compare 'a' and 'b', 's' words each. */
+static int rsaCmp(const uint32_t *a, const uint32_t *b, int s)
+{
+    while (s--) {
+        if (a[s] != b[s]) return a[s] < b[s] ? -1 : 1;
+    }
+    return 0;
+}
+
+/* a -= b, returning the borrow. */
+static uint32_t rsaSub(uint32_t *a, const uint32_t *b, int s)
+{
+    uint64_t borrow = 0, t;
+    int j;
+
+    for (j = 0; j < s; j++) {
+        t = (uint64_t)a[j] - b[j] - borrow;
+        a[j] = (uint32_t)t;
+        borrow = (t >> 32) & 1;
+    }
+    return (uint32_t)borrow;
+}
+
+/* r = a*b/R mod n, with R = 2^(32*s) and n0 = -1/n[0] mod 2^32. 'r' may
+ * be 'a' or 'b'. */
+static void rsaMontMul(uint32_t *r, const uint32_t *a, const uint32_t *b, const uint32_t *n, uint32_t n0, int s)
+{
+    uint32_t t[RSA_WORDS+2], m;
+    uint64_t c;
+    int i, j;
+
+    memset(t, 0, sizeof(uint32_t)*(s+2));
+    for (i = 0; i < s; i++) {
+        c = 0;
+        for (j = 0; j < s; j++) {
+            c += (uint64_t)a[j]*b[i] + t[j];
+            t[j] = (uint32_t)c;
+            c >>= 32;
+        }
+        c += t[s];
+        t[s] = (uint32_t)c;
+        t[s+1] = (uint32_t)(c >> 32);
+
+        m = t[0]*n0;
+        c = ((uint64_t)m*n[0] + t[0]) >> 32;
+        for (j = 1; j < s; j++) {
+            c += (uint64_t)m*n[j] + t[j];
+            t[j-1] = (uint32_t)c;
+            c >>= 32;
+        }
+        c += t[s];
+        t[s-1] = (uint32_t)c;
+        t[s] = t[s+1] + (uint32_t)(c >> 32);
+    }
+    if (t[s] || rsaCmp(t, n, s) >= 0) rsaSub(t, n, s);
+    memcpy(r, t, sizeof(uint32_t)*s);
+}
+
+int rsaVerify(const unsigned char *n, size_t nlen, const unsigned char *e, size_t elen, const unsigned char *sig, size_t siglen, int hash, const unsigned char *digest)
+{
+    uint32_t nw[RSA_WORDS], sw[RSA_WORDS], rr[RSA_WORDS], acc[RSA_WORDS];
+    uint32_t one[RSA_WORDS], n0;
+    unsigned char em[RSA_MAX_BITS/8];
+    const unsigned char *prefix;
+    size_t k, j, padlen, prefixlen, digestlen;
+    int s, i, bit;
+
+    if (hash == RSA_HASH_SHA1) {
+        prefix = sha1Prefix;
+        prefixlen = sizeof(sha1Prefix);
+        digestlen = 20;
+    } else {
+        prefix = sha256Prefix;
+        prefixlen = sizeof(sha256Prefix);
+        digestlen = 32;
+    }
+
+    /* Key size in bytes and in words, without leading zeros. */
+    while (nlen && *n == 0) {
+        n++;
+        nlen--;
+    }
+    while (elen && *e == 0) {
+        e++;
+        elen--;
+    }
+    k = nlen;
+    s = (int)((k+3)/4);
+    if (k < 64 || k > sizeof(em) || elen == 0 || elen > 8 || !(n[nlen-1] & 1))
+        return RSA_ERR_KEY;
+    if (rsaLoad(nw, s, n, nlen)) return RSA_ERR_KEY;
+    if (siglen != k || rsaLoad(sw, s, sig, siglen) || rsaCmp(sw, nw, s) >= 0)
+        return RSA_ERR_SIGNATURE;
+
+    /* n0 = -1/n mod 2^32 by Newton iteration, every step doubles the
+     * correct bits. */
+    n0 = 1;
+    for (i = 0; i < 5; i++) n0 *= 2 - nw[0]*n0;
+    n0 = -n0;
+
+    /* rr = R^2 mod n, doubling 1 for 2*32*s times. */
+    memset(rr, 0, sizeof(uint32_t)*s);
+    rr[0] = 1;
+    for (i = 0; i < 64*s; i++) {
+        uint32_t carry = rr[s-1] >> 31;
+
+        for (j = s-1; j > 0; j--) rr[j] = (rr[j] << 1) | (rr[j-1] >> 31);
+        rr[0] <<= 1;
+        if (carry || rsaCmp(rr, nw, s) >= 0) rsaSub(rr, nw, s);
+    }
+
+    /* acc = sig^e mod n, left to right, in the Montgomery domain. */
+    memset(one, 0, sizeof(uint32_t)*s);
+    one[0] = 1;
+    rsaMontMul(sw, sw, rr, nw, n0, s);
+    rsaMontMul(acc, one, rr, nw, n0, s);
+    for (j = 0; j < elen; j++) {
+        for (bit = 7; bit >= 0; bit--) {
+            rsaMontMul(acc, acc, acc, nw, n0, s);
+            if ((e[j] >> bit) & 1) rsaMontMul(acc, acc, sw, nw, n0, s);
+        }
+    }
+    rsaMontMul(acc, acc, one, nw, n0, s);
+
+    /* The result must be 00 01 FF .. FF 00 prefix digest. */
+    for (j = 0; j < k; j++)
+        em[k-1-j] = (unsigned char)(acc[j/4] >> ((j%4)*8));
+    padlen = k-3-prefixlen-digestlen;
+    if (em[0] != 0 || em[1] != 1) return RSA_ERR_SIGNATURE;
+    for (j = 0; j < padlen; j++)
+        if (em[2+j] != 0xff) return RSA_ERR_SIGNATURE;
+    if (em[2+padlen] != 0 ||
+        memcmp(em+3+padlen, prefix, prefixlen) ||
+        memcmp(em+3+padlen+prefixlen, digest, digestlen))
+        return RSA_ERR_SIGNATURE;
+    return RSA_OK;
+}
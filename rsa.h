@@ -0,0 +1,24 @@
+/* rsa.h -- RSA PKCS#1 v1.5 signature verification (RFC 8017).
+ * This software is released under the GPL license
+ * see the COPYING file for more information */
+
+#ifndef __RSA_H
+#define __RSA_H
+
+#include <stddef.h>
+
+#define RSA_MAX_BITS 8192
+
+#define RSA_OK 0
+#define RSA_ERR_KEY 1           /* unsupported or malformed public key */
+#define RSA_ERR_SIGNATURE 2     /* the signature does not match */
+
+#define RSA_HASH_SHA1 0
+#define RSA_HASH_SHA256 1
+
+/* Verify 'sig' against 'digest', computed with the hash function 'hash',
+ * with the public key 'n', 'e' (big endian integers, leading zeros
+ * allowed). */
+int rsaVerify(const unsigned char *n, size_t nlen, const unsigned char *e, size_t elen, const unsigned char *sig, size_t siglen, int hash, const unsigned char *digest);
+
+#endif /* __RSA_H */
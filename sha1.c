@@ -0,0 +1,102 @@
+/* sha1.c -- SHA-1 message digest (FIPS 180-2).
+ * This software is released under the GPL license
+ * see the COPYING file for more information
+ *
+ * SHA-1 is broken for collisions: it is here only because the signatures
+ * of EPOC packages and their certificates use it. */
+
+#include <string.h>
+
+#include "sha1.h"
+
+#define ROL(x,n) (((x) << (n)) | ((x) >> (32-(n))))
+
+/* Hash a single 64 bytes block. */
+static void SHA1Transform(uint32_t state[5], const unsigned char *data)
+{
+    uint32_t a, b, c, d, e, f, k, t, m[80];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        m[i] = ((uint32_t)data[i*4] << 24) | ((uint32_t)data[i*4+1] << 16) |
+               ((uint32_t)data[i*4+2] << 8) | data[i*4+3];
+    for (; i < 80; i++) m[i] = ROL(m[i-3] ^ m[i-8] ^ m[i-14] ^ m[i-16], 1);
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+    for (i = 0; i < 80; i++) {
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        t = ROL(a,5) + f + e + k + m[i];
+        e = d; d = c; c = ROL(b,30); b = a; a = t;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e;
+}
+
+void SHA1Init(SHA1_CTX *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->count = 0;
+}
+
+void SHA1Update(SHA1_CTX *ctx, const unsigned char *data, size_t len)
+{
+    size_t used = ctx->count & 63;
+
+    ctx->count += len;
+    /* Complete the pending block first, if any. */
+    if (used) {
+        size_t fill = 64-used;
+
+        if (len < fill) {
+            memcpy(ctx->buf+used, data, len);
+            return;
+        }
+        memcpy(ctx->buf+used, data, fill);
+        SHA1Transform(ctx->state, ctx->buf);
+        data += fill;
+        len -= fill;
+    }
+    /* Hash full blocks directly from the input. */
+    while (len >= 64) {
+        SHA1Transform(ctx->state, data);
+        data += 64;
+        len -= 64;
+    }
+    if (len) memcpy(ctx->buf, data, len);
+}
+
+void SHA1Final(SHA1_CTX *ctx, unsigned char digest[SHA1_DIGEST_LEN])
+{
+    size_t used = ctx->count & 63;
+    uint64_t bits = ctx->count*8;
+    int i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf+used, 0, 64-used);
+        SHA1Transform(ctx->state, ctx->buf);
+        used = 0;
+    }
+    memset(ctx->buf+used, 0, 56-used);
+    for (i = 0; i < 8; i++)
+        ctx->buf[56+i] = (unsigned char)(bits >> (56-i*8));
+    SHA1Transform(ctx->state, ctx->buf);
+    for (i = 0; i < SHA1_DIGEST_LEN; i++)
+        digest[i] = (unsigned char)(ctx->state[i/4] >> (24-(i%4)*8));
+}
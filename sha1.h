@@ -0,0 +1,23 @@
+/* sha1.h -- SHA-1 message digest (FIPS 180-2).
+ * This software is released under the GPL license
+ * see the COPYING file for more information */
+
+#ifndef __SHA1_H
+#define __SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_LEN 20
+
+typedef struct {
+    uint32_t state[5];
+    uint64_t count;         /* number of bytes hashed so far */
+    unsigned char buf[64];  /* pending bytes of an incomplete block */
+} SHA1_CTX;
+
+void SHA1Init(SHA1_CTX *ctx);
+void SHA1Update(SHA1_CTX *ctx, const unsigned char *data, size_t len);
+void SHA1Final(SHA1_CTX *ctx, unsigned char digest[SHA1_DIGEST_LEN]);
+
+#endif /* __SHA1_H */
@@ -0,0 +1,133 @@
+/* sha256.c -- SHA-256 message digest (FIPS 180-2).
+ * This software is released under the GPL license
+ * see the COPYING file for more information */
+
+#include <string.h>
+
+#include "sha256.h"
+
+#define ROR(x,n) (((x) >> (n)) | ((x) << (32-(n))))
+#define CH(x,y,z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define EP0(x) (ROR(x,2) ^ ROR(x,13) ^ ROR(x,22))
+#define EP1(x) (ROR(x,6) ^ ROR(x,11) ^ ROR(x,25))
+#define SIG0(x) (ROR(x,7) ^ ROR(x,18) ^ ((x) >> 3))
+#define SIG1(x) (ROR(x,17) ^ ROR(x,19) ^ ((x) >> 10))
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Hash a single 64 bytes block. */
+static void SHA256Transform(uint32_t state[8], const unsigned char *data)
+{
+    uint32_t a, b, c, d, e, f, g, h, t1, t2, m[64];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        m[i] = ((uint32_t)data[i*4] << 24) | ((uint32_t)data[i*4+1] << 16) |
+               ((uint32_t)data[i*4+2] << 8) | ((uint32_t)data[i*4+3]);
+    }
+    for (; i < 64; i++)
+        m[i] = SIG1(m[i-2]) + m[i-7] + SIG0(m[i-15]) + m[i-16];
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
+        t2 = EP0(a) + MAJ(a,b,c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void SHA256Init(SHA256_CTX *ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->count = 0;
+}
+
+void SHA256Update(SHA256_CTX *ctx, const unsigned char *data, size_t len)
+{
+    size_t used = ctx->count & 63;
+
+    ctx->count += len;
+    /* Complete the pending block first, if any. */
+    if (used) {
+        size_t fill = 64-used;
+
+        if (len < fill) {
+            memcpy(ctx->buf+used, data, len);
+            return;
+        }
+        memcpy(ctx->buf+used, data, fill);
+        SHA256Transform(ctx->state, ctx->buf);
+        data += fill;
+        len -= fill;
+    }
+    /* Hash full blocks directly from the input. */
+    while (len >= 64) {
+        SHA256Transform(ctx->state, data);
+        data += 64;
+        len -= 64;
+    }
+    if (len) memcpy(ctx->buf, data, len);
+}
+
+void SHA256Final(SHA256_CTX *ctx, unsigned char digest[SHA256_DIGEST_LEN])
+{
+    size_t used = ctx->count & 63;
+    uint64_t bits = ctx->count*8;
+    int i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf+used, 0, 64-used);
+        SHA256Transform(ctx->state, ctx->buf);
+        used = 0;
+    }
+    memset(ctx->buf+used, 0, 56-used);
+    for (i = 0; i < 8; i++)
+        ctx->buf[56+i] = (unsigned char)(bits >> (56-i*8));
+    SHA256Transform(ctx->state, ctx->buf);
+    for (i = 0; i < 32; i++)
+        digest[i] = (unsigned char)(ctx->state[i/4] >> (24-(i%4)*8));
+}
+
+/* Convert the digest into a 64 chars lowercase hex string. 'hex' must
+ * have room for 65 bytes, including the null term. */
+void SHA256Hex(unsigned char digest[SHA256_DIGEST_LEN], char *hex)
+{
+    static const char *charset = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < SHA256_DIGEST_LEN; i++) {
+        hex[i*2] = charset[digest[i] >> 4];
+        hex[i*2+1] = charset[digest[i] & 15];
+    }
+    hex[SHA256_DIGEST_LEN*2] = '\0';
+}
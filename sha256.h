@@ -0,0 +1,24 @@
+/* sha256.h -- SHA-256 message digest (FIPS 180-2).
+ * This software is released under the GPL license
+ * see the COPYING file for more information */
+
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN 32
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t count;         /* number of bytes hashed so far */
+    unsigned char buf[64];  /* pending bytes of an incomplete block */
+} SHA256_CTX;
+
+void SHA256Init(SHA256_CTX *ctx);
+void SHA256Update(SHA256_CTX *ctx, const unsigned char *data, size_t len);
+void SHA256Final(SHA256_CTX *ctx, unsigned char digest[SHA256_DIGEST_LEN]);
+void SHA256Hex(unsigned char digest[SHA256_DIGEST_LEN], char *hex);
+
+#endif /* __SHA256_H */
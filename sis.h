@@ -0,0 +1,102 @@
+/* sis.h -- SIS file format definitions shared by sisopen and sismake.
+ * This software is released under the GPL license
+ * see the COPYING file for more information */
+
+#ifndef __SIS_H
+#define __SIS_H
+
+#define SIS_UID2_EPOC5 0x1000006D
+#define SIS_UID2_EPOC6 0x10003A12
+#define SIS_UID3 0x10000419
+
+#define SIS_OPT_UNICODE 0x01
+#define SIS_OPT_DISTRIBUTABLE 0x02
+#define SIS_OPT_NOCOMPRESS 0x08
+#define SIS_OPT_SHUTDOWNAPPS 0x10
+
+#define SIS_TYPE_SA 0x00
+#define SIS_TYPE_SY 0x01
+#define SIS_TYPE_SO 0x02
+#define SIS_TYPE_SC 0x03
+#define SIS_TYPE_SP 0x04
+#define SIS_TYPE_SU 0x05
+
+#define SIS_FILE_SIMPLE     0x00
+#define SIS_FILE_MULTILANG  0x01
+#define SIS_FILE_OPTIONS    0x02
+#define SIS_FILE_IF         0x03
+#define SIS_FILE_ELSEIF     0x04
+#define SIS_FILE_ELSE       0x05
+#define SIS_FILE_ENDIF      0x06
+
+#define SIS_FILETYPE_STANDARD   0x00
+#define SIS_FILETYPE_TEXT       0x01
+#define SIS_FILETYPE_COMPONENT  0x02
+#define SIS_FILETYPE_RUN        0x03
+#define SIS_FILETYPE_NOTEXISTS  0x04
+#define SIS_FILETYPE_OPEN       0x05
+
+/* Condition expression nodes of if/else if records. Every node starts
+ * with its type, operators are followed by their operands. */
+#define SIS_COND_EQ         0x00    /* two operands */
+#define SIS_COND_NE         0x01
+#define SIS_COND_GT         0x02
+#define SIS_COND_LT         0x03
+#define SIS_COND_GE         0x04
+#define SIS_COND_LE         0x05
+#define SIS_COND_AND        0x06
+#define SIS_COND_OR         0x07
+#define SIS_COND_APPCAP     0x08    /* one operand */
+#define SIS_COND_EXISTS     0x09
+#define SIS_COND_DEVCAP     0x0a
+#define SIS_COND_NOT        0x0b
+#define SIS_COND_STRING     0x0c    /* length, offset */
+#define SIS_COND_ATTRIBUTE  0x0d    /* attribute, unused */
+#define SIS_COND_NUMBER     0x0e    /* value, unused */
+
+#define SIS_ATTR_OPTION 0x2000      /* attributes from here are options */
+
+#define SIS_NOTUSED(V) ((void) V)
+
+struct sishdr {
+    unsigned int uid1;
+    unsigned int uid2;
+    unsigned int uid3;
+    unsigned int uid4;
+    unsigned short cksum;
+    unsigned short languages;
+    unsigned short files;
+    unsigned short requisities;
+    unsigned short instlang;
+    unsigned short instfiles;
+    unsigned short instdrive;
+    unsigned short capabilities;
+    unsigned int installerver;
+    unsigned short options;
+    unsigned short type;
+    unsigned short major;
+    unsigned short minor;
+    unsigned int variant;
+    unsigned int langoff;
+    unsigned int fileoff;
+    unsigned int reqoff;
+    unsigned int certoff;
+    unsigned int compnameoff;
+    /* EPOC release 6 only fields follow */
+#define EPOC6_HDR_TAIL_LEN 16
+    unsigned int signoff;
+    unsigned int capaoff;
+    unsigned int instspace;
+    unsigned int maxinstspace;
+};
+
+struct filerecord {
+    unsigned int type;
+    unsigned int details;
+    unsigned int srcnamelen;
+    unsigned int srcnameoff;
+    unsigned int dstnamelen;
+    unsigned int dstnameoff;
+};
+
+#endif /* __SIS_H */
@@ -0,0 +1,1165 @@
+/* sismake -- build EPOC release 5 and 6 SIS packages from a package
+ * description (see the README for the format).
+ *
+ * Payloads are read and compressed by a pool of threads, then the whole
+ * package is laid out in memory and written with a single sequential
+ * write. The layout is the one sisopen reads:
+ *
+ *   header | languages | file table | component name | payloads | strings
+ *
+ * where the file table is written in reverse order, like makesis does. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifndef NOZLIB
+#include <zlib.h>
+#endif
+
+#include "antigetopt.h"
+#include "sis.h"
+#include "langtab.h"
+#include "attrtab.h"
+
+#define SISMAKE_ERRLEN 1024
+#define SISMAKE_MAXARGS 256         /* max tokens in a description line */
+#define SISMAKE_LINELEN 4096        /* max length of a description line */
+
+/* A node of a condition expression. */
+struct mkcond {
+    unsigned int type;              /* SIS_COND_* */
+    unsigned int value;             /* attribute or number */
+    char *str;                      /* SIS_COND_STRING */
+    struct mkcond *left, *right;    /* operands */
+};
+
+/* The content of a source file, as it will be stored in the package. */
+struct mkpayload {
+    char *src;
+    unsigned char *data;            /* as read from the source file */
+    size_t len;
+    unsigned char *zdata;           /* compressed data, NULL if stored */
+    size_t zlen;
+    char err[128];                  /* set if the file could not be read */
+};
+
+struct mkrecord {
+    unsigned int type;              /* SIS_FILE_* */
+    int line;                       /* line of the description */
+    /* SIS_FILE_SIMPLE and SIS_FILE_MULTILANG */
+    unsigned int filetype;          /* SIS_FILETYPE_* */
+    char *dst;
+    int *payloads;                  /* indexes of mkpkg.payloads */
+    int numpayloads;
+    /* SIS_FILE_OPTIONS */
+    char **opt;
+    int numopt;
+    /* SIS_FILE_IF and SIS_FILE_ELSEIF */
+    struct mkcond *cond;
+};
+
+struct mkpkg {
+    int epocrelease;
+    unsigned int uid;
+    unsigned int major, minor;
+    unsigned int type;
+    unsigned int options;
+    unsigned short langs[SISMAKE_MAXARGS];
+    int numlangs;
+    char *names[SISMAKE_MAXARGS];   /* component name for every language */
+    int numnames;
+    struct mkrecord *records;
+    int numrecords;
+    struct mkpayload *payloads;
+    int numpayloads;
+    int srcdir;                     /* sources are relative to this */
+    int level;                      /* zlib compression level */
+};
+
+/* A growing output buffer. */
+struct mkbuf {
+    unsigned char *p;
+    size_t len, size;
+};
+
+static void *mkalloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void *mkrealloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size ? size : 1);
+
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static char *mkstrdup(char *s)
+{
+    return strcpy(mkalloc(strlen(s)+1), s);
+}
+
+/* ------------------------------ Output buffer ----------------------------- */
+
+static void bufAppend(struct mkbuf *b, const void *p, size_t len)
+{
+    if (b->len+len > b->size) {
+        b->size = (b->len+len)*2;
+        b->p = mkrealloc(b->p, b->size);
+    }
+    memcpy(b->p+b->len, p, len);
+    b->len += len;
+}
+
+/* SIS files are little endian whatever the host is. */
+static void buf32(struct mkbuf *b, unsigned int v)
+{
+    unsigned char p[4];
+
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+    bufAppend(b, p, 4);
+}
+
+static void buf16(struct mkbuf *b, unsigned int v)
+{
+    unsigned char p[2];
+
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    bufAppend(b, p, 2);
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+/* Strings are stored as UTF-16LE. Append 's' to the strings section that
+ * starts at offset 'base' of the package, returning its offset. */
+static unsigned int addString(struct mkbuf *strings, unsigned int base, char *s)
+{
+    unsigned int off = base+strings->len;
+
+    while (*s) {
+        unsigned char c[2] = {(unsigned char)*s++, 0};
+        bufAppend(strings, c, 2);
+    }
+    return off;
+}
+
+/* Append the string 's', writing its length and offset in 'b'. */
+static void bufString(struct mkbuf *b, struct mkbuf *strings, unsigned int base, char *s)
+{
+    buf32(b, strlen(s)*2);
+    buf32(b, addString(strings, base, s));
+}
+
+/* CRC-16/CCITT, as used by EPOC for UID and file checksums. */
+static unsigned short crc16(const unsigned char *p, size_t len, unsigned short crc)
+{
+    int j;
+
+    while (len--) {
+        crc ^= (unsigned short)*p++ << 8;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+/* UID4 is the checksum of the first three UIDs: the CRC of their even
+ * bytes in the low half, the one of the odd bytes in the high half. */
+static unsigned int uidChecksum(unsigned int uid1, unsigned int uid2, unsigned int uid3)
+{
+    unsigned char b[12], even[6], odd[6];
+    int j;
+
+    put32(b, uid1);
+    put32(b+4, uid2);
+    put32(b+8, uid3);
+    for (j = 0; j < 6; j++) {
+        even[j] = b[j*2];
+        odd[j] = b[j*2+1];
+    }
+    return crc16(even, 6, 0) | ((unsigned int)crc16(odd, 6, 0) << 16);
+}
+
+static int writeAll(int fd, unsigned char *p, size_t len, char *err, int errlen)
+{
+    ssize_t nw;
+
+    while (len) {
+        nw = write(fd, p, len);
+        if (nw == -1) {
+            if (errno == EINTR) continue;
+            snprintf(err, errlen, "error writing file: %s", strerror(errno));
+            return 1;
+        }
+        p += nw;
+        len -= nw;
+    }
+    return 0;
+}
+
+/* ------------------------- Package description parser ------------------------
+ * Every line is split into tokens: words separated by spaces, or strings
+ * between double quotes (a quote inside a string is written twice). In
+ * conditions the parentheses and the comparison operators are tokens by
+ * themselves. */
+
+struct mktokens {
+    char *argv[SISMAKE_MAXARGS];
+    int quoted[SISMAKE_MAXARGS];
+    int argc;
+    int pos;                        /* next token, for the condition parser */
+    char buf[SISMAKE_LINELEN*2];    /* the tokens, null terminated */
+};
+
+static int isOpChar(char *p)
+{
+    return *p == '(' || *p == ')' || *p == '=' || *p == '<' || *p == '>' ||
+           (p[0] == '!' && p[1] == '=');
+}
+
+static int isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* Split 'line' into the tokens 't'. Returns 0 on success, 1 on syntax
+ * errors. */
+static int tokenize(char *line, struct mktokens *t, char *err, int errlen)
+{
+    char *p = line, *w = t->buf;
+
+    t->argc = t->pos = 0;
+    while (1) {
+        while (isSpace(*p)) p++;
+        if (*p == '\0' || *p == '#') break;
+        if (t->argc == SISMAKE_MAXARGS) {
+            snprintf(err, errlen, "too many tokens");
+            return 1;
+        }
+        t->quoted[t->argc] = (*p == '"');
+        t->argv[t->argc++] = w;
+        if (*p == '"') {
+            p++;
+            while (1) {
+                if (*p == '\0') {
+                    snprintf(err, errlen, "unterminated string");
+                    return 1;
+                }
+                if (*p == '"') {
+                    if (p[1] != '"') break;
+                    p++;
+                }
+                *w++ = *p++;
+            }
+            p++;
+        } else if (isOpChar(p)) {
+            /* ( ) = == != < <= > >= */
+            if (p[0] != '(' && p[0] != ')' && p[1] == '=') *w++ = *p++;
+            *w++ = *p++;
+        } else {
+            while (*p && !isSpace(*p) && *p != '"' && !isOpChar(p))
+                *w++ = *p++;
+        }
+        *w++ = '\0';
+    }
+    return 0;
+}
+
+static int parseNumber(char *s, unsigned int *value)
+{
+    char *end;
+    unsigned long v;
+
+    errno = 0;
+    v = strtoul(s, &end, 0);
+    if (*s == '\0' || *end != '\0' || errno || v > 0xffffffffUL) return 1;
+    *value = v;
+    return 0;
+}
+
+/* Attribute names are the ones shown by sisopen, without spaces and
+ * without case sensitivity: "CPU type" is CPUType or cputype. */
+static int attrMatch(char *name, char *tok)
+{
+    while (*name || *tok) {
+        if (*name == ' ') {
+            name++;
+            continue;
+        }
+        if (tolower((unsigned char)*name) != tolower((unsigned char)*tok))
+            return 0;
+        name++;
+        tok++;
+    }
+    return 1;
+}
+
+static struct mkcond *condNode(unsigned int type, struct mkcond *left, struct mkcond *right)
+{
+    struct mkcond *c = mkalloc(sizeof(*c));
+
+    memset(c, 0, sizeof(*c));
+    c->type = type;
+    c->left = left;
+    c->right = right;
+    return c;
+}
+
+static void condFree(struct mkcond *c)
+{
+    if (c == NULL) return;
+    condFree(c->left);
+    condFree(c->right);
+    free(c->str);
+    free(c);
+}
+
+static char *nextToken(struct mktokens *t)
+{
+    return t->pos < t->argc ? t->argv[t->pos] : NULL;
+}
+
+static int isKeyword(struct mktokens *t, char *kw)
+{
+    return t->pos < t->argc && !t->quoted[t->pos] &&
+           !strcasecmp(t->argv[t->pos], kw);
+}
+
+static struct mkcond *condOr(struct mktokens *t, char *err, int errlen);
+
+static int expectToken(struct mktokens *t, char *tok, char *err, int errlen)
+{
+    if (!isKeyword(t, tok)) {
+        snprintf(err, errlen, "expected '%s' in condition, found '%s'", tok,
+            nextToken(t) ? nextToken(t) : "end of line");
+        return 1;
+    }
+    t->pos++;
+    return 0;
+}
+
+/* primary: ( expr ) | NOT ( expr ) | EXISTS ( expr ) | DEVCAP ( expr )
+ *          | APPCAP ( expr ) | "string" | number | attribute
+ *          | option N | attribute N */
+static struct mkcond *condPrimary(struct mktokens *t, char *err, int errlen)
+{
+    static struct {char *name; unsigned int type;} funcs[] = {
+        {"NOT", SIS_COND_NOT}, {"EXISTS", SIS_COND_EXISTS},
+        {"DEVCAP", SIS_COND_DEVCAP}, {"APPCAP", SIS_COND_APPCAP},
+        {NULL, 0}
+    };
+    struct mkcond *c = NULL;
+    char *tok = nextToken(t);
+    unsigned int value;
+    int j;
+
+    if (tok == NULL) {
+        snprintf(err, errlen, "unexpected end of condition");
+        return NULL;
+    }
+    if (t->quoted[t->pos]) {
+        c = condNode(SIS_COND_STRING, NULL, NULL);
+        c->str = mkstrdup(tok);
+        t->pos++;
+        return c;
+    }
+    if (!strcmp(tok, "(")) {
+        t->pos++;
+        if ((c = condOr(t, err, errlen)) == NULL) return NULL;
+        if (expectToken(t, ")", err, errlen)) goto fail;
+        return c;
+    }
+    for (j = 0; funcs[j].name; j++) {
+        if (strcasecmp(tok, funcs[j].name)) continue;
+        t->pos++;
+        if (expectToken(t, "(", err, errlen)) return NULL;
+        if ((c = condOr(t, err, errlen)) == NULL) return NULL;
+        c = condNode(funcs[j].type, c, NULL);
+        if (expectToken(t, ")", err, errlen)) goto fail;
+        return c;
+    }
+    t->pos++;
+    if (parseNumber(tok, &value) == 0) {
+        c = condNode(SIS_COND_NUMBER, NULL, NULL);
+        c->value = value;
+        return c;
+    }
+    if (!strcasecmp(tok, "option") || !strcasecmp(tok, "attribute")) {
+        if (nextToken(t) == NULL || t->quoted[t->pos] ||
+            parseNumber(nextToken(t), &value))
+        {
+            snprintf(err, errlen, "number expected after '%s'", tok);
+            return NULL;
+        }
+        t->pos++;
+        c = condNode(SIS_COND_ATTRIBUTE, NULL, NULL);
+        c->value = tolower((unsigned char)tok[0]) == 'o' ?
+                   value+SIS_ATTR_OPTION : value;
+        return c;
+    }
+    for (j = 0; sisAttrTab[j].name; j++) {
+        if (attrMatch(sisAttrTab[j].name, tok)) {
+            c = condNode(SIS_COND_ATTRIBUTE, NULL, NULL);
+            c->value = sisAttrTab[j].id;
+            return c;
+        }
+    }
+    snprintf(err, errlen, "unknown attribute '%s' in condition", tok);
+    return NULL;
+
+fail:
+    condFree(c);
+    return NULL;
+}
+
+/* comparison: primary [ op primary ] */
+static struct mkcond *condCompare(struct mktokens *t, char *err, int errlen)
+{
+    static struct {char *op; unsigned int type;} ops[] = {
+        {"==", SIS_COND_EQ}, {"=", SIS_COND_EQ}, {"!=", SIS_COND_NE},
+        {">", SIS_COND_GT}, {"<", SIS_COND_LT}, {">=", SIS_COND_GE},
+        {"<=", SIS_COND_LE}, {NULL, 0}
+    };
+    struct mkcond *left, *right;
+    int j;
+
+    if ((left = condPrimary(t, err, errlen)) == NULL) return NULL;
+    for (j = 0; ops[j].op; j++) {
+        if (!isKeyword(t, ops[j].op)) continue;
+        t->pos++;
+        if ((right = condPrimary(t, err, errlen)) == NULL) {
+            condFree(left);
+            return NULL;
+        }
+        return condNode(ops[j].type, left, right);
+    }
+    return left;
+}
+
+/* Left associative AND / OR chains, AND binding tighter. */
+static struct mkcond *condAnd(struct mktokens *t, char *err, int errlen)
+{
+    struct mkcond *left, *right;
+
+    if ((left = condCompare(t, err, errlen)) == NULL) return NULL;
+    while (isKeyword(t, "AND")) {
+        t->pos++;
+        if ((right = condCompare(t, err, errlen)) == NULL) {
+            condFree(left);
+            return NULL;
+        }
+        left = condNode(SIS_COND_AND, left, right);
+    }
+    return left;
+}
+
+static struct mkcond *condOr(struct mktokens *t, char *err, int errlen)
+{
+    struct mkcond *left, *right;
+
+    if ((left = condAnd(t, err, errlen)) == NULL) return NULL;
+    while (isKeyword(t, "OR")) {
+        t->pos++;
+        if ((right = condAnd(t, err, errlen)) == NULL) {
+            condFree(left);
+            return NULL;
+        }
+        left = condNode(SIS_COND_OR, left, right);
+    }
+    return left;
+}
+
+static int parseLanguage(char *tok, unsigned short *lang)
+{
+    unsigned int v;
+    unsigned int j;
+
+    if (parseNumber(tok, &v) == 0 && v < 0x10000) {
+        *lang = v;
+        return 0;
+    }
+    for (j = 0; j < sizeof(sisLangTab)/sizeof(char*); j++) {
+        if (sisLangTab[j] && !strcasecmp(sisLangTab[j], tok)) {
+            *lang = j;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int parseFileType(char *tok, unsigned int *type)
+{
+    static char *types[] = {"standard", "text", "component", "run",
+                            "notexists", "open", NULL};
+    int j;
+
+    for (j = 0; types[j]; j++) {
+        if (!strcasecmp(types[j], tok)) {
+            *type = j;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int addPayload(struct mkpkg *pkg, char *src)
+{
+    struct mkpayload *p;
+
+    pkg->payloads = mkrealloc(pkg->payloads,
+        sizeof(*pkg->payloads)*(pkg->numpayloads+1));
+    p = &pkg->payloads[pkg->numpayloads];
+    memset(p, 0, sizeof(*p));
+    p->src = mkstrdup(src);
+    return pkg->numpayloads++;
+}
+
+static struct mkrecord *addRecord(struct mkpkg *pkg, unsigned int type, int line)
+{
+    struct mkrecord *r;
+
+    pkg->records = mkrealloc(pkg->records,
+        sizeof(*pkg->records)*(pkg->numrecords+1));
+    r = &pkg->records[pkg->numrecords++];
+    memset(r, 0, sizeof(*r));
+    r->type = type;
+    r->line = line;
+    return r;
+}
+
+/* Parse a line of the description, already split in tokens. */
+static int parseLine(struct mkpkg *pkg, struct mktokens *t, int line, char *err, int errlen)
+{
+    char *cmd = t->argv[0];
+    struct mkrecord *r;
+    unsigned int v;
+    int j, first;
+
+    if (!strcmp(cmd, "epoc")) {
+        if (t->argc != 2 || parseNumber(t->argv[1], &v) || (v != 5 && v != 6))
+            goto syntax;
+        pkg->epocrelease = v;
+    } else if (!strcmp(cmd, "uid")) {
+        if (t->argc != 2 || parseNumber(t->argv[1], &pkg->uid)) goto syntax;
+    } else if (!strcmp(cmd, "version")) {
+        if (t->argc != 3 || parseNumber(t->argv[1], &pkg->major) ||
+            parseNumber(t->argv[2], &pkg->minor) ||
+            pkg->major > 0xffff || pkg->minor > 0xffff) goto syntax;
+    } else if (!strcmp(cmd, "type")) {
+        static char *types[] = {"SA", "SY", "SO", "SC", "SP", "SU", NULL};
+
+        if (t->argc != 2) goto syntax;
+        for (j = 0; types[j]; j++)
+            if (!strcasecmp(types[j], t->argv[1])) break;
+        if (types[j] == NULL) goto syntax;
+        pkg->type = j;
+    } else if (!strcmp(cmd, "flags")) {
+        for (j = 1; j < t->argc; j++) {
+            if (!strcasecmp(t->argv[j], "unicode")) pkg->options |= SIS_OPT_UNICODE;
+            else if (!strcasecmp(t->argv[j], "distributable")) pkg->options |= SIS_OPT_DISTRIBUTABLE;
+            else if (!strcasecmp(t->argv[j], "nocompress")) pkg->options |= SIS_OPT_NOCOMPRESS;
+            else if (!strcasecmp(t->argv[j], "shutdownapps")) pkg->options |= SIS_OPT_SHUTDOWNAPPS;
+            else {
+                snprintf(err, errlen, "unknown flag '%s'", t->argv[j]);
+                return 1;
+            }
+        }
+    } else if (!strcmp(cmd, "languages")) {
+        if (t->argc < 2 || pkg->numlangs) goto syntax;
+        for (j = 1; j < t->argc; j++) {
+            if (parseLanguage(t->argv[j], &pkg->langs[pkg->numlangs++])) {
+                snprintf(err, errlen, "unknown language '%s'", t->argv[j]);
+                return 1;
+            }
+        }
+    } else if (!strcmp(cmd, "name")) {
+        if (t->argc < 2 || pkg->numnames) goto syntax;
+        for (j = 1; j < t->argc; j++)
+            pkg->names[pkg->numnames++] = mkstrdup(t->argv[j]);
+    } else if (!strcmp(cmd, "file") || !strcmp(cmd, "multilang")) {
+        /* file [TYPE] SRC DST
+         * multilang [TYPE] DST SRC1 SRC2 ... */
+        int multi = cmd[0] == 'm';
+
+        r = addRecord(pkg, multi ? SIS_FILE_MULTILANG : SIS_FILE_SIMPLE, line);
+        first = 1;
+        if (t->argc > 1 && !t->quoted[1] &&
+            parseFileType(t->argv[1], &r->filetype) == 0) first = 2;
+        if (!multi && t->argc-first != 2) goto syntax;
+        if (multi && t->argc-first < 2) goto syntax;
+        r->dst = mkstrdup(t->argv[multi ? first : first+1]);
+        r->numpayloads = multi ? t->argc-first-1 : 1;
+        r->payloads = mkalloc(sizeof(int)*r->numpayloads);
+        if (multi) {
+            for (j = 0; j < r->numpayloads; j++)
+                r->payloads[j] = addPayload(pkg, t->argv[first+1+j]);
+        } else {
+            r->payloads[0] = addPayload(pkg, t->argv[first]);
+        }
+    } else if (!strcmp(cmd, "options")) {
+        if (t->argc < 2) goto syntax;
+        r = addRecord(pkg, SIS_FILE_OPTIONS, line);
+        r->numopt = t->argc-1;
+        r->opt = mkalloc(sizeof(char*)*r->numopt);
+        for (j = 0; j < r->numopt; j++) r->opt[j] = mkstrdup(t->argv[j+1]);
+    } else if (!strcmp(cmd, "if") || !strcmp(cmd, "elseif")) {
+        r = addRecord(pkg, cmd[0] == 'i' ? SIS_FILE_IF : SIS_FILE_ELSEIF, line);
+        t->pos = 1;
+        if ((r->cond = condOr(t, err, errlen)) == NULL) return 1;
+        if (t->pos != t->argc) {
+            snprintf(err, errlen, "unexpected '%s' in condition", nextToken(t));
+            return 1;
+        }
+    } else if (!strcmp(cmd, "else") || !strcmp(cmd, "endif")) {
+        if (t->argc != 1) goto syntax;
+        addRecord(pkg, cmd[1] == 'l' ? SIS_FILE_ELSE : SIS_FILE_ENDIF, line);
+    } else {
+        snprintf(err, errlen, "unknown directive '%s'", cmd);
+        return 1;
+    }
+    return 0;
+
+syntax:
+    snprintf(err, errlen, "syntax error in '%s' line", cmd);
+    return 1;
+}
+
+/* Load the description 'filename'. Errors are reported as file:line. */
+static int loadDescription(struct mkpkg *pkg, char *filename)
+{
+    char line[SISMAKE_LINELEN], err[SISMAKE_ERRLEN];
+    struct mktokens t;
+    int linenum = 0, depth = 0, j;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "%s: %s opening file\n", filename, strerror(errno));
+        return 1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        linenum++;
+        if (tokenize(line, &t, err, sizeof(err)) ||
+            (t.argc && parseLine(pkg, &t, linenum, err, sizeof(err))))
+        {
+            fprintf(stderr, "%s:%d: %s\n", filename, linenum, err);
+            fclose(fp);
+            return 1;
+        }
+    }
+    fclose(fp);
+
+    /* Check the things that depend on more than one line. */
+    if (pkg->numlangs == 0) pkg->langs[pkg->numlangs++] = 1; /* UK English */
+    if (pkg->numnames && pkg->numnames != pkg->numlangs) {
+        fprintf(stderr, "%s: %d component names for %d languages\n",
+            filename, pkg->numnames, pkg->numlangs);
+        return 1;
+    }
+    for (j = 0; j < pkg->numrecords; j++) {
+        struct mkrecord *r = &pkg->records[j];
+
+        if (r->type == SIS_FILE_MULTILANG && r->numpayloads != pkg->numlangs) {
+            fprintf(stderr, "%s:%d: %d files for %d languages\n", filename,
+                r->line, r->numpayloads, pkg->numlangs);
+            return 1;
+        }
+        if (r->type == SIS_FILE_IF) depth++;
+        if ((r->type == SIS_FILE_ELSEIF || r->type == SIS_FILE_ELSE ||
+             r->type == SIS_FILE_ENDIF) && depth == 0)
+        {
+            fprintf(stderr, "%s:%d: %s without if\n", filename, r->line,
+                r->type == SIS_FILE_ENDIF ? "endif" : "else");
+            return 1;
+        }
+        if (r->type == SIS_FILE_ENDIF) depth--;
+    }
+    if (depth) {
+        fprintf(stderr, "%s: missing endif\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+/* ------------------------------ Compression ------------------------------- */
+
+struct mkjobs {
+    struct mkpkg *pkg;
+    int next;                       /* next payload to process */
+    int compress;
+    pthread_mutex_t lock;
+};
+
+static int readSource(struct mkpkg *pkg, struct mkpayload *p)
+{
+    struct stat st;
+    ssize_t n;
+    size_t got = 0;
+    int fd;
+
+    if ((fd = openat(pkg->srcdir, p->src, O_RDONLY)) == -1 ||
+        fstat(fd, &st) == -1)
+    {
+        snprintf(p->err, sizeof(p->err), "%s", strerror(errno));
+        if (fd != -1) close(fd);
+        return 1;
+    }
+    p->len = st.st_size;
+    p->data = mkalloc(p->len);
+    while (got < p->len) {
+        n = read(fd, p->data+got, p->len-got);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            snprintf(p->err, sizeof(p->err), "%s",
+                n == 0 ? "file changed while reading" : strerror(errno));
+            close(fd);
+            return 1;
+        }
+        got += n;
+    }
+    close(fd);
+    return 0;
+}
+
+static void *compressWorker(void *privdata)
+{
+    struct mkjobs *jobs = privdata;
+    struct mkpkg *pkg = jobs->pkg;
+    struct mkpayload *p;
+    int i;
+
+    while (1) {
+        pthread_mutex_lock(&jobs->lock);
+        i = jobs->next++;
+        pthread_mutex_unlock(&jobs->lock);
+        if (i >= pkg->numpayloads) break;
+        p = &pkg->payloads[i];
+        if (readSource(pkg, p)) continue;
+        /* Empty files are always stored: a zero original length is what
+         * tells readers that a payload is not compressed. */
+        if (!jobs->compress || p->len == 0) continue;
+#ifndef NOZLIB
+        {
+            uLongf zlen = compressBound(p->len);
+
+            p->zdata = mkalloc(zlen);
+            if (compress2(p->zdata, &zlen, p->data, p->len, pkg->level) != Z_OK) {
+                snprintf(p->err, sizeof(p->err), "zlib error compressing");
+                continue;
+            }
+            p->zlen = zlen;
+        }
+#endif
+    }
+    return NULL;
+}
+
+/* Read and compress all the payloads using 'numthreads' threads. */
+static int compressPayloads(struct mkpkg *pkg, int numthreads)
+{
+    struct mkjobs jobs;
+    pthread_t *tids;
+    int j, started = 0, errors = 0;
+
+    jobs.pkg = pkg;
+    jobs.next = 0;
+    jobs.compress = pkg->epocrelease == 6 && !(pkg->options & SIS_OPT_NOCOMPRESS);
+    pthread_mutex_init(&jobs.lock, NULL);
+    if (numthreads > pkg->numpayloads) numthreads = pkg->numpayloads;
+    tids = mkalloc(sizeof(pthread_t)*(numthreads+1));
+    for (j = 0; j < numthreads; j++) {
+        if (pthread_create(&tids[j], NULL, compressWorker, &jobs) != 0) break;
+        started++;
+    }
+    /* If no thread could be started do the work ourselves. */
+    if (started == 0) compressWorker(&jobs);
+    for (j = 0; j < started; j++) pthread_join(tids[j], NULL);
+    pthread_mutex_destroy(&jobs.lock);
+    free(tids);
+
+    for (j = 0; j < pkg->numpayloads; j++) {
+        if (pkg->payloads[j].err[0]) {
+            fprintf(stderr, "%s: %s\n", pkg->payloads[j].src,
+                pkg->payloads[j].err);
+            errors++;
+        }
+    }
+    return errors != 0;
+}
+
+/* --------------------------------- Layout --------------------------------- */
+
+static size_t condSize(struct mkcond *c)
+{
+    switch(c->type) {
+    case SIS_COND_STRING:
+    case SIS_COND_ATTRIBUTE:
+    case SIS_COND_NUMBER:
+        return 12;
+    case SIS_COND_APPCAP:
+    case SIS_COND_EXISTS:
+    case SIS_COND_DEVCAP:
+    case SIS_COND_NOT:
+        return 4+condSize(c->left);
+    default:
+        return 4+condSize(c->left)+condSize(c->right);
+    }
+}
+
+static size_t recordSize(struct mkpkg *pkg, struct mkrecord *r)
+{
+    switch(r->type) {
+    case SIS_FILE_SIMPLE:
+    case SIS_FILE_MULTILANG:
+        return 4+sizeof(struct filerecord)+8*r->numpayloads+
+               (pkg->epocrelease == 6 ? 4*r->numpayloads+8 : 0);
+    case SIS_FILE_OPTIONS:
+        return 4+4+8*r->numopt+16;
+    case SIS_FILE_IF:
+    case SIS_FILE_ELSEIF:
+        return 4+4+condSize(r->cond);
+    default:
+        return 4;
+    }
+}
+
+static void emitCond(struct mkbuf *b, struct mkbuf *strings, unsigned int stroff, struct mkcond *c)
+{
+    buf32(b, c->type);
+    switch(c->type) {
+    case SIS_COND_STRING:
+        bufString(b, strings, stroff, c->str);
+        break;
+    case SIS_COND_ATTRIBUTE:
+    case SIS_COND_NUMBER:
+        buf32(b, c->value);
+        buf32(b, 0);
+        break;
+    case SIS_COND_APPCAP:
+    case SIS_COND_EXISTS:
+    case SIS_COND_DEVCAP:
+    case SIS_COND_NOT:
+        emitCond(b, strings, stroff, c->left);
+        break;
+    default:
+        emitCond(b, strings, stroff, c->left);
+        emitCond(b, strings, stroff, c->right);
+        break;
+    }
+}
+
+static int payloadStored(struct mkpayload *p)
+{
+    return p->zdata == NULL;
+}
+
+/* Lay out the whole package in 'out'. */
+static void buildPackage(struct mkpkg *pkg, struct mkbuf *out)
+{
+    struct mkbuf strings = {NULL, 0, 0};
+    unsigned int hdrlen, langoff, fileoff, compnameoff, payoff, stroff;
+    unsigned int *paypos, pos, maxspace = 0;
+    unsigned char *h;
+    int i, j;
+
+    /* Compute where every section starts. */
+    hdrlen = sizeof(struct sishdr);
+    if (pkg->epocrelease != 6) hdrlen -= EPOC6_HDR_TAIL_LEN;
+    langoff = hdrlen;
+    fileoff = langoff+2*pkg->numlangs;
+    compnameoff = fileoff;
+    for (j = 0; j < pkg->numrecords; j++)
+        compnameoff += recordSize(pkg, &pkg->records[j]);
+    payoff = compnameoff+(pkg->numnames ? 8*pkg->numnames : 0);
+    paypos = mkalloc(sizeof(unsigned int)*(pkg->numpayloads+1));
+    pos = payoff;
+    for (j = 0; j < pkg->numpayloads; j++) {
+        struct mkpayload *p = &pkg->payloads[j];
+
+        paypos[j] = pos;
+        pos += payloadStored(p) ? p->len : p->zlen;
+        maxspace += p->len;
+    }
+    stroff = pos;
+
+    /* Header, fixed up at the end with the checksum. */
+    out->len = 0;
+    buf32(out, pkg->uid);
+    buf32(out, pkg->epocrelease == 6 ? SIS_UID2_EPOC6 : SIS_UID2_EPOC5);
+    buf32(out, SIS_UID3);
+    buf32(out, uidChecksum(pkg->uid,
+        pkg->epocrelease == 6 ? SIS_UID2_EPOC6 : SIS_UID2_EPOC5, SIS_UID3));
+    buf16(out, 0);                  /* checksum */
+    buf16(out, pkg->numlangs);
+    buf16(out, pkg->numrecords);
+    buf16(out, 0);                  /* requisites */
+    buf16(out, 0);                  /* installation language */
+    buf16(out, 0);                  /* installed files */
+    buf16(out, 0);                  /* installation drive */
+    buf16(out, 0);                  /* capabilities */
+    buf32(out, pkg->epocrelease == 6 ? 200 : 68);   /* installer version */
+    buf16(out, pkg->options);
+    buf16(out, pkg->type);
+    buf16(out, pkg->major);
+    buf16(out, pkg->minor);
+    buf32(out, 0);                  /* variant */
+    buf32(out, langoff);
+    buf32(out, fileoff);
+    buf32(out, 0);                  /* requisites */
+    buf32(out, 0);                  /* certificates */
+    buf32(out, pkg->numnames ? compnameoff : 0);
+    if (pkg->epocrelease == 6) {
+        buf32(out, 0);              /* signature */
+        buf32(out, 0);              /* capabilities */
+        buf32(out, 0);              /* installed space */
+        buf32(out, maxspace);       /* max installed space */
+    }
+
+    for (j = 0; j < pkg->numlangs; j++) buf16(out, pkg->langs[j]);
+
+    /* The file table, upside down. */
+    for (j = pkg->numrecords-1; j >= 0; j--) {
+        struct mkrecord *r = &pkg->records[j];
+
+        buf32(out, r->type);
+        switch(r->type) {
+        case SIS_FILE_SIMPLE:
+        case SIS_FILE_MULTILANG:
+            buf32(out, r->filetype);
+            buf32(out, 0);          /* details */
+            bufString(out, &strings, stroff, pkg->payloads[r->payloads[0]].src);
+            bufString(out, &strings, stroff, r->dst);
+            for (i = 0; i < r->numpayloads; i++) {
+                struct mkpayload *p = &pkg->payloads[r->payloads[i]];
+                buf32(out, payloadStored(p) ? p->len : p->zlen);
+            }
+            for (i = 0; i < r->numpayloads; i++)
+                buf32(out, paypos[r->payloads[i]]);
+            if (pkg->epocrelease == 6) {
+                for (i = 0; i < r->numpayloads; i++) {
+                    struct mkpayload *p = &pkg->payloads[r->payloads[i]];
+                    buf32(out, payloadStored(p) ? 0 : p->len);
+                }
+                buf32(out, 0);      /* MIME type */
+                buf32(out, 0);
+            }
+            break;
+        case SIS_FILE_OPTIONS:
+            buf32(out, r->numopt);
+            for (i = 0; i < r->numopt; i++)
+                bufString(out, &strings, stroff, r->opt[i]);
+            for (i = 0; i < 16; i++) bufAppend(out, "", 1); /* selected */
+            break;
+        case SIS_FILE_IF:
+        case SIS_FILE_ELSEIF:
+            buf32(out, condSize(r->cond));
+            emitCond(out, &strings, stroff, r->cond);
+            break;
+        }
+    }
+
+    /* Component name: all the lengths, then all the offsets. */
+    for (j = 0; j < pkg->numnames; j++)
+        buf32(out, strlen(pkg->names[j])*2);
+    for (j = 0; j < pkg->numnames; j++)
+        buf32(out, addString(&strings, stroff, pkg->names[j]));
+
+    for (j = 0; j < pkg->numpayloads; j++) {
+        struct mkpayload *p = &pkg->payloads[j];
+
+        if (payloadStored(p)) bufAppend(out, p->data, p->len);
+        else bufAppend(out, p->zdata, p->zlen);
+    }
+    bufAppend(out, strings.p, strings.len);
+    free(strings.p);
+    free(paypos);
+
+    /* The checksum covers the whole file, with the field set to zero. */
+    h = out->p+16;
+    pos = crc16(out->p, out->len, 0);
+    h[0] = pos & 0xff;
+    h[1] = (pos >> 8) & 0xff;
+}
+
+static void pkgFree(struct mkpkg *pkg)
+{
+    int i, j;
+
+    for (j = 0; j < pkg->numrecords; j++) {
+        struct mkrecord *r = &pkg->records[j];
+
+        free(r->dst);
+        free(r->payloads);
+        for (i = 0; i < r->numopt; i++) free(r->opt[i]);
+        free(r->opt);
+        condFree(r->cond);
+    }
+    free(pkg->records);
+    for (j = 0; j < pkg->numpayloads; j++) {
+        free(pkg->payloads[j].src);
+        free(pkg->payloads[j].data);
+        free(pkg->payloads[j].zdata);
+    }
+    free(pkg->payloads);
+    for (j = 0; j < pkg->numnames; j++) free(pkg->names[j]);
+}
+
+/* ---------------------------------- Main ---------------------------------- */
+
+enum options {OPT_HELP, OPT_OUTPUT, OPT_JOBS, OPT_LEVEL};
+
+static struct ago_optlist optList[] = {
+    {'h', "help",       OPT_HELP,       AGO_NOARG},
+    {'o', "output",     OPT_OUTPUT,     AGO_NEEDARG},
+    {'j', "jobs",       OPT_JOBS,       AGO_NEEDARG},
+    {'l', "level",      OPT_LEVEL,      AGO_NEEDARG},
+    AGO_LIST_TERM
+};
+
+static void showHelp(void)
+{
+    printf("\nUsage: sismake [options] <package description>\n");
+    printf("Available options:\n");
+    printf("  -h --help             | Show this help\n");
+    printf("  -o --output     <arg> | Output file (default: description name .sis)\n");
+    printf("  -j --jobs       <arg> | Compression threads (default: CPUs)\n");
+    printf("  -l --level      <arg> | zlib compression level 0-9 (default 6)\n\n");
+}
+
+/* foo.pkg -> foo.sis */
+static char *outputName(char *desc)
+{
+    char *name = mkalloc(strlen(desc)+5);
+    char *dot, *slash;
+
+    strcpy(name, desc);
+    dot = strrchr(name, '.');
+    slash = strrchr(name, '/');
+    if (dot && (slash == NULL || dot > slash) && strcasecmp(dot, ".sis"))
+        *dot = '\0';
+    strcat(name, ".sis");
+    return name;
+}
+
+int main(int argc, char **argv)
+{
+    struct mkpkg pkg;
+    struct mkbuf out = {NULL, 0, 0};
+    char err[SISMAKE_ERRLEN], *desc = NULL, *output = NULL, *dir, *slash;
+    int o, fd, numthreads = 0, exitcode = 1;
+
+    memset(&pkg, 0, sizeof(pkg));
+    pkg.epocrelease = 6;
+    pkg.level = 6;
+    pkg.options = SIS_OPT_UNICODE;
+    pkg.major = 1;
+
+    while ((o = antigetopt(argc, argv, optList)) != AGO_EOF) {
+        switch(o) {
+        case AGO_UNKNOWN:
+        case AGO_REQARG:
+        case AGO_AMBIG:
+            ago_gnu_error("sismake", o);
+            showHelp();
+            exit(1);
+            break;
+        case OPT_HELP:
+            showHelp();
+            exit(1);
+            break;
+        case OPT_OUTPUT:
+            output = ago_optarg;
+            break;
+        case OPT_JOBS:
+            numthreads = atoi(ago_optarg);
+            break;
+        case OPT_LEVEL:
+            pkg.level = atoi(ago_optarg);
+            if (pkg.level < 0 || pkg.level > 9) {
+                fprintf(stderr, "Compression level must be 0-9\n");
+                exit(1);
+            }
+            break;
+        case AGO_ALONE:
+            if (desc) {
+                fprintf(stderr, "Only one package description can be given\n");
+                exit(1);
+            }
+            desc = ago_optarg;
+            break;
+        }
+    }
+    if (desc == NULL) {
+        showHelp();
+        exit(1);
+    }
+    if (numthreads <= 0) numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numthreads <= 0) numthreads = 1;
+
+    /* Source files are relative to the directory of the description. */
+    dir = mkstrdup(desc);
+    if ((slash = strrchr(dir, '/')) != NULL) slash[1] = '\0';
+    else strcpy(dir, ".");
+    if ((pkg.srcdir = open(dir, O_RDONLY|O_DIRECTORY)) == -1) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+    free(dir);
+
+    if (loadDescription(&pkg, desc)) goto cleanup;
+#ifdef NOZLIB
+    if (pkg.epocrelease == 6 && !(pkg.options & SIS_OPT_NOCOMPRESS)) {
+        fprintf(stderr, "%s: sismake is compiled without zlib support, "
+            "the package will not be compressed\n", desc);
+        pkg.options |= SIS_OPT_NOCOMPRESS;
+    }
+#endif
+    if (compressPayloads(&pkg, numthreads)) goto cleanup;
+    buildPackage(&pkg, &out);
+
+    if (output == NULL) output = outputName(desc);
+    else output = mkstrdup(output);
+    if ((fd = open(output, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1) {
+        fprintf(stderr, "%s: %s opening file\n", output, strerror(errno));
+        goto cleanup;
+    }
+    if (writeAll(fd, out.p, out.len, err, sizeof(err)) || close(fd) == -1) {
+        fprintf(stderr, "%s: %s\n", output, err);
+        goto cleanup;
+    }
+    exitcode = 0;
+
+cleanup:
+    free(output);
+    free(out.p);
+    close(pkg.srcdir);
+    pkgFree(&pkg);
+    return exitcode;
+}
@@ -1,46 +1,64 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* copy_file_range(), fallocate(), syncfs() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h> /* FICLONE */
+#include <sys/inotify.h>
+#endif
 
 #ifndef NOZLIB
 #include <zlib.h>
 #endif
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 #include "antigetopt.h"
+#include "sis.h"
 #include "langtab.h"
+#include "attrtab.h"
+#include "sha256.h"
+#include "sha1.h"
+#include "crc32.h"
+#include "inflate.h"
+#include "rsa.h"
 
 #define SISOPEN_ERRLEN 1024
-
-#define SIS_OPT_UNICODE 0x01
-#define SIS_OPT_DISTRIBUTABLE 0x02
-#define SIS_OPT_NOCOMPRESS 0x08
-#define SIS_OPT_SHUTDOWNAPPS 0x10
-
-#define SIS_TYPE_SA 0x00
-#define SIS_TYPE_SY 0x01
-#define SIS_TYPE_SO 0x02
-#define SIS_TYPE_SC 0x03
-#define SIS_TYPE_SP 0x04
-#define SIS_TYPE_SU 0x05
-
-#define SIS_FILE_SIMPLE     0x00
-#define SIS_FILE_MULTILANG  0x01
-#define SIS_FILE_OPTIONS    0x02
-#define SIS_FILE_IF         0x03
-#define SIS_FILE_ELSEIF     0x04
-#define SIS_FILE_ELSE       0x05
-#define SIS_FILE_ENDIF      0x06
-
-#define SIS_FILETYPE_STANDARD   0x00
-#define SIS_FILETYPE_TEXT       0x01
-#define SIS_FILETYPE_COMPONENT  0x02
-#define SIS_FILETYPE_RUN        0x03
-#define SIS_FILETYPE_NOTEXISTS  0x04
-#define SIS_FILETYPE_OPEN       0x05
-
-#define SIS_NOTUSED(V) ((void) V)
+#define SIS_PREFETCH_DEFAULT 4      /* files opened ahead in batch mode */
+#define SIS_PREFETCH_HDRLEN 65536   /* bytes hinted at the start of a file */
+#define SIS_PREFETCH_RECLEN 128     /* estimated file table bytes per record */
+#define SIS_PREFETCH_FDRESERVE 64   /* descriptors left for everything else */
+#define SIS_COPY_BUFLEN 65536       /* buffer of the read/write copy fallback */
+#define SIS_CHUNK_LEN 65536         /* payloads are processed in chunks of this size */
+#define SIS_MAX_DEPTH 8             /* default nesting limit of --recurse */
+#define SIS_INFLATE_MAXRATIO 1032   /* max expansion of deflate, larger
+                                       original lengths are corrupted */
 
 static char *sisFileRecordTypeTab[] = {"simple","multilang","options","if","elseif","else","endif"};
 static char *sisFileTypeTab[] = {"standard","text","component","run during installation/removal","file does not exist, will be created when the app is run","open file"};
@@ -49,47 +67,90 @@ static int lendian; /* set to 1 if it's little endian.
                 Sisopen detects endianess at runtime */
 static int optExtract=0;
 static int optVerbose=0;
-static int flagNocompr=0; /* flag set to 1 if SIS_OPT_NOCOMPRESS is present */
-
-struct sishdr {
-    unsigned int uid1;
-    unsigned int uid2;
-    unsigned int uid3;
-    unsigned int uid4;
-    unsigned short cksum;
-    unsigned short languages;
-    unsigned short files;
-    unsigned short requisities;
-    unsigned short instlang;
-    unsigned short instfiles;
-    unsigned short instdrive;
-    unsigned short capabilities;
-    unsigned int installerver;
-    unsigned short options;
-    unsigned short type;
-    unsigned short major;
-    unsigned short minor;
+static int optPrefetch=SIS_PREFETCH_DEFAULT;
+static int optDiff=0;
+static int optRecurse=0;
+static int optMaxDepth=SIS_MAX_DEPTH;
+static FILE *manifestFp=NULL; /* --manifest output, if any */
+static struct sisdevice *optDevice=NULL; /* --device profile, if any */
+static int extractDir=AT_FDCWD; /* directory where files are extracted */
+
+/* A node of a condition, see condParse(). */
+struct condNode {
+    unsigned int type;          /* SIS_COND_* */
+    int left, right;            /* operands, -1 if not used */
+    unsigned int value;         /* attribute or number */
+    char *str;                  /* SIS_COND_STRING */
+};
+
+/* Value of the attribute, EXISTS(), APPCAP() or DEVCAP() node 'idx' on
+ * some device, see condEval(). Returns 0 if the value is unknown. */
+typedef int condLookupProc(void *privdata, struct condNode *nodes, int idx, unsigned int *value);
+
+/* A record of the file table. Only the fields relevant to the record
+ * type are used. */
+struct sisrecord {
+    unsigned int type;          /* SIS_FILE_* */
+    /* SIS_FILE_SIMPLE and SIS_FILE_MULTILANG */
+    struct filerecord file;
+    char *srcname;
+    char *dstname;
+    int numlangs;               /* entries of the three arrays below */
+    unsigned int *len;
+    unsigned int *off;
+    unsigned int *origlen;      /* EPOC release 6 only, otherwise NULL */
+    /* SIS_FILE_OPTIONS */
+    unsigned int numopt;
+    char **opt;
+    /* SIS_FILE_IF and SIS_FILE_ELSEIF */
+    char *cond;                 /* the condition, as shown in listings */
+    struct condNode *condnodes; /* the condition tree, root first */
+    int numcondnodes;
+};
+
+/* A requisite: another package (or a minimum version of the device ROM)
+ * that must be installed before this one. */
+struct sisreq {
+    unsigned int uid;
+    unsigned short major, minor;    /* minimum version */
     unsigned int variant;
-    unsigned int langoff;
-    unsigned int fileoff;
-    unsigned int reqoff;
-    unsigned int certoff;
-    unsigned int compnameoff;
-    /* EPOC release 6 only fields follow */
-#define EPOC6_HDR_TAIL_LEN 16
-    unsigned int signoff;
-    unsigned int capaoff;
-    unsigned int instspace;
-    unsigned int maxinstspace;
-};
-
-struct filerecord {
-    unsigned int type;
-    unsigned int details;
-    unsigned int srcnamelen;
-    unsigned int srcnameoff;
-    unsigned int dstnamelen;
-    unsigned int dstnameoff;
+    char **names;                   /* a name for every language */
+};
+
+/* The parser reads packages through a struct sisfile, that is either a
+ * file or a buffer in memory (for instance a component package that was
+ * uncompressed from its parent, see --recurse). */
+struct sisfile {
+    FILE *fp;               /* file input, or NULL for memory input */
+    unsigned char *buf;     /* memory input */
+    long len;               /* length of 'buf', or of the file input if
+                               not zero (see archiveOpen()) */
+    long pos;               /* current position inside 'buf' */
+    long base;              /* offset of the package in the file input */
+};
+
+/* A SIS package as loaded by sisLoad(). Payloads are not read, only their
+ * position is recorded in the file table records. */
+struct sispkg {
+    char *filename;
+    char *prefix;               /* component path for nested packages */
+    struct sisfile *sf;
+    struct sishdr hdr;
+    int valid;                  /* the header was read and looks sane */
+    int epocrelease;            /* 5, 6, or 0 if unknown */
+    int nocompr;                /* set if SIS_OPT_NOCOMPRESS is present */
+    unsigned short *langs;      /* hdr.languages language codes */
+    struct sisreq *reqs;        /* hdr.requisities requisites */
+    int numreqs;                /* requisites loaded */
+    int numrecords;             /* records loaded, < hdr.files on errors */
+    struct sisrecord *records;
+    char *installed;            /* --device: records installed, or NULL */
+    struct payloadMemo **memo;  /* payloads already extracted, by offset */
+    struct payloadMemo **memobyname;    /* the same, by extracted name */
+    unsigned int memosize;      /* buckets of 'memo' and 'memobyname' */
+    struct sisindex *index;     /* random access index, see sisIndex() */
+    struct stat st;             /* identity of the file, see cacheFetch() */
+    int statted;                /* 1 if 'st' is set, -1 if not available */
 };
 
 static unsigned int sis32toh(unsigned int val) {
@@ -111,27 +172,190 @@ static void verbose(const char *fmt, ...)
     }
 }
 
-int sisRead(FILE *fp, void *ptr, int len, char *err, int errlen)
+/* -------------------------------- I/O limits --------------------------------
+ * --io-limit and --iops-limit cap the bandwidth and the operations per
+ * second used, so that batch runs can share disks with latency sensitive
+ * services. Every budget is a token bucket kept as a virtual clock: taking
+ * N tokens moves the time the bucket is free again N/rate seconds ahead,
+ * and the caller sleeps until then. Requests are so paced one after the
+ * other at the configured rate, and only SIS_IO_BURST seconds of budget
+ * saved while idle can be spent at once. Large transfers are split in
+ * SIS_CHUNK_LEN pieces when a limit is set, so that even a single big
+ * payload flows smoothly instead of in bursts.
+ *
+ * Payload reads and the writes of extracted files use the bulk budget,
+ * as do the reads of the whole package hashed for signatures (--trust).
+ * Metadata reads (headers, file tables, names) have a budget of their own,
+ * a share of the limits reserved so that listings stay responsive while a
+ * big extraction is throttled: the two together never exceed the limits
+ * given. The state lives in shared memory, so the limits hold for all the
+ * threads and all the worker processes together. */
+
+#define SIS_IO_BULK 0
+#define SIS_IO_META 1
+#define SIS_IO_BURST 0.05       /* seconds of budget that can be saved */
+#define SIS_IO_META_SHARE 0.1   /* share of the limits reserved to metadata */
+
+struct ioBucket {
+    double rate;                /* tokens per second, 0 if unlimited */
+    double next;                /* time the bucket is free again */
+};
+
+struct ioLimits {
+    pthread_mutex_t lock;
+    struct ioBucket bytes[2], ops[2];   /* by SIS_IO_BULK and SIS_IO_META */
+};
+
+static struct ioLimits *ioState = NULL;  /* NULL if there are no limits */
+
+static double ioClock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+/* Set up the limits, in bytes and operations per second (0 for no limit).
+ * Returns 1 if the shared state can't be created. */
+static int ioSetLimits(double bytes, double ops)
+{
+    pthread_mutexattr_t attr;
+    double share[2] = {1-SIS_IO_META_SHARE, SIS_IO_META_SHARE};
+    int j;
+
+    if (bytes <= 0 && ops <= 0) return 0;
+    ioState = mmap(NULL, sizeof(*ioState), PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (ioState == MAP_FAILED) {
+        ioState = NULL;
+        return 1;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&ioState->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    for (j = 0; j < 2; j++) {
+        ioState->bytes[j].rate = bytes > 0 ? bytes*share[j] : 0;
+        ioState->ops[j].rate = ops > 0 ? ops*share[j] : 0;
+        ioState->bytes[j].next = ioState->ops[j].next = 0;
+    }
+    return 0;
+}
+
+/* Take 'tokens' from 'b' at time 'now', returning how long the caller has
+ * to wait for them. */
+static double ioTake(struct ioBucket *b, double tokens, double now)
+{
+    if (b->rate == 0) return 0;
+    if (b->next < now-SIS_IO_BURST) b->next = now-SIS_IO_BURST;
+    b->next += tokens/b->rate;
+    return b->next-now;
+}
+
+/* Account for 'bytes' bytes and 'ops' operations of the budget 'class'
+ * (SIS_IO_BULK or SIS_IO_META), sleeping as long as needed to stay within
+ * the limits. Call it before doing the I/O. */
+static void ioThrottle(int class, double bytes, double ops)
+{
+    struct timespec ts;
+    double now, wait, w;
+
+    if (ioState == NULL) return;
+    pthread_mutex_lock(&ioState->lock);
+    now = ioClock();
+    wait = ioTake(&ioState->bytes[class], bytes, now);
+    w = ioTake(&ioState->ops[class], ops, now);
+    if (w > wait) wait = w;
+    pthread_mutex_unlock(&ioState->lock);
+    if (wait <= 0) return;
+    ts.tv_sec = (time_t)wait;
+    ts.tv_nsec = (long)((wait-ts.tv_sec)*1e9);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+/* Length of the next piece of a 'len' bytes transfer. */
+static size_t ioChunk(size_t len)
+{
+    return (ioState && len > SIS_CHUNK_LEN) ? SIS_CHUNK_LEN : len;
+}
+
+static void sisFileInit(struct sisfile *sf, FILE *fp)
+{
+    sf->fp = fp;
+    sf->buf = NULL;
+    sf->len = sf->pos = sf->base = 0;
+}
+
+static void sisMemInit(struct sisfile *sf, unsigned char *buf, long len)
+{
+    sf->fp = NULL;
+    sf->buf = buf;
+    sf->len = len;
+    sf->pos = sf->base = 0;
+}
+
+static long sisTell(struct sisfile *sf)
+{
+    return sf->fp ? ftell(sf->fp)-sf->base : sf->pos;
+}
+
+/* Bytes that can be read from 'sf', or -1 if unknown. */
+static long sisSize(struct sisfile *sf)
+{
+    struct stat st;
+
+    if (sf->fp == NULL || sf->len) return sf->len;
+    if (fstat(fileno(sf->fp), &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+    return st.st_size-sf->base;
+}
+
+int sisRead(struct sisfile *sf, void *ptr, int len, char *err, int errlen)
 {
     int nread;
 
-    nread = fread(ptr, 1, len, fp);
+    if (len < 0) {
+        snprintf(err,errlen,"Invalid read length %d", len);
+        return 1;
+    }
+    if (sf->fp == NULL) {
+        nread = (sf->pos >= 0 && sf->pos < sf->len) ? sf->len-sf->pos : 0;
+        if (nread > len) nread = len;
+        memcpy(ptr, sf->buf+sf->pos, nread);
+        sf->pos += nread;
+    } else {
+        nread = len;
+        /* Don't read past the end of a package inside an archive. */
+        if (sf->len && sisTell(sf)+len > sf->len) nread = sf->len-sisTell(sf);
+        /* Reads are buffered by stdio, an operation every BUFSIZ bytes. */
+        ioThrottle(SIS_IO_META, len, (double)len/BUFSIZ);
+        nread = fread(ptr, 1, nread > 0 ? nread : 0, sf->fp);
+    }
     if (nread != len) {
-        if (ferror(fp)) {
+        if (sf->fp && ferror(sf->fp)) {
             snprintf(err,errlen,"Error reading from file: %s", strerror(errno));
             return 1;
         } else {
-            int offset = ftell(fp);
-            snprintf(err,errlen,"Unexpected EOF or short read (%d bytes of %d retured at offset %d)", nread, len, offset);
+            long offset = sisTell(sf);
+            snprintf(err,errlen,"Unexpected EOF or short read (%d bytes of %d retured at offset %ld)", nread, len, offset);
             return 1;
         }
     }
     return 0;
 }
 
-int sisSeek(FILE *fp, int off, char *err, int errlen)
+int sisSeek(struct sisfile *sf, long off, char *err, int errlen)
 {
-    if (fseek(fp,off,SEEK_SET) == -1) {
+    /* Offsets come from the package: never trust them. */
+    if (off < 0 || ((sf->fp == NULL || sf->len) && off > sf->len)) {
+        snprintf(err,errlen,"seeking: offset %ld out of range", off);
+        return 1;
+    }
+    if (sf->fp == NULL) {
+        sf->pos = off;
+        return 0;
+    }
+    if (fseek(sf->fp,sf->base+off,SEEK_SET) == -1) {
         snprintf(err,errlen,"seeking: %s", strerror(errno));
         return 1;
     }
@@ -139,14 +363,14 @@ int sisSeek(FILE *fp, int off, char *err, int errlen)
 }
 
 #if 0 /* debugging stuff */
-static int dumpBytes(FILE *fp, int count)
+static int dumpBytes(struct sisfile *sf, int count)
 {
     unsigned char c;
     int i = 0;
 
     while(count--) {
         i++;
-        c = fgetc(fp);
+        if (sisRead(sf, &c, 1, NULL, 0)) break;
         printf("%02x ", c);
         if ((i % 16) == 0) printf("\n");
         else if ((i % 8) == 0) printf("  --  ");
@@ -155,70 +379,145 @@ static int dumpBytes(FILE *fp, int count)
     return 0;
 }
 
-static int dumpBytesAt(FILE *fp, int count, int off)
+static int dumpBytesAt(struct sisfile *sf, int count, int off)
 {
-    long orig = ftell(fp);
-    sisSeek(fp, off, NULL, 0);
-    dumpBytes(fp, count);
-    sisSeek(fp, orig, NULL, 0);
+    long orig = sisTell(sf);
+    sisSeek(sf, off, NULL, 0);
+    dumpBytes(sf, count);
+    sisSeek(sf, orig, NULL, 0);
     return 0;
 }
 #endif
 
 
 
-int sisReadOffset(FILE *fp, void *ptr, int len, int off, char *err, int errlen)
+int sisReadOffset(struct sisfile *sf, void *ptr, int len, long off, char *err, int errlen)
 {
-    long oldpos = ftell(fp);
+    long oldpos = sisTell(sf);
 
-    if (oldpos == -1 || fseek(fp,off,SEEK_SET) == -1) {
+    if (oldpos == -1) {
         snprintf(err,errlen,"seeking: %s", strerror(errno));
         return 1;
     }
-    if (sisRead(fp,ptr,len,err,errlen)) return 1;
+    if (sisSeek(sf,off,err,errlen)) return 1;
+    if (sisRead(sf,ptr,len,err,errlen)) return 1;
     /* Restore the old position */
-    if (fseek(fp,oldpos,SEEK_SET) == -1) {
-        snprintf(err,errlen,"seeking: %s", strerror(errno));
-        return 1;
-    }
+    if (sisSeek(sf,oldpos,err,errlen)) return 1;
     return 0;
 }
 
-char *sisReadOffsetAlloc(FILE *fp, int len, int off, char *err, int errlen)
+char *sisReadOffsetAlloc(struct sisfile *sf, unsigned int len, long off, char *err, int errlen)
 {
-    unsigned char *buf = malloc(len+1);
+    char *buf;
+    long size;
 
-    if (!buf) {
+    /* Don't allocate what the file can't contain. Short strings are the
+     * norm, and are just read, without asking for the size. */
+    if (len > SIS_CHUNK_LEN && (len > INT_MAX ||
+        ((size = sisSize(sf)) != -1 && len > (unsigned long)size)))
+    {
+        snprintf(err,errlen,"Invalid length %u at offset %ld", len, off);
+        return NULL;
+    }
+    if ((buf = malloc((size_t)len+1)) == NULL) {
         snprintf(err,errlen,"Out of memory");
         return NULL;
     }
     buf[len] = '\0';
-    if (sisReadOffset(fp,buf,len,off,err,errlen)) {
+    if (sisReadOffset(sf,buf,len,off,err,errlen)) {
         free(buf);
         return NULL;
     }
     return buf;
 }
 
-static int langaugesSection(FILE *fp, struct sishdr *hdr, char *err, int errlen)
+static void uni2ascii(char *s, int len)
 {
-    int languages = hdr->languages;
+    int i;
 
-    if (sisSeek(fp, hdr->langoff, err, errlen)) return 1;
-    printf("\nLanguages\n  ");
-    while(languages--) {
-        unsigned short lang;
+    for(i = 0; i < len; i+=2) {
+        s[i/2] = s[i];
+    }
+    s[len/2]='\0';
+}
 
-        if (sisRead(fp, &lang, 2, err, errlen)) return 1;
-        lang = sis16toh(lang);
-        if (lang < sizeof(sisLangTab)/sizeof(char*)) {
-            printf("%s ", sisLangTab[lang]);
-        } else {
-            printf("Unknown language code %d ", lang);
+static int loadLanguages(struct sispkg *pkg, char *err, int errlen)
+{
+    struct sisfile *sf = pkg->sf;
+    int j;
+
+    if (sisSeek(sf, pkg->hdr.langoff, err, errlen)) return 1;
+    pkg->langs = malloc(sizeof(unsigned short)*(pkg->hdr.languages+1));
+    if (pkg->langs == NULL) {
+        snprintf(err,errlen,"Out of memory");
+        return 1;
+    }
+    for (j = 0; j < pkg->hdr.languages; j++) {
+        if (sisRead(sf, &pkg->langs[j], 2, err, errlen)) return 1;
+        pkg->langs[j] = sis16toh(pkg->langs[j]);
+    }
+    return 0;
+}
+
+/* Every requisite record is the UID, the minimum version and variant of
+ * the package required, then the lengths and the offsets of its name in
+ * every language of the package. */
+static int requisitesSection(struct sispkg *pkg, char *err, int errlen)
+{
+    struct sisfile *sf = pkg->sf;
+    int j, i, languages = pkg->hdr.languages;
+    unsigned int *lens = NULL;
+
+    if (pkg->hdr.requisities == 0) return 0;
+    pkg->reqs = calloc(pkg->hdr.requisities, sizeof(struct sisreq));
+    lens = malloc(sizeof(unsigned int)*(languages*2+1));
+    if (pkg->reqs == NULL || lens == NULL) goto oom;
+    if (sisSeek(sf, pkg->hdr.reqoff, err, errlen)) goto error;
+    for (j = 0; j < pkg->hdr.requisities; j++) {
+        struct sisreq *q = &pkg->reqs[j];
+
+        if (sisRead(sf, &q->uid, 4, err, errlen) ||
+            sisRead(sf, &q->major, 2, err, errlen) ||
+            sisRead(sf, &q->minor, 2, err, errlen) ||
+            sisRead(sf, &q->variant, 4, err, errlen) ||
+            (languages && sisRead(sf, lens, languages*8, err, errlen)))
+            goto error;
+        q->uid = sis32toh(q->uid);
+        q->major = sis16toh(q->major);
+        q->minor = sis16toh(q->minor);
+        q->variant = sis32toh(q->variant);
+        pkg->numreqs++;
+        if ((q->names = calloc(languages+1, sizeof(char*))) == NULL) goto oom;
+        for (i = 0; i < languages; i++) {
+            q->names[i] = sisReadOffsetAlloc(sf, sis32toh(lens[i]),
+                sis32toh(lens[languages+i]), err, errlen);
+            if (q->names[i] == NULL) goto error;
+            if (pkg->hdr.options & SIS_OPT_UNICODE)
+                uni2ascii(q->names[i], sis32toh(lens[i]));
         }
     }
-    printf("\n");
+    free(lens);
     return 0;
+
+oom:
+    snprintf(err,errlen,"Out of memory");
+error:
+    free(lens);
+    return 1;
+}
+
+static void reqsFree(struct sispkg *pkg)
+{
+    int j, i;
+
+    for (j = 0; j < pkg->numreqs; j++) {
+        for (i = 0; pkg->reqs[j].names && i < pkg->hdr.languages; i++)
+            free(pkg->reqs[j].names[i]);
+        free(pkg->reqs[j].names);
+    }
+    free(pkg->reqs);
+    pkg->reqs = NULL;
+    pkg->numreqs = 0;
 }
 
 static char *fileRecordTypeStr(unsigned int filetype) {
@@ -229,6 +528,15 @@ static char *fileRecordTypeStr(unsigned int filetype) {
     }
 }
 
+static char *langStr(unsigned int lang) {
+    /* The table has a few trailing slots without a name. */
+    if (lang < sizeof(sisLangTab)/sizeof(char*) && sisLangTab[lang]) {
+        return sisLangTab[lang];
+    } else {
+        return "unknown";
+    }
+}
+
 static char *fileTypeStr(unsigned int filetype) {
     if (filetype < sizeof(sisFileTypeTab)/sizeof(char*)) {
         return sisFileTypeTab[filetype];
@@ -237,571 +545,7272 @@ static char *fileTypeStr(unsigned int filetype) {
     }
 }
 
-static void uni2ascii(char *s, int len)
+/* Write all the 'len' bytes at 'p' into 'fd', handling short writes. */
+static int writeAll(int fd, unsigned char *p, size_t len, char *err, int errlen)
 {
-    int i;
+    ssize_t nw;
 
-    for(i = 0; i < len; i+=2) {
-        s[i/2] = s[i];
+    while (len) {
+        nw = write(fd, p, len);
+        if (nw == -1) {
+            if (errno == EINTR) continue;
+            snprintf(err, errlen, "error writing file: %s", strerror(errno));
+            return 1;
+        }
+        p += nw;
+        len -= nw;
     }
-    s[len/2]='\0';
+    return 0;
 }
 
-static int extractFile(FILE *fp, int len, int origlen, int off, char *name, char *err, int errlen)
-#ifndef NOZLIB
+/* Like writeAll(), for the data of extracted files, that is subject to
+ * the I/O limits. */
+static int ioWriteAll(int fd, unsigned char *p, size_t len, char *err, int errlen)
 {
-    char *basename = strrchr(name,'\\');
-    char *zdata, *data;
-    uLongf destlen; /* ulongf is a zlib type */
-    int retval;
-    FILE *dstfp;
+    size_t n;
 
-    if (basename && strrchr(basename,'/')) basename = strrchr(basename,'/');
-    if (basename)
-        basename++;
-    else
-        basename = name;
-    printf("Extracting %s (%d bytes compressed, offset %d)\n", basename, len, off);
-    if ((zdata = sisReadOffsetAlloc(fp, len, off, err, errlen)) == NULL)
-        return 1;
-    if (origlen && (data = malloc(origlen)) == NULL) {
-        snprintf(err, errlen, "Out of memory");
-        return 1;
+    while (len) {
+        n = ioChunk(len);
+        ioThrottle(SIS_IO_BULK, n, 1);
+        if (writeAll(fd, p, n, err, errlen)) return 1;
+        p += n;
+        len -= n;
     }
-    if (origlen == 0 || flagNocompr) {
-        data = zdata;
-        origlen = len;
-    } else {
-        destlen = origlen;
-        if ((retval = uncompress(data, &destlen, zdata, len)) != Z_OK) {
-            snprintf(err, errlen, "zlib reported error trying to uncompress (error %d)",retval);
-            free(zdata);
-            free(data);
+    return 0;
+}
+
+/* Copy 'len' bytes at offset 'off' of 'srcfd' into 'dstfd', at its
+ * current position. When the kernel supports it the data is copied with
+ * copy_file_range() (or sendfile()) without ever entering user space.
+ * Otherwise we fall back to a plain read/write loop with a small buffer.
+ * Note that positional reads are used, so the position of 'srcfd' is
+ * never touched. */
+static int fdCopyRange(int srcfd, long off, long len, int dstfd, char *err, int errlen)
+{
+    off_t inoff = off;
+    ssize_t n;
+    int method = 0; /* 0: copy_file_range, 1: sendfile, 2: read/write */
+    unsigned char buf[SIS_COPY_BUFLEN];
+
+#ifndef __linux__
+    method = 2;
+#endif
+    while (len > 0) {
+        /* Read and written: both count for the I/O limits. Pieces are
+         * at most SIS_COPY_BUFLEN bytes when a limit is set, so this is
+         * what every method below transfers at most. */
+        ioThrottle(SIS_IO_BULK, 2.0*ioChunk(len), 2);
+retry:
+#ifdef __linux__
+        if (method == 0) {
+            n = copy_file_range(srcfd, &inoff, dstfd, NULL, ioChunk(len), 0);
+            if (n == -1 && (errno == EXDEV || errno == ENOSYS ||
+                            errno == EINVAL || errno == EOPNOTSUPP)) {
+                method = 1;
+                goto retry;
+            }
+        } else if (method == 1) {
+            n = sendfile(dstfd, srcfd, &inoff, ioChunk(len));
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                method = 2;
+                goto retry;
+            }
+        } else
+#endif
+        {
+            n = pread(srcfd, buf, len < SIS_COPY_BUFLEN ? len : SIS_COPY_BUFLEN,
+                      inoff);
+            if (n > 0) {
+                if (writeAll(dstfd, buf, n, err, errlen)) return 1;
+                inoff += n;
+            }
+        }
+        if (n == -1) {
+            if (errno == EINTR) goto retry;
+            snprintf(err, errlen, "error copying file data: %s",
+                strerror(errno));
             return 1;
         }
-        if (destlen != (unsigned)origlen) {
-            free(zdata);
-            free(data);
-            snprintf(err, errlen, "uncompressed file length does not match!");
+        if (n == 0) {
+            snprintf(err, errlen, "Unexpected EOF copying file data at offset %ld",
+                (long) inoff);
             return 1;
         }
-        free(zdata);
+        len -= n;
     }
+    return 0;
+}
 
-    /* Time to write the file content on disk */
-    dstfp = fopen(basename, "w");
-    if (!dstfp) {
-        free(data);
-        snprintf(err, errlen, "error opening file for writing: %s\n",
-            strerror(errno));
+/* Copy 'len' bytes at offset 'off' of the SIS file into 'dstfd'. Stored
+ * payloads are written to disk as they are, so they are copied with
+ * fdCopyRange() from the package file, or written directly from the
+ * buffer of packages in memory. */
+static int sisCopyRange(struct sisfile *sf, long off, long len, int dstfd, char *err, int errlen)
+{
+    if (off < 0 || len < 0) {
+        snprintf(err, errlen, "Invalid file data range at offset %ld", off);
+        return 1;
+    }
+    if (sf->fp == NULL) {
+        if (off > sf->len || len > sf->len-off) {
+            snprintf(err, errlen, "Unexpected EOF copying file data at offset %ld",
+                sf->len);
+            return 1;
+        }
+        return ioWriteAll(dstfd, sf->buf+off, len, err, errlen);
+    }
+    if (sf->len && (off > sf->len || len > sf->len-off)) {
+        snprintf(err, errlen, "Unexpected EOF copying file data at offset %ld",
+            sf->len);
         return 1;
     }
-    fwrite(data, origlen, 1, dstfp);
-    fclose(dstfp);
+    return fdCopyRange(fileno(sf->fp), sf->base+off, len, dstfd, err, errlen);
+}
 
-    /* Done */
-    free(data);
-    return 0;
+/* ------------------------------ Archive input ------------------------------
+ * Packages often come in .zip or .tar(.gz) bundles. A package inside an
+ * archive is named "bundle.zip!/path/inner.sis", and an archive given on
+ * the command line stands for all the .sis members it contains (see
+ * archiveExpand()). Zip members are found in the central directory, tar
+ * members scanning the headers. Members stored without compression (zip
+ * method 0 and every member of a plain tar) are read in place, setting
+ * the base offset and length of the sisfile, deflated zip members and
+ * members of a .tar.gz are uncompressed in memory.
+ *
+ * The member list of the last archive is kept (per thread) along with the
+ * gzip stream, so opening the members of a .tar.gz one after the other in
+ * archive order only moves forward in the stream. Worker threads opening
+ * packages must call archiveRelease() before exiting.
+ *
+ * Lengths and offsets of the members are untrusted: stored members must
+ * be inside the archive, and members uncompressed in memory can't be
+ * larger than deflate can expand the archive. */
+
+#define SIS_ARCHIVE_SEP "!/"
+#define SIS_ARCHIVE_ZIP 1
+#define SIS_ARCHIVE_TAR 2
+#define SIS_ARCHIVE_TGZ 3
+#define SIS_ZIP_EOCD_LEN 22             /* end of central directory record */
+#define SIS_ZIP_MAXCOMMENT 65535
+#define SIS_TAR_BLOCK 512
+#define SIS_TAR_MAXNAME 4096            /* GNU and pax long names */
+
+struct archiveMember {
+    char *name;
+    long off;           /* zip: local header, tar: data */
+    long len;           /* stored length */
+    long origlen;       /* uncompressed length */
+    int method;         /* zip compression method */
+    int flags;          /* zip general purpose flags */
+};
+
+struct archive {
+    char *path;
+    int type;           /* SIS_ARCHIVE_* */
+    struct stat st;
+    int fd;
+#ifndef NOZLIB
+    gzFile gz;          /* SIS_ARCHIVE_TGZ */
+#endif
+    struct archiveMember *members;
+    int count;
+    int last;           /* last member looked up, see archiveFind() */
+};
+
+static __thread struct archive *lastArchive;
+
+static unsigned int archive16(unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
 }
-#else
+
+static unsigned int archive32(unsigned char *p)
 {
-    SIS_NOTUSED(fp);
-    SIS_NOTUSED(len);
-    SIS_NOTUSED(origlen);
-    SIS_NOTUSED(off);
-    SIS_NOTUSED(name);
-    SIS_NOTUSED(err);
-    SIS_NOTUSED(errlen);
-    fprintf(stderr, "Sorry, this sisopen binary is compiled without zlib support, so file extraction is not supported.\n");
-    exit(1);
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
 }
-#endif
 
-static int simpleFile(FILE *fp, struct sishdr *hdr, int filenum, int numlangs, char *err, int errlen)
+static void archiveFree(struct archive *a)
 {
-    struct filerecord file;
-    char *srcname = NULL;
-    char *dstname = NULL;
-    int isepoc6 = (hdr->uid2 == 0x10003A12);
-    int i;
-    unsigned int mimelen, mimeoff;
-    unsigned int *filelen = NULL, *fileoff = NULL, *origlen = NULL;
+    int j;
+
+    if (a == NULL) return;
+    for (j = 0; j < a->count; j++) free(a->members[j].name);
+    free(a->members);
+#ifndef NOZLIB
+    if (a->gz) gzclose(a->gz);
+#endif
+    if (a->fd != -1) close(a->fd);
+    free(a->path);
+    free(a);
+}
 
-    file.type = sis32toh(file.type);
-    file.details = sis32toh(file.details);
-    file.srcnamelen = sis32toh(file.srcnamelen);
-    file.srcnameoff = sis32toh(file.srcnameoff);
-    file.dstnamelen = sis32toh(file.dstnamelen);
-    file.dstnameoff = sis32toh(file.dstnameoff);
+/* Read 'len' bytes at offset 'off' of the archive (of the uncompressed
+ * stream for a .tar.gz), accounted to the I/O budget 'class'. Returns 0
+ * on success, 1 on errors or EOF. */
+static int archiveReadAt(struct archive *a, void *buf, long len, long off, int class)
+{
+    unsigned char *p = buf;
+    ssize_t n;
 
-    if (sisRead(fp, &file, sizeof(file), err, errlen)) return -1;
-    verbose("    file type: %s\n", fileTypeStr(file.type));
-    verbose("    file details: %d\n", file.details);
-    if ((srcname = sisReadOffsetAlloc(fp, file.srcnamelen, file.srcnameoff, err, errlen)) == NULL) goto err;
-    uni2ascii(srcname,file.srcnamelen);
-    verbose("    source file name: %s\n", srcname);
+#ifndef NOZLIB
+    if (a->type == SIS_ARCHIVE_TGZ) {
+        while (len) {
+            unsigned int chunk = ioChunk(len > (1<<30) ? (1<<30) : len);
 
-    if ((dstname = sisReadOffsetAlloc(fp, file.dstnamelen, file.dstnameoff, err, errlen)) == NULL) {
-        goto err;
+            /* Seeking backward restarts from the beginning of the
+             * stream, forward it uncompresses and skips the data. */
+            if (gztell(a->gz) != off && gzseek(a->gz, off, SEEK_SET) == -1)
+                return 1;
+            ioThrottle(class, chunk, 1);
+            if (gzread(a->gz, p, chunk) != (int)chunk) return 1;
+            p += chunk;
+            off += chunk;
+            len -= chunk;
+        }
+        return 0;
+    }
+#endif
+    while (len) {
+        ioThrottle(class, ioChunk(len), 1);
+        if ((n = pread(a->fd, p, ioChunk(len), off)) == -1) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        if (n == 0) return 1;
+        p += n;
+        off += n;
+        len -= n;
     }
-    uni2ascii(dstname,file.dstnamelen);
-    verbose("    destination file name: %s\n", dstname);
-    verbose("    this file is available in %d language(s)\n", numlangs);
+    return 0;
+}
 
-    if ((filelen = malloc(numlangs*sizeof(int))) == NULL) goto oom;
-    if ((fileoff = malloc(numlangs*sizeof(int))) == NULL) goto oom;
+/* Append a member, dropping any leading "./" from its name. */
+static int archiveAdd(struct archive *a, char *name, int namelen, struct archiveMember *m)
+{
+    struct archiveMember *members;
 
-    /* Read len/offset information */
-    for (i = 0; i < numlangs; i++) {
-        if (sisRead(fp, &filelen[i], 4, err, errlen)) goto err;
-        filelen[i] = sis32toh(filelen[i]);
-        verbose("      len[%d]: %d bytes\n", i+1, filelen[i]);
-    }
-    for (i = 0; i < numlangs; i++) {
-        if (sisRead(fp, &fileoff[i], 4, err, errlen)) goto err;
-        fileoff[i] = sis32toh(fileoff[i]);
-        verbose("      file language %d is at offset %d\n", i+1, fileoff[i]);
+    while (namelen >= 2 && name[0] == '.' && name[1] == '/') {
+        name += 2;
+        namelen -= 2;
     }
-    if (isepoc6) {
-        if ((origlen = malloc(numlangs*sizeof(int))) == NULL) goto oom;
-        for (i = 0; i < numlangs; i++) {
-            if (sisRead(fp, &origlen[i], 4, err, errlen)) goto err;
-            verbose("      original len[%d]: %d bytes\n", i+1, origlen[i]);
-        }
-        if (sisRead(fp, &mimelen, 4, err, errlen)) goto err;
-        if (sisRead(fp, &mimeoff, 4, err, errlen)) goto err;
+    if (namelen == 0 || name[namelen-1] == '/') return 0; /* Directory. */
+    if ((a->count & (a->count-1)) == 0) {
+        members = realloc(a->members, sizeof(*members)*(a->count ? a->count*2 : 16));
+        if (members == NULL) return 1;
+        a->members = members;
     }
+    if ((m->name = malloc(namelen+1)) == NULL) return 1;
+    memcpy(m->name, name, namelen);
+    m->name[namelen] = '\0';
+    a->members[a->count++] = *m;
+    return 0;
+}
 
-    /* Show file info in non verbose mode */
-    if (!optVerbose) {
-        char c=' ';
-        switch(file.type) {
-            case SIS_FILETYPE_STANDARD:
-                if (numlangs == 1)
-                    c='f';
-                else
-                    c='m';
-                break;
-            case SIS_FILETYPE_TEXT: c='t'; break;
-            case SIS_FILETYPE_COMPONENT: c='c'; break;
-            case SIS_FILETYPE_RUN: c='r'; break;
-            case SIS_FILETYPE_NOTEXISTS: c='x'; break;
-            case SIS_FILETYPE_OPEN: c='o'; break;
+/* Load the member list from the zip central directory. */
+static int zipScan(struct archive *a, char *err, int errlen)
+{
+    unsigned char *tail = NULL, *cd = NULL, *p, *eocd = NULL;
+    long taillen, cdoff, cdlen, left;
+    int entries, j, retval = 1;
+
+    taillen = a->st.st_size;
+    if (taillen > SIS_ZIP_EOCD_LEN+SIS_ZIP_MAXCOMMENT)
+        taillen = SIS_ZIP_EOCD_LEN+SIS_ZIP_MAXCOMMENT;
+    if (taillen < SIS_ZIP_EOCD_LEN) {
+        snprintf(err, errlen, "truncated zip archive");
+        return 1;
+    }
+    if ((tail = malloc(taillen)) == NULL) goto oom;
+    if (archiveReadAt(a, tail, taillen, a->st.st_size-taillen, SIS_IO_META)) goto ioerr;
+    for (p = tail+taillen-SIS_ZIP_EOCD_LEN; p >= tail; p--) {
+        if (p[0] == 'P' && p[1] == 'K' && p[2] == 5 && p[3] == 6) {
+            eocd = p;
+            break;
         }
-        printf("%03d %c %-63s", filenum,c,dstname[0] ? dstname : srcname);
-        if (origlen) printf(" %10d", origlen[0]);
-        printf("\n");
     }
+    if (eocd == NULL) {
+        snprintf(err, errlen, "zip end of central directory not found");
+        goto cleanup;
+    }
+    entries = archive16(eocd+10);
+    cdlen = archive32(eocd+12);
+    cdoff = archive32(eocd+16);
+    if (entries == 0xffff || cdlen == 0xffffffffL || cdoff == 0xffffffffL) {
+        snprintf(err, errlen, "ZIP64 archives are not supported");
+        goto cleanup;
+    }
+    if (cdoff+cdlen > (long)a->st.st_size) {
+        snprintf(err, errlen, "truncated zip central directory");
+        goto cleanup;
+    }
+    if ((cd = malloc(cdlen ? cdlen : 1)) == NULL) goto oom;
+    if (archiveReadAt(a, cd, cdlen, cdoff, SIS_IO_META)) goto ioerr;
+    for (p = cd, left = cdlen, j = 0; j < entries; j++) {
+        struct archiveMember m;
+        int namelen, extralen, commentlen;
 
-    /* Extract files if needed */
-    if (optExtract) {
-        for (i = 0; i < numlangs; i++) {
-            char *ename = dstname[0] ? dstname : srcname;
-            if (file.type != SIS_FILETYPE_NOTEXISTS) {
-                if (extractFile(fp, filelen[i], origlen ? origlen[i] : 0,
-                    fileoff[i], ename, err, errlen))
-                    goto err;
-            }
+        if (left < 46 || archive32(p) != 0x02014b50) {
+            snprintf(err, errlen, "corrupted zip central directory");
+            goto cleanup;
+        }
+        namelen = archive16(p+28);
+        extralen = archive16(p+30);
+        commentlen = archive16(p+32);
+        if (left < 46+namelen+extralen+commentlen) {
+            snprintf(err, errlen, "corrupted zip central directory");
+            goto cleanup;
+        }
+        m.flags = archive16(p+8);
+        m.method = archive16(p+10);
+        m.len = archive32(p+20);
+        m.origlen = archive32(p+24);
+        m.off = archive32(p+42);
+        if (m.len == 0xffffffffL || m.origlen == 0xffffffffL ||
+            m.off == 0xffffffffL)
+        {
+            snprintf(err, errlen, "ZIP64 archives are not supported");
+            goto cleanup;
         }
+        if (archiveAdd(a, (char*)p+46, namelen, &m)) goto oom;
+        p += 46+namelen+extralen+commentlen;
+        left -= 46+namelen+extralen+commentlen;
     }
-    verbose("\n");
-    free(filelen);
-    free(fileoff);
-    free(srcname);
-    free(dstname);
-    if (origlen) free(origlen);
-    return 0;
+    retval = 0;
+    goto cleanup;
 
 oom:
-    snprintf(err,errlen,"Out of memory");
-err:
-    if (filelen) free(filelen);
-    if (fileoff) free(fileoff);
-    if (origlen) free(origlen);
-    if (srcname) free(srcname);
-    if (dstname) free(dstname);
-    return 1;
+    snprintf(err, errlen, "Out of memory");
+    goto cleanup;
+ioerr:
+    snprintf(err, errlen, "Error reading the zip archive");
+cleanup:
+    free(tail);
+    free(cd);
+    return retval;
 }
 
-static void elseFile(void)
+/* Parse a numeric tar header field: octal, or base-256 if the first byte
+ * has the high bit set (GNU tar, for sizes of 8GB or more). Returns -1 if
+ * the value doesn't fit a long. */
+static long tarNumber(unsigned char *p, int len)
 {
-    printf("[else]\n");
+    long val = 0;
+    int j;
+
+    if (p[0] & 0x80) {
+        for (j = 1; j < len; j++) {
+            if (val > (LONG_MAX >> 8)) return -1;
+            val = (val << 8) | p[j];
+        }
+        return val;
+    }
+    for (j = 0; j < len && p[j] == ' '; j++);
+    for (; j < len && p[j] >= '0' && p[j] <= '7'; j++) {
+        if (val > (LONG_MAX >> 3)) return -1;
+        val = val*8 + (p[j]-'0');
+    }
+    return val;
 }
 
-static void endifFile(void)
+/* Return 1 if 'h' is a valid tar header: the checksum is the sum of the
+ * bytes of the header with the checksum field itself taken as spaces. */
+static int tarHeaderValid(unsigned char *h)
 {
-    printf("[endif]\n");
+    unsigned long sum = 0;
+    int j;
+
+    for (j = 0; j < SIS_TAR_BLOCK; j++)
+        sum += (j >= 148 && j < 156) ? ' ' : h[j];
+    return (long)sum == tarNumber(h+148, 8);
 }
 
-static int condAttribute(FILE *fp, char *err, int errlen)
+/* Get the "path" record of a pax extended header into 'name'. */
+static void tarPaxPath(char *data, long len, char *name)
 {
-    unsigned int attribtype, unused;
+    char *p = data, *end = data+len, *eq, *next;
+    long reclen;
 
-    if (sisRead(fp, &attribtype, 4, err, errlen)) return 1;
-    attribtype = sis32toh(attribtype);
-    /* Read the next unused 4 bytes */
-    if (sisRead(fp, &unused, 4, err, errlen)) return 1;
-    if (attribtype >= 0x2000) {
-        printf("option %d", attribtype-0x2000);
-    } else {
-        switch(attribtype) {
-        case 0x00: printf("Manufacturer"); break;
-        case 0x01: printf("ManufacturerHardwareRev"); break;
-        case 0x02: printf("ManufacturerSoftwareRev"); break;
-        case 0x03: printf("ManufacturerSoftwareBuild"); break;
-        case 0x04: printf("Model"); break;
-        case 0x05: printf("MachineUID"); break;
-        case 0x06: printf("DeviceFamily"); break;
-        case 0x07: printf("DeviceFamilyRev"); break;
-        case 0x08: printf("CPU type"); break;
-        case 0x09: printf("CPU arch"); break;
-        case 0x0a: printf("CPU ABI"); break;
-        case 0x0b: printf("CPU speed"); break;
-        case 0x0e: printf("System Tick Period"); break;
-        case 0x0f: printf("Total RAM"); break;
-        case 0x10: printf("Free RAM"); break;
-        case 0x11: printf("Total ROM"); break;
-        case 0x12: printf("Memory Page Size"); break;
-        case 0x15: printf("Power backup"); break;
-        case 0x18: printf("Keyboard"); break;
-        case 0x19: printf("Keyboard device key"); break;
-        case 0x1a: printf("Keyboard application key"); break;
-        case 0x1b: printf("Keyboard click"); break;
-        case 0x1e: printf("Keyboard clickVolMax"); break;
-        case 0x1f: printf("Screen width pixel"); break;
-        case 0x20: printf("Screen height pixel"); break;
-        case 0x21: printf("Screen width twips"); break;
-        case 0x22: printf("Screen height twips"); break;
-        case 0x23: printf("Display colors"); break;
-        case 0x26: printf("Display max contrast"); break;
-        case 0x27: printf("Backlight"); break;
-        case 0x29: printf("Pen"); break;
-        case 0x2a: printf("PenX"); break;
-        case 0x2b: printf("PenY"); break;
-        case 0x2c: printf("Pen display on"); break;
-        case 0x2d: printf("Pen click"); break;
-        case 0x30: printf("Pen volume max"); break;
-        case 0x31: printf("Mouse"); break;
-        case 0x32: printf("MouseX"); break;
-        case 0x33: printf("MouseY"); break;
-        case 0x37: printf("Mouse buttons"); break;
-        case 0x3a: printf("Case switch"); break;
-        case 0x3d: printf("Leds"); break;
-        case 0x3f: printf("Integrated phone"); break;
-        case 0x41: printf("Display brightness max"); break;
-        case 0x42: printf("Keyboard backlight state"); break;
-        case 0x43: printf("Accessory power"); break;
-        case 0x59: printf("Number of supported HAL attributes"); break;
-        case 0x1000: printf("Machine language"); break;
-        case 0x1001: printf("Remote install"); break;
-        default: printf("attribute %04x", attribtype); break;
-        }
-    }
-    return 0;
-}
-
-static int condNumber(FILE *fp, char *err, int errlen)
-{
-    unsigned int value, unused;
-
-    if (sisRead(fp, &value, 4, err, errlen)) return 1;
-    value = sis32toh(value);
-    if (sisRead(fp, &unused, 4, err, errlen)) return 1;
-    printf("0x%04x", value);
-    return 0;
-}
-
-static int condString(FILE *fp, char *err, int errlen)
-{
-    unsigned int len, off;
-    char *str;
-
-    if (sisRead(fp, &len, 4, err, errlen)) return 1;
-    if (sisRead(fp, &off, 4, err, errlen)) return 1;
-    len = sis32toh(len);
-    off = sis32toh(off);
-    if ((str = sisReadOffsetAlloc(fp, len, off, err, errlen)) == NULL) return 1;
-    uni2ascii(str,len);
-    printf("%s", str);
-    free(str);
-    return 0;
-}
-
-static int condExpr(FILE *fp, char *err, int errlen)
-{
-    unsigned int condtype;
-
-    if (sisRead(fp, &condtype, 4, err, errlen)) return 1;
-    condtype = sis32toh(condtype);
-    switch(condtype) {
-        case 0x00: /* Attribute == Value */
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(" == ");
-            if (condExpr(fp, err, errlen)) return 1;
-            break;
-        case 0x01: /* Attribute != Value */
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(" != ");
-            if (condExpr(fp, err, errlen)) return 1;
-            break;
-        case 0x02: /* Attribute > Value */
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(" > ");
-            if (condExpr(fp, err, errlen)) return 1;
-            break;
-        case 0x03: /* Attribute < Value */
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(" < ");
-            if (condExpr(fp, err, errlen)) return 1;
-            break;
-        case 0x04: /* Attribute >= Value */
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(" >= ");
-            if (condExpr(fp, err, errlen)) return 1;
-            break;
-        case 0x05: /* Attribute <= Value */
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(" <= ");
-            if (condExpr(fp, err, errlen)) return 1;
-            break;
-        case 0x06: /* expr AND expr */
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(" AND ");
-            if (condExpr(fp, err, errlen)) return 1;
-            break;
-        case 0x07: /* expr OR expr */
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(" OR ");
-            if (condExpr(fp, err, errlen)) return 1;
-            break;
-        case 0x08: /* ??? appcap(UID, Capability) */
-        case 0x09: /* exists(UID, Capability) */
-            printf("EXISTS(");
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(")");
-            break;
-        case 0x0a: /* devcap(Capability) */
-            printf("DEVCAP(");
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(")");
-            break;
-        case 0x0b: /* NOT(expr) */
-            printf("NOT(");
-            if (condExpr(fp, err, errlen)) return 1;
-            printf(")");
-            break;
-        case 0x0c: /* String */
-            if (condString(fp, err, errlen)) return 1;
-            break;
-        case 0x0d: /* Attribute */
-            if (condAttribute(fp, err, errlen)) return 1;
-            break;
-        case 0x0e:
-            if (condNumber(fp, err, errlen)) return 1;
-            break;
-        default:
-            snprintf(err, errlen, "Unknown conditional type %04x", condtype);
-            return 1;
-            break;
+    while (p < end) {
+        reclen = strtol(p, &eq, 10);
+        if (reclen <= 0 || p+reclen > end) return;
+        next = p+reclen;
+        if ((eq = memchr(eq, ' ', next-eq)) == NULL) return;
+        if (next-eq > 6 && !memcmp(eq+1, "path=", 5) &&
+            next-eq-7 < SIS_TAR_MAXNAME)
+        {
+            memcpy(name, eq+6, next-eq-7);
+            name[next-eq-7] = '\0';
+        }
+        p = next;
     }
-    return 0;
 }
 
-static int conditional(FILE *fp, char *err, int errlen)
+/* Load the member list scanning the tar headers. GNU long names ('L')
+ * and pax extended headers ('x') name the member that follows them. */
+static int tarScan(struct archive *a, char *err, int errlen)
 {
-    unsigned int condlen;
+    unsigned char h[SIS_TAR_BLOCK];
+    char longname[SIS_TAR_MAXNAME+1], name[SIS_TAR_MAXNAME+1];
+    char *data;
+    long off = 0, size;
+    int type, namelen;
 
-    if (sisRead(fp, &condlen, 4, err, errlen)) return 1;
-    condlen = sis32toh(condlen);
-    return condExpr(fp, err, errlen);
-}
+    longname[0] = '\0';
+    while (1) {
+        if (archiveReadAt(a, h, SIS_TAR_BLOCK, off, SIS_IO_META)) {
+            snprintf(err, errlen, off ? "truncated tar archive" :
+                "not a zip or tar archive");
+            return 1;
+        }
+        if (h[0] == '\0') break; /* End of archive marker. */
+        if (!tarHeaderValid(h)) {
+            snprintf(err, errlen, off ? "corrupted tar header at offset %ld" :
+                "not a zip or tar archive", off);
+            return 1;
+        }
+        size = tarNumber(h+124, 12);
+        type = h[156];
+        if (size < 0 || size > LONG_MAX-off-2*SIS_TAR_BLOCK) {
+            snprintf(err, errlen, "corrupted tar header at offset %ld", off);
+            return 1;
+        }
+        off += SIS_TAR_BLOCK;
+        if ((type == 'L' || type == 'x') && size <= SIS_TAR_MAXNAME*4) {
+            if ((data = malloc(size+1)) == NULL ||
+                archiveReadAt(a, data, size, off, SIS_IO_META))
+            {
+                snprintf(err, errlen, "bad tar extended header at offset %ld",
+                    off-SIS_TAR_BLOCK);
+                free(data);
+                return 1;
+            }
+            data[size] = '\0';
+            if (type == 'x') tarPaxPath(data, size, longname);
+            else snprintf(longname, sizeof(longname), "%s", data);
+            free(data);
+        } else if (type == '0' || type == '\0' || type == '7') {
+            struct archiveMember m;
+
+            if (longname[0]) {
+                namelen = snprintf(name, sizeof(name), "%s", longname);
+            } else if (!memcmp(h+257, "ustar", 5) && h[345]) {
+                namelen = snprintf(name, sizeof(name), "%.155s/%.100s",
+                    (char*)h+345, (char*)h);
+            } else {
+                namelen = snprintf(name, sizeof(name), "%.100s", (char*)h);
+            }
+            m.off = off;
+            m.len = m.origlen = size;
+            m.method = m.flags = 0;
+            if (archiveAdd(a, name, namelen, &m)) {
+                snprintf(err, errlen, "Out of memory");
+                return 1;
+            }
+            longname[0] = '\0';
+        } else {
+            longname[0] = '\0'; /* Directories, links, ... */
+        }
+        off += (size+SIS_TAR_BLOCK-1) / SIS_TAR_BLOCK * SIS_TAR_BLOCK;
+    }
+    return 0;
+}
+
+/* Return the archive 'path' with its member list, reusing the last one
+ * if the file didn't change. NULL is returned on errors. */
+static struct archive *archiveGet(char *path, char *err, int errlen)
+{
+    struct archive *a = lastArchive;
+    unsigned char magic[4] = {0, 0, 0, 0};
+    struct stat st;
+
+    if (stat(path, &st) == -1) {
+        snprintf(err, errlen, "%s opening %s", strerror(errno), path);
+        return NULL;
+    }
+    if (a && !strcmp(a->path, path) && a->st.st_dev == st.st_dev &&
+        a->st.st_ino == st.st_ino && a->st.st_size == st.st_size &&
+        a->st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+        a->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec) return a;
+    archiveFree(a);
+    lastArchive = NULL;
+
+    if ((a = calloc(1, sizeof(*a))) == NULL ||
+        (a->path = strdup(path)) == NULL)
+    {
+        free(a);
+        snprintf(err, errlen, "Out of memory");
+        return NULL;
+    }
+    if ((a->fd = open(path, O_RDONLY|O_CLOEXEC)) == -1 ||
+        fstat(a->fd, &a->st) == -1)
+    {
+        snprintf(err, errlen, "%s opening %s", strerror(errno), path);
+        goto error;
+    }
+    if (archiveReadAt(a, magic, 4, 0, SIS_IO_META) == 0 && magic[0] == 'P' &&
+        magic[1] == 'K' && (magic[2] == 3 || magic[2] == 5))
+    {
+        a->type = SIS_ARCHIVE_ZIP;
+        if (zipScan(a, err, errlen)) goto error;
+    } else if (magic[0] == 0x1f && magic[1] == 0x8b) {
+#ifndef NOZLIB
+        int fd = dup(a->fd);
+
+        if (fd == -1 || (a->gz = gzdopen(fd, "r")) == NULL) {
+            if (fd != -1) close(fd);
+            snprintf(err, errlen, "Out of memory");
+            goto error;
+        }
+        gzbuffer(a->gz, SIS_CHUNK_LEN);
+        a->type = SIS_ARCHIVE_TGZ;
+        if (tarScan(a, err, errlen)) goto error;
+#else
+        snprintf(err, errlen, "compressed tar archives need zlib");
+        goto error;
+#endif
+    } else {
+        a->type = SIS_ARCHIVE_TAR;
+        if (tarScan(a, err, errlen)) goto error;
+    }
+    lastArchive = a;
+    return a;
+
+error:
+    archiveFree(a);
+    return NULL;
+}
+
+/* Release the archive kept by the calling thread, see archiveGet(). */
+static void archiveRelease(void)
+{
+    archiveFree(lastArchive);
+    lastArchive = NULL;
+}
+
+/* Find the member 'name', starting from the one after the last found, so
+ * that opening all the members in order takes linear time. */
+static struct archiveMember *archiveFind(struct archive *a, char *name)
+{
+    int j, i;
+
+    while (name[0] == '.' && name[1] == '/') name += 2;
+    for (j = 0; j < a->count; j++) {
+        i = (a->last+1+j) % a->count;
+        if (!strcmp(a->members[i].name, name)) {
+            a->last = i;
+            return &a->members[i];
+        }
+    }
+    return NULL;
+}
+
+/* Uncompress the raw deflate stream of a zip member into memory. */
+static unsigned char *zipInflate(struct archive *a, struct archiveMember *m, long off, char *err, int errlen)
+{
+#ifndef NOZLIB
+    unsigned char *src, *dst;
+    z_stream zs;
+    int ret;
+
+    /* Both the lengths come from the central directory: the caller
+     * checked that the data is inside the archive, and the original
+     * length must be one deflate can produce from it. */
+    if (m->origlen > m->len*SIS_INFLATE_MAXRATIO+1024) {
+        snprintf(err, errlen, "invalid uncompressed length %ld for %ld bytes",
+            m->origlen, m->len);
+        return NULL;
+    }
+    src = malloc(m->len ? m->len : 1);
+    dst = malloc(m->origlen ? m->origlen : 1);
+    if (src == NULL || dst == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        goto error;
+    }
+    if (archiveReadAt(a, src, m->len, off, SIS_IO_BULK)) {
+        snprintf(err, errlen, "Error reading the zip archive");
+        goto error;
+    }
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        snprintf(err, errlen, "Out of memory");
+        goto error;
+    }
+    zs.next_in = src;
+    zs.avail_in = m->len;
+    zs.next_out = dst;
+    zs.avail_out = m->origlen;
+    ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.total_out != (unsigned long)m->origlen) {
+        snprintf(err, errlen, "corrupted compressed zip member");
+        goto error;
+    }
+    free(src);
+    return dst;
+
+error:
+    free(src);
+    free(dst);
+    return NULL;
+#else
+    SIS_NOTUSED(a);
+    SIS_NOTUSED(m);
+    SIS_NOTUSED(off);
+    snprintf(err, errlen, "compressed zip members need zlib");
+    return NULL;
+#endif
+}
+
+/* Open the member 'member' of the archive 'path' as 'sf'. */
+static int archiveOpen(struct sisfile *sf, char *path, char *member, char *err, int errlen)
+{
+    struct archiveMember *m;
+    struct archive *a;
+    unsigned char *buf, h[30];
+    long off;
+    FILE *fp;
+
+    if ((a = archiveGet(path, err, errlen)) == NULL) return 1;
+    if ((m = archiveFind(a, member)) == NULL) {
+        snprintf(err, errlen, "no such archive member: %s", member);
+        return 1;
+    }
+    off = m->off;
+    if (a->type == SIS_ARCHIVE_ZIP) {
+        /* The data follows the local header, whose name and extra field
+         * lengths may differ from the ones of the central directory. */
+        if (archiveReadAt(a, h, sizeof(h), off, SIS_IO_META) || archive32(h) != 0x04034b50) {
+            snprintf(err, errlen, "bad zip local header at offset %ld", off);
+            return 1;
+        }
+        off += sizeof(h)+archive16(h+26)+archive16(h+28);
+        if (off > (long)a->st.st_size || m->len > (long)a->st.st_size-off) {
+            snprintf(err, errlen, "zip member %s extends past the end of "
+                "the archive", member);
+            return 1;
+        }
+        if (m->flags & 1) {
+            snprintf(err, errlen, "encrypted zip members are not supported");
+            return 1;
+        }
+        if (m->method == 8) {
+            if ((buf = zipInflate(a, m, off, err, errlen)) == NULL) return 1;
+            sisMemInit(sf, buf, m->origlen);
+            return 0;
+        } else if (m->method != 0) {
+            snprintf(err, errlen, "unsupported zip compression method %d",
+                m->method);
+            return 1;
+        }
+    } else if (a->type == SIS_ARCHIVE_TGZ) {
+        /* The size in the tar header can't be checked against the length
+         * of the uncompressed stream without reading it all, but gzip
+         * can't expand the archive more than deflate does. */
+        if (m->len > (long)a->st.st_size*SIS_INFLATE_MAXRATIO) {
+            snprintf(err, errlen, "tar member %s larger than the archive "
+                "can hold (%ld bytes)", member, m->len);
+            return 1;
+        }
+        if ((buf = malloc(m->len ? m->len : 1)) == NULL) {
+            snprintf(err, errlen, "Out of memory");
+            return 1;
+        }
+        if (archiveReadAt(a, buf, m->len, off, SIS_IO_BULK)) {
+            snprintf(err, errlen, "truncated tar archive");
+            free(buf);
+            return 1;
+        }
+        sisMemInit(sf, buf, m->len);
+        return 0;
+    } else if (off > (long)a->st.st_size || m->len > (long)a->st.st_size-off) {
+        snprintf(err, errlen, "truncated tar archive: %s", member);
+        return 1;
+    }
+    /* Stored: read the member in place. */
+    if ((fp = fopen(path, "r")) == NULL) {
+        snprintf(err, errlen, "%s opening %s", strerror(errno), path);
+        return 1;
+    }
+    sisFileInit(sf, fp);
+    sf->base = off;
+    sf->len = m->len;
+    return sisSeek(sf, 0, err, errlen);
+}
+
+/* Open the package 'name' for reading: a plain file, or a member of an
+ * archive as in "bundle.zip!/path/inner.sis". Returns 0 on success, the
+ * input must be released with sisInputClose(). */
+static int sisInputOpen(struct sisfile *sf, char *name, char *err, int errlen)
+{
+    char *sep = strstr(name, SIS_ARCHIVE_SEP), *path;
+    FILE *fp;
+    int retval;
+
+    if (sep == NULL) {
+        if ((fp = fopen(name, "r")) == NULL) {
+            snprintf(err, errlen, "%s opening file", strerror(errno));
+            return 1;
+        }
+        sisFileInit(sf, fp);
+        return 0;
+    }
+    if ((path = strndup(name, sep-name)) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        return 1;
+    }
+    retval = archiveOpen(sf, path, sep+strlen(SIS_ARCHIVE_SEP), err, errlen);
+    free(path);
+    return retval;
+}
+
+static void sisInputClose(struct sisfile *sf)
+{
+    if (sf->fp) fclose(sf->fp);
+    else free(sf->buf);
+    sf->fp = NULL;
+    sf->buf = NULL;
+}
+
+/* stat() the package 'name', or the archive containing it. */
+static int sisInputStat(char *name, struct stat *st)
+{
+    char *sep = strstr(name, SIS_ARCHIVE_SEP), *path;
+    int retval;
+
+    if (sep == NULL) return stat(name, st);
+    if ((path = strndup(name, sep-name)) == NULL) return -1;
+    retval = stat(path, st);
+    free(path);
+    return retval;
+}
+
+/* Return 1 if the file name has the extension of an archive. */
+static int archiveName(char *name)
+{
+    static char *ext[] = {".zip", ".tar", ".tgz", ".tar.gz", NULL};
+    size_t len = strlen(name), extlen;
+    int j;
+
+    for (j = 0; ext[j]; j++) {
+        extlen = strlen(ext[j]);
+        if (len > extlen && !strcasecmp(name+len-extlen, ext[j])) return 1;
+    }
+    return 0;
+}
+
+/* Replace every archive in 'filenames' with its .sis members, named as
+ * "archive!/member". If an archive can't be read it is replaced with
+ * "archive!/", so that opening it reports the error where every other
+ * package would. Returns the new count. */
+static int archiveExpand(char ***filenames, int count)
+{
+    char **in = *filenames, **out = NULL, err[SISOPEN_ERRLEN], *name;
+    struct archive *a;
+    int i, j, n = 0, found;
+
+    for (i = 0; i < count; i++) {
+        a = NULL;
+        if (archiveName(in[i]) && strstr(in[i], SIS_ARCHIVE_SEP) == NULL)
+            a = archiveGet(in[i], err, sizeof(err));
+        if ((out = realloc(out, sizeof(char*)*(n+(a ? a->count : 0)+1))) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        if (a == NULL && (!archiveName(in[i]) || strstr(in[i], SIS_ARCHIVE_SEP))) {
+            out[n++] = in[i];
+            continue;
+        }
+        found = 0;
+        for (j = 0; j < (a ? a->count : 1); j++) {
+            size_t len;
+
+            name = a ? a->members[j].name : "";
+            len = strlen(name);
+            if (a && (len < 4 || strcasecmp(name+len-4, ".sis"))) continue;
+            if (asprintf(&out[n++], "%s%s%s", in[i], SIS_ARCHIVE_SEP, name) == -1) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+            found++;
+        }
+        if (!found) fprintf(stderr, "%s: no .sis packages in the archive\n", in[i]);
+    }
+    free(in);
+    *filenames = out;
+    return n;
+}
+
+/* ------------------------------ Output files -------------------------------
+ * Extracted files are never written in place: the data goes to an unnamed
+ * O_TMPFILE (or to a hidden temporary name where that is not supported),
+ * that is published under its final name with linkat() or rename() only
+ * once complete, so whoever watches the extraction directory never sees a
+ * partial file. When the final size is known the space is preallocated,
+ * so that big payloads are not fragmented. --fsync sets when the data is
+ * made durable: "file" syncs every file before publishing it, "package"
+ * publishes all the files of a package together once synced, at the end
+ * of the package, and "never" (the default) leaves it to the kernel.
+ *
+ * Packages can have any number of files waiting for the "package" policy:
+ * only the first SIS_OUT_MAXOPEN are kept open, the others are linked
+ * under their hidden temporary name right away and closed, and renamed
+ * like the rest at the end. The preallocation of a file is trimmed to the
+ * data actually written before it is published. */
+
+#define SIS_FSYNC_NEVER 0
+#define SIS_FSYNC_FILE 1
+#define SIS_FSYNC_PACKAGE 2
+#define SIS_OUT_MAXOPEN 256         /* pending files kept open */
+
+struct sisout {
+    int fd;
+    char *name;                 /* final name, in extractDir */
+    char *tmpname;              /* temporary name, NULL for O_TMPFILE */
+    unsigned long prealloc;     /* bytes preallocated, see outTrim() */
+};
+
+static int optFsync = SIS_FSYNC_NEVER;
+static struct sisout *outPending = NULL; /* files waiting for the package end */
+static int outNumPending = 0, outPendingSize = 0;
+static unsigned long outCounter = 0; /* to make temporary names unique */
+
+/* Create a new hidden file in extractDir, linked to 'fd' if it is not -1
+ * (an O_TMPFILE), setting its name in o->tmpname. The name is the final
+ * one cut as needed to fit NAME_MAX: the pid and the counter alone make
+ * it unique. */
+static int outTempName(struct sisout *o, int fd)
+{
+    char *tmp, suffix[64];
+    int retval, prefix;
+
+    while(1) {
+        snprintf(suffix, sizeof(suffix), ".%ld.%lu.tmp", (long)getpid(),
+            outCounter++);
+        prefix = NAME_MAX-1-strlen(suffix);
+        if ((tmp = malloc(NAME_MAX+1)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        snprintf(tmp, NAME_MAX+1, ".%.*s%s", prefix, o->name, suffix);
+        if (fd == -1) {
+            retval = openat(extractDir, tmp, O_RDWR|O_CREAT|O_EXCL, 0666);
+        } else {
+            char path[64];
+
+            snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+            retval = linkat(AT_FDCWD, path, extractDir, tmp, AT_SYMLINK_FOLLOW);
+        }
+        if (retval != -1) break;
+        free(tmp);
+        if (errno != EEXIST) return -1;
+    }
+    o->tmpname = tmp;
+    return retval;
+}
+
+/* Open a new output file, that will be called 'name' once published, and
+ * should be 'size' bytes long (0 if unknown). */
+static int outOpen(struct sisout *o, char *name, unsigned long size, char *err, int errlen)
+{
+    static int tmpfileOk = -1;
+
+    if ((o->name = strdup(name)) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        return 1;
+    }
+    o->tmpname = NULL;
+    o->fd = -1;
+    o->prealloc = 0;
+#ifdef O_TMPFILE
+    /* Unnamed files can only be linked through /proc. */
+    if (tmpfileOk == -1) tmpfileOk = access("/proc/self/fd", X_OK) == 0;
+    if (tmpfileOk) o->fd = openat(extractDir, ".", O_TMPFILE|O_RDWR, 0666);
+#else
+    SIS_NOTUSED(tmpfileOk);
+#endif
+    if (o->fd == -1) o->fd = outTempName(o, -1);
+    if (o->fd == -1) {
+        snprintf(err, errlen, "error opening file for writing: %s\n",
+            strerror(errno));
+        free(o->name);
+        return 1;
+    }
+#ifdef __linux__
+    /* Only a hint: the size is set by the data actually written, and the
+     * space past it is released by outTrim(). */
+    if (size && fallocate(o->fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0)
+        o->prealloc = size;
+#else
+    SIS_NOTUSED(size);
+#endif
+    return 0;
+}
+
+/* Release the space preallocated past the data actually written, when
+ * the payload turned out to be shorter than announced. */
+static void outTrim(struct sisout *o)
+{
+#ifdef __linux__
+    struct stat st;
+
+    if (o->prealloc && fstat(o->fd, &st) == 0 &&
+        (unsigned long)st.st_size < o->prealloc)
+    {
+        fallocate(o->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+            st.st_size, o->prealloc-st.st_size);
+    }
+#endif
+    o->prealloc = 0;
+}
+
+/* Discard a file that could not be written completely. */
+static void outAbort(struct sisout *o)
+{
+    if (o->tmpname) unlinkat(extractDir, o->tmpname, 0);
+    if (o->fd != -1) close(o->fd);
+    free(o->name);
+    free(o->tmpname);
+}
+
+/* Give the file its final name, replacing any existing file atomically.
+ * The file is closed even on errors. */
+static int outPublish(struct sisout *o, char *err, int errlen)
+{
+    char path[64];
+
+    if (o->tmpname == NULL) {
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", o->fd);
+        if (linkat(AT_FDCWD, path, extractDir, o->name, AT_SYMLINK_FOLLOW) == 0)
+            goto done;
+        /* The name exists: link the file with a temporary name, and
+         * rename it over the old one. */
+        if (errno != EEXIST || outTempName(o, o->fd) == -1) goto werr;
+    }
+    if (renameat(extractDir, o->tmpname, extractDir, o->name) == -1)
+        goto werr;
+    free(o->tmpname);
+    o->tmpname = NULL;
+done:
+    if (o->fd != -1) close(o->fd);
+    free(o->name);
+    return 0;
+
+werr:
+    snprintf(err, errlen, "error publishing %s: %s", o->name, strerror(errno));
+    outAbort(o);
+    return 1;
+}
+
+/* Sync the extraction directory, so that new names are durable. */
+static void outSyncDir(void)
+{
+    int fd = openat(extractDir, ".", O_RDONLY|O_DIRECTORY);
+
+    if (fd == -1) return;
+    fsync(fd);
+    close(fd);
+}
+
+/* Publish the files of the package extracted so far. With the "package"
+ * fsync policy the data of all of them is synced together first. */
+static int outFlush(char *err, int errlen)
+{
+    int j, fd, retval = 0;
+
+    if (outNumPending == 0) return 0;
+#ifdef __linux__
+    if (syncfs(outPending[0].fd) == -1)
+#endif
+    {
+        for (j = 0; j < outNumPending; j++) {
+            if ((fd = outPending[j].fd) == -1)
+                fd = openat(extractDir, outPending[j].tmpname, O_RDONLY);
+            if (fd == -1) continue;
+            fsync(fd);
+            if (fd != outPending[j].fd) close(fd);
+        }
+    }
+    for (j = 0; j < outNumPending; j++) {
+        if (outPublish(&outPending[j], err, errlen)) retval = 1;
+    }
+    outNumPending = 0;
+    outSyncDir();
+    return retval;
+}
+
+/* The file 'o' is complete: publish it now, or at the end of the package
+ * with the "package" fsync policy. */
+static int outClose(struct sisout *o, char *err, int errlen)
+{
+    outTrim(o);
+    if (optFsync == SIS_FSYNC_PACKAGE) {
+        if (outNumPending == outPendingSize) {
+            int size = outPendingSize ? outPendingSize*2 : 16;
+            struct sisout *pending = realloc(outPending, sizeof(*pending)*size);
+
+            if (pending == NULL) {
+                snprintf(err, errlen, "Out of memory");
+                outAbort(o);
+                return 1;
+            }
+            outPending = pending;
+            outPendingSize = size;
+        }
+        if (outNumPending >= SIS_OUT_MAXOPEN) {
+            if (o->tmpname == NULL && outTempName(o, o->fd) == -1) {
+                snprintf(err, errlen, "error linking %s: %s", o->name,
+                    strerror(errno));
+                outAbort(o);
+                return 1;
+            }
+            close(o->fd);
+            o->fd = -1;
+        }
+        outPending[outNumPending++] = *o;
+        return 0;
+    }
+    if (optFsync == SIS_FSYNC_FILE && fsync(o->fd) == -1) {
+        snprintf(err, errlen, "error syncing %s: %s", o->name, strerror(errno));
+        outAbort(o);
+        return 1;
+    }
+    if (outPublish(o, err, errlen)) return 1;
+    if (optFsync == SIS_FSYNC_FILE) outSyncDir();
+    return 0;
+}
+
+/* Return a new descriptor of the file that will be published as 'name'
+ * at the end of the package, or -1 if there is no such file. */
+static int outPendingOpen(char *name)
+{
+    int j;
+
+    for (j = outNumPending-1; j >= 0; j--) {
+        if (strcmp(outPending[j].name, name)) continue;
+        if (outPending[j].fd != -1) return dup(outPending[j].fd);
+        return openat(extractDir, outPending[j].tmpname, O_RDONLY);
+    }
+    return -1;
+}
+
+static int extractStored(struct sisfile *sf, int len, int off, char *basename, char *err, int errlen)
+{
+    struct sisout o;
+
+    if (outOpen(&o, basename, len, err, errlen)) return 1;
+    if (sisCopyRange(sf, off, len, o.fd, err, errlen)) {
+        outAbort(&o);
+        return 1;
+    }
+    return outClose(&o, err, errlen);
+}
+
+/* Return the last component of a Symbian (or Unix) path. */
+static char *sisBasename(char *name)
+{
+    char *basename = strrchr(name,'\\');
+
+    if (basename && strrchr(basename,'/')) basename = strrchr(basename,'/');
+    if (basename == NULL) basename = strrchr(name,'/');
+    return basename ? basename+1 : name;
+}
+
+/* Nested packages (see --recurse) prefix their output with the path of
+ * the component inside the top level package. */
+static void showPrefix(struct sispkg *pkg)
+{
+    if (pkg->prefix) printf("%s: ", pkg->prefix);
+}
+
+/* Return a pointer to 'len' bytes at offset 'off' of the input, without
+ * moving the read position, so that payloads can be read while the file
+ * table is parsed. For memory input this is the data itself, otherwise
+ * the data is read into 'buf', accounted to the I/O budget 'class'. On
+ * error NULL is returned. */
+static unsigned char *sisChunk(struct sisfile *sf, unsigned char *buf, size_t len, long off, int class, char *err, int errlen)
+{
+    unsigned char *p = buf;
+    ssize_t n;
+
+    if (off < 0 || len > LONG_MAX) {
+        snprintf(err,errlen,"Invalid payload range at offset %ld", off);
+        return NULL;
+    }
+    if (sf->fp == NULL) {
+        if (off > sf->len || (long)len > sf->len-off) {
+            snprintf(err,errlen,"Unexpected EOF reading payload at offset %ld", off);
+            return NULL;
+        }
+        return sf->buf+off;
+    }
+    if (sf->len && (off > sf->len || (long)len > sf->len-off)) {
+        snprintf(err,errlen,"Unexpected EOF reading payload at offset %ld", off);
+        return NULL;
+    }
+    while (len) {
+        ioThrottle(class, ioChunk(len), 1);
+        n = pread(fileno(sf->fp), p, ioChunk(len), sf->base+off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            snprintf(err,errlen,"Error reading from file: %s", strerror(errno));
+            return NULL;
+        }
+        if (n == 0) {
+            snprintf(err,errlen,"Unexpected EOF reading payload at offset %ld", off);
+            return NULL;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return buf;
+}
+
+/* A payload consumer: called for every chunk of data produced. Returns
+ * non zero on error, after setting 'err'. */
+typedef int payloadProc(void *privdata, unsigned char *buf, size_t len, char *err, int errlen);
+
+/* Buffers and decompression state used by sisPayload(). They are allocated
+ * the first time a payload is read and then reused for every payload of
+ * every package processed by this thread (in --serve mode, of every
+ * request served by a worker), so that after the first payload the setup
+ * cost is just an inflateReset(). */
+struct sisdecoder {
+    unsigned char *in;          /* input chunk, SIS_CHUNK_LEN bytes */
+    unsigned char *src;         /* whole compressed payload (one-shot) */
+    size_t srclen;
+    unsigned char *out;         /* output chunk, or whole payload (one-shot) */
+    size_t outlen;
+#ifndef NOZLIB
+    z_stream zs;
+    int zinit;                  /* inflateInit() was called on 'zs' */
+#endif
+#ifdef USE_LIBDEFLATE
+    struct libdeflate_decompressor *ld;
+#endif
+    int busy;                   /* in use by a sisPayload() call */
+};
+
+static __thread struct sisdecoder sharedDecoder;
+
+static void sisDecoderFree(struct sisdecoder *d)
+{
+    free(d->in);
+    free(d->src);
+    free(d->out);
+#ifndef NOZLIB
+    if (d->zinit) inflateEnd(&d->zs);
+#endif
+#ifdef USE_LIBDEFLATE
+    if (d->ld) libdeflate_free_decompressor(d->ld);
+#endif
+    memset(d, 0, sizeof(*d));
+}
+
+/* Make sure '*buf' can hold 'len' bytes. Returns 0 on success, 1 if out
+ * of memory. */
+static int decoderBuffer(unsigned char **buf, size_t *size, size_t len)
+{
+    unsigned char *p;
+
+    if (*size >= len && *buf) return 0;
+    if ((p = realloc(*buf, len ? len : 1)) == NULL) return 1;
+    *buf = p;
+    *size = len;
+    return 0;
+}
+
+/* ------------------------- Decompression backends --------------------------
+ * Compressed payloads are zlib streams. The backends compiled in are listed
+ * in inflateBackends[], the first one is used unless --bench is comparing
+ * them. The build selects the default backend:
+ *
+ *   make               zlib (streaming)
+ *   make libdeflate    libdeflate (one-shot), zlib is still compiled in
+ *   make builtin       the built-in decoder of inflate.c, no dependencies
+ *
+ * Streaming backends use a fixed amount of memory whatever the size of the
+ * payload. One-shot backends need the whole payload in memory, but this is
+ * not a problem as the file table records the uncompressed length, so the
+ * output buffer is allocated once with the right size: in exchange they
+ * don't need to save and restore their state at every chunk. */
+
+typedef int inflateProc(struct sisdecoder *d, struct sisfile *sf, unsigned int len, unsigned int origlen, long off, payloadProc *rawproc, payloadProc *proc, void *privdata, char *err, int errlen);
+
+/* A one-shot decoder: uncompress 'srclen' bytes at 'src' into 'dst'. */
+typedef int oneshotProc(struct sisdecoder *d, unsigned char *src, size_t srclen, unsigned char *dst, size_t dstlen, size_t *produced, char *err, int errlen);
+
+/* Read the whole payload, uncompress it with 'decode' and pass it to the
+ * callbacks in chunks, exactly like the streaming backends do. */
+static int oneshotInflate(oneshotProc *decode, struct sisdecoder *d, struct sisfile *sf, unsigned int len, unsigned int origlen, long off, payloadProc *rawproc, payloadProc *proc, void *privdata, char *err, int errlen)
+{
+    unsigned char *src;
+    size_t produced, pos, n;
+
+    /* Memory input is used in place. */
+    if (sf->fp && decoderBuffer(&d->src, &d->srclen, len)) goto oom;
+    if ((src = sisChunk(sf, d->src, len, off, SIS_IO_BULK, err, errlen)) == NULL)
+        return 1;
+    for (pos = 0; rawproc && pos < len; pos += n) {
+        n = len-pos < SIS_CHUNK_LEN ? len-pos : SIS_CHUNK_LEN;
+        if (rawproc(privdata, src+pos, n, err, errlen)) return 1;
+    }
+    if (decoderBuffer(&d->out, &d->outlen, origlen)) goto oom;
+    if (decode(d, src, len, d->out, origlen, &produced, err, errlen))
+        return 1;
+    if (produced != origlen) {
+        snprintf(err, errlen, "uncompressed file length does not match!");
+        return 1;
+    }
+    for (pos = 0; pos < origlen; pos += n) {
+        n = origlen-pos < SIS_CHUNK_LEN ? origlen-pos : SIS_CHUNK_LEN;
+        if (proc(privdata, d->out+pos, n, err, errlen)) return 1;
+    }
+    return 0;
+
+oom:
+    snprintf(err, errlen, "Out of memory");
+    return 1;
+}
+
+static int builtinDecode(struct sisdecoder *d, unsigned char *src, size_t srclen, unsigned char *dst, size_t dstlen, size_t *produced, char *err, int errlen)
+{
+    SIS_NOTUSED(d);
+    switch(sisInflate(dst, dstlen, src, srclen, produced)) {
+    case INFLATE_OK: return 0;
+    case INFLATE_ERR_SPACE:
+        snprintf(err, errlen, "uncompressed file length does not match!");
+        return 1;
+    default:
+        snprintf(err, errlen, "corrupted compressed data");
+        return 1;
+    }
+}
+
+static int builtinInflate(struct sisdecoder *d, struct sisfile *sf, unsigned int len, unsigned int origlen, long off, payloadProc *rawproc, payloadProc *proc, void *privdata, char *err, int errlen)
+{
+    return oneshotInflate(builtinDecode, d, sf, len, origlen, off, rawproc,
+        proc, privdata, err, errlen);
+}
+
+#ifdef USE_LIBDEFLATE
+static int libdeflateDecode(struct sisdecoder *d, unsigned char *src, size_t srclen, unsigned char *dst, size_t dstlen, size_t *produced, char *err, int errlen)
+{
+    enum libdeflate_result res;
+
+    if (d->ld == NULL && (d->ld = libdeflate_alloc_decompressor()) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        return 1;
+    }
+    res = libdeflate_zlib_decompress(d->ld, src, srclen, dst, dstlen, produced);
+    if (res == LIBDEFLATE_SUCCESS) return 0;
+    if (res == LIBDEFLATE_INSUFFICIENT_SPACE)
+        snprintf(err, errlen, "uncompressed file length does not match!");
+    else
+        snprintf(err, errlen, "libdeflate reported error trying to uncompress (error %d)", (int) res);
+    return 1;
+}
+
+static int libdeflateInflate(struct sisdecoder *d, struct sisfile *sf, unsigned int len, unsigned int origlen, long off, payloadProc *rawproc, payloadProc *proc, void *privdata, char *err, int errlen)
+{
+    return oneshotInflate(libdeflateDecode, d, sf, len, origlen, off,
+        rawproc, proc, privdata, err, errlen);
+}
+#endif
+
+#ifndef NOZLIB
+static int zlibInflate(struct sisdecoder *d, struct sisfile *sf, unsigned int len, unsigned int origlen, long off, payloadProc *rawproc, payloadProc *proc, void *privdata, char *err, int errlen)
+{
+    z_stream *zs = &d->zs;
+    unsigned int left = len;
+    unsigned char *p;
+    int zret = Z_OK;
+
+    if (decoderBuffer(&d->out, &d->outlen, SIS_CHUNK_LEN)) goto oom;
+    if (!d->zinit) {
+        if (inflateInit(zs) != Z_OK) goto oom;
+        d->zinit = 1;
+    } else if (inflateReset(zs) != Z_OK) {
+        goto oom;
+    }
+    zs->avail_in = 0;
+    while (zret != Z_STREAM_END) {
+        if (zs->avail_in == 0 && left) {
+            int n = left < SIS_CHUNK_LEN ? left : SIS_CHUNK_LEN;
+
+            if ((p = sisChunk(sf, d->in, n, off, SIS_IO_BULK, err, errlen)) == NULL)
+                return 1;
+            if (rawproc && rawproc(privdata, p, n, err, errlen)) return 1;
+            zs->next_in = p;
+            zs->avail_in = n;
+            off += n;
+            left -= n;
+        }
+        zs->next_out = d->out;
+        zs->avail_out = SIS_CHUNK_LEN;
+        zret = inflate(zs, Z_NO_FLUSH);
+        if (zret != Z_OK && zret != Z_STREAM_END) {
+            if (zret == Z_BUF_ERROR) zret = Z_DATA_ERROR; /* truncated */
+            snprintf(err, errlen, "zlib reported error trying to uncompress (error %d)",zret);
+            return 1;
+        }
+        if (zs->total_out > origlen) break;
+        if (zs->avail_out != SIS_CHUNK_LEN &&
+            proc(privdata, d->out, SIS_CHUNK_LEN-zs->avail_out, err, errlen))
+            return 1;
+    }
+    if (zs->total_out != origlen) {
+        snprintf(err, errlen, "uncompressed file length does not match!");
+        return 1;
+    }
+    return 0;
+
+oom:
+    snprintf(err, errlen, "Out of memory");
+    return 1;
+}
+#endif
+
+static struct {char *name; inflateProc *inflate;} inflateBackends[] = {
+#ifdef USE_LIBDEFLATE
+    {"libdeflate", libdeflateInflate},
+#endif
+#ifndef NOZLIB
+    {"zlib", zlibInflate},
+#endif
+    {"builtin", builtinInflate},
+    {NULL, NULL}
+};
+
+static inflateProc *payloadInflate = NULL; /* NULL: inflateBackends[0] */
+
+/* Check that a payload is inside the package and that its lengths make
+ * sense. Returns 0 if it looks sane, otherwise 1 setting 'err'. */
+static int payloadCheck(struct sispkg *pkg, unsigned int len, unsigned int origlen, unsigned int off, char *err, int errlen)
+{
+    long size = sisSize(pkg->sf);
+
+    if (len > INT_MAX || origlen > INT_MAX || off > INT_MAX ||
+        (size != -1 && (off > (unsigned long)size || len > size-off)))
+    {
+        snprintf(err, errlen, "payload of %u bytes at offset %u out of range",
+            len, off);
+        return 1;
+    }
+    if (origlen && !pkg->nocompr &&
+        origlen > (unsigned long long)len*SIS_INFLATE_MAXRATIO+1024)
+    {
+        snprintf(err, errlen, "invalid uncompressed length %u for %u bytes",
+            origlen, len);
+        return 1;
+    }
+    return 0;
+}
+
+/* Stream the payload of 'len' bytes at offset 'off' in chunks of at most
+ * SIS_CHUNK_LEN bytes. 'rawproc' (if not NULL) is called with the data as
+ * stored in the SIS file, 'proc' with the uncompressed data. Payloads are
+ * stored if 'origlen' is zero or the package is not compressed, in this
+ * case both the callbacks see the same chunks. If 'proc' is NULL the
+ * payload is not uncompressed at all. */
+static int sisPayload(struct sispkg *pkg, unsigned int len, unsigned int origlen, unsigned int off, payloadProc *rawproc, payloadProc *proc, void *privdata, char *err, int errlen)
+{
+    struct sisfile *sf = pkg->sf;
+    struct sisdecoder tmp, *d = &sharedDecoder;
+    inflateProc *inflate = payloadInflate;
+    unsigned char *p;
+    int left = len, retval = 1;
+
+    if (payloadCheck(pkg, len, origlen, off, err, errlen)) return 1;
+    /* A callback may read another payload: give it its own buffers. */
+    if (d->busy) {
+        memset(&tmp, 0, sizeof(tmp));
+        d = &tmp;
+    }
+    d->busy = 1;
+    if (d->in == NULL && (d->in = malloc(SIS_CHUNK_LEN)) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        goto cleanup;
+    }
+    if (origlen == 0 || pkg->nocompr || proc == NULL) {
+        while (left) {
+            int n = left < SIS_CHUNK_LEN ? left : SIS_CHUNK_LEN;
+
+            if ((p = sisChunk(sf, d->in, n, off, SIS_IO_BULK, err, errlen)) == NULL)
+                goto cleanup;
+            if (rawproc && rawproc(privdata, p, n, err, errlen)) goto cleanup;
+            if (proc && proc(privdata, p, n, err, errlen)) goto cleanup;
+            off += n;
+            left -= n;
+        }
+        retval = 0;
+        goto cleanup;
+    }
+    if (inflate == NULL) inflate = inflateBackends[0].inflate;
+    retval = inflate(d, sf, len, origlen, off, rawproc, proc, privdata,
+        err, errlen);
+
+cleanup:
+    d->busy = 0;
+    if (d == &tmp) sisDecoderFree(&tmp);
+    return retval;
+}
+
+/* State of a single payload extraction: the destination file (NULL if we
+ * are only computing the manifest) and the running hashes. */
+struct extractState {
+    struct sisout *out;
+    SHA256_CTX sha, zsha;
+    unsigned int crc;
+};
+
+static int extractRawChunk(void *privdata, unsigned char *buf, size_t len, char *err, int errlen)
+{
+    struct extractState *es = privdata;
+
+    SIS_NOTUSED(err);
+    SIS_NOTUSED(errlen);
+    SHA256Update(&es->zsha, buf, len);
+    return 0;
+}
+
+static int extractChunk(void *privdata, unsigned char *buf, size_t len, char *err, int errlen)
+{
+    struct extractState *es = privdata;
+
+    if (manifestFp) {
+        SHA256Update(&es->sha, buf, len);
+        es->crc = crc32Update(es->crc, buf, len);
+    }
+    if (es->out) return ioWriteAll(es->out->fd, buf, len, err, errlen);
+    return 0;
+}
+
+/* Some packages point more file records, or all the language slots of a
+ * multilang record, to the same payload. Every distinct payload (same
+ * offset and lengths) is remembered once extracted, with the name of the
+ * file written and its hashes, so that the next files using it are cloned
+ * from the first one instead of uncompressing the data again. */
+struct payloadMemo {
+    unsigned int off, len, origlen;
+    char *name;                 /* extracted file with the data, or NULL */
+    int hashed;                 /* the three fields below are valid */
+    char hex[SHA256_DIGEST_LEN*2+1], zhex[SHA256_DIGEST_LEN*2+1];
+    unsigned int crc;
+    struct payloadMemo *next;   /* next in the same bucket */
+    struct payloadMemo *nextname;   /* next in the same 'memobyname' bucket */
+};
+
+static unsigned int memoNameHash(struct sispkg *pkg, char *name)
+{
+    unsigned int h = 5381;
+
+    while (*name) h = h*33 + (unsigned char)*name++;
+    return h % pkg->memosize;
+}
+
+/* Return the memo of the given payload, creating it if needed. NULL is
+ * returned when out of memory: payloads are then just extracted again. */
+static struct payloadMemo *memoLookup(struct sispkg *pkg, unsigned int off, unsigned int len, unsigned int origlen)
+{
+    struct payloadMemo *m;
+    unsigned int h;
+    int j, payloads = 0;
+
+    if (pkg->memo == NULL) {
+        for (j = 0; j < pkg->numrecords; j++)
+            payloads += pkg->records[j].numlangs;
+        pkg->memosize = payloads*2+1;
+        pkg->memo = calloc(pkg->memosize, sizeof(struct payloadMemo*));
+        pkg->memobyname = calloc(pkg->memosize, sizeof(struct payloadMemo*));
+        if (pkg->memo == NULL || pkg->memobyname == NULL) {
+            free(pkg->memo);
+            free(pkg->memobyname);
+            pkg->memo = pkg->memobyname = NULL;
+            return NULL;
+        }
+    }
+    h = off % pkg->memosize;
+    for (m = pkg->memo[h]; m; m = m->next) {
+        if (m->off == off && m->len == len && m->origlen == origlen)
+            return m;
+    }
+    if ((m = calloc(1, sizeof(*m))) == NULL) return NULL;
+    m->off = off;
+    m->len = len;
+    m->origlen = origlen;
+    m->next = pkg->memo[h];
+    pkg->memo[h] = m;
+    return m;
+}
+
+/* The file 'name' is going to be written with the payload of 'keep': other
+ * payloads can't be cloned from it anymore. */
+static void memoForget(struct sispkg *pkg, char *name, struct payloadMemo *keep)
+{
+    struct payloadMemo *m, **prev;
+
+    if (pkg->memo == NULL) return;
+    prev = &pkg->memobyname[memoNameHash(pkg, name)];
+    while ((m = *prev) != NULL) {
+        if (m != keep && !strcmp(m->name, name)) {
+            *prev = m->nextname;
+            free(m->name);
+            m->name = NULL;
+        } else {
+            prev = &m->nextname;
+        }
+    }
+}
+
+/* Remember that the payload of 'm' was extracted as 'name'. */
+static void memoSetName(struct sispkg *pkg, struct payloadMemo *m, char *name)
+{
+    unsigned int h;
+
+    if ((m->name = strdup(name)) == NULL) return;
+    h = memoNameHash(pkg, name);
+    m->nextname = pkg->memobyname[h];
+    pkg->memobyname[h] = m;
+}
+
+static void memoFree(struct sispkg *pkg)
+{
+    struct payloadMemo *m, *next;
+    unsigned int h;
+
+    if (pkg->memo == NULL) return;
+    for (h = 0; h < pkg->memosize; h++) {
+        for (m = pkg->memo[h]; m; m = next) {
+            next = m->next;
+            free(m->name);
+            free(m);
+        }
+    }
+    free(pkg->memo);
+    free(pkg->memobyname);
+    pkg->memo = pkg->memobyname = NULL;
+}
+
+/* Make 'dstname' a copy of 'srcname', both in 'extractDir'. Where the
+ * filesystem supports it the data is shared with FICLONE. This is not a
+ * hard link: the two files can still be modified independently. */
+static int cloneFile(char *srcname, char *dstname, char *err, int errlen)
+{
+    struct sisout o;
+    struct stat st;
+    int srcfd, retval = 0;
+
+    /* The source may still be waiting for the end of the package. */
+    if ((srcfd = outPendingOpen(srcname)) == -1 &&
+        (srcfd = openat(extractDir, srcname, O_RDONLY)) == -1)
+    {
+        snprintf(err, errlen, "error opening %s: %s", srcname,
+            strerror(errno));
+        return 1;
+    }
+    if (fstat(srcfd, &st) == -1) {
+        snprintf(err, errlen, "error reading %s: %s", srcname,
+            strerror(errno));
+        retval = 1;
+    } else if (outOpen(&o, dstname, 0, err, errlen)) {
+        retval = 1;
+    } else {
+#ifdef FICLONE
+        if (ioctl(o.fd, FICLONE, srcfd) == -1)
+#endif
+            retval = fdCopyRange(srcfd, 0, st.st_size, o.fd, err, errlen);
+        if (retval)
+            outAbort(&o);
+        else
+            retval = outClose(&o, err, errlen);
+    }
+    close(srcfd);
+    return retval;
+}
+
+/* Extract the payload of file 'filenum' for the language slot 'lang'
+ * (-1 if the file is not language dependent), writing it in 'extractDir'
+ * if 'write' is true, and appending a line to the manifest if --manifest
+ * was given. */
+static int extractFile(struct sispkg *pkg, int filenum, int lang, int len, int origlen, int off, char *name, int write, char *err, int errlen)
+{
+    char *basename = sisBasename(name);
+    struct extractState es;
+    struct payloadMemo *m;
+    unsigned char digest[SHA256_DIGEST_LEN];
+    char hex[SHA256_DIGEST_LEN*2+1], zhex[SHA256_DIGEST_LEN*2+1];
+    unsigned int crc;
+    int stored = (origlen == 0 || pkg->nocompr);
+    struct sisout out;
+    int retval;
+
+    /* Stored payloads are copied directly from the SIS file, unless we
+     * need to see the data to hash it. */
+    if (write && stored && !manifestFp) {
+        memoForget(pkg, basename, NULL);
+        return extractStored(pkg->sf, len, off, basename, err, errlen);
+    }
+
+    /* Payloads seen already are cloned from the file written the first
+     * time, and their hashes reused. */
+    m = memoLookup(pkg, off, len, origlen);
+    if (write) memoForget(pkg, basename, m);
+    if (m && (!write || m->name) && (!manifestFp || m->hashed)) {
+        if (write && strcmp(m->name, basename) &&
+            cloneFile(m->name, basename, err, errlen)) return 1;
+        if (!manifestFp) return 0;
+        memcpy(hex, m->hex, sizeof(hex));
+        memcpy(zhex, m->zhex, sizeof(zhex));
+        crc = m->crc;
+        goto manifest;
+    }
+
+    es.out = NULL;
+    es.crc = 0;
+    SHA256Init(&es.sha);
+    SHA256Init(&es.zsha);
+    if (write) {
+        if (outOpen(&out, basename, stored ? len : origlen, err, errlen))
+            return 1;
+        es.out = &out;
+    }
+    retval = sisPayload(pkg, len, origlen, off,
+        manifestFp ? extractRawChunk : NULL, extractChunk, &es, err, errlen);
+    if (es.out) {
+        if (retval)
+            outAbort(&out);
+        else
+            retval = outClose(&out, err, errlen);
+    }
+    if (retval) return retval;
+    if (m && write && m->name == NULL) memoSetName(pkg, m, basename);
+    if (!manifestFp) return 0;
+
+    SHA256Final(&es.sha, digest);
+    SHA256Hex(digest, hex);
+    SHA256Final(&es.zsha, digest);
+    SHA256Hex(digest, zhex);
+    crc = es.crc;
+    if (m) {
+        memcpy(m->hex, hex, sizeof(hex));
+        memcpy(m->zhex, zhex, sizeof(zhex));
+        m->crc = crc;
+        m->hashed = 1;
+    }
+
+manifest:
+    /* package, index, name, language, sizes, hashes */
+    fprintf(manifestFp, "%s\t%03d\t%s\t%s\t%d\t%d\t%s\t%08x\t%s\n",
+        pkg->filename, filenum, name,
+        lang == -1 ? "-" : langStr(pkg->langs[lang]),
+        len, stored ? len : origlen, hex, crc, zhex);
+    return 0;
+}
+
+static int simpleFile(struct sisfile *sf, struct sispkg *pkg, struct sisrecord *r, int numlangs, char *err, int errlen)
+{
+    struct filerecord *file = &r->file;
+    int i;
+
+    if (sisRead(sf, file, sizeof(*file), err, errlen)) return 1;
+    file->type = sis32toh(file->type);
+    file->details = sis32toh(file->details);
+    file->srcnamelen = sis32toh(file->srcnamelen);
+    file->srcnameoff = sis32toh(file->srcnameoff);
+    file->dstnamelen = sis32toh(file->dstnamelen);
+    file->dstnameoff = sis32toh(file->dstnameoff);
+
+    if ((r->srcname = sisReadOffsetAlloc(sf, file->srcnamelen, file->srcnameoff, err, errlen)) == NULL) return 1;
+    uni2ascii(r->srcname,file->srcnamelen);
+    if ((r->dstname = sisReadOffsetAlloc(sf, file->dstnamelen, file->dstnameoff, err, errlen)) == NULL) return 1;
+    uni2ascii(r->dstname,file->dstnamelen);
+
+    if ((r->len = malloc(numlangs*sizeof(int))) == NULL) goto oom;
+    if ((r->off = malloc(numlangs*sizeof(int))) == NULL) goto oom;
+    r->numlangs = numlangs;
+
+    /* Read len/offset information */
+    for (i = 0; i < numlangs; i++) {
+        if (sisRead(sf, &r->len[i], 4, err, errlen)) return 1;
+        r->len[i] = sis32toh(r->len[i]);
+    }
+    for (i = 0; i < numlangs; i++) {
+        if (sisRead(sf, &r->off[i], 4, err, errlen)) return 1;
+        r->off[i] = sis32toh(r->off[i]);
+    }
+    if (pkg->epocrelease == 6) {
+        unsigned int mimelen, mimeoff;
+
+        if ((r->origlen = malloc(numlangs*sizeof(int))) == NULL) goto oom;
+        for (i = 0; i < numlangs; i++) {
+            if (sisRead(sf, &r->origlen[i], 4, err, errlen)) return 1;
+            r->origlen[i] = sis32toh(r->origlen[i]);
+        }
+        if (sisRead(sf, &mimelen, 4, err, errlen)) return 1;
+        if (sisRead(sf, &mimeoff, 4, err, errlen)) return 1;
+    }
+    return 0;
+
+oom:
+    snprintf(err,errlen,"Out of memory");
+    return 1;
+}
+
+/* Return the number of operands of the condition node 'type', or -1 if
+ * the type is unknown. */
+static int condArity(unsigned int type)
+{
+    if (type <= SIS_COND_OR) return 2;
+    if (type <= SIS_COND_NOT) return 1;
+    if (type <= SIS_COND_NUMBER) return 0;
+    return -1;
+}
+
+/* Parse the condition at the current position of 'sf' into the nodes of
+ * 'r'. The tree is stored in prefix order, and the nodes are appended to
+ * the array in the same order, so that the root is the first node and
+ * operands always come after their operator. Instead of recursing, the
+ * parser keeps a stack with the operands still to read, and it never
+ * reads past the 'condlen' bytes of the condition: a crafted condition
+ * can't have more than condlen/4 nodes, whatever its depth. */
+static int condParse(struct sisfile *sf, struct sisrecord *r, unsigned int condlen, char *err, int errlen)
+{
+    struct condNode *n;
+    unsigned int type, args[2];
+    unsigned long used = 0;
+    int *stack = NULL, *tmp, depth = 0, alloc = 0, idx, slot;
+
+    do {
+        if (used+4 > condlen) goto toolong;
+        if (sisRead(sf, &type, 4, err, errlen)) goto fail;
+        type = sis32toh(type);
+        used += 4;
+        if (condArity(type) == -1) {
+            snprintf(err, errlen, "Unknown conditional type %04x", type);
+            goto fail;
+        }
+        if (r->numcondnodes == alloc) {
+            alloc = alloc ? alloc*2 : 16;
+            n = realloc(r->condnodes, sizeof(*n)*alloc);
+            if (n == NULL) goto oom;
+            r->condnodes = n;
+            /* Every node pops one operand and pushes up to two. */
+            if ((tmp = realloc(stack, sizeof(int)*(alloc+2))) == NULL)
+                goto oom;
+            stack = tmp;
+        }
+        idx = r->numcondnodes++;
+        n = &r->condnodes[idx];
+        n->type = type;
+        n->left = n->right = -1;
+        n->value = 0;
+        n->str = NULL;
+        /* Link the node to its operator. */
+        if (depth) {
+            slot = stack[--depth];
+            if (slot & 1)
+                r->condnodes[slot/2].right = idx;
+            else
+                r->condnodes[slot/2].left = idx;
+        }
+        switch(condArity(type)) {
+        case 2:
+            stack[depth++] = idx*2+1;
+            /* fall through */
+        case 1:
+            stack[depth++] = idx*2;
+            break;
+        default:
+            if (used+8 > condlen) goto toolong;
+            if (sisRead(sf, args, 8, err, errlen)) goto fail;
+            used += 8;
+            args[0] = sis32toh(args[0]);
+            args[1] = sis32toh(args[1]);
+            if (type == SIS_COND_STRING) {
+                n->str = sisReadOffsetAlloc(sf, args[0], args[1], err, errlen);
+                if (n->str == NULL) goto fail;
+                uni2ascii(n->str, args[0]);
+            } else {
+                n->value = args[0];
+            }
+            break;
+        }
+    } while(depth);
+    free(stack);
+    return 0;
+
+toolong:
+    snprintf(err, errlen, "condition longer than its declared length (%u bytes)",
+        condlen);
+    goto fail;
+oom:
+    snprintf(err, errlen, "Out of memory");
+fail:
+    free(stack);
+    return 1;
+}
+
+static char *condOpStr(unsigned int type)
+{
+    static char *ops[] = {"==","!=",">","<",">=","<=","AND","OR",
+                          "APPCAP","EXISTS","DEVCAP","NOT"};
+
+    return type <= SIS_COND_NOT ? ops[type] : "?";
+}
+
+static void condLeafRender(FILE *out, struct condNode *n)
+{
+    int j;
+
+    switch(n->type) {
+    case SIS_COND_STRING:
+        fprintf(out, "%s", n->str);
+        break;
+    case SIS_COND_NUMBER:
+        fprintf(out, "0x%04x", n->value);
+        break;
+    case SIS_COND_ATTRIBUTE:
+        if (n->value >= SIS_ATTR_OPTION) {
+            fprintf(out, "option %d", n->value-SIS_ATTR_OPTION);
+            return;
+        }
+        for (j = 0; sisAttrTab[j].name; j++) {
+            if (sisAttrTab[j].id == n->value) {
+                fprintf(out, "%s", sisAttrTab[j].name);
+                return;
+            }
+        }
+        fprintf(out, "attribute %04x", n->value);
+        break;
+    }
+}
+
+/* A node being visited by the non recursive tree walkers: 'state' is the
+ * number of operands already visited. */
+struct condVisit {
+    int idx;
+    int state;
+};
+
+/* Render the condition as shown in listings. The tree is walked in order
+ * with an explicit stack, that is at most as deep as the number of nodes.
+ * Returns 1 when out of memory. */
+static int condRender(FILE *out, struct condNode *nodes, int numnodes)
+{
+    struct condVisit *stack, *v;
+    struct condNode *n;
+    int depth = 0;
+
+    if ((stack = malloc(sizeof(*stack)*(numnodes+1))) == NULL) return 1;
+    stack[depth].idx = 0;
+    stack[depth++].state = 0;
+    while(depth) {
+        v = &stack[depth-1];
+        n = &nodes[v->idx];
+        if (condArity(n->type) == 0) {
+            condLeafRender(out, n);
+            depth--;
+        } else if (v->state == 0) {
+            /* appcap() has always been shown as EXISTS() */
+            if (condArity(n->type) == 1)
+                fprintf(out, "%s(", n->type == SIS_COND_APPCAP ?
+                    "EXISTS" : condOpStr(n->type));
+            v->state = 1;
+            stack[depth].idx = n->left;
+            stack[depth++].state = 0;
+        } else if (v->state == 1 && condArity(n->type) == 2) {
+            fprintf(out, " %s ", condOpStr(n->type));
+            v->state = 2;
+            stack[depth].idx = n->right;
+            stack[depth++].state = 0;
+        } else {
+            if (condArity(n->type) == 1) fprintf(out, ")");
+            depth--;
+        }
+    }
+    free(stack);
+    return 0;
+}
+
+/* Evaluate a condition on a device. Operands always follow their operator
+ * in the array, so scanning it backward every node is evaluated after its
+ * operands, without any stack. 'lookup' returns the value of attribute,
+ * EXISTS(), APPCAP() and DEVCAP() nodes, or 0 if it is unknown: as on the
+ * phone, comparisons with unknown attributes are false. Returns 1 if the
+ * condition is true, 0 if not, -1 when out of memory. */
+static int condEval(struct condNode *nodes, int numnodes, condLookupProc *lookup, void *privdata)
+{
+    unsigned int *val, l, r;
+    unsigned char *known;
+    int i, retval;
+
+    if ((val = malloc((sizeof(*val)+1)*numnodes)) == NULL) return -1;
+    known = (unsigned char*)(val+numnodes);
+    for (i = numnodes-1; i >= 0; i--) {
+        struct condNode *n = &nodes[i];
+
+        l = n->left == -1 ? 0 : val[n->left];
+        r = n->right == -1 ? 0 : val[n->right];
+        known[i] = 1;
+        switch(n->type) {
+        case SIS_COND_EQ: case SIS_COND_NE: case SIS_COND_GT:
+        case SIS_COND_LT: case SIS_COND_GE: case SIS_COND_LE:
+            if (!known[n->left] || !known[n->right]) {
+                val[i] = 0;
+                break;
+            }
+            switch(n->type) {
+            case SIS_COND_EQ: val[i] = l == r; break;
+            case SIS_COND_NE: val[i] = l != r; break;
+            case SIS_COND_GT: val[i] = l > r; break;
+            case SIS_COND_LT: val[i] = l < r; break;
+            case SIS_COND_GE: val[i] = l >= r; break;
+            case SIS_COND_LE: val[i] = l <= r; break;
+            }
+            break;
+        case SIS_COND_AND: val[i] = l && r; break;
+        case SIS_COND_OR: val[i] = l || r; break;
+        case SIS_COND_NOT: val[i] = !l; break;
+        case SIS_COND_NUMBER: val[i] = n->value; break;
+        case SIS_COND_STRING:
+            val[i] = 0;
+            known[i] = 0;
+            break;
+        case SIS_COND_ATTRIBUTE:
+            known[i] = lookup(privdata, nodes, i, &val[i]);
+            if (!known[i]) val[i] = 0;
+            break;
+        default: /* EXISTS(), APPCAP(), DEVCAP() */
+            if (!lookup(privdata, nodes, i, &val[i])) val[i] = 0;
+            break;
+        }
+    }
+    retval = val[0] != 0;
+    free(val);
+    return retval;
+}
+
+/* A device profile, as given with --device NAME=VALUE,...: NAME is an
+ * attribute as shown in listings (case and spaces don't matter),
+ * "optionN" for the installation options selected by the user (1 if
+ * selected) or "exists" for a file that EXISTS() finds on the device. */
+struct sisdevice {
+    int numattrs;
+    unsigned int *ids;
+    unsigned int *values;
+    int numpaths;
+    char **paths;
+};
+
+/* Return the attribute id of 'name', or -1 if unknown. */
+static int deviceAttrId(char *name)
+{
+    char *a, *b;
+    int j;
+
+    if (!strncasecmp(name, "option", 6) && isdigit((unsigned char)name[6]))
+        return SIS_ATTR_OPTION+atoi(name+6);
+    for (j = 0; sisAttrTab[j].name; j++) {
+        a = sisAttrTab[j].name;
+        b = name;
+        while (*a && *b) {
+            if (*a == ' ') { a++; continue; }
+            if (*b == ' ') { b++; continue; }
+            if (tolower((unsigned char)*a) != tolower((unsigned char)*b)) break;
+            a++;
+            b++;
+        }
+        while (*a == ' ') a++;
+        while (*b == ' ') b++;
+        if (*a == '\0' && *b == '\0') return sisAttrTab[j].id;
+    }
+    return -1;
+}
+
+/* Add the NAME=VALUE pair 'item' to 'dev'. Returns 1 on errors. */
+static int deviceSet(struct sisdevice *dev, char *item, char *err, int errlen)
+{
+    char *eq = strchr(item, '='), *end;
+    unsigned int value;
+    int id;
+
+    if (eq == NULL) {
+        snprintf(err, errlen, "'%s' is not NAME=VALUE", item);
+        return 1;
+    }
+    *eq = '\0';
+    if (!strcasecmp(item, "exists")) {
+        char **paths = realloc(dev->paths, sizeof(char*)*(dev->numpaths+1));
+
+        if (paths == NULL || (paths[dev->numpaths] = strdup(eq+1)) == NULL)
+            goto oom;
+        dev->paths = paths;
+        dev->numpaths++;
+        return 0;
+    }
+    if ((id = deviceAttrId(item)) == -1) {
+        snprintf(err, errlen, "unknown attribute '%s'", item);
+        return 1;
+    }
+    value = strtoul(eq+1, &end, 0);
+    if (eq[1] == '\0' || *end != '\0') {
+        snprintf(err, errlen, "invalid value for %s: '%s'", item, eq+1);
+        return 1;
+    }
+    dev->ids = realloc(dev->ids, sizeof(unsigned int)*(dev->numattrs+1));
+    dev->values = realloc(dev->values, sizeof(unsigned int)*(dev->numattrs+1));
+    if (dev->ids == NULL || dev->values == NULL) goto oom;
+    dev->ids[dev->numattrs] = id;
+    dev->values[dev->numattrs++] = value;
+    return 0;
+
+oom:
+    snprintf(err, errlen, "Out of memory");
+    return 1;
+}
+
+static int deviceLookup(void *privdata, struct condNode *nodes, int idx, unsigned int *value)
+{
+    struct sisdevice *dev = privdata;
+    struct condNode *n = &nodes[idx];
+    int j;
+
+    switch(n->type) {
+    case SIS_COND_ATTRIBUTE:
+        for (j = 0; j < dev->numattrs; j++) {
+            if (dev->ids[j] == n->value) {
+                *value = dev->values[j];
+                return 1;
+            }
+        }
+        break;
+    case SIS_COND_EXISTS:
+        if (nodes[n->left].type != SIS_COND_STRING) break;
+        *value = 0;
+        for (j = 0; j < dev->numpaths; j++) {
+            if (!strcasecmp(dev->paths[j], nodes[n->left].str)) *value = 1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* Set installed[j] to 1 for every record of 'pkg' that is installed on
+ * a device, 0 for the records in the branches not taken. The file table
+ * is stored in reverse order, so it is walked backward. Returns 1 when out
+ * of memory. */
+static int condInstalled(struct sispkg *pkg, condLookupProc *lookup, void *privdata, char *installed)
+{
+    char *active, *taken;       /* for every if/endif nesting level */
+    int j, depth = 0, cond;
+
+    if ((active = malloc((pkg->numrecords+1)*2)) == NULL) return 1;
+    taken = active+pkg->numrecords+1;
+    active[0] = 1;
+    for (j = pkg->numrecords-1; j >= 0; j--) {
+        struct sisrecord *r = &pkg->records[j];
+
+        cond = 0;
+        if ((r->type == SIS_FILE_IF || (r->type == SIS_FILE_ELSEIF && depth &&
+            !taken[depth])) && active[r->type == SIS_FILE_IF ? depth : depth-1])
+        {
+            cond = condEval(r->condnodes, r->numcondnodes, lookup, privdata);
+            if (cond == -1) {
+                free(active);
+                return 1;
+            }
+        }
+        switch(r->type) {
+        case SIS_FILE_IF:
+            depth++;
+            active[depth] = taken[depth] = cond;
+            break;
+        case SIS_FILE_ELSEIF:
+            if (depth == 0) break;
+            active[depth] = cond;
+            taken[depth] |= cond;
+            break;
+        case SIS_FILE_ELSE:
+            if (depth == 0) break;
+            active[depth] = active[depth-1] && !taken[depth];
+            taken[depth] = 1;
+            break;
+        case SIS_FILE_ENDIF:
+            if (depth) depth--;
+            break;
+        }
+        installed[j] = active[depth];
+    }
+    free(active);
+    return 0;
+}
+
+/* Load the condition of an if/else if record, rendering it as a string
+ * that is saved in the record. */
+static int conditional(struct sisfile *sf, struct sisrecord *r, char *err, int errlen)
+{
+    unsigned int condlen;
+    size_t size;
+    FILE *out;
+    int retval;
+
+    if (sisRead(sf, &condlen, 4, err, errlen)) return 1;
+    condlen = sis32toh(condlen);
+    if (condParse(sf, r, condlen, err, errlen)) return 1;
+    if ((out = open_memstream(&r->cond, &size)) == NULL) {
+        snprintf(err,errlen,"Out of memory");
+        return 1;
+    }
+    retval = condRender(out, r->condnodes, r->numcondnodes);
+    fclose(out);
+    if (retval) snprintf(err,errlen,"Out of memory");
+    return retval;
+}
+
+static int optionsFile(struct sisfile *sf, struct sisrecord *r, char *err, int errlen)
+{
+    unsigned int numopt, j;
+    unsigned char selected[16];
+    long size;
+
+    if (sisRead(sf, &numopt, 4, err, errlen)) return 1;
+    numopt = sis32toh(numopt);
+    /* Every option takes 8 bytes of the record: don't trust a count that
+     * can't fit in what is left of the input. */
+    if ((size = sisSize(sf)) != -1 &&
+        (size_t)numopt*8 > (size_t)(size > sisTell(sf) ? size-sisTell(sf) : 0))
+    {
+        snprintf(err,errlen,"Invalid number of options %u", numopt);
+        return 1;
+    }
+    for (j = 0; j < numopt; j++) {
+        unsigned int optlen, optoff;
+        char *optstr;
+
+        /* Grown as options are read, one slot always left for NULL. */
+        if ((j & (j+1)) == 0) {
+            size_t slots = (size_t)j*2+2;
+            char **opt = realloc(r->opt, sizeof(char*)*slots);
+
+            if (opt == NULL) {
+                snprintf(err,errlen,"Out of memory");
+                return 1;
+            }
+            r->opt = opt;
+            memset(r->opt+j, 0, sizeof(char*)*(slots-j));
+        }
+        if (sisRead(sf, &optlen, 4, err, errlen)) return 1;
+        if (sisRead(sf, &optoff, 4, err, errlen)) return 1;
+        optlen = sis32toh(optlen);
+        optoff = sis32toh(optoff);
+        if ((optstr = sisReadOffsetAlloc(sf, optlen, optoff, err, errlen)) == NULL) return 1;
+        uni2ascii(optstr,optlen);
+        r->opt[r->numopt++] = optstr;
+    }
+    /* Read the "selected options" section, but discard it */
+    if (sisRead(sf, selected, 16, err, errlen)) return 1;
+    return 0;
+}
+
+static int filesSection(struct sispkg *pkg, char *err, int errlen)
+{
+    struct sisfile *sf = pkg->sf;
+    int j;
+
+    if (sisSeek(sf, pkg->hdr.fileoff, err, errlen)) return 1;
+    pkg->records = calloc(pkg->hdr.files+1, sizeof(struct sisrecord));
+    if (pkg->records == NULL) {
+        snprintf(err,errlen,"Out of memory");
+        return 1;
+    }
+    for (j = 0; j < pkg->hdr.files; j++) {
+        struct sisrecord *r = &pkg->records[j];
+
+        if (sisRead(sf, &r->type, 4, err, errlen)) return 1;
+        r->type = sis32toh(r->type);
+        switch(r->type) {
+        case SIS_FILE_SIMPLE:
+            if (simpleFile(sf, pkg, r, 1, err, errlen)) return 1;
+            break;
+        case SIS_FILE_MULTILANG:
+            if (simpleFile(sf, pkg, r, pkg->hdr.languages, err, errlen)) return 1;
+            break;
+        case SIS_FILE_OPTIONS:
+            if (optionsFile(sf, r, err, errlen)) return 1;
+            break;
+        case SIS_FILE_IF:
+        case SIS_FILE_ELSEIF:
+            if (conditional(sf, r, err, errlen)) return 1;
+            break;
+        case SIS_FILE_ELSE:
+        case SIS_FILE_ENDIF:
+            break;
+        default:
+            snprintf(err, errlen, "Unknown file record type %d", r->type);
+            return 1;
+            break;
+        }
+        pkg->numrecords++;
+    }
+    return 0;
+}
+
+static int loadHeader(struct sispkg *pkg, char *err, int errlen)
+{
+    struct sisfile *sf = pkg->sf;
+    struct sishdr *hdr = &pkg->hdr;
+
+    if (sisRead(sf, hdr, sizeof(*hdr)-EPOC6_HDR_TAIL_LEN, err, errlen))
+        return 1;
+    hdr->uid1 = sis32toh(hdr->uid1);
+    hdr->uid2 = sis32toh(hdr->uid2);
+    hdr->uid3 = sis32toh(hdr->uid3);
+    hdr->uid4 = sis32toh(hdr->uid4);
+    hdr->cksum = sis16toh(hdr->cksum);
+    hdr->languages = sis16toh(hdr->languages);
+    hdr->files = sis16toh(hdr->files);
+    hdr->requisities = sis16toh(hdr->requisities);
+    hdr->instlang = sis16toh(hdr->instlang);
+    hdr->instfiles = sis16toh(hdr->instfiles);
+    hdr->instdrive = sis16toh(hdr->instdrive);
+    hdr->capabilities = sis16toh(hdr->capabilities);
+    hdr->installerver = sis32toh(hdr->installerver);
+    hdr->options = sis16toh(hdr->options);
+    hdr->type = sis16toh(hdr->type);
+    hdr->major = sis16toh(hdr->major);
+    hdr->minor = sis16toh(hdr->minor);
+    hdr->variant = sis32toh(hdr->variant);
+    hdr->langoff = sis32toh(hdr->langoff);
+    hdr->fileoff = sis32toh(hdr->fileoff);
+    hdr->reqoff = sis32toh(hdr->reqoff);
+    hdr->certoff = sis32toh(hdr->certoff);
+    hdr->compnameoff = sis32toh(hdr->compnameoff);
+
+    if (hdr->uid3 != SIS_UID3) {
+        snprintf(err, errlen, "file corrupted or not a SIS file");
+        return 1;
+    }
+    pkg->valid = 1;
+    switch(hdr->uid2) {
+    case SIS_UID2_EPOC5: pkg->epocrelease = 5; break;
+    case SIS_UID2_EPOC6: pkg->epocrelease = 6; break;
+    }
+    /* If it's an EPOC release 6 file read the rest of the header */
+    if (pkg->epocrelease == 6) {
+        unsigned char *tail = ((unsigned char*)hdr)+(sizeof(*hdr)-EPOC6_HDR_TAIL_LEN);
+        if (sisRead(sf, tail, EPOC6_HDR_TAIL_LEN, err, errlen)) return 1;
+        hdr->signoff = sis32toh(hdr->signoff);
+        hdr->capaoff = sis32toh(hdr->capaoff);
+        hdr->instspace = sis32toh(hdr->instspace);
+        hdr->maxinstspace = sis32toh(hdr->maxinstspace);
+    }
+    pkg->nocompr = (hdr->options & SIS_OPT_NOCOMPRESS) != 0;
+    return 0;
+}
+
+/* Load the header, the languages and the file table of the package in
+ * 'sf'. On error what was loaded so far is left in 'pkg', so that the
+ * caller can still show it. In any case sisFree() must be called. */
+static int sisLoad(struct sispkg *pkg, char *filename, struct sisfile *sf, char *err, int errlen)
+{
+    memset(pkg, 0, sizeof(*pkg));
+    pkg->filename = filename;
+    pkg->sf = sf;
+    if (loadHeader(pkg, err, errlen)) return 1;
+    if (loadLanguages(pkg, err, errlen)) return 1;
+    if (filesSection(pkg, err, errlen)) return 1;
+    /* Only the listing and --deps show the requisites: a broken table
+     * should not stop extracting or inspecting the files. */
+    if (requisitesSection(pkg, err, errlen)) {
+        fprintf(stderr, "%s: %s in the requisites, ignored\n", filename, err);
+        reqsFree(pkg);
+    }
+    return 0;
+}
+
+static void sisIndexFree(struct sispkg *pkg);
+
+static void sisFree(struct sispkg *pkg)
+{
+    unsigned int i, j;
+
+    if (pkg->records) {
+        for (j = 0; j < pkg->hdr.files; j++) {
+            struct sisrecord *r = &pkg->records[j];
+
+            free(r->srcname);
+            free(r->dstname);
+            free(r->len);
+            free(r->off);
+            free(r->origlen);
+            for (i = 0; i < r->numopt; i++) free(r->opt[i]);
+            free(r->opt);
+            free(r->cond);
+            for (i = 0; i < (unsigned int)r->numcondnodes; i++)
+                free(r->condnodes[i].str);
+            free(r->condnodes);
+        }
+        free(pkg->records);
+    }
+    reqsFree(pkg);
+    free(pkg->langs);
+    free(pkg->installed);
+    memoFree(pkg);
+    sisIndexFree(pkg);
+}
+
+static char *recordName(struct sisrecord *r) {
+    return r->dstname[0] ? r->dstname : r->srcname;
+}
+
+static int payloadStored(struct sispkg *pkg, struct sisrecord *r, int slot) {
+    return r->origlen == NULL || r->origlen[slot] == 0 || pkg->nocompr;
+}
+
+static unsigned int payloadSize(struct sispkg *pkg, struct sisrecord *r, int slot) {
+    return payloadStored(pkg,r,slot) ? r->len[slot] : r->origlen[slot];
+}
+
+static char *pkgTypeStr(unsigned int type) {
+    switch(type) {
+    case SIS_TYPE_SA: return "application";
+    case SIS_TYPE_SY: return "shared/system component/library";
+    case SIS_TYPE_SO: return "optional component";
+    case SIS_TYPE_SC: return "configuration";
+    case SIS_TYPE_SP: return "patch";
+    case SIS_TYPE_SU: return "upgrade";
+    default: return "unknown";
+    }
+}
+
+static void showHeader(struct sispkg *pkg)
+{
+    struct sishdr *hdr = &pkg->hdr;
+
+    printf("%s: SIS header detected\n", pkg->filename);
+    printf("  application UID: 0x%04X\n", hdr->uid1);
+    verbose("  UID2: %04X", hdr->uid2);
+    if (pkg->epocrelease == 5) verbose(" (EPOC release 3,4,5)");
+    if (pkg->epocrelease == 6) verbose(" (EPOC release 6)");
+    verbose("\n");
+    verbose("  installer version required: %d\n", hdr->installerver);
+    verbose("  number of languages in this SIS: %d\n", hdr->languages);
+    verbose("  number of files in this SIS: %d\n", hdr->files);
+    verbose("  options:");
+    if (hdr->options & SIS_OPT_UNICODE) verbose(" unicode");
+    if (hdr->options & SIS_OPT_DISTRIBUTABLE) verbose(" distributable");
+    if (hdr->options & SIS_OPT_NOCOMPRESS) verbose(" nocompress");
+    if (hdr->options & SIS_OPT_SHUTDOWNAPPS) verbose(" shutdownapps");
+    if (hdr->options == 0) verbose("none");
+    verbose("\n");
+    verbose("  package type: %s", pkgTypeStr(hdr->type));
+    if (!strcmp(pkgTypeStr(hdr->type),"unknown")) verbose(" (%d)", hdr->type);
+    verbose("\n");
+    printf("  application version: %d.%02d\n", hdr->major, hdr->minor);
+    verbose("  variant: %d\n", hdr->variant);
+    verbose("  languages section is at: %d\n", hdr->langoff);
+    verbose("  files section is at    : %d\n", hdr->fileoff);
+
+    /* Show epoc6 additional header info */
+    if (pkg->epocrelease == 6) {
+        verbose("  installed space (last installation): %d\n", hdr->instspace);
+        verbose("  max installed space: %d\n", hdr->maxinstspace);
+    }
+}
+
+static void showLanguages(struct sispkg *pkg)
+{
+    int j;
+
+    printf("\nLanguages\n  ");
+    for (j = 0; j < pkg->hdr.languages; j++) {
+        unsigned short lang = pkg->langs[j];
+
+        if (lang < sizeof(sisLangTab)/sizeof(char*)) {
+            printf("%s ", sisLangTab[lang]);
+        } else {
+            printf("Unknown language code %d ", lang);
+        }
+    }
+    printf("\n");
+}
+
+static void showRequisites(struct sispkg *pkg)
+{
+    int j;
+
+    if (pkg->numreqs == 0) return;
+    printf("\nRequisites\n");
+    for (j = 0; j < pkg->numreqs; j++) {
+        struct sisreq *q = &pkg->reqs[j];
+
+        printf("  0x%08X %d.%02d %s", q->uid, q->major, q->minor,
+            pkg->hdr.languages ? q->names[0] : "");
+        if (q->variant) printf(" (variant %u)", q->variant);
+        printf("\n");
+    }
+}
+
+static void showFile(struct sispkg *pkg, int filenum)
+{
+    struct sisrecord *r = &pkg->records[filenum];
+    int i;
+
+    verbose("    file type: %s\n", fileTypeStr(r->file.type));
+    verbose("    file details: %d\n", r->file.details);
+    verbose("    source file name: %s\n", r->srcname);
+    verbose("    destination file name: %s\n", r->dstname);
+    verbose("    this file is available in %d language(s)\n", r->numlangs);
+    for (i = 0; i < r->numlangs; i++)
+        verbose("      len[%d]: %d bytes\n", i+1, r->len[i]);
+    for (i = 0; i < r->numlangs; i++)
+        verbose("      file language %d is at offset %d\n", i+1, r->off[i]);
+    for (i = 0; r->origlen && i < r->numlangs; i++)
+        verbose("      original len[%d]: %d bytes\n", i+1, r->origlen[i]);
+    if (pkg->installed && !pkg->installed[filenum])
+        verbose("    not installed on the device\n");
+
+    /* Show file info in non verbose mode */
+    if (!optVerbose) {
+        char c=' ';
+        switch(r->file.type) {
+            case SIS_FILETYPE_STANDARD:
+                if (r->numlangs == 1)
+                    c='f';
+                else
+                    c='m';
+                break;
+            case SIS_FILETYPE_TEXT: c='t'; break;
+            case SIS_FILETYPE_COMPONENT: c='c'; break;
+            case SIS_FILETYPE_RUN: c='r'; break;
+            case SIS_FILETYPE_NOTEXISTS: c='x'; break;
+            case SIS_FILETYPE_OPEN: c='o'; break;
+        }
+        showPrefix(pkg);
+        printf("%03d %c %-63s", filenum,c,recordName(r));
+        if (r->origlen) printf(" %10d", r->origlen[0]);
+        if (pkg->installed && !pkg->installed[filenum])
+            printf(" (not installed)");
+        printf("\n");
+    }
+}
+
+static void showRecord(struct sispkg *pkg, int filenum)
+{
+    struct sisrecord *r = &pkg->records[filenum];
+    unsigned int j;
+
+    if (optVerbose) showPrefix(pkg);
+    verbose("  FILE %d type %s\n",filenum+1,fileRecordTypeStr(r->type));
+    if (!optVerbose && r->type != SIS_FILE_SIMPLE &&
+        r->type != SIS_FILE_MULTILANG && r->type != SIS_FILE_OPTIONS)
+        showPrefix(pkg);
+    switch(r->type) {
+    case SIS_FILE_SIMPLE:
+    case SIS_FILE_MULTILANG:
+        showFile(pkg, filenum);
+        break;
+    case SIS_FILE_OPTIONS:
+        for (j = 0; j < r->numopt; j++) {
+            showPrefix(pkg);
+            printf("  option %d: %s\n", r->numopt-j, r->opt[j]);
+        }
+        break;
+    case SIS_FILE_IF: printf("[if (%s)]\n", r->cond); break;
+    case SIS_FILE_ELSEIF: printf("[else if (%s)]\n", r->cond); break;
+    case SIS_FILE_ELSE: printf("[else]\n"); break;
+    case SIS_FILE_ENDIF: printf("[endif]\n"); break;
+    }
+}
+
+/* Extract (or just hash, if 'write' is false) the payloads of the file
+ * record 'filenum'. */
+static int extractRecord(struct sispkg *pkg, int filenum, int write, char *err, int errlen)
+{
+    struct sisrecord *r = &pkg->records[filenum];
+    int i;
+
+    if (r->file.type == SIS_FILETYPE_NOTEXISTS) return 0;
+    for (i = 0; i < r->numlangs; i++) {
+        if (write) {
+            showPrefix(pkg);
+            printf("Extracting %s (%d bytes compressed, offset %d)\n",
+                sisBasename(recordName(r)), r->len[i], r->off[i]);
+        }
+        if (extractFile(pkg, filenum, r->numlangs == 1 ? -1 : i,
+            r->len[i], r->origlen ? r->origlen[i] : 0,
+            r->off[i], recordName(r), write, err, errlen))
+            return 1;
+    }
+    return 0;
+}
+
+static int memChunk(void *privdata, unsigned char *buf, size_t len, char *err, int errlen)
+{
+    struct sisfile *sf = privdata;
+
+    if (sf->pos+(long)len > sf->len) {
+        snprintf(err, errlen, "uncompressed file length does not match!");
+        return 1;
+    }
+    memcpy(sf->buf+sf->pos, buf, len);
+    sf->pos += len;
+    return 0;
+}
+
+/* Uncompress the payload in 'slot' of the record 'r' into memory, setting
+ * up 'sf' to read from it. The buffer must be freed by the caller. */
+static int payloadLoad(struct sispkg *pkg, struct sisrecord *r, int slot, struct sisfile *sf, char *err, int errlen)
+{
+    long len = payloadSize(pkg, r, slot);
+
+    if (payloadCheck(pkg, r->len[slot], r->origlen ? r->origlen[slot] : 0,
+        r->off[slot], err, errlen)) return 1;
+    if ((sf->buf = malloc(len ? len : 1)) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        return 1;
+    }
+    sisMemInit(sf, sf->buf, len);
+    if (sisPayload(pkg, r->len[slot], r->origlen ? r->origlen[slot] : 0,
+        r->off[slot], NULL, memChunk, sf, err, errlen))
+    {
+        free(sf->buf);
+        return 1;
+    }
+    sf->pos = 0;
+    return 0;
+}
+
+/* -------------------------------- Signatures --------------------------------
+ * Packages may carry a certificate chain (at hdr.certoff) and, in EPOC
+ * release 6, a signature (at hdr.signoff). The layout parsed is:
+ *
+ *   certificates: 6 x 16 bit time stamp (year, month, day, hour, minute,
+ *                 second), 32 bit number of certificates, then for every
+ *                 certificate a 32 bit length and the DER X.509 data,
+ *                 the signer first, every one issued by the next.
+ *   signature:    32 bit length and the signature of all the bytes of the
+ *                 package before it. There is no algorithm field: it
+ *                 follows from the key of the signer.
+ *
+ * EPOC signing tools hash the package with SHA-1 and sign it with an RSA
+ * or a DSA key. RSA signatures (PKCS#1 v1.5) are verified, for the package
+ * and for the certificates of the chain (SHA-1 or SHA-256), DSA ones are
+ * reported as unsupported. Hashing the package costs as much as reading
+ * it, so it is only done when a trust store is given with --trust: plain
+ * listings just show the certificates. The digest is then taken in one
+ * sequential pass, in SIS_CHUNK_LEN reads, without uncompressing any
+ * payload. A chain is trusted when its last certificate is in the trust
+ * store, or was issued by one that is there. Validity dates are shown but
+ * not enforced: old packages are signed by certificates that expired long
+ * ago. */
+
+#define SIS_SIG_MAXCERTS 16
+#define SIS_SIG_MAXCERTLEN 65536
+
+#define SIS_SIG_UNSIGNED 0
+#define SIS_SIG_VERIFIED 1      /* good signature and trusted chain */
+#define SIS_SIG_UNTRUSTED 2     /* good signature, chain not trusted */
+#define SIS_SIG_BAD 3           /* the signature doesn't match */
+#define SIS_SIG_BADCHAIN 4      /* a certificate was not signed by the next */
+#define SIS_SIG_UNSUPPORTED 5   /* unknown algorithm or key */
+#define SIS_SIG_CORRUPTED 6     /* the sections can't be parsed */
+#define SIS_SIG_UNCHECKED 7     /* no trust store, the signature wasn't checked */
+
+static char *sigStatusTab[] = {"unsigned", "verified", "untrusted",
+    "bad signature", "bad certificate chain", "unsupported algorithm",
+    "corrupted", "not checked"};
+
+/* Signature algorithms of certificates. */
+#define SIS_SIGALG_OTHER 0
+#define SIS_SIGALG_SHA1RSA 1
+#define SIS_SIGALG_SHA256RSA 2
+
+/* A parsed X.509 certificate: every pointer is inside 'der'. */
+struct sigcert {
+    unsigned char *der;
+    size_t derlen;
+    const unsigned char *tbs, *issuer, *subject;    /* whole DER elements */
+    size_t tbslen, issuerlen, subjectlen;
+    const unsigned char *n, *e;                     /* RSA public key */
+    size_t nlen, elen;
+    int sigalg;             /* SIS_SIGALG_* */
+    const unsigned char *sig;
+    size_t siglen;
+    char cn[128];           /* common name of the subject */
+    char notbefore[32], notafter[32];
+};
+
+struct sissig {
+    int status;             /* SIS_SIG_* */
+    char error[SISOPEN_ERRLEN];     /* what was wrong, if not verified */
+    unsigned short stamp[6];
+    int numcerts;
+    struct sigcert certs[SIS_SIG_MAXCERTS];
+};
+
+static struct sigcert *trustStore;  /* --trust certificates */
+static int trustCount;
+
+static const unsigned char oidRsaEncryption[] =
+    {0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01};
+static const unsigned char oidSha1Rsa[] =
+    {0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x05};
+static const unsigned char oidSha256Rsa[] =
+    {0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x0b};
+static const unsigned char oidCommonName[] = {0x55, 0x04, 0x03};
+
+/* A DER element: 'p' and 'len' are the content, 'raw' and 'rawlen' the
+ * whole element, tag and length included. */
+struct derItem {
+    unsigned char tag;
+    const unsigned char *p, *raw;
+    size_t len, rawlen;
+};
+
+/* Read the element at '*pp', moving '*pp' past it. Returns 0 on success,
+ * 1 if it is malformed or doesn't end before 'end'. */
+static int derNext(const unsigned char **pp, const unsigned char *end, struct derItem *it)
+{
+    const unsigned char *p = *pp;
+    size_t len, j, n;
+
+    if (end-p < 2) return 1;
+    it->raw = p;
+    it->tag = *p++;
+    len = *p++;
+    if (len & 0x80) {
+        n = len & 0x7f;
+        if (n == 0 || n > 4 || (size_t)(end-p) < n) return 1;
+        for (len = 0, j = 0; j < n; j++) len = (len << 8) | *p++;
+    }
+    if ((size_t)(end-p) < len) return 1;
+    it->p = p;
+    it->len = len;
+    it->rawlen = (p-it->raw)+len;
+    *pp = p+len;
+    return 0;
+}
+
+/* Like derNext(), also checking the tag. */
+static int derExpect(const unsigned char **pp, const unsigned char *end, unsigned char tag, struct derItem *it)
+{
+    return derNext(pp, end, it) || it->tag != tag;
+}
+
+/* Copy the common name from the Name 'name', if any. */
+static void x509CommonName(struct derItem *name, char *cn, size_t cnlen)
+{
+    const unsigned char *p = name->p, *end = name->p+name->len, *q, *qend;
+    struct derItem set, atv, oid, val;
+
+    cn[0] = '\0';
+    while (p < end && derExpect(&p, end, 0x31, &set) == 0) {
+        q = set.p;
+        qend = set.p+set.len;
+        while (q < qend && derExpect(&q, qend, 0x30, &atv) == 0) {
+            const unsigned char *a = atv.p, *aend = atv.p+atv.len;
+
+            if (derExpect(&a, aend, 0x06, &oid) || derNext(&a, aend, &val))
+                continue;
+            if (oid.len == sizeof(oidCommonName) &&
+                !memcmp(oid.p, oidCommonName, oid.len))
+            {
+                snprintf(cn, cnlen, "%.*s", (int)val.len, (char*)val.p);
+            }
+        }
+    }
+}
+
+/* Format a validity time as YYYY-MM-DD. UTCTime has a two digits year
+ * (50-99 are 19xx), GeneralizedTime has four. Anything else is shown as
+ * it is. */
+static void x509Time(struct derItem *t, char *buf, size_t buflen)
+{
+    const char *p = (const char*)t->p;
+    int century;
+
+    if (t->tag == 0x17 && t->len >= 12) {
+        century = p[0] >= '5' ? 19 : 20;
+    } else if (t->tag == 0x18 && t->len >= 14) {
+        century = -1;
+    } else {
+        snprintf(buf, buflen, "%.*s", (int)t->len, p);
+        return;
+    }
+    if (century != -1) {
+        snprintf(buf, buflen, "%d%.2s-%.2s-%.2s", century, p, p+2, p+4);
+    } else {
+        snprintf(buf, buflen, "%.4s-%.2s-%.2s", p, p+4, p+6);
+    }
+}
+
+/* Parse the certificate in 'c->der'. Returns 0 on success. */
+static int x509Parse(struct sigcert *c)
+{
+    const unsigned char *p = c->der, *end = c->der+c->derlen, *q, *qend;
+    struct derItem cert, tbs, it, alg, key, oid, rsa, n, e;
+
+    if (derExpect(&p, end, 0x30, &cert)) return 1;
+    p = cert.p;
+    end = cert.p+cert.len;
+    if (derExpect(&p, end, 0x30, &tbs)) return 1;
+    c->tbs = tbs.raw;
+    c->tbslen = tbs.rawlen;
+    /* signatureAlgorithm, then signatureValue (a BIT STRING). */
+    if (derExpect(&p, end, 0x30, &alg)) return 1;
+    q = alg.p;
+    c->sigalg = SIS_SIGALG_OTHER;
+    if (derExpect(&q, alg.p+alg.len, 0x06, &oid) == 0) {
+        if (oid.len == sizeof(oidSha1Rsa) && !memcmp(oid.p, oidSha1Rsa, oid.len))
+            c->sigalg = SIS_SIGALG_SHA1RSA;
+        else if (oid.len == sizeof(oidSha256Rsa) &&
+                 !memcmp(oid.p, oidSha256Rsa, oid.len))
+            c->sigalg = SIS_SIGALG_SHA256RSA;
+    }
+    if (derExpect(&p, end, 0x03, &it) || it.len < 1 || it.p[0] != 0) return 1;
+    c->sig = it.p+1;
+    c->siglen = it.len-1;
+
+    /* TBSCertificate: [0] version, serial, signature, issuer, validity,
+     * subject, subjectPublicKeyInfo, ... */
+    p = tbs.p;
+    end = tbs.p+tbs.len;
+    if (derNext(&p, end, &it)) return 1;
+    if (it.tag == 0xa0 && derNext(&p, end, &it)) return 1;
+    if (it.tag != 0x02) return 1;
+    if (derExpect(&p, end, 0x30, &it)) return 1;
+    if (derExpect(&p, end, 0x30, &it)) return 1;
+    c->issuer = it.raw;
+    c->issuerlen = it.rawlen;
+    if (derExpect(&p, end, 0x30, &it)) return 1;
+    q = it.p;
+    qend = it.p+it.len;
+    if (derNext(&q, qend, &alg)) return 1;
+    x509Time(&alg, c->notbefore, sizeof(c->notbefore));
+    if (derNext(&q, qend, &alg)) return 1;
+    x509Time(&alg, c->notafter, sizeof(c->notafter));
+    if (derExpect(&p, end, 0x30, &it)) return 1;
+    c->subject = it.raw;
+    c->subjectlen = it.rawlen;
+    x509CommonName(&it, c->cn, sizeof(c->cn));
+
+    /* The public key: only RSA keys are kept. */
+    c->n = c->e = NULL;
+    c->nlen = c->elen = 0;
+    if (derExpect(&p, end, 0x30, &key)) return 1;
+    q = key.p;
+    qend = key.p+key.len;
+    if (derExpect(&q, qend, 0x30, &alg)) return 1;
+    p = alg.p;
+    if (derExpect(&p, alg.p+alg.len, 0x06, &oid)) return 1;
+    if (oid.len != sizeof(oidRsaEncryption) ||
+        memcmp(oid.p, oidRsaEncryption, oid.len)) return 0;
+    if (derExpect(&q, qend, 0x03, &it) || it.len < 1 || it.p[0] != 0) return 1;
+    p = it.p+1;
+    if (derExpect(&p, it.p+it.len, 0x30, &rsa)) return 1;
+    p = rsa.p;
+    if (derExpect(&p, rsa.p+rsa.len, 0x02, &n) ||
+        derExpect(&p, rsa.p+rsa.len, 0x02, &e)) return 1;
+    c->n = n.p;
+    c->nlen = n.len;
+    c->e = e.p;
+    c->elen = e.len;
+    return 0;
+}
+
+/* Check that 'c' was signed by the key of 'issuer'. */
+static int x509Signed(struct sigcert *c, struct sigcert *issuer)
+{
+    unsigned char digest[SHA256_DIGEST_LEN];
+    int hash;
+
+    if (c->sigalg == SIS_SIGALG_OTHER || issuer->n == NULL)
+        return SIS_SIG_UNSUPPORTED;
+    if (c->issuerlen != issuer->subjectlen ||
+        memcmp(c->issuer, issuer->subject, c->issuerlen))
+        return SIS_SIG_BADCHAIN;
+    if (c->sigalg == SIS_SIGALG_SHA1RSA) {
+        SHA1_CTX ctx;
+
+        SHA1Init(&ctx);
+        SHA1Update(&ctx, c->tbs, c->tbslen);
+        SHA1Final(&ctx, digest);
+        hash = RSA_HASH_SHA1;
+    } else {
+        SHA256_CTX ctx;
+
+        SHA256Init(&ctx);
+        SHA256Update(&ctx, c->tbs, c->tbslen);
+        SHA256Final(&ctx, digest);
+        hash = RSA_HASH_SHA256;
+    }
+    switch(rsaVerify(issuer->n, issuer->nlen, issuer->e, issuer->elen,
+        c->sig, c->siglen, hash, digest))
+    {
+    case RSA_OK: return SIS_SIG_VERIFIED;
+    case RSA_ERR_KEY: return SIS_SIG_UNSUPPORTED;
+    default: return SIS_SIG_BADCHAIN;
+    }
+}
+
+static int base64Value(int c)
+{
+    if (c >= 'A' && c <= 'Z') return c-'A';
+    if (c >= 'a' && c <= 'z') return c-'a'+26;
+    if (c >= '0' && c <= '9') return c-'0'+52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+/* Decode base64 text in place, skipping whitespace. Returns the length. */
+static size_t base64Decode(unsigned char *p, size_t len)
+{
+    unsigned int acc = 0;
+    size_t j, n = 0;
+    int bits = 0, v;
+
+    for (j = 0; j < len; j++) {
+        if ((v = base64Value(p[j])) == -1) continue;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            p[n++] = (acc >> bits) & 0xff;
+        }
+    }
+    return n;
+}
+
+static int trustAdd(unsigned char *der, size_t len, char *filename, char *err, int errlen)
+{
+    struct sigcert *store, *c;
+
+    if ((store = realloc(trustStore, sizeof(*store)*(trustCount+1))) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        return 1;
+    }
+    trustStore = store;
+    c = &trustStore[trustCount];
+    memset(c, 0, sizeof(*c));
+    if ((c->der = malloc(len ? len : 1)) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        return 1;
+    }
+    memcpy(c->der, der, len);
+    c->derlen = len;
+    if (x509Parse(c)) {
+        snprintf(err, errlen, "%s: certificate %d is not valid X.509",
+            filename, trustCount+1);
+        free(c->der);
+        return 1;
+    }
+    trustCount++;
+    return 0;
+}
+
+/* Add the certificates of 'filename' to the trust store: PEM (one or more
+ * certificates) or DER. */
+static int trustLoad(char *filename, char *err, int errlen)
+{
+    static char *begin = "-----BEGIN CERTIFICATE-----";
+    static char *end = "-----END CERTIFICATE-----";
+    char *p, *q;
+    unsigned char *buf = NULL;
+    long len;
+    size_t n;
+    FILE *fp;
+    int retval = 1, found = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL ||
+        fseek(fp, 0, SEEK_END) == -1 || (len = ftell(fp)) == -1 ||
+        fseek(fp, 0, SEEK_SET) == -1 ||
+        (buf = malloc(len+1)) == NULL ||
+        fread(buf, 1, len, fp) != (size_t)len)
+    {
+        snprintf(err, errlen, "%s reading %s", strerror(errno), filename);
+        goto cleanup;
+    }
+    buf[len] = '\0';
+    for (p = (char*)buf; (p = strstr(p, begin)) != NULL; p = q+strlen(end)) {
+        p += strlen(begin);
+        if ((q = strstr(p, end)) == NULL) break;
+        n = base64Decode((unsigned char*)p, q-p);
+        if (trustAdd((unsigned char*)p, n, filename, err, errlen)) goto cleanup;
+        found++;
+    }
+    if (!found && trustAdd(buf, len, filename, err, errlen)) goto cleanup;
+    retval = 0;
+
+cleanup:
+    if (fp) fclose(fp);
+    free(buf);
+    return retval;
+}
+
+/* SHA-1 of the first 'len' bytes of the package, in one sequential pass. */
+static int sigDigest(struct sisfile *sf, long len, unsigned char *digest, char *err, int errlen)
+{
+    unsigned char *buf = NULL, *p;
+    SHA1_CTX ctx;
+    long off, n;
+
+    if (sf->fp && (buf = malloc(SIS_CHUNK_LEN)) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        return 1;
+    }
+    /* The whole package is read: this is bulk I/O even if it happens
+     * while loading the file table, so that --trust can't starve the
+     * metadata budget of the other packages. */
+    SHA1Init(&ctx);
+    for (off = 0; off < len; off += n) {
+        n = len-off < SIS_CHUNK_LEN ? len-off : SIS_CHUNK_LEN;
+        if ((p = sisChunk(sf, buf, n, off, SIS_IO_BULK, err, errlen)) == NULL) {
+            free(buf);
+            return 1;
+        }
+        SHA1Update(&ctx, p, n);
+    }
+    SHA1Final(&ctx, digest);
+    free(buf);
+    return 0;
+}
+
+static void sigFree(struct sissig *sig)
+{
+    int j;
+
+    for (j = 0; j < sig->numcerts; j++) free(sig->certs[j].der);
+    sig->numcerts = 0;
+}
+
+/* Is the last certificate of the chain in the trust store, or issued by
+ * one that is? */
+static int sigTrusted(struct sigcert *last)
+{
+    int j;
+
+    for (j = 0; j < trustCount; j++) {
+        struct sigcert *t = &trustStore[j];
+
+        if (t->derlen == last->derlen && !memcmp(t->der, last->der, t->derlen))
+            return 1;
+        if (x509Signed(last, t) == SIS_SIG_VERIFIED) return 1;
+    }
+    return 0;
+}
+
+#define SIG_FAIL(st, ...) do { \
+    sig->status = (st); \
+    snprintf(sig->error, sizeof(sig->error), __VA_ARGS__); \
+    return; \
+} while(0)
+
+/* Parse the certificates and the signature of 'pkg', checking them when a
+ * trust store was given. The result is in 'sig', that must be released
+ * with sigFree(). */
+static void sisSignature(struct sispkg *pkg, struct sissig *sig)
+{
+    struct sishdr *hdr = &pkg->hdr;
+    struct sisfile *sf = pkg->sf;
+    unsigned char digest[SHA1_DIGEST_LEN], *buf;
+    unsigned int count, siglen, len, j;
+    unsigned long long off, size;
+    char err[SISOPEN_ERRLEN];
+    long filesize;
+    int st;
+
+    memset(sig, 0, sizeof(*sig));
+    if (hdr->certoff == 0 && (pkg->epocrelease != 6 || hdr->signoff == 0))
+        return;
+    if (hdr->certoff == 0 || pkg->epocrelease != 6 || hdr->signoff == 0)
+        SIG_FAIL(SIS_SIG_CORRUPTED, "certificates without a signature, or the opposite");
+    /* Every length is checked against the size of the package before
+     * reading: the sums can't overflow 64 bits. */
+    filesize = sisSize(sf);
+    size = filesize == -1 ? ULLONG_MAX : (unsigned long long)filesize;
+
+    /* Certificate chain. */
+    off = hdr->certoff;
+    if (off+16 > size)
+        SIG_FAIL(SIS_SIG_CORRUPTED, "certificates past the end of the file");
+    if (sisReadOffset(sf, sig->stamp, 12, off, err, sizeof(err)) ||
+        sisReadOffset(sf, &count, 4, off+12, err, sizeof(err)))
+        SIG_FAIL(SIS_SIG_CORRUPTED, "%s", err);
+    for (j = 0; j < 6; j++) sig->stamp[j] = sis16toh(sig->stamp[j]);
+    count = sis32toh(count);
+    if (count == 0 || count > SIS_SIG_MAXCERTS)
+        SIG_FAIL(SIS_SIG_CORRUPTED, "bad number of certificates (%u)", count);
+    off += 16;
+    for (j = 0; j < count; j++) {
+        struct sigcert *c = &sig->certs[j];
+
+        if (off+4 > size ||
+            sisReadOffset(sf, &len, 4, off, err, sizeof(err)) ||
+            (len = sis32toh(len)) == 0 || len > SIS_SIG_MAXCERTLEN ||
+            off+4+len > size)
+            SIG_FAIL(SIS_SIG_CORRUPTED, "bad length of certificate %u", j+1);
+        if ((buf = (unsigned char*)sisReadOffsetAlloc(sf, len, off+4, err, sizeof(err))) == NULL)
+            SIG_FAIL(SIS_SIG_CORRUPTED, "%s", err);
+        c->der = buf;
+        c->derlen = len;
+        sig->numcerts++;
+        if (x509Parse(c))
+            SIG_FAIL(SIS_SIG_CORRUPTED, "certificate %u is not valid X.509", j+1);
+        off += 4+len;
+    }
+
+    /* Signature record. */
+    off = hdr->signoff;
+    if (off+4 > size ||
+        sisReadOffset(sf, &siglen, 4, off, err, sizeof(err)) ||
+        (siglen = sis32toh(siglen)) == 0 || siglen > RSA_MAX_BITS/8 ||
+        off+4+siglen > size)
+        SIG_FAIL(SIS_SIG_CORRUPTED, "bad signature length");
+    if (sig->certs[0].n == NULL)
+        SIG_FAIL(SIS_SIG_UNSUPPORTED, "the signer key is not RSA");
+    if (trustCount == 0) SIG_FAIL(SIS_SIG_UNCHECKED, "no trust store given");
+
+    /* The signature of the digest of what precedes it. */
+    if ((buf = (unsigned char*)sisReadOffsetAlloc(sf, siglen, off+4, err, sizeof(err))) == NULL)
+        SIG_FAIL(SIS_SIG_CORRUPTED, "%s", err);
+    if (sigDigest(sf, hdr->signoff, digest, err, sizeof(err))) {
+        free(buf);
+        SIG_FAIL(SIS_SIG_CORRUPTED, "%s", err);
+    }
+    st = rsaVerify(sig->certs[0].n, sig->certs[0].nlen, sig->certs[0].e,
+        sig->certs[0].elen, buf, siglen, RSA_HASH_SHA1, digest);
+    free(buf);
+    if (st == RSA_ERR_KEY) SIG_FAIL(SIS_SIG_UNSUPPORTED, "unsupported signer key");
+    if (st != RSA_OK) SIG_FAIL(SIS_SIG_BAD, "the package was modified after signing");
+
+    for (j = 0; j+1 < (unsigned int)sig->numcerts; j++) {
+        if ((st = x509Signed(&sig->certs[j], &sig->certs[j+1])) != SIS_SIG_VERIFIED)
+            SIG_FAIL(st, "certificate %u was not issued by certificate %u", j+1, j+2);
+    }
+    if (!sigTrusted(&sig->certs[sig->numcerts-1]))
+        SIG_FAIL(SIS_SIG_UNTRUSTED, "no trusted certificate in the chain");
+    sig->status = SIS_SIG_VERIFIED;
+}
+
+#undef SIG_FAIL
+
+/* Show the signature section of a listing. Returns the status. */
+static int showSignature(struct sispkg *pkg)
+{
+    struct sissig sig;
+    int j;
+
+    sisSignature(pkg, &sig);
+    if (sig.status == SIS_SIG_UNSIGNED) return sig.status;
+    printf("\nSignature\n");
+    if (sig.numcerts)
+        printf("  signed on %04d-%02d-%02d %02d:%02d:%02d\n", sig.stamp[0],
+            sig.stamp[1], sig.stamp[2], sig.stamp[3], sig.stamp[4], sig.stamp[5]);
+    for (j = 0; j < sig.numcerts; j++) {
+        struct sigcert *c = &sig.certs[j];
+
+        printf("  certificate %d: %s (valid %s to %s)\n", j+1,
+            c->cn[0] ? c->cn : "(no common name)", c->notbefore, c->notafter);
+        if (optVerbose) {
+            unsigned char digest[SHA256_DIGEST_LEN];
+            char hex[SHA256_DIGEST_LEN*2+1];
+            SHA256_CTX ctx;
+
+            SHA256Init(&ctx);
+            SHA256Update(&ctx, c->der, c->derlen);
+            SHA256Final(&ctx, digest);
+            SHA256Hex(digest, hex);
+            printf("    sha256: %s\n", hex);
+        }
+    }
+    printf("  status: %s", sigStatusTab[sig.status]);
+    if (sig.error[0]) printf(" (%s)", sig.error);
+    printf("\n");
+    sigFree(&sig);
+    return sig.status;
+}
+
+/* ------------------------------ Random access ------------------------------
+ * Services asking for single files of a package (an icon, a resource) open
+ * it once and fetch what they need: sisIndex() builds a table of every
+ * payload (one entry for every language slot of every file record) and a
+ * hash of their names, so that a file is found by name or by file index
+ * without walking the file table, and only its payload is read. */
+
+struct sisentry {
+    int filenum;                /* file record */
+    int slot;                   /* language slot in the record */
+    int lang;                   /* language code, -1 for single payloads */
+    unsigned int off, len, origlen;
+    unsigned int size;          /* uncompressed length */
+    char *name;                 /* destination (or source) name */
+};
+
+struct sisindex {
+    struct sisentry *entries;   /* in file table order */
+    int numentries;
+    int *first;                 /* first entry of every file record, or -1 */
+    int *table;                 /* open addressing hash of names -> entry */
+    unsigned int mask;          /* slots of 'table' minus one */
+};
+
+/* Case insensitive hash of a name: Symbian paths don't care about case. */
+static unsigned int indexHash(char *name)
+{
+    unsigned int h = 2166136261U;
+
+    for (; *name; name++) h = (h ^ tolower((unsigned char)*name)) * 16777619U;
+    return h;
+}
+
+/* Add the key 'name' pointing to the entry 'e' to the hash table. */
+static void indexAdd(struct sisindex *idx, char *name, int e)
+{
+    unsigned int i = indexHash(name) & idx->mask;
+
+    if (name[0] == '\0') return;
+    while (idx->table[i] != -1) i = (i+1) & idx->mask;
+    idx->table[i] = e;
+}
+
+/* Build the index of the package, if not already done. Every payload can
+ * be found by its destination name, its source name or the last component
+ * of the destination name. Returns the index, or NULL if out of memory. */
+static struct sisindex *sisIndex(struct sispkg *pkg)
+{
+    struct sisindex *idx;
+    unsigned int slots = 8;
+    int i, j, n = 0;
+
+    if (pkg->index) return pkg->index;
+    for (j = 0; j < pkg->numrecords; j++) {
+        struct sisrecord *r = &pkg->records[j];
+
+        if (r->type == SIS_FILE_SIMPLE || r->type == SIS_FILE_MULTILANG)
+            n += r->numlangs;
+    }
+    while (slots < (unsigned int)n*6) slots *= 2; /* 3 keys, load <= 0.5 */
+    if ((idx = calloc(1, sizeof(*idx))) == NULL ||
+        (idx->entries = malloc(sizeof(struct sisentry)*(n ? n : 1))) == NULL ||
+        (idx->first = malloc(sizeof(int)*(pkg->numrecords+1))) == NULL ||
+        (idx->table = malloc(sizeof(int)*slots)) == NULL)
+    {
+        if (idx) {
+            free(idx->entries);
+            free(idx->first);
+            free(idx);
+        }
+        return NULL;
+    }
+    idx->mask = slots-1;
+    memset(idx->table, 0xff, sizeof(int)*slots);
+    for (j = 0; j < pkg->numrecords; j++) {
+        struct sisrecord *r = &pkg->records[j];
+
+        idx->first[j] = -1;
+        if (r->type != SIS_FILE_SIMPLE && r->type != SIS_FILE_MULTILANG)
+            continue;
+        idx->first[j] = idx->numentries;
+        for (i = 0; i < r->numlangs; i++) {
+            struct sisentry *e = &idx->entries[idx->numentries];
+
+            e->filenum = j;
+            e->slot = i;
+            e->lang = r->numlangs == 1 ? -1 : pkg->langs[i];
+            e->off = r->off[i];
+            e->len = r->len[i];
+            e->origlen = r->origlen ? r->origlen[i] : 0;
+            e->size = payloadSize(pkg, r, i);
+            e->name = recordName(r);
+            /* Slots are added in order: the first language is found
+             * first when no language is requested. */
+            indexAdd(idx, r->dstname, idx->numentries);
+            if (strcasecmp(r->srcname, r->dstname))
+                indexAdd(idx, r->srcname, idx->numentries);
+            if (sisBasename(r->dstname) != r->dstname)
+                indexAdd(idx, sisBasename(r->dstname), idx->numentries);
+            idx->numentries++;
+        }
+    }
+    pkg->index = idx;
+    return idx;
+}
+
+static void sisIndexFree(struct sispkg *pkg)
+{
+    if (pkg->index == NULL) return;
+    free(pkg->index->entries);
+    free(pkg->index->first);
+    free(pkg->index->table);
+    free(pkg->index);
+    pkg->index = NULL;
+}
+
+/* Return the payload of the file called 'name' (destination name, source
+ * name or destination base name, in any case) in the language 'lang', or
+ * in the first language if 'lang' is -1. NULL if there is no such file. */
+static struct sisentry *sisLookupName(struct sispkg *pkg, char *name, int lang)
+{
+    struct sisindex *idx = sisIndex(pkg);
+    struct sisentry *found = NULL;
+    unsigned int i;
+
+    if (idx == NULL) return NULL;
+    for (i = indexHash(name) & idx->mask; idx->table[i] != -1;
+         i = (i+1) & idx->mask)
+    {
+        struct sisentry *e = &idx->entries[idx->table[i]];
+        struct sisrecord *r = &pkg->records[e->filenum];
+
+        if (strcasecmp(r->dstname, name) && strcasecmp(r->srcname, name) &&
+            strcasecmp(sisBasename(r->dstname), name)) continue;
+        if (lang == -1 || e->lang == -1 || e->lang == lang) return e;
+        if (found == NULL) found = e;
+    }
+    return lang == -1 ? found : NULL;
+}
+
+/* Return the payload in the language slot 'slot' of the file record
+ * 'filenum', as numbered in listings. NULL if there is no such payload. */
+static struct sisentry *sisLookupIndex(struct sispkg *pkg, int filenum, int slot)
+{
+    struct sisindex *idx = sisIndex(pkg);
+
+    if (idx == NULL || filenum < 0 || filenum >= pkg->numrecords ||
+        idx->first[filenum] == -1 || slot < 0 ||
+        slot >= pkg->records[filenum].numlangs) return NULL;
+    return &idx->entries[idx->first[filenum]+slot];
+}
+
+/* Long running processes (like the --serve workers) are often asked for
+ * the same few payloads of the same popular packages, the icons and the
+ * resources. With --cache MB the files fetched with sisFetch() and
+ * sisFetchTo() are kept uncompressed in memory, up to the given budget,
+ * and the least recently used ones are dropped first. Payloads are keyed
+ * by the identity of the package file (device, inode, size, mtime) and
+ * their offset and length in it, so a package that is replaced is never
+ * served stale data. Payloads of packages in memory (components) are not
+ * cached, nor the ones larger than the whole budget. A payload is added
+ * to the cache as soon as it misses, marked as loading: threads asking
+ * for it meanwhile wait for the first one to uncompress it, instead of
+ * uncompressing it again and adding a duplicate entry. */
+
+struct cacheEntry {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    off_t off;                  /* of the payload in the file */
+    unsigned int len, origlen;
+    unsigned char *data;
+    size_t datalen;
+    int refcount;               /* callbacks using 'data' right now */
+    int evicted;                /* free when 'refcount' drops to zero */
+    int loading;                /* 'data' is being uncompressed */
+    int failed;                 /* uncompressing it failed */
+    struct cacheEntry *hnext;   /* hash bucket chain */
+    struct cacheEntry *prev, *next; /* LRU list, most recent first */
+};
+
+static struct {
+    size_t budget;              /* max bytes of data, 0: cache disabled */
+    size_t used;
+    unsigned long long hits, misses, evictions;
+    struct cacheEntry **table;
+    unsigned int tablesize;     /* a power of two, or 0 */
+    unsigned int numentries;
+    struct cacheEntry *head, *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;      /* signaled when an entry is loaded */
+} payloadCache = {0, 0, 0, 0, 0, NULL, 0, 0, NULL, NULL,
+                  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static unsigned int cacheHash(dev_t dev, ino_t ino, off_t off)
+{
+    unsigned long long h = (unsigned long long)ino*0x9E3779B97F4A7C15ULL;
+
+    h ^= (unsigned long long)dev + (unsigned long long)off*0xC2B2AE3D27D4EB4FULL;
+    return (unsigned int)(h ^ (h >> 29));
+}
+
+static int cacheMatch(struct cacheEntry *c, struct stat *st, off_t off, struct sisentry *e)
+{
+    return c->ino == st->st_ino && c->dev == st->st_dev &&
+           c->size == st->st_size && c->mtime.tv_sec == st->st_mtim.tv_sec &&
+           c->mtime.tv_nsec == st->st_mtim.tv_nsec && c->off == off &&
+           c->len == e->len && c->origlen == e->origlen;
+}
+
+static void cacheUnlink(struct cacheEntry *c)
+{
+    if (c->prev) c->prev->next = c->next;
+    else payloadCache.head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    else payloadCache.tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+static void cachePushFront(struct cacheEntry *c)
+{
+    c->next = payloadCache.head;
+    if (payloadCache.head) payloadCache.head->prev = c;
+    payloadCache.head = c;
+    if (payloadCache.tail == NULL) payloadCache.tail = c;
+}
+
+/* Remove 'c' from the cache. If it is still in use it is freed by its
+ * last user. */
+static void cacheRemove(struct cacheEntry *c)
+{
+    struct cacheEntry **pp;
+    unsigned int b;
+
+    b = cacheHash(c->dev, c->ino, c->off) & (payloadCache.tablesize-1);
+    for (pp = &payloadCache.table[b]; *pp != c; pp = &(*pp)->hnext);
+    *pp = c->hnext;
+    cacheUnlink(c);
+    payloadCache.used -= c->datalen;
+    payloadCache.numentries--;
+    if (c->refcount) {
+        c->evicted = 1;
+    } else {
+        free(c->data);
+        free(c);
+    }
+}
+
+/* Drop the least recently used payloads until 'need' more bytes fit in
+ * the budget. */
+static void cacheEvict(size_t need)
+{
+    while (payloadCache.tail && payloadCache.used+need > payloadCache.budget) {
+        cacheRemove(payloadCache.tail);
+        payloadCache.evictions++;
+    }
+}
+
+/* Add 'c' to the hash table, growing it when it gets too crowded. */
+static int cacheInsert(struct cacheEntry *c)
+{
+    unsigned int b;
+
+    if (payloadCache.numentries >= payloadCache.tablesize) {
+        unsigned int j, size = payloadCache.tablesize ? payloadCache.tablesize*2 : 256;
+        struct cacheEntry **table = calloc(size, sizeof(*table));
+
+        if (table == NULL) return 1;
+        for (j = 0; j < payloadCache.tablesize; j++) {
+            while (payloadCache.table[j]) {
+                struct cacheEntry *e = payloadCache.table[j];
+
+                payloadCache.table[j] = e->hnext;
+                b = cacheHash(e->dev, e->ino, e->off) & (size-1);
+                e->hnext = table[b];
+                table[b] = e;
+            }
+        }
+        free(payloadCache.table);
+        payloadCache.table = table;
+        payloadCache.tablesize = size;
+    }
+    b = cacheHash(c->dev, c->ino, c->off) & (payloadCache.tablesize-1);
+    c->hnext = payloadCache.table[b];
+    payloadCache.table[b] = c;
+    cachePushFront(c);
+    payloadCache.used += c->datalen;
+    payloadCache.numentries++;
+    return 0;
+}
+
+static void cacheRelease(struct cacheEntry *c)
+{
+    pthread_mutex_lock(&payloadCache.lock);
+    if (--c->refcount == 0 && c->evicted) {
+        free(c->data);
+        free(c);
+    }
+    pthread_mutex_unlock(&payloadCache.lock);
+}
+
+/* Return the cached uncompressed data of the payload 'e' of 'pkg' with a
+ * reference taken (see cacheRelease()), uncompressing and caching it on
+ * a miss. NULL is returned, without errors, if the payload can't be
+ * cached: the caller should stream it as usual. */
+static struct cacheEntry *cacheFetch(struct sispkg *pkg, struct sisentry *e, int *retval, char *err, int errlen)
+{
+    struct cacheEntry *c;
+    struct sisfile sf;
+    unsigned int b;
+    off_t off = pkg->sf->base + e->off; /* packages inside archives */
+
+    *retval = 0;
+    if (payloadCache.budget == 0 || e->size > payloadCache.budget) return NULL;
+    if (pkg->statted == 0)
+        pkg->statted = (pkg->sf->fp && fstat(fileno(pkg->sf->fp), &pkg->st) == 0) ? 1 : -1;
+    if (pkg->statted != 1) return NULL;
+
+    pthread_mutex_lock(&payloadCache.lock);
+    if (payloadCache.tablesize) {
+        b = cacheHash(pkg->st.st_dev, pkg->st.st_ino, off) & (payloadCache.tablesize-1);
+        for (c = payloadCache.table[b]; c; c = c->hnext) {
+            if (!cacheMatch(c, &pkg->st, off, e)) continue;
+            cacheUnlink(c);
+            cachePushFront(c);
+            c->refcount++;
+            payloadCache.hits++;
+            while (c->loading)
+                pthread_cond_wait(&payloadCache.loaded, &payloadCache.lock);
+            pthread_mutex_unlock(&payloadCache.lock);
+            if (c->failed) {
+                /* The caller streams it, and reports the error. */
+                cacheRelease(c);
+                return NULL;
+            }
+            return c;
+        }
+    }
+    payloadCache.misses++;
+
+    /* Add the entry before uncompressing it, so that other threads
+     * missing the same payload wait for it. */
+    if ((c = calloc(1, sizeof(*c))) == NULL ||
+        (c->data = malloc(e->size ? e->size : 1)) == NULL)
+    {
+        pthread_mutex_unlock(&payloadCache.lock);
+        free(c);
+        return NULL;
+    }
+    c->dev = pkg->st.st_dev;
+    c->ino = pkg->st.st_ino;
+    c->size = pkg->st.st_size;
+    c->mtime = pkg->st.st_mtim;
+    c->off = off;
+    c->len = e->len;
+    c->origlen = e->origlen;
+    c->datalen = e->size;
+    c->refcount = 1;
+    c->loading = 1;
+    cacheEvict(c->datalen);
+    if (cacheInsert(c)) c->evicted = 1; /* not cached, just used once */
+    pthread_mutex_unlock(&payloadCache.lock);
+
+    /* Uncompress the payload without holding the lock. */
+    sisMemInit(&sf, c->data, e->size);
+    if (sisPayload(pkg, e->len, e->origlen, e->off, NULL, memChunk, &sf,
+        err, errlen) || sf.pos != (long)e->size)
+    {
+        if (sf.pos != (long)e->size)
+            snprintf(err, errlen, "uncompressed file length does not match!");
+        c->failed = 1;
+        *retval = 1;
+    }
+    pthread_mutex_lock(&payloadCache.lock);
+    c->loading = 0;
+    if (c->failed && !c->evicted) cacheRemove(c);
+    pthread_cond_broadcast(&payloadCache.loaded);
+    pthread_mutex_unlock(&payloadCache.lock);
+    if (c->failed) {
+        cacheRelease(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* Stream the uncompressed payload of 'e' to 'proc'. */
+static int sisFetchTo(struct sispkg *pkg, struct sisentry *e, payloadProc *proc, void *privdata, char *err, int errlen)
+{
+    struct cacheEntry *c;
+    int retval;
+
+    if ((c = cacheFetch(pkg, e, &retval, err, errlen)) != NULL) {
+        retval = proc(privdata, c->data, c->datalen, err, errlen);
+        cacheRelease(c);
+        return retval;
+    }
+    if (retval) return 1;
+    return sisPayload(pkg, e->len, e->origlen, e->off, NULL, proc, privdata,
+        err, errlen);
+}
+
+/* Uncompress the payload of 'e' into 'buf', that must hold at least
+ * e->size bytes. */
+static int sisFetch(struct sispkg *pkg, struct sisentry *e, unsigned char *buf, size_t buflen, char *err, int errlen)
+{
+    struct sisfile sf;
+
+    if (buflen < e->size) {
+        snprintf(err, errlen, "buffer too small for %s (%u bytes)",
+            e->name, e->size);
+        return 1;
+    }
+    sisMemInit(&sf, buf, e->size);
+    if (sisFetchTo(pkg, e, memChunk, &sf, err, errlen)) return 1;
+    if (sf.pos != (long)e->size) {
+        snprintf(err, errlen, "uncompressed file length does not match!");
+        return 1;
+    }
+    return 0;
+}
+
+/* Find the payload selected by 'what': a file name, or "#" followed by a
+ * file index as shown in listings, optionally followed by ":slot" for
+ * multilang records. Names are never taken as indexes, so that files
+ * called "1" or "#tmp" can still be selected by name when no valid index
+ * follows the "#". */
+static struct sisentry *sisLookup(struct sispkg *pkg, char *what)
+{
+    char *end;
+    long filenum, slot = 0;
+
+    if (what[0] == '#' && isdigit((unsigned char)what[1])) {
+        filenum = strtol(what+1, &end, 10);
+        if (*end == ':' && isdigit((unsigned char)end[1]))
+            slot = strtol(end+1, &end, 10);
+        if (*end == '\0') return sisLookupIndex(pkg, filenum, slot);
+    }
+    return sisLookupName(pkg, what, -1);
+}
+
+static int catChunk(void *privdata, unsigned char *buf, size_t len, char *err, int errlen)
+{
+    return writeAll(*(int*)privdata, buf, len, err, errlen);
+}
+
+/* sisopen --cat NAME: write the payload selected by 'what' (see
+ * sisLookup()) of every package to the standard output. */
+static int sisCat(char **filenames, int count, char *what)
+{
+    char err[SISOPEN_ERRLEN];
+    struct sispkg pkg;
+    struct sisentry *e;
+    struct sisfile sf;
+    int j, fd = STDOUT_FILENO, errors = 0;
+
+    for (j = 0; j < count; j++) {
+        if (sisInputOpen(&sf, filenames[j], err, sizeof(err))) {
+            fprintf(stderr, "%s: %s\n", filenames[j], err);
+            errors++;
+            continue;
+        }
+        if (sisLoad(&pkg, filenames[j], &sf, err, sizeof(err)) == 0) {
+            if ((e = sisLookup(&pkg, what)) == NULL)
+                snprintf(err, sizeof(err), "no such file: %s", what);
+        } else {
+            e = NULL;
+        }
+        if (e == NULL || sisFetchTo(&pkg, e, catChunk, &fd, err, sizeof(err))) {
+            fprintf(stderr, "%s: %s\n", filenames[j], err);
+            errors++;
+        }
+        sisFree(&pkg);
+        sisInputClose(&sf);
+    }
+    return errors != 0;
+}
+
+/* --------------------------------- Journal ---------------------------------
+ * Batch extraction of a big corpus takes hours, and should not start from
+ * scratch when interrupted. With --journal FILE a line is appended to FILE
+ * every time a package is processed, and (with -x) every time a file
+ * record is extracted, carrying the mode of the run (see journalMode()),
+ * the identity of the package (size and mtime) and the outcome:
+ *
+ *   package <tab> MODE <tab> SIZE <tab> MTIME <tab> ok|error <tab> PATH
+ *   file <tab> MODE <tab> SIZE <tab> MTIME <tab> INDEX <tab> PATH
+ *
+ * Backslashes, tabs and newlines in PATH are escaped as \\, \t and \n.
+ *
+ * When the job is started again the journal is loaded first: packages
+ * whose last run in the same mode was successful, and that were not
+ * modified since, are skipped without even opening them, and the file
+ * records already extracted from a package that was interrupted are not
+ * extracted again. With --manifest nothing is skipped: what was already
+ * done is read again only to hash it, so that the manifest is complete.
+ * File records are not journaled with --fsync package, as in this case
+ * the files of a package only appear all together at its end. */
+
+#define SIS_JOURNAL_MODELEN 16
+
+struct journalEntry {
+    char *path;
+    char mode[SIS_JOURNAL_MODELEN]; /* see journalMode() */
+    long long size, mtime;      /* identity of the package, mtime in ns */
+    int done;                   /* the package was processed successfully */
+    unsigned char *files;       /* bitmap of the records extracted */
+    int filesize;               /* bytes of 'files' */
+    struct journalEntry *next;  /* hash bucket chain */
+};
+
+static int journalFd = -1;
+static struct journalEntry **journalTable = NULL;
+static unsigned int journalSize = 0; /* buckets, a power of two */
+static struct journalEntry *journalPkg = NULL; /* package being processed */
+
+static unsigned int journalHash(char *path)
+{
+    unsigned int h = 5381;
+
+    for (; *path; path++) h = h*33 + (unsigned char)*path;
+    return h;
+}
+
+/* What the runs recorded in the journal did: a package listed was not
+ * extracted, and one extracted without --recurse didn't have its nested
+ * packages extracted, so entries only count for runs in the same mode. */
+static char *journalMode(void)
+{
+    if (optExtract) return optRecurse ? "extract+recurse" : "extract";
+    return optRecurse ? "list+recurse" : "list";
+}
+
+/* Return the entry of 'path' in 'mode' (NULL if there is none). */
+static struct journalEntry *journalFind(char *path, char *mode)
+{
+    unsigned int b = journalHash(path) & (journalSize-1);
+    struct journalEntry *e;
+
+    for (e = journalTable[b]; e; e = e->next)
+        if (!strcmp(e->path, path) && !strcmp(e->mode, mode)) break;
+    return e;
+}
+
+/* Return the entry of 'path' in 'mode' with the given identity, creating
+ * it (or resetting it, if the package changed) as needed. */
+static struct journalEntry *journalGet(char *path, char *mode, long long size, long long mtime)
+{
+    unsigned int b = journalHash(path) & (journalSize-1);
+    struct journalEntry *e;
+
+    if ((e = journalFind(path, mode)) == NULL) {
+        if ((e = calloc(1, sizeof(*e))) == NULL ||
+            (e->path = strdup(path)) == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        snprintf(e->mode, sizeof(e->mode), "%s", mode);
+        e->next = journalTable[b];
+        journalTable[b] = e;
+    }
+    if (e->size != size || e->mtime != mtime) {
+        e->size = size;
+        e->mtime = mtime;
+        e->done = 0;
+        memset(e->files, 0, e->filesize);
+    }
+    return e;
+}
+
+static void journalSetFile(struct journalEntry *e, int index)
+{
+    if (index/8 >= e->filesize) {
+        int size = index/8+64;
+
+        if ((e->files = realloc(e->files, size)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        memset(e->files+e->filesize, 0, size-e->filesize);
+        e->filesize = size;
+    }
+    e->files[index/8] |= 1 << (index%8);
+}
+
+/* Return 'path' with backslashes, tabs and newlines escaped, so that it
+ * can be the last field of a journal line. The result must be freed. */
+static char *journalEscape(char *path)
+{
+    char *buf, *p;
+
+    if ((buf = p = malloc(strlen(path)*2+1)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (; *path; path++) {
+        if (*path == '\\' || *path == '\t' || *path == '\n') {
+            *p++ = '\\';
+            *p++ = *path == '\t' ? 't' : (*path == '\n' ? 'n' : '\\');
+        } else {
+            *p++ = *path;
+        }
+    }
+    *p = '\0';
+    return buf;
+}
+
+/* Undo journalEscape() in place. Returns 1 on invalid escapes. */
+static int journalUnescape(char *path)
+{
+    char *p = path;
+
+    for (; *path; path++) {
+        if (*path != '\\') {
+            *p++ = *path;
+            continue;
+        }
+        path++;
+        if (*path == '\\') *p++ = '\\';
+        else if (*path == 't') *p++ = '\t';
+        else if (*path == 'n') *p++ = '\n';
+        else return 1;
+    }
+    *p = '\0';
+    return 0;
+}
+
+/* Load the journal 'filename', if it exists, and open it for appending.
+ * Lines that can't be parsed, like the last one of a job that was killed
+ * while writing it, are ignored. */
+static int journalOpen(char *filename, char *err, int errlen)
+{
+    char *line = NULL, *f[6], c;
+    size_t linecap = 0;
+    ssize_t n;
+    FILE *fp;
+    int j;
+
+    journalSize = 1024;
+    if ((journalTable = calloc(journalSize, sizeof(*journalTable))) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        return 1;
+    }
+    if ((fp = fopen(filename, "r")) != NULL) {
+        while ((n = getline(&line, &linecap, fp)) > 0) {
+            char *p = line;
+            struct journalEntry *e;
+            long long size, mtime;
+
+            if (line[n-1] != '\n') break;
+            line[n-1] = '\0';
+            for (j = 0; j < 6 && p; j++) f[j] = strsep(&p, "\t");
+            if (j < 6 || p || journalUnescape(f[5])) continue;
+            size = strtoll(f[2], NULL, 10);
+            mtime = strtoll(f[3], NULL, 10);
+            e = journalGet(f[5], f[1], size, mtime);
+            if (!strcmp(f[0], "package")) e->done = !strcmp(f[4], "ok");
+            else if (!strcmp(f[0], "file") && atoi(f[4]) >= 0)
+                journalSetFile(e, atoi(f[4]));
+        }
+        free(line);
+        fclose(fp);
+    } else if (errno != ENOENT) {
+        snprintf(err, errlen, "%s reading %s", strerror(errno), filename);
+        return 1;
+    }
+    if ((journalFd = open(filename, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0666)) == -1) {
+        snprintf(err, errlen, "%s opening %s", strerror(errno), filename);
+        return 1;
+    }
+    /* Terminate the half written line, if any, before appending. */
+    if ((n = lseek(journalFd, 0, SEEK_END)) > 0 &&
+        (pread(journalFd, &c, 1, n-1) != 1 || c != '\n') &&
+        write(journalFd, "\n", 1) != 1)
+    {
+        snprintf(err, errlen, "%s writing %s", strerror(errno), filename);
+        return 1;
+    }
+    return 0;
+}
+
+static long long journalMtime(struct stat *st)
+{
+    return (long long)st->st_mtim.tv_sec*1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/* Remove from 'filenames' the packages already processed successfully in
+ * the same mode and not modified since, returning the new count. With
+ * --manifest they are kept, see journalDone(). */
+static int journalFilter(char **filenames, int count)
+{
+    struct stat st;
+    int i, n = 0, done = 0;
+
+    for (i = 0; i < count; i++) {
+        struct journalEntry *e = journalFind(filenames[i], journalMode());
+
+        if (e && e->done && sisInputStat(filenames[i], &st) == 0 &&
+            e->size == (long long)st.st_size && e->mtime == journalMtime(&st))
+        {
+            done++;
+            if (!manifestFp) continue;
+        }
+        filenames[n++] = filenames[i];
+    }
+    if (done && manifestFp)
+        fprintf(stderr, "%d package(s) already processed, "
+            "only hashed for the manifest\n", done);
+    else if (done)
+        fprintf(stderr, "%d package(s) already processed, skipped\n", done);
+    return n;
+}
+
+/* Start processing the package 'path', open as 'fp' (NULL if the package
+ * is in memory). */
+static void journalBegin(char *path, FILE *fp)
+{
+    struct stat st;
+
+    journalPkg = NULL;
+    if (journalFd == -1) return;
+    /* Packages inside archives take the identity of the archive. */
+    if (fp ? fstat(fileno(fp), &st) : sisInputStat(path, &st)) return;
+    journalPkg = journalGet(path, journalMode(), st.st_size,
+        journalMtime(&st));
+}
+
+/* Return true if the package being processed was already processed by a
+ * previous run. This only happens with --manifest: the package is read
+ * again only to hash its files. */
+static int journalDone(void)
+{
+    return journalPkg && journalPkg->done;
+}
+
+static void journalAppend(char *kind, char *status, char *path)
+{
+    char err[SISOPEN_ERRLEN], *buf, *escaped = journalEscape(path);
+    int len;
+
+    len = asprintf(&buf, "%s\t%s\t%lld\t%lld\t%s\t%s\n", kind,
+        journalPkg->mode, journalPkg->size, journalPkg->mtime, status,
+        escaped);
+    free(escaped);
+    if (len == -1) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    /* A single write: lines are never interleaved or half written, unless
+     * the process is killed right in the middle of it. */
+    if (writeAll(journalFd, (unsigned char*)buf, len, err, sizeof(err))) {
+        fprintf(stderr, "Error writing the journal: %s\n", err);
+        exit(1);
+    }
+    free(buf);
+}
+
+/* Return true if the file record 'index' of the package being processed
+ * was already extracted by a previous run. */
+static int journalFileDone(int index)
+{
+    return journalPkg && index/8 < journalPkg->filesize &&
+           (journalPkg->files[index/8] & (1 << (index%8)));
+}
+
+/* The file record 'index' was extracted. */
+static void journalFile(int index)
+{
+    char num[16];
+
+    if (journalPkg == NULL || optFsync == SIS_FSYNC_PACKAGE) return;
+    snprintf(num, sizeof(num), "%d", index);
+    journalAppend("file", num, journalPkg->path);
+    journalSetFile(journalPkg, index);
+}
+
+/* The package being processed is done. */
+static void journalEnd(int ok)
+{
+    if (journalPkg == NULL) return;
+    journalAppend("package", ok ? "ok" : "error", journalPkg->path);
+    journalPkg->done = ok;
+    if (optFsync != SIS_FSYNC_NEVER) fdatasync(journalFd);
+    journalPkg = NULL;
+}
+
+static int sisopen(char *filename, char *prefix, struct sisfile *sf, int depth, char *err, int errlen);
+
+/* Component files are SIS packages themselves: with --recurse they are
+ * uncompressed in memory and processed like top level packages, without
+ * touching the disk. Returns the number of components that could not be
+ * processed. */
+static int recurseComponent(struct sispkg *pkg, int filenum, int depth)
+{
+    struct sisrecord *r = &pkg->records[filenum];
+    struct sisfile sf;
+    char err[SISOPEN_ERRLEN], *compname, *name, *prefix;
+    int i, errors = 0;
+
+    for (i = 0; i < r->numlangs; i++) {
+        compname = sisBasename(recordName(r));
+        name = malloc(strlen(pkg->filename)+strlen(compname)+64);
+        prefix = malloc((pkg->prefix ? strlen(pkg->prefix) : 0)+strlen(compname)+64);
+        if (name == NULL || prefix == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        if (r->numlangs > 1) {
+            sprintf(name, "%s:%s(%s)", pkg->filename, compname, langStr(pkg->langs[i]));
+            sprintf(prefix, "%s%s%s(%s)", pkg->prefix ? pkg->prefix : "",
+                pkg->prefix ? ":" : "", compname, langStr(pkg->langs[i]));
+        } else {
+            sprintf(name, "%s:%s", pkg->filename, compname);
+            sprintf(prefix, "%s%s%s", pkg->prefix ? pkg->prefix : "",
+                pkg->prefix ? ":" : "", compname);
+        }
+        if (depth >= optMaxDepth) {
+            fprintf(stderr, "%s: not descending, nesting limit of %d reached\n",
+                name, optMaxDepth);
+        } else if (payloadLoad(pkg, r, i, &sf, err, sizeof(err))) {
+            fprintf(stderr, "%s: %s\n", name, err);
+            errors++;
+        } else {
+            if (sf.len >= 12 && sf.buf[8] == 0x19 && sf.buf[9] == 0x04 &&
+                sf.buf[10] == 0x00 && sf.buf[11] == 0x10)
+            {
+                printf("\n");
+                if (sisopen(name, prefix, &sf, depth+1, err, sizeof(err))) {
+                    fprintf(stderr, "%s: %s\n", name, err);
+                    errors++;
+                }
+            } else {
+                verbose("%s: component is not a SIS package\n", name);
+            }
+            free(sf.buf);
+        }
+        free(name);
+        free(prefix);
+    }
+    return errors;
+}
+
+/* List (and extract, if requested) the package read from 'sf'. 'prefix'
+ * is the component path of nested packages, NULL at the top level, where
+ * 'depth' is zero. */
+static int sisopen(char *filename, char *prefix, struct sisfile *sf, int depth, char *err, int errlen)
+{
+    struct sispkg pkg;
+    int j, retval, write, comperr = 0, sigstatus = SIS_SIG_UNSIGNED;
+
+    retval = sisLoad(&pkg, filename, sf, err, errlen);
+    pkg.prefix = prefix;
+    if (retval == 0 && optDevice) {
+        if ((pkg.installed = malloc(pkg.numrecords+1)) == NULL ||
+            condInstalled(&pkg, deviceLookup, optDevice, pkg.installed))
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    /* Show what we were able to load even if there was an error. */
+    if (pkg.valid) showHeader(&pkg);
+    if (pkg.valid && pkg.records) showLanguages(&pkg);
+    if (pkg.valid && pkg.records) showRequisites(&pkg);
+    if (pkg.valid && pkg.records) sigstatus = showSignature(&pkg);
+    if (pkg.records) printf("\nFiles\n");
+    for (j = 0; j < pkg.numrecords; j++) {
+        struct sisrecord *r = &pkg.records[j];
+
+        showRecord(&pkg, j);
+        if (r->type != SIS_FILE_SIMPLE && r->type != SIS_FILE_MULTILANG)
+            continue;
+        /* Extract (or just hash) files if needed. Files extracted by a
+         * previous run, alone or with their whole package, are only
+         * hashed, for the manifest. */
+        write = optExtract && !journalDone() &&
+                !(depth == 0 && journalFileDone(j));
+        if ((write || manifestFp) &&
+            (pkg.installed == NULL || pkg.installed[j]))
+        {
+            if (extractRecord(&pkg, j, write, err, errlen)) {
+                retval = 1;
+                break;
+            }
+            if (depth == 0 && write) journalFile(j);
+        }
+        verbose("\n");
+        if (optRecurse && r->file.type == SIS_FILETYPE_COMPONENT)
+            comperr += recurseComponent(&pkg, j, depth);
+    }
+    /* Files held for the "package" fsync policy are published even if
+     * the package could not be extracted completely. */
+    if (retval) {
+        char flusherr[SISOPEN_ERRLEN];
+
+        outFlush(flusherr, sizeof(flusherr));
+    } else if (outFlush(err, errlen)) {
+        retval = 1;
+    }
+    if (retval == 0) printf("\n");
+    if (retval == 0 && comperr) {
+        snprintf(err, errlen, "%d embedded package(s) could not be processed",
+            comperr);
+        retval = 1;
+    }
+    /* Signatures that can't be checked (unsigned packages, DSA keys, ...)
+     * are only reported: failing on them would fail most real corpora. */
+    if (retval == 0 && trustCount && (sigstatus == SIS_SIG_BAD ||
+        sigstatus == SIS_SIG_BADCHAIN || sigstatus == SIS_SIG_UNTRUSTED))
+    {
+        snprintf(err, errlen, "signature not verified: %s",
+            sigStatusTab[sigstatus]);
+        retval = 1;
+    }
+    sisFree(&pkg);
+    return retval;
+}
+
+/* --------------------------------- Sharding --------------------------------
+ * --shard I/N splits the input among N machines running the same command
+ * line over the same files, without any coordination: every node computes
+ * the same assignment and keeps only the files of shard I (1 to N). By
+ * default a file goes to the shard given by a hash of its name. With
+ * --shard-by size files are assigned from the largest to the smallest to
+ * the shard with the fewest bytes so far (ties to the lowest shard), that
+ * balances the run times much better when package sizes vary a lot. Sizes
+ * come from stat() (or from the archive directory for archive members),
+ * so every node must see the same files. Files that can't be sized are
+ * assigned by name, and will report their error on the node they land. */
+
+static int shardIndex, shardCount;  /* 0 of 0 when not sharding */
+static int shardBySize;
+
+struct shardFile {
+    long long size;
+    int pos;            /* position in the file list */
+};
+
+/* 64 bit FNV-1a: the assignment must not change across runs and builds. */
+static unsigned long long shardHash(char *name)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int shardCompare(const void *a, const void *b)
+{
+    const struct shardFile *fa = a, *fb = b;
+
+    if (fa->size != fb->size) return fa->size > fb->size ? -1 : 1;
+    return fa->pos - fb->pos;
+}
+
+/* Size of the package 'name' in bytes, or -1 if it can't be read. */
+static long long shardSize(char *name)
+{
+    char err[SISOPEN_ERRLEN], *sep = strstr(name, SIS_ARCHIVE_SEP), *path;
+    struct archiveMember *m = NULL;
+    struct archive *a;
+    struct stat st;
+
+    if (sep == NULL) return stat(name, &st) == 0 ? (long long)st.st_size : -1;
+    if ((path = strndup(name, sep-name)) == NULL) return -1;
+    if ((a = archiveGet(path, err, sizeof(err))) != NULL)
+        m = archiveFind(a, sep+strlen(SIS_ARCHIVE_SEP));
+    free(path);
+    return m ? m->len : -1;
+}
+
+/* The shard loads are a binary min-heap of (bytes, shard) pairs, so that
+ * picking the lightest shard takes O(log N) even with many nodes. */
+static int shardLess(long long *load, int *shard, int a, int b)
+{
+    if (load[a] != load[b]) return load[a] < load[b];
+    return shard[a] < shard[b];
+}
+
+static void shardSiftDown(long long *load, int *shard, int n)
+{
+    int j = 0, c, tmp;
+    long long t;
+
+    while ((c = j*2+1) < n) {
+        if (c+1 < n && shardLess(load, shard, c+1, c)) c++;
+        if (!shardLess(load, shard, c, j)) break;
+        t = load[j]; load[j] = load[c]; load[c] = t;
+        tmp = shard[j]; shard[j] = shard[c]; shard[c] = tmp;
+        j = c;
+    }
+}
+
+/* Remove from 'filenames' the files of the other shards, keeping the
+ * order of the list. Returns the new count. */
+static int shardFilter(char **filenames, int count)
+{
+    struct shardFile *files;
+    unsigned char *mine;
+    long long *load = NULL;
+    int *shard = NULL, i, n = 0;
+
+    files = malloc(sizeof(*files)*(count+1));
+    mine = calloc(count+1, 1);
+    if (shardBySize) {
+        load = calloc(shardCount, sizeof(*load));
+        shard = malloc(sizeof(*shard)*shardCount);
+    }
+    if (files == NULL || mine == NULL || (shardBySize && (load == NULL || shard == NULL))) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < count; i++) {
+        files[i].pos = i;
+        files[i].size = shardBySize ? shardSize(filenames[i]) : -1;
+        if (files[i].size == -1)
+            mine[i] = shardHash(filenames[i]) % shardCount == (unsigned)shardIndex;
+    }
+    if (shardBySize) {
+        /* Largest first: the sizes are all known here, so the order (and
+         * then the assignment) is the same on every node. */
+        qsort(files, count, sizeof(*files), shardCompare);
+        for (i = 0; i < shardCount; i++) shard[i] = i;
+        for (i = 0; i < count && files[i].size != -1; i++) {
+            if (shard[0] == shardIndex) mine[files[i].pos] = 1;
+            load[0] += files[i].size;
+            shardSiftDown(load, shard, shardCount);
+        }
+    }
+    for (i = 0; i < count; i++)
+        if (mine[i]) filenames[n++] = filenames[i];
+    free(files);
+    free(mine);
+    free(load);
+    free(shard);
+    return n;
+}
+
+/* ------------------------------ Package diff -------------------------------
+ * sisopen --diff old.sis new.sis compares two packages without extracting
+ * anything. File records are matched by destination name and language.
+ * Payloads are only read when the original sizes match, as a different
+ * size is already enough to report the file as changed: in this case the
+ * data as stored is compared first, and only if it is not the same the
+ * payloads are uncompressed and their SHA-256 compared. */
+
+struct diffEntry {
+    char *name;
+    int occurrence;     /* records with the same name before this one */
+    struct sisrecord *r;
+};
+
+struct diffState {
+    struct sispkg *a, *b;
+    int changes;
+};
+
+static void diffLine(struct diffState *ds, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (ds->changes++ == 0)
+        printf("--- %s\n+++ %s\n", ds->a->filename, ds->b->filename);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+static int diffDigestChunk(void *privdata, unsigned char *buf, size_t len, char *err, int errlen)
+{
+    SIS_NOTUSED(err);
+    SIS_NOTUSED(errlen);
+    SHA256Update(privdata, buf, len);
+    return 0;
+}
+
+/* SHA-256 of the payload in 'slot', of the data as stored if 'raw' is
+ * true, otherwise of the uncompressed data. */
+static int payloadDigest(struct sispkg *pkg, struct sisrecord *r, int slot, int raw, unsigned char *digest, char *err, int errlen)
+{
+    SHA256_CTX ctx;
+
+    SHA256Init(&ctx);
+    if (sisPayload(pkg, r->len[slot], r->origlen ? r->origlen[slot] : 0,
+        r->off[slot], raw ? diffDigestChunk : NULL,
+        raw ? NULL : diffDigestChunk, &ctx, err, errlen)) return 1;
+    SHA256Final(&ctx, digest);
+    return 0;
+}
+
+/* Compare two payloads. Returns 0 if they are the same, 1 if they differ
+ * (and 'why' is set), -1 on error. */
+static int diffPayload(struct sispkg *a, struct sisrecord *ra, int sa, struct sispkg *b, struct sisrecord *rb, int sb, char *why, int whylen, char *err, int errlen)
+{
+    unsigned char da[SHA256_DIGEST_LEN], db[SHA256_DIGEST_LEN];
+    unsigned int sizea = payloadSize(a,ra,sa), sizeb = payloadSize(b,rb,sb);
+    int storeda = payloadStored(a,ra,sa), storedb = payloadStored(b,rb,sb);
+
+    if (sizea != sizeb) {
+        snprintf(why, whylen, "size %u -> %u", sizea, sizeb);
+        return 1;
+    }
+    /* Same storage and same stored bytes: no need to uncompress. */
+    if (storeda == storedb && ra->len[sa] == rb->len[sb]) {
+        if (payloadDigest(a, ra, sa, 1, da, err, errlen) ||
+            payloadDigest(b, rb, sb, 1, db, err, errlen)) return -1;
+        if (memcmp(da, db, sizeof(da)) == 0) return 0;
+        if (storeda) goto changed; /* Stored data is the content. */
+    }
+    if (payloadDigest(a, ra, sa, 0, da, err, errlen) ||
+        payloadDigest(b, rb, sb, 0, db, err, errlen)) return -1;
+    if (memcmp(da, db, sizeof(da)) == 0) return 0;
+changed:
+    snprintf(why, whylen, "content, same size %u", sizea);
+    return 1;
+}
+
+/* Language of a payload slot, as shown in the diff output. */
+static char *slotLang(struct sispkg *pkg, struct sisrecord *r, int slot) {
+    return r->numlangs == 1 ? NULL : langStr(pkg->langs[slot]);
+}
+
+static int slotMatch(struct sispkg *a, struct sisrecord *ra, int sa, struct sispkg *b, struct sisrecord *rb, int sb) {
+    if (ra->numlangs == 1 || rb->numlangs == 1)
+        return ra->numlangs == rb->numlangs;
+    return a->langs[sa] == b->langs[sb];
+}
+
+static int diffFile(struct diffState *ds, struct sisrecord *ra, struct sisrecord *rb, char *err, int errlen)
+{
+    struct sispkg *a = ds->a, *b = ds->b;
+    char *name = recordName(ra), why[128], *lang;
+    int i, j;
+
+    if (ra->file.type != rb->file.type)
+        diffLine(ds, "~ file %s (type %s -> %s)", name,
+            fileTypeStr(ra->file.type), fileTypeStr(rb->file.type));
+    for (i = 0; i < ra->numlangs; i++) {
+        lang = slotLang(a, ra, i);
+        for (j = 0; j < rb->numlangs; j++)
+            if (slotMatch(a, ra, i, b, rb, j)) break;
+        if (j == rb->numlangs) {
+            diffLine(ds, "- file %s%s%s%s", name, lang ? " (" : "",
+                lang ? lang : "", lang ? ")" : "");
+            continue;
+        }
+        switch(diffPayload(a, ra, i, b, rb, j, why, sizeof(why), err, errlen)) {
+        case -1: return 1;
+        case 1:
+            diffLine(ds, "~ file %s%s%s (%s)", name,
+                lang ? " " : "", lang ? lang : "", why);
+            break;
+        }
+    }
+    for (j = 0; j < rb->numlangs; j++) {
+        lang = slotLang(b, rb, j);
+        for (i = 0; i < ra->numlangs; i++)
+            if (slotMatch(a, ra, i, b, rb, j)) break;
+        if (i == ra->numlangs)
+            diffLine(ds, "+ file %s%s%s%s", name, lang ? " (" : "",
+                lang ? lang : "", lang ? ")" : "");
+    }
+    return 0;
+}
+
+static int diffEntryCompare(const void *a, const void *b)
+{
+    const struct diffEntry *ea = a, *eb = b;
+    int cmp = strcasecmp(ea->name, eb->name);
+
+    if (cmp) return cmp;
+    if (ea->occurrence != eb->occurrence)
+        return ea->occurrence - eb->occurrence;
+    return (ea->r > eb->r) - (ea->r < eb->r);
+}
+
+/* Return the file records of 'pkg' sorted by name. Records with the same
+ * name (for instance in different branches of a condition) are matched in
+ * the order they appear in the file table. */
+static struct diffEntry *diffEntries(struct sispkg *pkg, int *count)
+{
+    struct diffEntry *e = malloc(sizeof(*e)*(pkg->numrecords+1));
+    int j, n = 0;
+
+    if (e == NULL) return NULL;
+    for (j = 0; j < pkg->numrecords; j++) {
+        struct sisrecord *r = &pkg->records[j];
+
+        if (r->type != SIS_FILE_SIMPLE && r->type != SIS_FILE_MULTILANG)
+            continue;
+        e[n].name = recordName(r);
+        e[n].occurrence = 0;
+        e[n].r = r;
+        n++;
+    }
+    qsort(e, n, sizeof(*e), diffEntryCompare);
+    for (j = 1; j < n; j++) {
+        if (strcasecmp(e[j].name, e[j-1].name) == 0)
+            e[j].occurrence = e[j-1].occurrence+1;
+    }
+    *count = n;
+    return e;
+}
+
+static int strPtrCompare(const void *a, const void *b)
+{
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+/* Show the strings only present in one of the two sets. Both the arrays
+ * are sorted in place. */
+static void diffStrings(struct diffState *ds, char *what, char **a, int na, char **b, int nb)
+{
+    int i = 0, j = 0, cmp;
+
+    qsort(a, na, sizeof(char*), strPtrCompare);
+    qsort(b, nb, sizeof(char*), strPtrCompare);
+    while (i < na || j < nb) {
+        if (i == na) cmp = 1;
+        else if (j == nb) cmp = -1;
+        else cmp = strcmp(a[i], b[j]);
+        if (cmp < 0) diffLine(ds, "- %s %s", what, a[i++]);
+        else if (cmp > 0) diffLine(ds, "+ %s %s", what, b[j++]);
+        else i++, j++;
+    }
+}
+
+/* Collect the option names or the conditions (rendered as they are in
+ * listings) of a package into '*vp'. Strings are owned by the package.
+ * Returns the number of strings, or -1 if out of memory. */
+static int diffCollect(struct sispkg *pkg, int options, char ***vp)
+{
+    char **v = malloc(sizeof(char*)), **nv;
+    int j, n = 0;
+    unsigned int i;
+
+    for (j = 0; v && j < pkg->numrecords; j++) {
+        struct sisrecord *r = &pkg->records[j];
+        int add = options ? (int)r->numopt : (r->cond != NULL);
+
+        if (add == 0) continue;
+        if ((nv = realloc(v, sizeof(char*)*(n+add))) == NULL) {
+            free(v);
+            return -1;
+        }
+        v = nv;
+        if (options) {
+            for (i = 0; i < r->numopt; i++) v[n++] = r->opt[i];
+        } else {
+            v[n++] = r->cond;
+        }
+    }
+    if (v == NULL) return -1;
+    *vp = v;
+    return n;
+}
+
+static int diffPackages(struct diffState *ds, char *err, int errlen)
+{
+    struct sispkg *a = ds->a, *b = ds->b;
+    struct diffEntry *ea = NULL, *eb = NULL;
+    char **sa = NULL, **sb = NULL;
+    int na, nb, i, j, cmp, retval = 1;
+
+    /* Header */
+    if (a->hdr.uid1 != b->hdr.uid1)
+        diffLine(ds, "~ application UID 0x%04X -> 0x%04X", a->hdr.uid1, b->hdr.uid1);
+    if (a->hdr.major != b->hdr.major || a->hdr.minor != b->hdr.minor)
+        diffLine(ds, "~ version %d.%02d -> %d.%02d", a->hdr.major,
+            a->hdr.minor, b->hdr.major, b->hdr.minor);
+    if (a->hdr.type != b->hdr.type)
+        diffLine(ds, "~ package type %s -> %s", pkgTypeStr(a->hdr.type),
+            pkgTypeStr(b->hdr.type));
+    if (a->hdr.options != b->hdr.options)
+        diffLine(ds, "~ options 0x%02x -> 0x%02x", a->hdr.options, b->hdr.options);
+    if (a->epocrelease != b->epocrelease)
+        diffLine(ds, "~ EPOC release %d -> %d", a->epocrelease, b->epocrelease);
+
+    /* Languages */
+    na = a->langs ? a->hdr.languages : 0;
+    nb = b->langs ? b->hdr.languages : 0;
+    if ((sa = malloc(sizeof(char*)*(na+1))) == NULL ||
+        (sb = malloc(sizeof(char*)*(nb+1))) == NULL) goto oom;
+    for (i = 0; i < na; i++) sa[i] = langStr(a->langs[i]);
+    for (j = 0; j < nb; j++) sb[j] = langStr(b->langs[j]);
+    diffStrings(ds, "language", sa, na, sb, nb);
+    free(sa);
+    free(sb);
+    sa = sb = NULL;
+
+    /* Options and conditions */
+    if ((na = diffCollect(a, 1, &sa)) == -1) goto oom;
+    if ((nb = diffCollect(b, 1, &sb)) == -1) goto oom;
+    diffStrings(ds, "option", sa, na, sb, nb);
+    free(sa);
+    free(sb);
+    sa = sb = NULL;
+    if ((na = diffCollect(a, 0, &sa)) == -1) goto oom;
+    if ((nb = diffCollect(b, 0, &sb)) == -1) goto oom;
+    diffStrings(ds, "condition", sa, na, sb, nb);
+
+    /* Files */
+    if ((ea = diffEntries(a, &na)) == NULL) goto oom;
+    if ((eb = diffEntries(b, &nb)) == NULL) goto oom;
+    i = j = 0;
+    while (i < na || j < nb) {
+        if (i == na) cmp = 1;
+        else if (j == nb) cmp = -1;
+        else cmp = strcasecmp(ea[i].name, eb[j].name) ?
+                   strcasecmp(ea[i].name, eb[j].name) :
+                   ea[i].occurrence - eb[j].occurrence;
+        if (cmp < 0) {
+            diffLine(ds, "- file %s", ea[i++].name);
+        } else if (cmp > 0) {
+            diffLine(ds, "+ file %s", eb[j++].name);
+        } else {
+            if (diffFile(ds, ea[i].r, eb[j].r, err, errlen)) goto cleanup;
+            i++, j++;
+        }
+    }
+    retval = 0;
+    goto cleanup;
+
+oom:
+    snprintf(err, errlen, "Out of memory");
+cleanup:
+    free(sa);
+    free(sb);
+    free(ea);
+    free(eb);
+    return retval;
+}
+
+/* Returns 0 if the packages are the same, 1 if they differ, 2 on error,
+ * like diff(1). */
+static int sisDiff(char *oldname, char *newname)
+{
+    struct sispkg pkg[2];
+    struct sisfile sf[2];
+    struct diffState ds;
+    char *names[2] = {oldname, newname};
+    char err[SISOPEN_ERRLEN];
+    int j, loaded = 0, retval = 2;
+
+    for (j = 0; j < 2; j++) {
+        if (sisInputOpen(&sf[j], names[j], err, sizeof(err))) {
+            fprintf(stderr, "%s: %s\n", names[j], err);
+            goto cleanup;
+        }
+        loaded++;
+        if (sisLoad(&pkg[j], names[j], &sf[j], err, sizeof(err))) {
+            fprintf(stderr, "%s: %s\n", names[j], err);
+            goto cleanup;
+        }
+    }
+    ds.a = &pkg[0];
+    ds.b = &pkg[1];
+    ds.changes = 0;
+    if (diffPackages(&ds, err, sizeof(err))) {
+        fprintf(stderr, "%s: %s\n", newname, err);
+        goto cleanup;
+    }
+    retval = ds.changes != 0;
+
+cleanup:
+    for (j = 0; j < loaded; j++) {
+        sisFree(&pkg[j]);
+        sisInputClose(&sf[j]);
+    }
+    return retval;
+}
+
+/* -------------------------------- Benchmark --------------------------------
+ * sisopen --bench uncompresses every compressed payload of the packages
+ * given with each one of the backends compiled in, reporting their speed
+ * in MB/s of uncompressed data. Packages are read in memory first, so
+ * that only the decompression is measured, and every backend runs over
+ * all the payloads for at least one second. */
+
+#define SIS_BENCH_TIME 1.0
+
+static int benchChunk(void *privdata, unsigned char *buf, size_t len, char *err, int errlen)
+{
+    SIS_NOTUSED(buf);
+    SIS_NOTUSED(err);
+    SIS_NOTUSED(errlen);
+    *(unsigned long long*)privdata += len;
+    return 0;
+}
+
+static double benchClock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+/* Uncompress all the compressed payloads of 'pkg' once, adding the
+ * uncompressed bytes to '*bytes'. */
+static int benchPackage(struct sispkg *pkg, unsigned long long *bytes, char *err, int errlen)
+{
+    int i, j;
+
+    for (j = 0; j < pkg->numrecords; j++) {
+        struct sisrecord *r = &pkg->records[j];
+
+        if (r->type != SIS_FILE_SIMPLE && r->type != SIS_FILE_MULTILANG)
+            continue;
+        for (i = 0; i < r->numlangs; i++) {
+            if (payloadStored(pkg, r, i)) continue;
+            if (sisPayload(pkg, r->len[i], r->origlen[i], r->off[i], NULL,
+                benchChunk, bytes, err, errlen)) return 1;
+        }
+    }
+    return 0;
+}
+
+static int sisBench(char **filenames, int count)
+{
+    struct sispkg *pkgs;
+    struct sisfile *sfs;
+    char err[SISOPEN_ERRLEN];
+    unsigned long long bytes;
+    double start, elapsed;
+    int i, b, rounds, loaded = 0, retval = 1;
+    FILE *fp;
+    long len;
+
+    pkgs = calloc(count, sizeof(*pkgs));
+    sfs = calloc(count, sizeof(*sfs));
+    if (pkgs == NULL || sfs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < count; i++) {
+        unsigned char *buf = NULL;
+
+        if ((fp = fopen(filenames[i], "r")) == NULL ||
+            fseek(fp, 0, SEEK_END) == -1 || (len = ftell(fp)) == -1 ||
+            fseek(fp, 0, SEEK_SET) == -1 ||
+            (buf = malloc(len ? len : 1)) == NULL ||
+            fread(buf, 1, len, fp) != (size_t)len)
+        {
+            fprintf(stderr, "%s: %s reading file\n", filenames[i],
+                strerror(errno));
+            if (fp) fclose(fp);
+            free(buf);
+            goto cleanup;
+        }
+        fclose(fp);
+        sisMemInit(&sfs[i], buf, len);
+        loaded++;
+        if (sisLoad(&pkgs[i], filenames[i], &sfs[i], err, sizeof(err))) {
+            fprintf(stderr, "%s: %s\n", filenames[i], err);
+            goto cleanup;
+        }
+    }
+
+    for (b = 0; inflateBackends[b].name; b++) {
+        payloadInflate = inflateBackends[b].inflate;
+        bytes = 0;
+        rounds = 0;
+        start = benchClock();
+        do {
+            for (i = 0; i < count; i++) {
+                if (benchPackage(&pkgs[i], &bytes, err, sizeof(err))) {
+                    fprintf(stderr, "%s: %s: %s\n", inflateBackends[b].name,
+                        filenames[i], err);
+                    goto cleanup;
+                }
+            }
+            rounds++;
+            elapsed = benchClock()-start;
+        } while (bytes && elapsed < SIS_BENCH_TIME);
+        if (bytes == 0) {
+            fprintf(stderr, "No compressed payloads to benchmark\n");
+            goto cleanup;
+        }
+        printf("%-12s %10.1f MB/s (%llu bytes in %.3f seconds, %d rounds)\n",
+            inflateBackends[b].name, bytes/elapsed/1e6, bytes, elapsed,
+            rounds);
+    }
+    retval = 0;
+
+cleanup:
+    payloadInflate = NULL;
+    for (i = 0; i < loaded; i++) {
+        sisFree(&pkgs[i]);
+        free(sfs[i].buf);
+    }
+    free(pkgs);
+    free(sfs);
+    return retval;
+}
+
+/* ---------------------------------- Grep -----------------------------------
+ * sisopen --grep PATTERN file.sis ... finds the packages containing one of
+ * the patterns in their payloads, without extracting anything. Payloads
+ * are streamed through sisPayload() and every chunk is searched with
+ * memmem(), that libc implements with vectorized instructions. A match
+ * can span two chunks: to find these matches the last bytes of a chunk
+ * (one less than the longest pattern) are kept, and searched together
+ * with the first bytes of the next chunk. Files are searched in parallel
+ * by a pool of threads (--jobs), every thread with its own decoder. */
+
+#define SIS_GREP_MAXLEN 1024        /* longest pattern */
+
+struct grepPattern {
+    char *text;                     /* as given on the command line */
+    unsigned char *p;
+    size_t len;
+};
+
+static struct grepPattern *grepPatterns = NULL;
+static int grepNumPatterns = 0;
+static size_t grepMaxLen = 0;
+
+/* State of the search in a single payload. */
+struct grepState {
+    struct sispkg *pkg;
+    int filenum;
+    int slot;
+    unsigned long long pos;         /* payload offset of the next chunk */
+    unsigned char tail[SIS_GREP_MAXLEN];            /* last bytes seen */
+    size_t taillen;
+    unsigned char edge[SIS_GREP_MAXLEN*2];          /* tail + next bytes */
+    FILE *out;
+    int matches;
+};
+
+/* Add a pattern, where \xNN, \n, \r, \t, \0 and \\ can be used to search
+ * for any byte. Returns 0 on success, 1 on syntax errors. */
+static int grepAddPattern(char *text)
+{
+    struct grepPattern *pat;
+    unsigned char *p;
+    char *s = text, hex[3] = {0, 0, 0};
+    size_t len = 0;
+
+    if ((p = malloc(strlen(text)+1)) == NULL) return 1;
+    while (*s) {
+        if (*s != '\\') {
+            p[len++] = *s++;
+            continue;
+        }
+        s++;
+        switch(*s) {
+        case 'n': p[len++] = '\n'; s++; break;
+        case 'r': p[len++] = '\r'; s++; break;
+        case 't': p[len++] = '\t'; s++; break;
+        case '0': p[len++] = '\0'; s++; break;
+        case '\\': p[len++] = '\\'; s++; break;
+        case 'x':
+            if (!isxdigit((unsigned char)s[1]) || !isxdigit((unsigned char)s[2]))
+                goto fail;
+            hex[0] = s[1];
+            hex[1] = s[2];
+            p[len++] = strtol(hex, NULL, 16);
+            s += 3;
+            break;
+        default:
+            goto fail;
+        }
+    }
+    if (len == 0 || len > SIS_GREP_MAXLEN) goto fail;
+    pat = realloc(grepPatterns, sizeof(*pat)*(grepNumPatterns+1));
+    if (pat == NULL) goto fail;
+    grepPatterns = pat;
+    pat = &grepPatterns[grepNumPatterns++];
+    pat->text = text;
+    pat->p = p;
+    pat->len = len;
+    if (len > grepMaxLen) grepMaxLen = len;
+    return 0;
+
+fail:
+    free(p);
+    return 1;
+}
+
+static void grepReport(struct grepState *gs, struct grepPattern *pat, unsigned long long off)
+{
+    struct sisrecord *r = &gs->pkg->records[gs->filenum];
+
+    fprintf(gs->out, "%s\t%03d\t%s\t%s\t%llu\t%s\n", gs->pkg->filename,
+        gs->filenum, recordName(r),
+        r->numlangs == 1 ? "-" : langStr(gs->pkg->langs[gs->slot]),
+        off, pat->text);
+    gs->matches++;
+}
+
+/* Report the matches of every pattern in 'buf'. If 'from' is not zero only
+ * the ones crossing it are reported: they start in the tail of the
+ * previous chunks and end in the new one, while the ones inside the new
+ * chunk are found searching it. */
+static void grepSearch(struct grepState *gs, unsigned char *buf, size_t len, size_t from, unsigned long long off)
+{
+    unsigned char *p, *end = buf+len;
+    int j;
+
+    for (j = 0; j < grepNumPatterns; j++) {
+        struct grepPattern *pat = &grepPatterns[j];
+
+        p = buf;
+        while ((size_t)(end-p) >= pat->len &&
+               (p = memmem(p, end-p, pat->p, pat->len)) != NULL)
+        {
+            if (from == 0 ||
+                ((size_t)(p-buf) < from && (size_t)(p-buf)+pat->len > from))
+                grepReport(gs, pat, off+(p-buf));
+            p++;
+        }
+    }
+}
+
+static int grepChunk(void *privdata, unsigned char *buf, size_t len, char *err, int errlen)
+{
+    struct grepState *gs = privdata;
+    size_t keep = grepMaxLen-1, head, old;
+
+    SIS_NOTUSED(err);
+    SIS_NOTUSED(errlen);
+    /* Matches starting in the previous chunks and ending in this one. */
+    if (gs->taillen) {
+        head = len < keep ? len : keep;
+        memcpy(gs->edge, gs->tail, gs->taillen);
+        memcpy(gs->edge+gs->taillen, buf, head);
+        grepSearch(gs, gs->edge, gs->taillen+head, gs->taillen,
+            gs->pos-gs->taillen);
+    }
+    grepSearch(gs, buf, len, 0, gs->pos);
+    gs->pos += len;
+
+    /* Remember the last 'keep' bytes seen. */
+    if (len >= keep) {
+        memcpy(gs->tail, buf+len-keep, keep);
+        gs->taillen = keep;
+    } else {
+        old = gs->taillen+len > keep ? keep-len : gs->taillen;
+        memmove(gs->tail, gs->tail+gs->taillen-old, old);
+        memcpy(gs->tail+old, buf, len);
+        gs->taillen = old+len;
+    }
+    return 0;
+}
+
+/* Search the payloads of 'filename', writing the matches to 'out'.
+ * Returns the number of matches, or -1 on error. */
+static int grepFile(char *filename, FILE *out, char *err, int errlen)
+{
+    struct sispkg pkg;
+    struct sisfile sf;
+    struct grepState *gs;
+    int i, j, matches = -1;
+
+    if (sisInputOpen(&sf, filename, err, errlen)) return -1;
+    if ((gs = malloc(sizeof(*gs))) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        sisInputClose(&sf);
+        return -1;
+    }
+    if (sisLoad(&pkg, filename, &sf, err, errlen)) goto cleanup;
+    gs->pkg = &pkg;
+    gs->out = out;
+    gs->matches = 0;
+    for (j = 0; j < pkg.numrecords; j++) {
+        struct sisrecord *r = &pkg.records[j];
+
+        if (r->type != SIS_FILE_SIMPLE && r->type != SIS_FILE_MULTILANG)
+            continue;
+        for (i = 0; i < r->numlangs; i++) {
+            gs->filenum = j;
+            gs->slot = i;
+            gs->pos = 0;
+            gs->taillen = 0;
+            if (sisPayload(&pkg, r->len[i], r->origlen ? r->origlen[i] : 0,
+                r->off[i], NULL, grepChunk, gs, err, errlen)) goto cleanup;
+        }
+    }
+    matches = gs->matches;
+
+cleanup:
+    sisFree(&pkg);
+    free(gs);
+    sisInputClose(&sf);
+    return matches;
+}
+
+struct grepJobs {
+    char **filenames;
+    int count;
+    int next;               /* next file to search */
+    int matches;            /* files with matches */
+    int errors;
+    pthread_mutex_t lock;   /* protects the above and stdout */
+};
+
+static void *grepWorker(void *privdata)
+{
+    struct grepJobs *jobs = privdata;
+    char err[SISOPEN_ERRLEN], *buf;
+    size_t size;
+    FILE *out;
+    int i, matches;
+
+    while (1) {
+        pthread_mutex_lock(&jobs->lock);
+        i = jobs->next++;
+        pthread_mutex_unlock(&jobs->lock);
+        if (i >= jobs->count) break;
+
+        /* Matches of a file are written all together. */
+        if ((out = open_memstream(&buf, &size)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+        matches = grepFile(jobs->filenames[i], out, err, sizeof(err));
+        fclose(out);
+        pthread_mutex_lock(&jobs->lock);
+        fwrite(buf, 1, size, stdout);
+        if (matches == -1) {
+            fflush(stdout);
+            fprintf(stderr, "%s: %s\n", jobs->filenames[i], err);
+            jobs->errors++;
+        } else if (matches) {
+            jobs->matches++;
+        }
+        pthread_mutex_unlock(&jobs->lock);
+        free(buf);
+    }
+    sisDecoderFree(&sharedDecoder);
+    archiveRelease();
+    return NULL;
+}
+
+/* Like grep(1) returns 0 if something was found, 1 if not, 2 on errors. */
+static int sisGrep(char **filenames, int count, int numthreads)
+{
+    struct grepJobs jobs;
+    pthread_t *tids;
+    int j, started = 0;
+
+    jobs.filenames = filenames;
+    jobs.count = count;
+    jobs.next = 0;
+    jobs.matches = jobs.errors = 0;
+    pthread_mutex_init(&jobs.lock, NULL);
+    if (numthreads > count) numthreads = count;
+    if ((tids = malloc(sizeof(pthread_t)*numthreads)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    for (j = 0; j < numthreads; j++) {
+        if (pthread_create(&tids[j], NULL, grepWorker, &jobs) != 0) break;
+        started++;
+    }
+    if (started == 0) grepWorker(&jobs);
+    for (j = 0; j < started; j++) pthread_join(tids[j], NULL);
+    pthread_mutex_destroy(&jobs.lock);
+    free(tids);
+    fflush(stdout);
+    if (jobs.errors) return 2;
+    return jobs.matches ? 0 : 1;
+}
+
+/* ------------------------------- Dependencies -------------------------------
+ * sisopen --deps file1.sis ... resolves the requisites of a whole corpus.
+ * Every package is a node of the graph, and every requisite an edge to
+ * the package with the same UID and the highest version, among the ones
+ * at least as recent as required (a package never satisfies its own
+ * requisites). Requisites that no package satisfies are reported, then
+ * the cycles, as the packages involved, and finally all the packages in
+ * an installation order, where every package comes after its requisites
+ * (the packages of a cycle come together, in no particular order).
+ *
+ * Most packages also require a platform (a Series 60 or UIQ release) or
+ * a device, whose UIDs are in the ROM and never in a corpus. Requisites
+ * without a package are reported as "platform", and don't count as
+ * problems, if their UID is a known platform product ID (see
+ * depsPlatforms), if their name ends in "ProductID" as the SDKs name
+ * them, or if the UID was given with --provided.
+ *
+ * Only the header, the languages and the requisites of the packages are
+ * read, by a pool of threads (-j). Packages are found by UID with an open
+ * addressing hash table, and cycles and order come from a single pass of
+ * Tarjan's strongly connected components algorithm, whose components are
+ * completed requisites first. It is iterative, so that long dependency
+ * chains can't overflow the stack. */
+
+struct depsPkg {
+    char *filename;
+    int loaded;             /* the requisites below are valid */
+    unsigned int uid;
+    unsigned short major, minor;
+    int languages;
+    int numreqs;
+    struct sisreq *reqs;    /* taken from the sispkg */
+    int next;               /* next package with the same UID, or -1 */
+    int firstedge;          /* resolved requisites, in 'edges' */
+    int numedges;
+};
+
+struct depsJobs {
+    struct depsPkg *pkgs;
+    int count;
+    int next;               /* next package to load */
+    int errors;
+    pthread_mutex_t lock;   /* protects the above and stderr */
+};
+
+static void *depsWorker(void *privdata)
+{
+    struct depsJobs *jobs = privdata;
+    char err[SISOPEN_ERRLEN];
+    struct depsPkg *p;
+    struct sispkg pkg;
+    struct sisfile sf;
+    int i, failed;
+
+    while (1) {
+        pthread_mutex_lock(&jobs->lock);
+        i = jobs->next++;
+        pthread_mutex_unlock(&jobs->lock);
+        if (i >= jobs->count) break;
+
+        p = &jobs->pkgs[i];
+        if (sisInputOpen(&sf, p->filename, err, sizeof(err))) {
+            failed = 1;
+        } else {
+            memset(&pkg, 0, sizeof(pkg));
+            pkg.filename = p->filename;
+            pkg.sf = &sf;
+            failed = loadHeader(&pkg, err, sizeof(err)) ||
+                     loadLanguages(&pkg, err, sizeof(err)) ||
+                     requisitesSection(&pkg, err, sizeof(err));
+            if (!failed) {
+                p->uid = pkg.hdr.uid1;
+                p->major = pkg.hdr.major;
+                p->minor = pkg.hdr.minor;
+                p->languages = pkg.hdr.languages;
+                p->numreqs = pkg.numreqs;
+                p->reqs = pkg.reqs;
+                p->loaded = 1;
+                pkg.reqs = NULL;
+                pkg.numreqs = 0;
+            }
+            sisFree(&pkg);
+            sisInputClose(&sf);
+        }
+        if (failed) {
+            pthread_mutex_lock(&jobs->lock);
+            fprintf(stderr, "%s: %s\n", p->filename, err);
+            jobs->errors++;
+            pthread_mutex_unlock(&jobs->lock);
+        }
+    }
+    archiveRelease();
+    return NULL;
+}
+
+/* Platform product IDs found in requisites of EPOC packages. */
+static struct {unsigned int uid; char *name;} depsPlatforms[] = {
+    {0x101F6F88, "Series 60 v0.9"},
+    {0x101F8202, "Series 60 v1.2"},
+    {0x101F7960, "Series 60 2nd Edition"},
+    {0x101F9115, "Series 60 2nd Edition FP1"},
+    {0x10200BAB, "Series 60 2nd Edition FP2"},
+    {0x102032BE, "Series 60 2nd Edition FP3"},
+    {0x101F617B, "UIQ 2.0"},
+    {0x101F61CE, "UIQ 2.1"},
+    {0, NULL}
+};
+
+static unsigned int *depsProvided = NULL;   /* --provided UIDs */
+static int depsNumProvided = 0;
+
+/* Add the UIDs of the comma separated list 'list' to the ones provided by
+ * the device. Returns 1 on syntax errors. */
+static int depsProvide(char *list)
+{
+    unsigned int *provided;
+    unsigned long uid;
+    char *item, *end;
+
+    for (item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+        errno = 0;
+        uid = strtoul(item, &end, 0);
+        if (end == item || *end != '\0' || errno || uid > 0xffffffffUL)
+            return 1;
+        provided = realloc(depsProvided, sizeof(*provided)*(depsNumProvided+1));
+        if (provided == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        depsProvided = provided;
+        depsProvided[depsNumProvided++] = uid;
+    }
+    return 0;
+}
+
+/* Is the requisite 'q' satisfied by the platform instead of a package? */
+static int depsPlatform(struct sisreq *q, int languages)
+{
+    size_t len;
+    int j;
+
+    for (j = 0; depsPlatforms[j].name; j++)
+        if (depsPlatforms[j].uid == q->uid) return 1;
+    for (j = 0; j < depsNumProvided; j++)
+        if (depsProvided[j] == q->uid) return 1;
+    if (languages && q->names[0] && (len = strlen(q->names[0])) >= 9 &&
+        !strcasecmp(q->names[0]+len-9, "ProductID")) return 1;
+    return 0;
+}
+
+static unsigned int depsHash(unsigned int uid)
+{
+    return uid*2654435761U;
+}
+
+static int depsVersionCmp(unsigned short amajor, unsigned short aminor,
+                          unsigned short bmajor, unsigned short bminor)
+{
+    if (amajor != bmajor) return amajor < bmajor ? -1 : 1;
+    if (aminor != bminor) return aminor < bminor ? -1 : 1;
+    return 0;
+}
+
+/* Returns 0 if every requisite was satisfied and there are no cycles, 1
+ * if not, 2 on errors reading the packages. */
+static int sisDeps(char **filenames, int count, int numthreads)
+{
+    struct depsJobs jobs;
+    struct depsPkg *pkgs;
+    pthread_t *tids;
+    int *table, *edges, *order, *idx, *low, *stack, *frames, *framepos;
+    unsigned char *onstack;
+    unsigned int mask, b;
+    int i, j, v, w, started = 0, numedges = 0, problems = 0;
+    int counter = 0, sp = 0, fp, ordered = 0;
+
+    if ((pkgs = calloc(count, sizeof(*pkgs))) == NULL) goto oom;
+    for (i = 0; i < count; i++) pkgs[i].filename = filenames[i];
+    jobs.pkgs = pkgs;
+    jobs.count = count;
+    jobs.next = 0;
+    jobs.errors = 0;
+    pthread_mutex_init(&jobs.lock, NULL);
+    if (numthreads > count) numthreads = count;
+    if ((tids = malloc(sizeof(pthread_t)*numthreads)) == NULL) goto oom;
+    for (j = 0; j < numthreads; j++) {
+        if (pthread_create(&tids[j], NULL, depsWorker, &jobs) != 0) break;
+        started++;
+    }
+    if (started == 0) depsWorker(&jobs);
+    for (j = 0; j < started; j++) pthread_join(tids[j], NULL);
+    pthread_mutex_destroy(&jobs.lock);
+    free(tids);
+
+    /* Index the packages by UID. */
+    for (mask = 1; mask < (unsigned int)count*2; mask <<= 1);
+    mask--;
+    if ((table = malloc(sizeof(int)*(mask+1))) == NULL) goto oom;
+    for (b = 0; b <= mask; b++) table[b] = -1;
+    for (i = 0; i < count; i++) {
+        struct depsPkg *p = &pkgs[i];
+
+        if (!p->loaded) continue;
+        numedges += p->numreqs;
+        for (b = depsHash(p->uid) & mask; table[b] != -1; b = (b+1) & mask)
+            if (pkgs[table[b]].uid == p->uid) break;
+        p->next = table[b];
+        table[b] = i;
+    }
+
+    /* Resolve the requisites into edges. */
+    if ((edges = malloc(sizeof(int)*(numedges+1))) == NULL) goto oom;
+    numedges = 0;
+    for (i = 0; i < count; i++) {
+        struct depsPkg *p = &pkgs[i];
+
+        p->firstedge = numedges;
+        for (j = 0; j < p->numreqs; j++) {
+            struct sisreq *q = &p->reqs[j];
+            int newest = -1;
+
+            for (b = depsHash(q->uid) & mask; table[b] != -1; b = (b+1) & mask)
+                if (pkgs[table[b]].uid == q->uid) break;
+            for (w = table[b]; w != -1; w = pkgs[w].next) {
+                if (w == i) continue;
+                if (newest == -1 || depsVersionCmp(pkgs[w].major, pkgs[w].minor,
+                    pkgs[newest].major, pkgs[newest].minor) > 0) newest = w;
+            }
+            if (newest != -1 && depsVersionCmp(pkgs[newest].major,
+                pkgs[newest].minor, q->major, q->minor) >= 0)
+            {
+                edges[numedges++] = newest;
+                continue;
+            }
+            if (newest == -1 && depsPlatform(q, p->languages)) {
+                printf("platform\t%s\t0x%08X\t%d.%02d\t%s\n", p->filename,
+                    q->uid, q->major, q->minor,
+                    p->languages ? q->names[0] : "");
+                continue;
+            }
+            printf("unresolved\t%s\t0x%08X\t%d.%02d\t%s\t", p->filename,
+                q->uid, q->major, q->minor, p->languages ? q->names[0] : "");
+            if (newest == -1) printf("not found\n");
+            else printf("only %d.%02d\n", pkgs[newest].major, pkgs[newest].minor);
+            problems++;
+        }
+        p->numedges = numedges-p->firstedge;
+    }
+
+    /* Tarjan's algorithm, with an explicit stack of frames: the package
+     * visited and the position in its edges. */
+    idx = malloc(sizeof(int)*count);
+    low = malloc(sizeof(int)*count);
+    stack = malloc(sizeof(int)*count);
+    frames = malloc(sizeof(int)*count);
+    framepos = malloc(sizeof(int)*count);
+    order = malloc(sizeof(int)*count);
+    onstack = calloc(count, 1);
+    if (!idx || !low || !stack || !frames || !framepos || !order || !onstack)
+        goto oom;
+    for (i = 0; i < count; i++) idx[i] = -1;
+    for (i = 0; i < count; i++) {
+        if (idx[i] != -1) continue;
+        fp = 0;
+        frames[fp] = i;
+        framepos[fp++] = pkgs[i].firstedge;
+        idx[i] = low[i] = counter++;
+        stack[sp++] = i;
+        onstack[i] = 1;
+        while (fp) {
+            v = frames[fp-1];
+            if (framepos[fp-1] < pkgs[v].firstedge+pkgs[v].numedges) {
+                w = edges[framepos[fp-1]++];
+                if (idx[w] == -1) {
+                    frames[fp] = w;
+                    framepos[fp++] = pkgs[w].firstedge;
+                    idx[w] = low[w] = counter++;
+                    stack[sp++] = w;
+                    onstack[w] = 1;
+                } else if (onstack[w] && idx[w] < low[v]) {
+                    low[v] = idx[w];
+                }
+                continue;
+            }
+            fp--;
+            if (fp && low[v] < low[frames[fp-1]]) low[frames[fp-1]] = low[v];
+            if (low[v] != idx[v]) continue;
+            /* 'v' is the root of a component: pop it. */
+            j = sp;
+            do {
+                w = stack[--sp];
+                onstack[w] = 0;
+                order[ordered++] = w;
+            } while (w != v);
+            if (j-sp > 1) {
+                printf("cycle");
+                for (w = sp; w < j; w++) printf("\t%s", pkgs[stack[w]].filename);
+                printf("\n");
+                problems++;
+            }
+        }
+    }
+    for (i = 0, j = 0; i < ordered; i++) {
+        struct depsPkg *p = &pkgs[order[i]];
+
+        if (!p->loaded) continue;
+        printf("order\t%d\t%s\t0x%08X\t%d.%02d\n", ++j, p->filename, p->uid,
+            p->major, p->minor);
+    }
+    fflush(stdout);
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < pkgs[i].numreqs; j++) {
+            for (w = 0; pkgs[i].reqs[j].names && w < pkgs[i].languages; w++)
+                free(pkgs[i].reqs[j].names[w]);
+            free(pkgs[i].reqs[j].names);
+        }
+        free(pkgs[i].reqs);
+    }
+    free(pkgs);
+    free(table);
+    free(edges);
+    free(idx);
+    free(low);
+    free(stack);
+    free(frames);
+    free(framepos);
+    free(order);
+    free(onstack);
+    if (jobs.errors) return 2;
+    return problems != 0;
+
+oom:
+    fprintf(stderr, "Out of memory\n");
+    exit(2);
+}
+
+/* --------------------------------- Summary ---------------------------------
+ * sisopen --summary file1.sis ... prints totals across the packages given:
+ * packages by type, EPOC release and language, file records by file type,
+ * payloads and their stored and original bytes, and a histogram of the
+ * compression ratio of the compressed payloads. Everything comes from the
+ * header and the file table as loaded by sisLoad(), no payload is read.
+ *
+ * Packages are loaded by a pool of threads (-j), every thread counting in
+ * its own struct sisSummary: they are only added together once all the
+ * threads are done, so counting needs no locking at all. */
+
+#define SIS_SUMMARY_TYPES (SIS_TYPE_SU+2)       /* the last is "unknown" */
+#define SIS_SUMMARY_LANGS (sizeof(sisLangTab)/sizeof(char*)+1)
+#define SIS_SUMMARY_FILETYPES (SIS_FILETYPE_OPEN+2)
+#define SIS_SUMMARY_RATIOS 11                   /* 10% each, then >= 100% */
+
+static char *summaryFileTypes[] = {"standard", "text", "component", "run",
+    "notexists", "open", "unknown"};
+
+struct sisSummary {
+    unsigned long long packages, errors;
+    unsigned long long types[SIS_SUMMARY_TYPES];
+    unsigned long long epoc[3];                 /* unknown, 5, 6 */
+    unsigned long long langs[SIS_SUMMARY_LANGS];
+    unsigned long long records, files;
+    unsigned long long filetypes[SIS_SUMMARY_FILETYPES];
+    unsigned long long payloads, compressed;
+    unsigned long long storedbytes, origbytes;  /* all the payloads */
+    unsigned long long ratios[SIS_SUMMARY_RATIOS];
+};
+
+static void summaryPackage(struct sisSummary *s, struct sispkg *pkg)
+{
+    int j, i;
+
+    s->packages++;
+    s->types[pkg->hdr.type <= SIS_TYPE_SU ? pkg->hdr.type : SIS_SUMMARY_TYPES-1]++;
+    s->epoc[pkg->epocrelease == 5 ? 1 : (pkg->epocrelease == 6 ? 2 : 0)]++;
+    for (j = 0; j < pkg->hdr.languages; j++) {
+        unsigned int lang = pkg->langs[j];
+
+        s->langs[lang < SIS_SUMMARY_LANGS-1 ? lang : SIS_SUMMARY_LANGS-1]++;
+    }
+    s->records += pkg->numrecords;
+    for (j = 0; j < pkg->numrecords; j++) {
+        struct sisrecord *r = &pkg->records[j];
+
+        if (r->type != SIS_FILE_SIMPLE && r->type != SIS_FILE_MULTILANG)
+            continue;
+        s->files++;
+        s->filetypes[r->file.type <= SIS_FILETYPE_OPEN ? r->file.type :
+            SIS_SUMMARY_FILETYPES-1]++;
+        for (i = 0; i < r->numlangs; i++) {
+            s->payloads++;
+            s->storedbytes += r->len[i];
+            s->origbytes += payloadSize(pkg, r, i);
+            if (payloadStored(pkg, r, i)) continue;
+            s->compressed++;
+            if (r->len[i] >= r->origlen[i])
+                s->ratios[SIS_SUMMARY_RATIOS-1]++;
+            else
+                s->ratios[(unsigned long long)r->len[i]*10/r->origlen[i]]++;
+        }
+    }
+}
+
+/* Add the counters of 'b' to 'a': struct sisSummary is only counters. */
+static void summaryMerge(struct sisSummary *a, struct sisSummary *b)
+{
+    unsigned long long *pa = (unsigned long long*)a;
+    unsigned long long *pb = (unsigned long long*)b;
+    size_t j;
+
+    for (j = 0; j < sizeof(*a)/sizeof(*pa); j++) pa[j] += pb[j];
+}
+
+static void summaryShow(struct sisSummary *s)
+{
+    unsigned int j;
+
+    printf("packages\ttotal\t%llu\n", s->packages);
+    printf("packages\terrors\t%llu\n", s->errors);
+    for (j = 0; j < SIS_SUMMARY_TYPES; j++) {
+        if (s->types[j] == 0) continue;
+        printf("type\t%s\t%llu\n", j < SIS_SUMMARY_TYPES-1 ? pkgTypeStr(j) :
+            "unknown", s->types[j]);
+    }
+    for (j = 0; j < 3; j++) {
+        if (s->epoc[j] == 0) continue;
+        if (j) printf("epoc\t%d\t%llu\n", j+4, s->epoc[j]);
+        else printf("epoc\tunknown\t%llu\n", s->epoc[j]);
+    }
+    for (j = 0; j < SIS_SUMMARY_LANGS; j++) {
+        if (s->langs[j] == 0) continue;
+        printf("language\t%s\t%llu\n", j < SIS_SUMMARY_LANGS-1 ? langStr(j) :
+            "unknown", s->langs[j]);
+    }
+    printf("records\ttotal\t%llu\n", s->records);
+    printf("files\ttotal\t%llu\n", s->files);
+    for (j = 0; j < SIS_SUMMARY_FILETYPES; j++) {
+        if (s->filetypes[j] == 0) continue;
+        printf("filetype\t%s\t%llu\n", summaryFileTypes[j], s->filetypes[j]);
+    }
+    printf("payloads\ttotal\t%llu\n", s->payloads);
+    printf("payloads\tcompressed\t%llu\n", s->compressed);
+    printf("bytes\tstored\t%llu\n", s->storedbytes);
+    printf("bytes\toriginal\t%llu\n", s->origbytes);
+    printf("bytes\tratio\t%.3f\n", s->origbytes ?
+        (double)s->storedbytes/s->origbytes : 0.0);
+    for (j = 0; j < SIS_SUMMARY_RATIOS; j++) {
+        if (j < SIS_SUMMARY_RATIOS-1)
+            printf("ratio\t%d-%d%%\t%llu\n", j*10, (j+1)*10, s->ratios[j]);
+        else
+            printf("ratio\t>=100%%\t%llu\n", s->ratios[j]);
+    }
+}
+
+struct summaryJobs {
+    char **filenames;
+    int count;
+    int next;               /* next package to load */
+    pthread_mutex_t lock;   /* protects 'next' and stderr */
+};
+
+struct summaryWorkerArg {
+    struct summaryJobs *jobs;
+    struct sisSummary sum;  /* owned by the thread until it is joined */
+};
+
+static void *summaryWorker(void *privdata)
+{
+    struct summaryWorkerArg *arg = privdata;
+    struct summaryJobs *jobs = arg->jobs;
+    char err[SISOPEN_ERRLEN];
+    struct sispkg pkg;
+    struct sisfile sf;
+    int i;
+
+    while (1) {
+        pthread_mutex_lock(&jobs->lock);
+        i = jobs->next++;
+        pthread_mutex_unlock(&jobs->lock);
+        if (i >= jobs->count) break;
+
+        if (sisInputOpen(&sf, jobs->filenames[i], err, sizeof(err)) == 0) {
+            if (sisLoad(&pkg, jobs->filenames[i], &sf, err, sizeof(err)) == 0) {
+                summaryPackage(&arg->sum, &pkg);
+                err[0] = '\0';
+            }
+            sisFree(&pkg);
+            sisInputClose(&sf);
+            if (err[0] == '\0') continue;
+        }
+        arg->sum.errors++;
+        pthread_mutex_lock(&jobs->lock);
+        fprintf(stderr, "%s: %s\n", jobs->filenames[i], err);
+        pthread_mutex_unlock(&jobs->lock);
+    }
+    archiveRelease();
+    return NULL;
+}
+
+/* Returns 0 on success, 1 if some package could not be loaded. */
+static int sisSummarize(char **filenames, int count, int numthreads)
+{
+    struct summaryWorkerArg *args;
+    struct summaryJobs jobs;
+    pthread_t *tids;
+    int j, started = 0;
+
+    jobs.filenames = filenames;
+    jobs.count = count;
+    jobs.next = 0;
+    pthread_mutex_init(&jobs.lock, NULL);
+    if (numthreads > count) numthreads = count;
+    if (numthreads < 1) numthreads = 1;
+    tids = malloc(sizeof(pthread_t)*numthreads);
+    args = calloc(numthreads, sizeof(*args));
+    if (tids == NULL || args == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (j = 0; j < numthreads; j++) {
+        args[j].jobs = &jobs;
+        if (pthread_create(&tids[j], NULL, summaryWorker, &args[j]) != 0) break;
+        started++;
+    }
+    if (started == 0) summaryWorker(&args[0]);
+    for (j = 0; j < started; j++) pthread_join(tids[j], NULL);
+    for (j = 1; j < started; j++) summaryMerge(&args[0].sum, &args[j].sum);
+    pthread_mutex_destroy(&jobs.lock);
+    summaryShow(&args[0].sum);
+    j = args[0].sum.errors != 0;
+    free(tids);
+    free(args);
+    return j;
+}
+
+/* --------------------------- Compatibility matrix ---------------------------
+ * sisopen --matrix devices.csv file1.sis ... tells, for every package and
+ * every device profile of the CSV file, which file records would be
+ * installed and how many bytes they take. The first line of the CSV file
+ * names the columns: the device name first, then attributes as accepted
+ * by --device, "exists" columns listing files separated by ';'. Empty
+ * cells are attributes the device doesn't know.
+ *
+ * Evaluating the package once for every device would mean walking every
+ * condition hundreds of times: instead every condition is evaluated once
+ * for all the devices together. Operands are columns with a value for
+ * every device, and boolean results (and the if/else if branches taken,
+ * like in condInstalled()) are bitsets with a bit for every device, so
+ * AND, OR, NOT and the branch bookkeeping are done 64 devices at a time. */
+
+#define SIS_MATRIX_LINELEN 65536
+
+struct sismatrix {
+    int numdevices;
+    int words;                  /* 64 bit words of a device bitset */
+    char **names;
+    struct sisdevice *devices;
+};
+
+/* A value on the evaluation stack: a boolean bitset, or a number for every
+ * device with the bitset of the ones where it is known. */
+struct matrixColumn {
+    int scalar;
+    int constant;               /* same number 'value' for every device */
+    unsigned int value;
+    unsigned int *val;          /* numbers, if 'scalar' and not 'constant' */
+    unsigned long long *bits;   /* truth, or known numbers if 'scalar' */
+};
+
+#define MATRIX_BIT(b,d) (((b)[(d)/64] >> ((d)%64)) & 1)
+#define MATRIX_SET(b,d) ((b)[(d)/64] |= 1ULL << ((d)%64))
+#define MATRIX_VAL(c,d) ((c)->constant ? (c)->value : (c)->val[d])
+
+/* Split the CSV line 'line' in place into at most 'max' fields, handling
+ * double quoted fields ("" is a quote). Returns the number of fields. */
+static int matrixFields(char *line, char **fields, int max)
+{
+    char *r = line, *w = line;
+    int n = 0;
+
+    while (n < max) {
+        fields[n++] = w;
+        if (*r == '"') {
+            for (r++; *r; r++) {
+                if (*r == '"' && r[1] == '"') r++;
+                else if (*r == '"') { r++; break; }
+                *w++ = *r;
+            }
+        }
+        while (*r && *r != ',') *w++ = *r++;
+        if (*r == '\0') {
+            *w = '\0';
+            break;
+        }
+        r++;
+        *w++ = '\0';
+    }
+    return n;
+}
+
+static int matrixLoad(struct sismatrix *m, char *filename, char *err, int errlen)
+{
+    char line[SIS_MATRIX_LINELEN], item[SIS_MATRIX_LINELEN], msg[256];
+    char *hdrbuf = NULL, **hdr = NULL, **cell = NULL, *path, *p;
+    int numcols = 0, n, j, lineno = 0, retval = 1;
+    FILE *fp;
+
+    memset(m, 0, sizeof(*m));
+    if ((fp = fopen(filename, "r")) == NULL) {
+        snprintf(err, errlen, "%s opening %s", strerror(errno), filename);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (hdr == NULL) {
+            numcols = 1;
+            for (p = line; *p; p++) if (*p == ',') numcols++;
+            if ((hdrbuf = strdup(line)) == NULL ||
+                (hdr = malloc(sizeof(char*)*numcols*2)) == NULL) goto oom;
+            cell = hdr+numcols;
+            numcols = matrixFields(hdrbuf, hdr, numcols);
+            for (j = 1; j < numcols; j++) {
+                if (strcasecmp(hdr[j], "exists") && deviceAttrId(hdr[j]) == -1) {
+                    snprintf(err, errlen, "%s:%d: unknown attribute '%s'",
+                        filename, lineno, hdr[j]);
+                    goto cleanup;
+                }
+            }
+            continue;
+        }
+        n = matrixFields(line, cell, numcols);
+        if ((m->names = realloc(m->names, sizeof(char*)*(m->numdevices+1))) == NULL ||
+            (m->devices = realloc(m->devices, sizeof(struct sisdevice)*(m->numdevices+1))) == NULL ||
+            (m->names[m->numdevices] = strdup(cell[0])) == NULL) goto oom;
+        memset(&m->devices[m->numdevices], 0, sizeof(struct sisdevice));
+        m->numdevices++;
+        for (j = 1; j < n; j++) {
+            if (cell[j][0] == '\0') continue;
+            for (path = strtok(cell[j], ";"); path; path = strtok(NULL, ";")) {
+                snprintf(item, sizeof(item), "%s=%s", hdr[j], path);
+                if (deviceSet(&m->devices[m->numdevices-1], item, msg, sizeof(msg))) {
+                    snprintf(err, errlen, "%s:%d: %s", filename, lineno, msg);
+                    goto cleanup;
+                }
+                if (strcasecmp(hdr[j], "exists")) break;
+            }
+        }
+    }
+    if (m->numdevices == 0) {
+        snprintf(err, errlen, "%s: no devices", filename);
+        goto cleanup;
+    }
+    m->words = (m->numdevices+63)/64;
+    retval = 0;
+    goto cleanup;
+
+oom:
+    snprintf(err, errlen, "Out of memory");
+cleanup:
+    free(hdr);
+    free(hdrbuf);
+    fclose(fp);
+    return retval;
+}
+
+/* Make 'c' a boolean column: numbers are true if known and not zero. */
+static void matrixTruth(struct sismatrix *m, struct matrixColumn *c)
+{
+    int d;
+
+    if (!c->scalar) return;
+    c->scalar = 0;
+    if (c->constant) {
+        if (c->value == 0) memset(c->bits, 0, sizeof(unsigned long long)*m->words);
+        return;
+    }
+    for (d = 0; d < m->numdevices; d++)
+        if (MATRIX_BIT(c->bits, d) && MATRIX_VAL(c, d) == 0)
+            c->bits[d/64] &= ~(1ULL << (d%64));
+}
+
+/* Evaluate the condition 'nodes' for every device of 'm', setting the bits
+ * of the devices where it is true in 'result'. Same rules of condEval():
+ * the tree is in prefix order, so it is evaluated from the last node with
+ * a stack of columns, and a node finds its left operand on the top. The
+ * columns of the stack are reused across conditions. Returns 1 when out
+ * of memory. */
+static int matrixEval(struct sismatrix *m, struct condNode *nodes, int numnodes, unsigned long long *result)
+{
+    static struct matrixColumn *stack = NULL;
+    static int alloc = 0, allocdevices = 0;
+    struct matrixColumn *c, *l, *r;
+    unsigned int value;
+    int i, d, w, top = 0;
+
+    if (allocdevices != m->numdevices) {
+        for (i = 0; i < alloc; i++) {
+            free(stack[i].val);
+            free(stack[i].bits);
+        }
+        free(stack);
+        stack = NULL;
+        alloc = 0;
+        allocdevices = m->numdevices;
+    }
+    for (i = numnodes-1; i >= 0; i--) {
+        struct condNode *n = &nodes[i];
+        int arity = condArity(n->type);
+
+        if (top-arity+1 > alloc) {
+            struct matrixColumn *s = realloc(stack, sizeof(*s)*(alloc+16));
+
+            if (s == NULL) return 1;
+            stack = s;
+            /* Numbers are only allocated for attributes, see below. */
+            for (d = alloc; d < alloc+16; d++) {
+                stack[d].val = NULL;
+                stack[d].bits = malloc(sizeof(unsigned long long)*m->words);
+                if (stack[d].bits == NULL) return 1;
+            }
+            alloc += 16;
+        }
+        if (arity > top) return 1; /* can't happen with condParse() trees */
+        /* The result replaces the operands: the left one is on the top. */
+        l = arity ? &stack[top-1] : NULL;
+        r = arity == 2 ? &stack[top-2] : NULL;
+        c = &stack[top-arity];
+        switch(n->type) {
+        case SIS_COND_EQ: case SIS_COND_NE: case SIS_COND_GT:
+        case SIS_COND_LT: case SIS_COND_GE: case SIS_COND_LE:
+            for (d = 0; d < m->numdevices; d++) {
+                unsigned int a, b;
+                int ok;
+
+                if (!MATRIX_BIT(l->bits, d) && l->scalar) { ok = 0; }
+                else if (!MATRIX_BIT(r->bits, d) && r->scalar) { ok = 0; }
+                else {
+                    a = l->scalar ? MATRIX_VAL(l, d) : MATRIX_BIT(l->bits, d);
+                    b = r->scalar ? MATRIX_VAL(r, d) : MATRIX_BIT(r->bits, d);
+                    switch(n->type) {
+                    case SIS_COND_EQ: ok = a == b; break;
+                    case SIS_COND_NE: ok = a != b; break;
+                    case SIS_COND_GT: ok = a > b; break;
+                    case SIS_COND_LT: ok = a < b; break;
+                    case SIS_COND_GE: ok = a >= b; break;
+                    default: ok = a <= b; break;
+                    }
+                }
+                /* 'c' is 'r': its bit d is not needed anymore. */
+                if (ok) MATRIX_SET(r->bits, d);
+                else r->bits[d/64] &= ~(1ULL << (d%64));
+            }
+            c->scalar = 0;
+            break;
+        case SIS_COND_AND:
+        case SIS_COND_OR:
+            matrixTruth(m, l);
+            matrixTruth(m, r);
+            for (w = 0; w < m->words; w++)
+                c->bits[w] = n->type == SIS_COND_AND ?
+                    l->bits[w] & r->bits[w] : l->bits[w] | r->bits[w];
+            c->scalar = 0;
+            break;
+        case SIS_COND_NOT:
+            matrixTruth(m, c);
+            for (w = 0; w < m->words; w++) c->bits[w] = ~c->bits[w];
+            break;
+        case SIS_COND_NUMBER:
+        case SIS_COND_STRING:
+            c->scalar = c->constant = 1;
+            c->value = n->value;
+            memset(c->bits, n->type == SIS_COND_NUMBER ? 0xff : 0,
+                sizeof(unsigned long long)*m->words);
+            break;
+        case SIS_COND_ATTRIBUTE:
+            if (c->val == NULL &&
+                (c->val = malloc(sizeof(unsigned int)*m->numdevices)) == NULL)
+                return 1;
+            c->scalar = 1;
+            c->constant = 0;
+            memset(c->bits, 0, sizeof(unsigned long long)*m->words);
+            for (d = 0; d < m->numdevices; d++) {
+                c->val[d] = 0;
+                if (deviceLookup(&m->devices[d], nodes, i, &c->val[d]))
+                    MATRIX_SET(c->bits, d);
+            }
+            break;
+        default: /* EXISTS(), APPCAP(), DEVCAP() */
+            memset(c->bits, 0, sizeof(unsigned long long)*m->words);
+            for (d = 0; d < m->numdevices; d++) {
+                if (deviceLookup(&m->devices[d], nodes, i, &value) && value)
+                    MATRIX_SET(c->bits, d);
+            }
+            c->scalar = 0;
+            break;
+        }
+        top = top-arity+1;
+    }
+    if (top != 1) return 1;
+    matrixTruth(m, &stack[0]);
+    memcpy(result, stack[0].bits, sizeof(unsigned long long)*m->words);
+    return 0;
+}
+
+/* Like condInstalled(), for all the devices at once: the bits of the
+ * devices where the record j is installed are set in installed+j*words. */
+static int matrixInstalled(struct sismatrix *m, struct sispkg *pkg, unsigned long long *installed)
+{
+    unsigned long long *active, *taken, *cond, *a, *t, *up;
+    int j, w, depth = 0, words = m->words, retval = 0;
+
+    if ((active = malloc(sizeof(*active)*words*((pkg->numrecords+1)*2+1))) == NULL)
+        return 1;
+    taken = active+words*(pkg->numrecords+1);
+    cond = taken+words*(pkg->numrecords+1);
+    memset(active, 0xff, sizeof(*active)*words);
+    for (j = pkg->numrecords-1; j >= 0; j--) {
+        struct sisrecord *r = &pkg->records[j];
+
+        switch(r->type) {
+        case SIS_FILE_IF:
+            up = active+words*depth;
+            depth++;
+            a = active+words*depth;
+            t = taken+words*depth;
+            if (matrixEval(m, r->condnodes, r->numcondnodes, cond)) goto oom;
+            for (w = 0; w < words; w++) a[w] = t[w] = cond[w] & up[w];
+            break;
+        case SIS_FILE_ELSEIF:
+            if (depth == 0) break;
+            up = active+words*(depth-1);
+            a = active+words*depth;
+            t = taken+words*depth;
+            if (matrixEval(m, r->condnodes, r->numcondnodes, cond)) goto oom;
+            for (w = 0; w < words; w++) {
+                a[w] = cond[w] & up[w] & ~t[w];
+                t[w] |= a[w];
+            }
+            break;
+        case SIS_FILE_ELSE:
+            if (depth == 0) break;
+            up = active+words*(depth-1);
+            a = active+words*depth;
+            t = taken+words*depth;
+            for (w = 0; w < words; w++) {
+                a[w] = up[w] & ~t[w];
+                t[w] = ~0ULL;
+            }
+            break;
+        case SIS_FILE_ENDIF:
+            if (depth) depth--;
+            break;
+        }
+        memcpy(installed+words*j, active+words*depth, sizeof(*active)*words);
+    }
+    goto cleanup;
+
+oom:
+    retval = 1;
+cleanup:
+    free(active);
+    return retval;
+}
+
+/* Language slot of a multilang record installed on 'dev': the one of its
+ * "Machine language" if the package has it, otherwise the first one. */
+static int matrixSlot(struct sispkg *pkg, struct sisrecord *r, struct sisdevice *dev)
+{
+    int j, slot;
+
+    if (r->numlangs == 1) return 0;
+    for (j = 0; j < dev->numattrs; j++) {
+        if (dev->ids[j] != 0x1000) continue;
+        for (slot = 0; slot < r->numlangs; slot++)
+            if (pkg->langs[slot] == dev->values[j]) return slot;
+    }
+    return 0;
+}
+
+/* Write a tab separated line for every device: package, device, number of
+ * files installed, their uncompressed size and their indexes. */
+static int matrixPackage(struct sismatrix *m, char *filename, char *err, int errlen)
+{
+    unsigned long long *installed, bytes;
+    struct sispkg pkg;
+    struct sisfile sf;
+    int d, j, files, retval = 1;
+
+    if (sisInputOpen(&sf, filename, err, errlen)) return 1;
+    if (sisLoad(&pkg, filename, &sf, err, errlen)) goto cleanup;
+    installed = malloc(sizeof(*installed)*m->words*(pkg.numrecords+1));
+    if (installed == NULL || matrixInstalled(m, &pkg, installed)) {
+        snprintf(err, errlen, "Out of memory");
+        free(installed);
+        goto cleanup;
+    }
+    for (d = 0; d < m->numdevices; d++) {
+        files = 0;
+        bytes = 0;
+        for (j = 0; j < pkg.numrecords; j++) {
+            struct sisrecord *r = &pkg.records[j];
+
+            if (r->type != SIS_FILE_SIMPLE && r->type != SIS_FILE_MULTILANG)
+                continue;
+            if (!MATRIX_BIT(installed+m->words*j, d)) continue;
+            files++;
+            bytes += payloadSize(&pkg, r, matrixSlot(&pkg, r, &m->devices[d]));
+        }
+        printf("%s\t%s\t%d\t%llu\t", filename, m->names[d], files, bytes);
+        files = 0;
+        for (j = 0; j < pkg.numrecords; j++) {
+            struct sisrecord *r = &pkg.records[j];
+
+            if ((r->type == SIS_FILE_SIMPLE || r->type == SIS_FILE_MULTILANG) &&
+                MATRIX_BIT(installed+m->words*j, d))
+                printf("%s%03d", files++ ? "," : "", j);
+        }
+        printf("\n");
+    }
+    free(installed);
+    retval = 0;
+
+cleanup:
+    sisFree(&pkg);
+    sisInputClose(&sf);
+    return retval;
+}
+
+static int sisMatrix(char *csvname, char **filenames, int count)
+{
+    char err[SISOPEN_ERRLEN];
+    struct sismatrix m;
+    int j, errors = 0;
+
+    if (matrixLoad(&m, csvname, err, sizeof(err))) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    printf("# package\tdevice\tfiles\tsize\tinstalled\n");
+    for (j = 0; j < count; j++) {
+        if (matrixPackage(&m, filenames[j], err, sizeof(err))) {
+            fflush(stdout);
+            fprintf(stderr, "%s: %s\n", filenames[j], err);
+            errors++;
+        }
+    }
+    return errors != 0;
+}
+
+/* ------------------------------ Image carving ------------------------------
+ * sisopen --carve IMAGE finds the SIS packages stored at any offset of a
+ * disk or firmware image, and lists (or extracts) them in place, without
+ * copying them out first. The image is mapped in memory and split into
+ * chunks searched in parallel for the UID3 of the SIS header (at offset
+ * 8): every hit is then loaded like a package (see sisLoad()) to discard
+ * random matches, and its extent estimated from the file table, the
+ * sections the header points to and the end of the last payload. Hits
+ * inside a package already found are its components, and are left to
+ * --recurse. */
+
+#define SIS_CARVE_CHUNK (16*1024*1024) /* bytes searched by a thread at once */
+
+struct carveHit {
+    unsigned long long base;    /* offset of the header in the image */
+    unsigned long long len;     /* estimated length of the package */
+};
+
+struct carveJobs {
+    unsigned char *image;
+    unsigned long long len;
+    unsigned long long next;    /* start of the next chunk to search */
+    struct carveHit *hits;
+    int numhits;
+    pthread_mutex_t lock;       /* protects the above */
+};
+
+/* Estimate the length of the package 'pkg', loaded from 'sf': the end of
+ * the last thing we know it contains. Sections whose length is unknown
+ * (requisites, certificates, signature) only count for their start. */
+static unsigned long long carveExtent(struct sispkg *pkg, struct sisfile *sf)
+{
+    struct sishdr *hdr = &pkg->hdr;
+    unsigned long long end = sisTell(sf), e;
+    unsigned int name[2];
+    char err[SISOPEN_ERRLEN];
+    int i, j;
+
+#define CARVE_MAX(x) do { e = (x); if (e > end) end = e; } while(0)
+    CARVE_MAX((unsigned long long)hdr->langoff + 2*hdr->languages);
+    CARVE_MAX(hdr->reqoff);
+    CARVE_MAX(hdr->certoff);
+    if (pkg->epocrelease == 6) {
+        CARVE_MAX(hdr->signoff);
+        CARVE_MAX(hdr->capaoff);
+    }
+    /* Component names: the lengths of all the names, then the offsets. */
+    for (i = 0; hdr->compnameoff && i < hdr->languages; i++) {
+        if (sisReadOffset(sf, &name[0], 4, hdr->compnameoff+i*4, err, sizeof(err)) ||
+            sisReadOffset(sf, &name[1], 4, hdr->compnameoff+(hdr->languages+i)*4,
+                err, sizeof(err))) break;
+        CARVE_MAX((unsigned long long)sis32toh(name[1]) + sis32toh(name[0]));
+    }
+    for (j = 0; j < pkg->numrecords; j++) {
+        struct sisrecord *r = &pkg->records[j];
+
+        if (r->type != SIS_FILE_SIMPLE && r->type != SIS_FILE_MULTILANG)
+            continue;
+        for (i = 0; i < r->numlangs; i++)
+            CARVE_MAX((unsigned long long)r->off[i] + r->len[i]);
+    }
+#undef CARVE_MAX
+    if (end > (unsigned long long)sf->len) end = sf->len;
+    return end;
+}
+
+/* Random matches may parse as a package: the sections the header points
+ * to must all be inside the 'len' bytes left in the image. */
+static int carveSectionsValid(struct sispkg *pkg, unsigned long long len)
+{
+    struct sishdr *hdr = &pkg->hdr;
+
+    if (hdr->langoff > len || hdr->fileoff > len || hdr->reqoff > len ||
+        hdr->certoff > len || hdr->compnameoff > len) return 0;
+    if (pkg->epocrelease == 6 && (hdr->signoff > len || hdr->capaoff > len))
+        return 0;
+    return 1;
+}
+
+/* Check if the header at 'base' is the start of a package, recording it
+ * as a hit. */
+static void carveCandidate(struct carveJobs *jobs, unsigned long long base)
+{
+    char err[SISOPEN_ERRLEN];
+    struct sispkg pkg;
+    struct sisfile sf;
+    struct carveHit *hits;
+    unsigned long long len;
+
+    sisMemInit(&sf, jobs->image+base, jobs->len-base);
+    if (sisLoad(&pkg, NULL, &sf, err, sizeof(err)) == 0 &&
+        pkg.epocrelease != 0 && carveSectionsValid(&pkg, jobs->len-base))
+    {
+        len = carveExtent(&pkg, &sf);
+        pthread_mutex_lock(&jobs->lock);
+        hits = realloc(jobs->hits, sizeof(*hits)*(jobs->numhits+1));
+        if (hits == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+        jobs->hits = hits;
+        hits[jobs->numhits].base = base;
+        hits[jobs->numhits].len = len;
+        jobs->numhits++;
+        pthread_mutex_unlock(&jobs->lock);
+    }
+    sisFree(&pkg);
+}
+
+/* Size of the image: st_size is 0 for block devices, that are measured
+ * with BLKGETSIZE64 or by seeking to their end. */
+static int carveImageSize(int fd, struct stat *st, unsigned long long *len)
+{
+    off_t end;
+
+    if (!S_ISBLK(st->st_mode)) {
+        *len = st->st_size;
+        return 0;
+    }
+#ifdef BLKGETSIZE64
+    {
+        unsigned long long size;
+
+        if (ioctl(fd, BLKGETSIZE64, &size) == 0) {
+            *len = size;
+            return 0;
+        }
+    }
+#endif
+    if ((end = lseek(fd, 0, SEEK_END)) == -1) return 1;
+    *len = end;
+    return 0;
+}
+
+static void *carveWorker(void *privdata)
+{
+    static const unsigned char uid3[4] = {0x19, 0x04, 0x00, 0x10};
+    struct carveJobs *jobs = privdata;
+    unsigned long long start, end;
+    unsigned char *p, *last;
+
+    while (1) {
+        pthread_mutex_lock(&jobs->lock);
+        start = jobs->next;
+        jobs->next += SIS_CARVE_CHUNK;
+        pthread_mutex_unlock(&jobs->lock);
+        if (start >= jobs->len) break;
+
+        /* Matches starting in this chunk may end in the next one. */
+        end = start+SIS_CARVE_CHUNK+sizeof(uid3)-1;
+        if (end > jobs->len) end = jobs->len;
+        p = jobs->image+start;
+        last = jobs->image+end;
+        while ((p = memmem(p, last-p, uid3, sizeof(uid3))) != NULL) {
+            unsigned long long off = p-jobs->image;
+
+            if (off >= start+SIS_CARVE_CHUNK) break;
+            if (off >= 8) carveCandidate(jobs, off-8);
+            p++;
+        }
+    }
+    return NULL;
+}
+
+static int carveHitCompare(const void *a, const void *b)
+{
+    const struct carveHit *ha = a, *hb = b;
+
+    if (ha->base < hb->base) return -1;
+    return ha->base > hb->base;
+}
+
+/* Returns 0 if packages were found and processed, 1 if none was found,
+ * 2 on errors. */
+static int sisCarve(char *filename, int numthreads)
+{
+    struct carveJobs jobs;
+    struct stat st;
+    struct sisfile sf;
+    unsigned long long end = 0;
+    char err[SISOPEN_ERRLEN], *name;
+    pthread_t *tids;
+    int fd, j, xfd, started = 0, errors = 0, found = 0;
+
+    memset(&jobs, 0, sizeof(jobs));
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st) == -1 ||
+        carveImageSize(fd, &st, &jobs.len))
+    {
+        fprintf(stderr, "%s: %s opening image\n", filename, strerror(errno));
+        if (fd != -1) close(fd);
+        return 2;
+    }
+    if (jobs.len == 0) {
+        close(fd);
+        return 1;
+    }
+    jobs.image = mmap(NULL, jobs.len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (jobs.image == MAP_FAILED) {
+        fprintf(stderr, "%s: %s mapping image\n", filename, strerror(errno));
+        return 2;
+    }
+    madvise(jobs.image, jobs.len, MADV_SEQUENTIAL);
+    pthread_mutex_init(&jobs.lock, NULL);
+    if ((unsigned long long)numthreads > jobs.len/SIS_CARVE_CHUNK+1)
+        numthreads = jobs.len/SIS_CARVE_CHUNK+1;
+    if ((tids = malloc(sizeof(pthread_t)*numthreads)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    for (j = 0; j < numthreads; j++) {
+        if (pthread_create(&tids[j], NULL, carveWorker, &jobs) != 0) break;
+        started++;
+    }
+    if (started == 0) carveWorker(&jobs);
+    for (j = 0; j < started; j++) pthread_join(tids[j], NULL);
+    pthread_mutex_destroy(&jobs.lock);
+    free(tids);
+    if (jobs.numhits)
+        qsort(jobs.hits, jobs.numhits, sizeof(struct carveHit), carveHitCompare);
+
+    /* Process the packages in order, skipping the ones nested inside the
+     * previous package. */
+    for (j = 0; j < jobs.numhits; j++) {
+        struct carveHit *h = &jobs.hits[j];
+
+        if (h->base < end) continue;
+        end = h->base+h->len;
+        found++;
+        if ((name = malloc(strlen(filename)+32)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(2);
+        }
+        sprintf(name, "%s@0x%llx", sisBasename(filename), h->base);
+        printf("%s: %llu bytes at offset %llu\n", name, h->len, h->base);
+        xfd = -1;
+        if (optExtract) {
+            if ((mkdir(name, 0777) == -1 && errno != EEXIST) ||
+                (xfd = open(name, O_RDONLY|O_DIRECTORY)) == -1)
+            {
+                fprintf(stderr, "%s: %s creating directory\n", name,
+                    strerror(errno));
+                errors++;
+                free(name);
+                continue;
+            }
+            extractDir = xfd;
+        }
+        sisMemInit(&sf, jobs.image+h->base, h->len);
+        if (sisopen(name, name, &sf, 0, err, sizeof(err))) {
+            fprintf(stderr, "%s: %s\n", name, err);
+            errors++;
+        }
+        extractDir = AT_FDCWD;
+        if (xfd != -1) close(xfd);
+        free(name);
+    }
+    free(jobs.hits);
+    munmap(jobs.image, jobs.len);
+    if (errors) return 2;
+    return found ? 0 : 1;
+}
+
+/* ----------------------------- Prefetching --------------------------------
+ * When many files are given on the command line, most of the time on cold
+ * storage is spent waiting for the first read of every file. To hide this
+ * latency the next files are opened ahead of time, and the kernel is asked
+ * to start reading the header and the file table while the current file is
+ * still being parsed. After a file is processed its pages are dropped from
+ * the page cache, as we are not going to read it again. */
+
+struct prefetch {
+    char *filename;
+    FILE *fp;
+    int err;        /* errno of the failed fopen(), if fp is NULL, or 0
+                       for archive members, opened when processed */
+    int tablehint;  /* set once the file table region was hinted */
+};
+
+static void sisAdvise(FILE *fp, long off, long len, int advice)
+{
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fileno(fp), off, len, advice);
+#else
+    SIS_NOTUSED(fp);
+    SIS_NOTUSED(off);
+    SIS_NOTUSED(len);
+    SIS_NOTUSED(advice);
+#endif
+}
+
+#ifndef POSIX_FADV_WILLNEED
+#define POSIX_FADV_WILLNEED 0
+#define POSIX_FADV_SEQUENTIAL 0
+#define POSIX_FADV_DONTNEED 0
+#endif
+
+/* Parse the --prefetch argument. Every file read ahead holds a descriptor,
+ * so the value is clamped to what RLIMIT_NOFILE allows, keeping some for
+ * the extracted files and the rest. */
+static int prefetchParse(char *arg)
+{
+    struct rlimit rl;
+    long n, max = INT_MAX-1;
+    char *end;
+
+    errno = 0;
+    n = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno || n < 0) {
+        fprintf(stderr, "Invalid --prefetch: %s\n", arg);
+        exit(1);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur < (rlim_t)max)
+    {
+        max = (long)rl.rlim_cur-SIS_PREFETCH_FDRESERVE;
+        if (max < 0) max = 0;
+    }
+    if (n > max) {
+        fprintf(stderr, "--prefetch %ld exceeds the open files limit, "
+            "using %ld\n", n, max);
+        n = max;
+    }
+    return n;
+}
+
+/* Open 'filename' and hint the kernel about the first bytes of the file,
+ * that contain the header and, in most packages, the languages section. */
+static void prefetchOpen(struct prefetch *pf, char *filename)
+{
+    pf->filename = filename;
+    pf->tablehint = 0;
+    pf->err = 0;
+    pf->fp = NULL;
+    if (strstr(filename, SIS_ARCHIVE_SEP)) return;
+    if ((pf->fp = fopen(filename, "r")) == NULL) {
+        pf->err = errno;
+        return;
+    }
+    if (optPrefetch) {
+        /* The kernel reads what we hint: it counts for the I/O limits. */
+        ioThrottle(SIS_IO_META, SIS_PREFETCH_HDRLEN, 1);
+        sisAdvise(pf->fp, 0, SIS_PREFETCH_HDRLEN, POSIX_FADV_WILLNEED);
+    }
+}
+
+/* Called when the file is the next one to be processed: at this point the
+ * header was hopefully already read by the kernel, so we can read it
+ * without blocking and hint the file table region as well. Reading with
+ * pread() does not touch the FILE position. */
+static void prefetchTable(struct prefetch *pf)
+{
+    struct sishdr hdr;
+    unsigned int fileoff;
+    long len;
+
+    if (!optPrefetch || pf->fp == NULL || pf->tablehint) return;
+    pf->tablehint = 1;
+    if (pread(fileno(pf->fp), &hdr, sizeof(hdr)-EPOC6_HDR_TAIL_LEN, 0) !=
+        (ssize_t)(sizeof(hdr)-EPOC6_HDR_TAIL_LEN)) return;
+    if (sis32toh(hdr.uid3) != SIS_UID3) return;
+    fileoff = sis32toh(hdr.fileoff);
+    len = (long)sis16toh(hdr.files)*SIS_PREFETCH_RECLEN;
+    if (fileoff+len <= SIS_PREFETCH_HDRLEN) return; /* Already hinted. */
+    ioThrottle(SIS_IO_META, len, 1);
+    sisAdvise(pf->fp, fileoff, len, POSIX_FADV_WILLNEED);
+}
+
+/* Release the file, dropping its pages from the page cache. */
+static void prefetchClose(struct prefetch *pf)
+{
+    if (pf->fp == NULL) return;
+    if (optPrefetch) sisAdvise(pf->fp, 0, 0, POSIX_FADV_DONTNEED);
+    fclose(pf->fp);
+    pf->fp = NULL;
+}
+
+/* ------------------------------- Server mode -------------------------------
+ * sisopen --serve /path/to.sock runs as a daemon answering requests over a
+ * Unix domain socket, so that services scanning many packages don't pay
+ * the process startup for every one of them. A pool of pre-forked workers
+ * accepts connections on the same socket: every worker keeps its payload
+ * buffers and inflate state (see sisPayload()) across requests.
+ *
+ * A request is a single line of tab separated fields:
+ *
+ *   list <tab> PATH              file table of the package
+ *   triage <tab> PATH            header and totals only, no payload is read
+ *   extract <tab> PATH <tab> DIR extract every file into DIR
+ *   fetch <tab> PATH <tab> NAME  a single file, see sisLookup()
+ *   stats                        payload cache counters of the worker
+ *
+ * Instead of opening PATH (and DIR) the server can use descriptors passed
+ * with SCM_RIGHTS along with the request line, in the same order: in this
+ * case PATH is only used as the package name in the reply. Every request
+ * is answered with a single line containing a JSON object, whose last
+ * member is "ok", followed by "error" if the request failed. A successful
+ * fetch reply is followed by the "size" bytes of the file: files larger
+ * than SIS_SERVE_MAXFETCH are refused, use extract for them. Requests on
+ * the same connection are served in order. */
+
+#define SIS_SERVE_LINELEN 4096  /* max length of a request line */
+#define SIS_SERVE_MAXFDS 2      /* max descriptors passed with a request */
+#define SIS_SERVE_MAXFETCH (64*1024*1024) /* max size of a fetched file */
+
+static volatile sig_atomic_t serveStop = 0;
+
+static void jsonString(FILE *fp, char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f) fprintf(fp, "\\u%04x", c);
+        else fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+/* Language of a payload slot, or null if the file has a single payload. */
+static void jsonSlotLang(FILE *fp, struct sispkg *pkg, struct sisrecord *r, int slot)
+{
+    if (r->numlangs == 1) fprintf(fp, "null");
+    else jsonString(fp, langStr(pkg->langs[slot]));
+}
+
+static void jsonHeader(FILE *fp, struct sispkg *pkg)
+{
+    struct sishdr *hdr = &pkg->hdr;
+    int j, n = 0;
+
+    fprintf(fp, ",\"uid\":\"0x%08X\",\"epoc\":%d,\"type\":", hdr->uid1,
+        pkg->epocrelease);
+    jsonString(fp, pkgTypeStr(hdr->type));
+    fprintf(fp, ",\"version\":\"%d.%02d\",\"options\":[", hdr->major,
+        hdr->minor);
+    if (hdr->options & SIS_OPT_UNICODE) fprintf(fp, "%s\"unicode\"", n++ ? "," : "");
+    if (hdr->options & SIS_OPT_DISTRIBUTABLE) fprintf(fp, "%s\"distributable\"", n++ ? "," : "");
+    if (hdr->options & SIS_OPT_NOCOMPRESS) fprintf(fp, "%s\"nocompress\"", n++ ? "," : "");
+    if (hdr->options & SIS_OPT_SHUTDOWNAPPS) fprintf(fp, "%s\"shutdownapps\"", n++ ? "," : "");
+    fprintf(fp, "],\"languages\":[");
+    for (j = 0; pkg->langs && j < pkg->hdr.languages; j++) {
+        if (j) fputc(',', fp);
+        jsonString(fp, langStr(pkg->langs[j]));
+    }
+    fprintf(fp, "],\"requisites\":[");
+    for (j = 0; j < pkg->numreqs; j++) {
+        struct sisreq *q = &pkg->reqs[j];
+
+        fprintf(fp, "%s{\"uid\":\"0x%08X\",\"version\":\"%d.%02d\",\"variant\":%u,\"name\":",
+            j ? "," : "", q->uid, q->major, q->minor, q->variant);
+        if (pkg->hdr.languages) jsonString(fp, q->names[0]);
+        else fprintf(fp, "null");
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "]");
+}
+
+/* The condition tree as JSON: operators are {"op":OP,"args":[...]}, the
+ * operands {"attribute":NAME}, {"option":N}, {"number":N} or {"string":S}.
+ * Like condRender() the tree is walked with an explicit stack. */
+static void jsonCondition(FILE *fp, struct condNode *nodes, int numnodes)
+{
+    struct condVisit *stack, *v;
+    struct condNode *n;
+    int depth = 0, j;
+
+    if ((stack = malloc(sizeof(*stack)*(numnodes+1))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    stack[depth].idx = 0;
+    stack[depth++].state = 0;
+    while(depth) {
+        v = &stack[depth-1];
+        n = &nodes[v->idx];
+        if (condArity(n->type) == 0) {
+            switch(n->type) {
+            case SIS_COND_STRING:
+                fprintf(fp, "{\"string\":");
+                jsonString(fp, n->str);
+                break;
+            case SIS_COND_NUMBER:
+                fprintf(fp, "{\"number\":%u", n->value);
+                break;
+            case SIS_COND_ATTRIBUTE:
+                if (n->value >= SIS_ATTR_OPTION) {
+                    fprintf(fp, "{\"option\":%u", n->value-SIS_ATTR_OPTION);
+                    break;
+                }
+                for (j = 0; sisAttrTab[j].name; j++)
+                    if (sisAttrTab[j].id == n->value) break;
+                fprintf(fp, "{\"attribute\":");
+                if (sisAttrTab[j].name)
+                    jsonString(fp, sisAttrTab[j].name);
+                else
+                    fprintf(fp, "%u", n->value);
+                break;
+            }
+            fprintf(fp, "}");
+            depth--;
+        } else if (v->state < condArity(n->type)) {
+            if (v->state == 0)
+                fprintf(fp, "{\"op\":\"%s\",\"args\":[", condOpStr(n->type));
+            else
+                fprintf(fp, ",");
+            stack[depth].idx = v->state == 0 ? n->left : n->right;
+            stack[depth++].state = 0;
+            v->state++;
+        } else {
+            fprintf(fp, "]}");
+            depth--;
+        }
+    }
+    free(stack);
+}
+
+static void jsonRecords(FILE *fp, struct sispkg *pkg)
+{
+    int i, j;
+    unsigned int k;
+
+    fprintf(fp, ",\"records\":[");
+    for (j = 0; j < pkg->numrecords; j++) {
+        struct sisrecord *r = &pkg->records[j];
+
+        fprintf(fp, "%s{\"index\":%d,\"record\":\"%s\"", j ? "," : "", j,
+            fileRecordTypeStr(r->type));
+        switch(r->type) {
+        case SIS_FILE_SIMPLE:
+        case SIS_FILE_MULTILANG:
+            fprintf(fp, ",\"type\":");
+            jsonString(fp, fileTypeStr(r->file.type));
+            fprintf(fp, ",\"name\":");
+            jsonString(fp, recordName(r));
+            fprintf(fp, ",\"source\":");
+            jsonString(fp, r->srcname);
+            fprintf(fp, ",\"payloads\":[");
+            for (i = 0; i < r->numlangs; i++) {
+                fprintf(fp, "%s{\"language\":", i ? "," : "");
+                jsonSlotLang(fp, pkg, r, i);
+                fprintf(fp, ",\"offset\":%u,\"length\":%u,\"size\":%u}",
+                    r->off[i], r->len[i], payloadSize(pkg, r, i));
+            }
+            fprintf(fp, "]");
+            break;
+        case SIS_FILE_OPTIONS:
+            fprintf(fp, ",\"options\":[");
+            for (k = 0; k < r->numopt; k++) {
+                if (k) fputc(',', fp);
+                jsonString(fp, r->opt[k]);
+            }
+            fprintf(fp, "]");
+            break;
+        case SIS_FILE_IF:
+        case SIS_FILE_ELSEIF:
+            fprintf(fp, ",\"condition\":");
+            jsonString(fp, r->cond);
+            fprintf(fp, ",\"expr\":");
+            jsonCondition(fp, r->condnodes, r->numcondnodes);
+            break;
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "]");
+}
+
+/* Totals of the file table, enough to decide if a package needs a closer
+ * look without reading any payload. */
+static void jsonTriage(FILE *fp, struct sispkg *pkg)
+{
+    unsigned long long stored = 0, size = 0;
+    int j, i, files = 0, payloads = 0, components = 0, run = 0, conds = 0;
+
+    for (j = 0; j < pkg->numrecords; j++) {
+        struct sisrecord *r = &pkg->records[j];
+
+        if (r->type == SIS_FILE_IF || r->type == SIS_FILE_ELSEIF) conds++;
+        if (r->type != SIS_FILE_SIMPLE && r->type != SIS_FILE_MULTILANG)
+            continue;
+        files++;
+        if (r->file.type == SIS_FILETYPE_COMPONENT) components++;
+        if (r->file.type == SIS_FILETYPE_RUN) run++;
+        for (i = 0; i < r->numlangs; i++) {
+            payloads++;
+            stored += r->len[i];
+            size += payloadSize(pkg, r, i);
+        }
+    }
+    fprintf(fp, ",\"files\":%d,\"payloads\":%d,\"components\":%d,"
+        "\"run\":%d,\"conditions\":%d,\"stored\":%llu,\"size\":%llu,"
+        "\"ratio\":%.2f", files, payloads, components, run, conds,
+        stored, size, stored ? (double)size/stored : 0.0);
+}
+
+/* Extract every payload of the package, listing what was written. */
+static int jsonExtract(FILE *fp, struct sispkg *pkg, char *err, int errlen)
+{
+    int i, j, n = 0, retval = 0;
+
+    fprintf(fp, ",\"extracted\":[");
+    for (j = 0; j < pkg->numrecords && retval == 0; j++) {
+        struct sisrecord *r = &pkg->records[j];
+
+        if (r->type != SIS_FILE_SIMPLE && r->type != SIS_FILE_MULTILANG)
+            continue;
+        if (r->file.type == SIS_FILETYPE_NOTEXISTS) continue;
+        for (i = 0; i < r->numlangs; i++) {
+            if (extractFile(pkg, j, r->numlangs == 1 ? -1 : i, r->len[i],
+                r->origlen ? r->origlen[i] : 0, r->off[i], recordName(r), 1,
+                err, errlen))
+            {
+                retval = 1;
+                break;
+            }
+            fprintf(fp, "%s{\"index\":%d,\"name\":", n++ ? "," : "", j);
+            jsonString(fp, sisBasename(recordName(r)));
+            fprintf(fp, ",\"language\":");
+            jsonSlotLang(fp, pkg, r, i);
+            fprintf(fp, ",\"size\":%u}", payloadSize(pkg, r, i));
+        }
+    }
+    fprintf(fp, "]");
+    if (retval) {
+        char flusherr[SISOPEN_ERRLEN];
+
+        outFlush(flusherr, sizeof(flusherr));
+    } else if (outFlush(err, errlen)) {
+        retval = 1;
+    }
+    return retval;
+}
+
+/* Workers keep the last package a file was fetched from loaded, so that
+ * a service asking for many files of the same package (and passing it
+ * again with every request) doesn't pay for the file table each time.
+ * The package is recognized by device, inode, size and mtime. */
+static struct {
+    FILE *fp;
+    struct sisfile sf;
+    struct sispkg pkg;
+    struct stat st;
+} fetchCache;
+
+static void fetchCacheFree(void)
+{
+    if (fetchCache.fp == NULL) return;
+    free(fetchCache.pkg.filename);
+    sisFree(&fetchCache.pkg);
+    fclose(fetchCache.fp);
+    fetchCache.fp = NULL;
+}
+
+/* Return the package open as 'in' from the cache, loading it if it is not
+ * the cached one. 'in' is taken over in any case. NULL on error. */
+static struct sispkg *fetchPackage(FILE *in, char *name, char *err, int errlen)
+{
+    struct stat st;
+
+    if (fstat(fileno(in), &st) == -1) {
+        snprintf(err, errlen, "%s reading file information", strerror(errno));
+        fclose(in);
+        return NULL;
+    }
+    if (fetchCache.fp && st.st_dev == fetchCache.st.st_dev &&
+        st.st_ino == fetchCache.st.st_ino &&
+        st.st_size == fetchCache.st.st_size &&
+        st.st_mtim.tv_sec == fetchCache.st.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == fetchCache.st.st_mtim.tv_nsec)
+    {
+        fclose(in);
+        return &fetchCache.pkg;
+    }
+    fetchCacheFree();
+    fetchCache.fp = in;
+    fetchCache.st = st;
+    sisFileInit(&fetchCache.sf, in);
+    if (sisLoad(&fetchCache.pkg, NULL, &fetchCache.sf, err, errlen)) {
+        fetchCacheFree();
+        return NULL;
+    }
+    if ((fetchCache.pkg.filename = strdup(name)) == NULL) {
+        snprintf(err, errlen, "Out of memory");
+        fetchCacheFree();
+        return NULL;
+    }
+    return &fetchCache.pkg;
+}
+
+/* Serve the request 'line', appending the JSON reply to 'fp'. 'fds' are
+ * the descriptors received with the request: they are owned by the
+ * caller. */
+static void serveRequest(FILE *fp, char *line, int *fds, int numfds)
+{
+    char err[SISOPEN_ERRLEN], *argv[3], *cmd;
+    struct sispkg pkg, *p;
+    struct sisentry *e;
+    struct sisfile sf;
+    FILE *in = NULL;
+    unsigned char *data = NULL;
+    int argc = 0, fd, dirfd = -1, loaded = 0, retval = 1, fetch;
+
+    while (line && argc < 3) argv[argc++] = strsep(&line, "\t");
+    cmd = argv[0];
+    fetch = !strcmp(cmd, "fetch");
+    fprintf(fp, "{\"request\":");
+    jsonString(fp, cmd);
+    if (argc >= 2) {
+        fprintf(fp, ",\"file\":");
+        jsonString(fp, argv[1]);
+    }
+    if (!strcmp(cmd, "stats") && argc == 1) {
+        pthread_mutex_lock(&payloadCache.lock);
+        fprintf(fp, ",\"cache\":{\"budget\":%zu,\"used\":%zu,\"entries\":%u,"
+            "\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu}",
+            payloadCache.budget, payloadCache.used, payloadCache.numentries,
+            payloadCache.hits, payloadCache.misses, payloadCache.evictions);
+        pthread_mutex_unlock(&payloadCache.lock);
+        retval = 0;
+        goto reply;
+    }
+    if (line || argc < 2 ||
+        (strcmp(cmd, "extract") == 0 || fetch) != (argc == 3) ||
+        (strcmp(cmd, "list") && strcmp(cmd, "triage") &&
+         strcmp(cmd, "extract") && !fetch))
+    {
+        snprintf(err, sizeof(err), "invalid request");
+        goto reply;
+    }
+
+    /* Open the package and the destination directory. */
+    if (numfds > 0) {
+        if ((fd = dup(fds[0])) == -1 || (in = fdopen(fd, "r")) == NULL) {
+            snprintf(err, sizeof(err), "%s using file descriptor",
+                strerror(errno));
+            if (fd != -1) close(fd);
+            goto reply;
+        }
+    } else if ((in = fopen(argv[1], "r")) == NULL) {
+        snprintf(err, sizeof(err), "%s opening file", strerror(errno));
+        goto reply;
+    }
+    if (fetch) {
+        p = fetchPackage(in, argv[1], err, sizeof(err));
+        in = NULL;
+        if (p == NULL) goto reply;
+        if ((e = sisLookup(p, argv[2])) == NULL) {
+            snprintf(err, sizeof(err), "no such file: %s", argv[2]);
+            goto reply;
+        }
+        /* The size comes from the package: don't let any client make
+         * the worker allocate up to 4GB for a single request. */
+        if (e->size > SIS_SERVE_MAXFETCH) {
+            snprintf(err, sizeof(err), "%s is too large to fetch "
+                "(%u bytes, max %d)", argv[2], e->size, SIS_SERVE_MAXFETCH);
+            goto reply;
+        }
+        if ((data = malloc(e->size ? e->size : 1)) == NULL) {
+            snprintf(err, sizeof(err), "Out of memory");
+            goto reply;
+        }
+        if (sisFetch(p, e, data, e->size, err, sizeof(err))) goto reply;
+        fprintf(fp, ",\"index\":%d,\"name\":", e->filenum);
+        jsonString(fp, sisBasename(e->name));
+        fprintf(fp, ",\"language\":");
+        jsonSlotLang(fp, p, &p->records[e->filenum], e->slot);
+        fprintf(fp, ",\"size\":%u", e->size);
+        retval = 0;
+        goto reply;
+    }
+    if (argc == 3) {
+        if (numfds > 1) {
+            dirfd = fds[1];
+        } else if ((dirfd = open(argv[2], O_RDONLY|O_DIRECTORY)) == -1) {
+            snprintf(err, sizeof(err), "%s opening directory",
+                strerror(errno));
+            goto reply;
+        }
+    }
+
+    sisFileInit(&sf, in);
+    loaded = 1;
+    retval = sisLoad(&pkg, argv[1], &sf, err, sizeof(err));
+    if (pkg.valid) jsonHeader(fp, &pkg);
+    if (retval) goto reply;
+    if (!strcmp(cmd, "list")) {
+        jsonRecords(fp, &pkg);
+    } else if (!strcmp(cmd, "triage")) {
+        jsonTriage(fp, &pkg);
+    } else {
+        optExtract = 1;
+        extractDir = dirfd;
+        retval = jsonExtract(fp, &pkg, err, sizeof(err));
+        optExtract = 0;
+        extractDir = AT_FDCWD;
+    }
+
+reply:
+    fprintf(fp, ",\"ok\":%s", retval ? "false" : "true");
+    if (retval) {
+        fprintf(fp, ",\"error\":");
+        jsonString(fp, err);
+    }
+    fprintf(fp, "}\n");
+    /* The content of a fetched file follows its reply line. */
+    if (retval == 0 && data) fwrite(data, 1, e->size, fp);
+    free(data);
+    if (loaded) sisFree(&pkg);
+    if (in) fclose(in);
+    if (dirfd != -1 && numfds < 2) close(dirfd);
+}
+
+/* Read requests from the connection 'fd' until the client closes it. */
+static void serveConnection(int fd)
+{
+    char buf[SIS_SERVE_LINELEN], err[SISOPEN_ERRLEN], *nl, *reply;
+    char cbuf[CMSG_SPACE(sizeof(int)*SIS_SERVE_MAXFDS)];
+    int fds[SIS_SERVE_MAXFDS], numfds = 0, used = 0, j;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    size_t size;
+    ssize_t n;
+    FILE *fp;
+
+    while (1) {
+        iov.iov_base = buf+used;
+        iov.iov_len = sizeof(buf)-used-1;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        /* Collect the descriptors passed with this part of the request. */
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            int *cfd = (int*) CMSG_DATA(cmsg);
+            int count = (cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            for (j = 0; j < count; j++) {
+                if (numfds < SIS_SERVE_MAXFDS) fds[numfds++] = cfd[j];
+                else close(cfd[j]);
+            }
+        }
+        used += n;
+        buf[used] = '\0';
+        while ((nl = strchr(buf, '\n')) != NULL) {
+            *nl = '\0';
+            if ((fp = open_memstream(&reply, &size)) == NULL) goto done;
+            serveRequest(fp, buf, fds, numfds);
+            fclose(fp);
+            for (j = 0; j < numfds; j++) close(fds[j]);
+            numfds = 0;
+            n = writeAll(fd, (unsigned char*)reply, size, err, sizeof(err));
+            free(reply);
+            if (n) goto done;
+            used -= nl+1-buf;
+            memmove(buf, nl+1, used+1);
+        }
+        if (used == sizeof(buf)-1) {
+            snprintf(err, sizeof(err), "{\"ok\":false,\"error\":\"request too long\"}\n");
+            writeAll(fd, (unsigned char*)err, strlen(err), err, sizeof(err));
+            break;
+        }
+    }
+done:
+    for (j = 0; j < numfds; j++) close(fds[j]);
+}
+
+static void serveWorker(int listenfd)
+{
+    int fd;
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    manifestFp = NULL;
+    while (1) {
+        if ((fd = accept(listenfd, NULL, NULL)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            exit(1);
+        }
+        serveConnection(fd);
+        close(fd);
+    }
+}
 
-static int ifFile(FILE *fp, char *err, int errlen)
+static void serveSignal(int sig)
 {
-    printf("[if (");
-    if (conditional(fp, err, errlen)) return 1;
-    printf(")]\n");
-    return 0;
+    SIS_NOTUSED(sig);
+    serveStop = 1;
 }
 
-static int elseifFile(FILE *fp, char *err, int errlen)
+static pid_t serveFork(int listenfd)
 {
-    printf("[else if (");
-    if (conditional(fp, err, errlen)) return 1;
-    printf(")]\n");
-    return 0;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        serveWorker(listenfd);
+        exit(0);
+    }
+    if (pid == -1) fprintf(stderr, "fork: %s\n", strerror(errno));
+    return pid;
 }
 
-static int optionsFile(FILE *fp, char *err, int errlen)
+/* Listen on the Unix socket 'path' with 'workers' worker processes, until
+ * SIGINT or SIGTERM is received. Workers that exit are restarted. */
+static int sisServe(char *path, int workers)
 {
-    unsigned int numopt, j;
-    unsigned char selected[16];
+    struct sockaddr_un sa;
+    struct sigaction act;
+    struct stat st;
+    pid_t *pids, pid;
+    int listenfd, j, status;
 
-    if (sisRead(fp, &numopt, 4, err, errlen)) return 1;
-    numopt = sis32toh(numopt);
-    for (j = 0; j < numopt; j++) {
-        unsigned int optlen, optoff;
-        char *optstr;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return 1;
+    }
+    if ((pids = calloc(workers, sizeof(pid_t))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    /* Remove the socket of a previous instance. */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        bind(listenfd, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+        listen(listenfd, 128) == -1)
+    {
+        fprintf(stderr, "%s: %s creating the socket\n", path, strerror(errno));
+        free(pids);
+        return 1;
+    }
 
-        if (sisRead(fp, &optlen, 4, err, errlen)) return 1;
-        if (sisRead(fp, &optoff, 4, err, errlen)) return 1;
-        optlen = sis32toh(optlen);
-        optoff = sis32toh(optoff);
-        if ((optstr = sisReadOffsetAlloc(fp, optlen, optoff, err, errlen)) == NULL) return 1;
-        uni2ascii(optstr,optlen);
-        printf("  option %d: %s\n", numopt-j, optstr);
-        free(optstr);
+    signal(SIGPIPE, SIG_IGN);
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = serveSignal;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    fflush(stdout);
+    for (j = 0; j < workers; j++) pids[j] = serveFork(listenfd);
+    printf("Serving on %s with %d workers\n", path, workers);
+    fflush(stdout);
+
+    while (!serveStop) {
+        if ((pid = wait(&status)) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (j = 0; j < workers; j++) {
+            if (pids[j] != pid) continue;
+            fprintf(stderr, "worker %d exited, restarting\n", (int) pid);
+            if (!serveStop) {
+                sleep(1);
+                pids[j] = serveFork(listenfd);
+            }
+        }
     }
-    /* Read the "selected options" section, but discard it */
-    if (sisRead(fp, selected, 16, err, errlen)) return 1;
+
+    for (j = 0; j < workers; j++)
+        if (pids[j] > 0) kill(pids[j], SIGTERM);
+    for (j = 0; j < workers; j++)
+        if (pids[j] > 0) waitpid(pids[j], NULL, 0);
+    close(listenfd);
+    unlink(path);
+    free(pids);
     return 0;
 }
 
-static int filesSection(FILE *fp, struct sishdr *hdr, char *err, int errlen)
+/* Send the files to the server listening on 'path', passing descriptors
+ * (so that the server does not need to see our paths), and print the
+ * replies. Files are extracted in the current directory with -x. */
+static int sisClient(char *path, char **filenames, int count, int triage)
 {
-    int j;
+    char cbuf[CMSG_SPACE(sizeof(int)*SIS_SERVE_MAXFDS)];
+    char *line = NULL, *req = NULL;
+    size_t linecap = 0;
+    struct sockaddr_un sa;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    FILE *replies = NULL;
+    int sock, dirfd = -1, fd, i, numfds, exitcode = 0;
+    ssize_t n;
 
-    if (sisSeek(fp, hdr->fileoff, err, errlen)) return 1;
-    printf("\nFiles\n");
-    for (j = 0; j < hdr->files; j++) {
-        unsigned int recordtype;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, path, sizeof(sa.sun_path)-1);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        connect(sock, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+        (fd = dup(sock)) == -1 || (replies = fdopen(fd, "r")) == NULL)
+    {
+        fprintf(stderr, "%s: %s connecting to the server\n", path,
+            strerror(errno));
+        return 1;
+    }
+    if (optExtract && (dirfd = open(".", O_RDONLY|O_DIRECTORY)) == -1) {
+        fprintf(stderr, "%s opening the current directory\n", strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
 
-        if (sisRead(fp, &recordtype, 4, err, errlen)) return 1;
-        recordtype = sis32toh(recordtype);
-        verbose("  FILE %d type %s\n",j+1,fileRecordTypeStr(recordtype));
-        switch(recordtype) {
-        case SIS_FILE_SIMPLE:
-            if (simpleFile(fp, hdr, j, 1, err, errlen)) return 1;
-            break;
-        case SIS_FILE_MULTILANG:
-            if (simpleFile(fp, hdr, j, hdr->languages, err, errlen)) return 1;
-            break;
-        case SIS_FILE_OPTIONS:
-            if (optionsFile(fp, err, errlen)) return 1;
-            break;
-        case SIS_FILE_IF:
-            if (ifFile(fp, err, errlen)) return 1;
-            break;
-        case SIS_FILE_ELSEIF:
-            if (elseifFile(fp, err, errlen)) return 1;
+    for (i = 0; i < count; i++) {
+        if (strpbrk(filenames[i], "\t\n")) {
+            fprintf(stderr, "%s: file name not supported\n", filenames[i]);
+            exitcode = 1;
+            continue;
+        }
+        if ((fd = open(filenames[i], O_RDONLY)) == -1) {
+            fprintf(stderr, "%s: %s opening file\n", filenames[i],
+                strerror(errno));
+            exitcode = 1;
+            continue;
+        }
+        free(req);
+        if ((req = malloc(strlen(filenames[i])+32)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        sprintf(req, "%s\t%s%s\n",
+            triage ? "triage" : (optExtract ? "extract" : "list"),
+            filenames[i], (!triage && optExtract) ? "\t." : "");
+        numfds = (!triage && optExtract) ? 2 : 1;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = req;
+        iov.iov_len = strlen(req);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int)*numfds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int)*numfds);
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        if (numfds == 2) memcpy(CMSG_DATA(cmsg)+sizeof(int), &dirfd, sizeof(int));
+        while ((n = sendmsg(sock, &msg, 0)) == -1 && errno == EINTR);
+        close(fd);
+        /* The request is tiny, a short write would mean a broken server. */
+        if (n != (ssize_t)iov.iov_len) {
+            fprintf(stderr, "%s: error sending the request\n", path);
+            exitcode = 1;
             break;
-        case SIS_FILE_ELSE: elseFile(); break;
-        case SIS_FILE_ENDIF: endifFile(); break;
-        default:
-            snprintf(err, errlen, "Unknown file record type %d", recordtype);
-            return 1;
+        }
+        if ((n = getline(&line, &linecap, replies)) <= 0) {
+            fprintf(stderr, "%s: connection closed by the server\n", path);
+            exitcode = 1;
             break;
         }
+        fputs(line, stdout);
+        if (n < 11 || strcmp(line+n-11, "\"ok\":true}\n")) exitcode = 1;
     }
-    printf("\n");
-    return 0;
+    free(req);
+    free(line);
+    fclose(replies);
+    close(sock);
+    if (dirfd != -1) close(dirfd);
+    return exitcode;
 }
 
-static int sisopen(char *filename, FILE *fp, char *err, int errlen)
+/* ---------------------------------- Watch ----------------------------------
+ * sisopen --watch DIR processes the packages landing in DIR as soon as they
+ * are complete: inotify reports the files closed after writing and the
+ * ones moved into the directory, and their names are passed to a pool of
+ * worker processes through a SOCK_SEQPACKET socket pair, one name for every
+ * message. Workers load (and with -x extract) every package, writing a
+ * JSON line like the --serve replies, and optionally move it into the
+ * --done directory if it was processed successfully. Packages already in
+ * DIR at startup are processed too. Output lines are written whole thanks
+ * to a token passed around with a pipe, like the make jobserver does.
+ *
+ * The parent polls the inotify descriptor along with a self-pipe written
+ * by the SIGCHLD handler, so that dead workers are restarted at once even
+ * if no package arrives. */
+
+#define SIS_WATCH_EVBUF 65536       /* inotify events read at once */
+
+static int watchChildPipe[2] = {-1, -1};
+
+static void watchChild(int sig)
 {
-    struct sishdr hdr;
-    int epocrelease = 0;
+    int saved = errno;
 
-    /* Header */
+    SIS_NOTUSED(sig);
+    if (write(watchChildPipe[1], "c", 1) == -1) {
+        /* Full pipe: a wakeup is already pending. */
+    }
+    errno = saved;
+}
 
-    if (sisRead(fp, &hdr, sizeof(hdr)-EPOC6_HDR_TAIL_LEN, err, errlen))
-        return 1;
-    hdr.uid1 = sis32toh(hdr.uid1);
-    hdr.uid2 = sis32toh(hdr.uid2);
-    hdr.uid3 = sis32toh(hdr.uid3);
-    hdr.uid4 = sis32toh(hdr.uid4);
-    hdr.cksum = sis16toh(hdr.cksum);
-    hdr.languages = sis16toh(hdr.languages);
-    hdr.files = sis16toh(hdr.files);
-    hdr.requisities = sis16toh(hdr.requisities);
-    hdr.instlang = sis16toh(hdr.instlang);
-    hdr.instfiles = sis16toh(hdr.instfiles);
-    hdr.instdrive = sis16toh(hdr.instdrive);
-    hdr.capabilities = sis16toh(hdr.capabilities);
-    hdr.installerver = sis32toh(hdr.installerver);
-    hdr.options = sis16toh(hdr.options);
-    hdr.type = sis16toh(hdr.type);
-    hdr.major = sis16toh(hdr.major);
-    hdr.minor = sis16toh(hdr.minor);
-    hdr.variant = sis32toh(hdr.variant);
-    hdr.langoff = sis32toh(hdr.langoff);
-    hdr.fileoff = sis32toh(hdr.fileoff);
-    hdr.reqoff = sis32toh(hdr.reqoff);
-    hdr.certoff = sis32toh(hdr.certoff);
-    hdr.compnameoff = sis32toh(hdr.compnameoff);
-
-    if (hdr.uid3 == 0x10000419) {
-        printf("%s: SIS header detected\n", filename);
-    } else {
-        snprintf(err, errlen, "file corrupted or not a SIS file");
-        return 1;
+/* A package queued at startup: an event for the same name may follow if
+ * it was completed after the watch was added, see watchSeen(). */
+struct watchStartup {
+    char *name;
+    off_t size;
+    struct timespec mtime;
+    int seen;                   /* an event for it was already received */
+};
+
+static int watchStartupCompare(const void *a, const void *b)
+{
+    return strcmp(((struct watchStartup*)a)->name,
+                  ((struct watchStartup*)b)->name);
+}
+
+/* Return true if the event for 'name' is about a package already queued
+ * at startup, with the same size and mtime (or gone already), so that it
+ * must not be processed again. Only the first event of every name is
+ * matched: later ones are always new versions of the file. */
+static int watchSeen(struct watchStartup *st, int count, int dirfd, char *name)
+{
+    struct watchStartup key, *w;
+    struct stat sb;
+
+    key.name = name;
+    if (count == 0 || (w = bsearch(&key, st, count, sizeof(*st),
+        watchStartupCompare)) == NULL || w->seen) return 0;
+    w->seen = 1;
+    if (fstatat(dirfd, name, &sb, 0) == -1) return 1;
+    return sb.st_size == w->size && sb.st_mtim.tv_sec == w->mtime.tv_sec &&
+           sb.st_mtim.tv_nsec == w->mtime.tv_nsec;
+}
+
+static int watchIsPackage(char *name)
+{
+    size_t len = strlen(name);
+
+    return name[0] != '.' && len > 4 && !strcasecmp(name+len-4, ".sis");
+}
+
+/* Load the package 'name' in the watched directory 'dirfd' ('dir' is its
+ * path), appending the JSON result to 'fp'. With -x the files are
+ * extracted in a directory named after the package. Returns 0 if the
+ * package was processed successfully. */
+static int watchPackage(FILE *fp, int dirfd, char *dir, char *name)
+{
+    char err[SISOPEN_ERRLEN], *path, *xdir = NULL;
+    struct sispkg pkg;
+    struct sisfile sf;
+    FILE *in = NULL;
+    int fd, j, xfd, loaded = 0, retval = 1;
+
+    if ((path = malloc(strlen(dir)+strlen(name)+2)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
     }
-    printf("  application UID: 0x%04X\n", hdr.uid1);
-    verbose("  UID2: %04X", hdr.uid2);
-    switch(hdr.uid2) {
-    case 0x1000006D:
-        epocrelease = 5;
-        verbose(" (EPOC release 3,4,5)");
-        break;
-    case 0x10003A12:
-        epocrelease = 6;
-        verbose(" (EPOC release 6)");
-        break;
+    sprintf(path, "%s/%s", dir, name);
+    fprintf(fp, "{\"file\":");
+    jsonString(fp, path);
+    if ((fd = openat(dirfd, name, O_RDONLY)) == -1 ||
+        (in = fdopen(fd, "r")) == NULL)
+    {
+        snprintf(err, sizeof(err), "%s opening file", strerror(errno));
+        if (fd != -1) close(fd);
+        goto reply;
     }
-    /* If it's an EPOC release 6 file read the rest of the header */
-    if (epocrelease == 6) {
-        unsigned char *tail = ((unsigned char*)&hdr)+(sizeof(hdr)-EPOC6_HDR_TAIL_LEN);
-        if (sisRead(fp, tail, EPOC6_HDR_TAIL_LEN, err, errlen)) return 1;
-        hdr.signoff = sis32toh(hdr.signoff);
-        hdr.capaoff = sis32toh(hdr.capaoff);
-        hdr.instspace = sis32toh(hdr.instspace);
-        hdr.maxinstspace = sis32toh(hdr.maxinstspace);
+    sisFileInit(&sf, in);
+    loaded = 1;
+    retval = sisLoad(&pkg, path, &sf, err, sizeof(err));
+    if (pkg.valid) jsonHeader(fp, &pkg);
+    if (retval) goto reply;
+    jsonRecords(fp, &pkg);
+    if (optExtract) {
+        if ((xdir = strdup(name)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        xdir[strlen(xdir)-4] = '\0';
+        if ((mkdir(xdir, 0777) == -1 && errno != EEXIST) ||
+            (xfd = open(xdir, O_RDONLY|O_DIRECTORY)) == -1)
+        {
+            snprintf(err, sizeof(err), "%s creating %s", strerror(errno), xdir);
+            retval = 1;
+            goto reply;
+        }
+        fprintf(fp, ",\"dir\":");
+        jsonString(fp, xdir);
+        extractDir = xfd;
+        retval = jsonExtract(fp, &pkg, err, sizeof(err));
+        extractDir = AT_FDCWD;
+        close(xfd);
+    } else if (manifestFp) {
+        /* Only hash the payloads for the manifest. */
+        for (j = 0; j < pkg.numrecords && retval == 0; j++) {
+            struct sisrecord *r = &pkg.records[j];
+
+            if (r->type == SIS_FILE_SIMPLE || r->type == SIS_FILE_MULTILANG)
+                retval = extractRecord(&pkg, j, 0, err, sizeof(err));
+        }
     }
 
-    /* Show header information */
-    verbose("\n");
-    verbose("  installer version required: %d\n", hdr.installerver);
-    verbose("  number of languages in this SIS: %d\n", hdr.languages);
-    verbose("  number of files in this SIS: %d\n", hdr.files);
-    verbose("  options:");
-    if (hdr.options & SIS_OPT_UNICODE) verbose(" unicode");
-    if (hdr.options & SIS_OPT_DISTRIBUTABLE) verbose(" distributable");
-    if (hdr.options & SIS_OPT_NOCOMPRESS) {
-        flagNocompr = 1;
-        verbose(" nocompress");
-    }
-    if (hdr.options & SIS_OPT_SHUTDOWNAPPS) verbose(" shutdownapps");
-    if (hdr.options == 0) verbose("none");
-    verbose("\n");
-    verbose("  package type: ");
-    switch(hdr.type) {
-    case SIS_TYPE_SA: verbose("application"); break;
-    case SIS_TYPE_SY: verbose("shared/system component/library"); break;
-    case SIS_TYPE_SO: verbose("optional component"); break;
-    case SIS_TYPE_SC: verbose("configuration"); break;
-    case SIS_TYPE_SP: verbose("patch"); break;
-    case SIS_TYPE_SU: verbose("upgrade"); break;
-    default: verbose("unknown (%d)", hdr.type); break;
+reply:
+    fprintf(fp, ",\"ok\":%s", retval ? "false" : "true");
+    if (retval) {
+        fprintf(fp, ",\"error\":");
+        jsonString(fp, err);
     }
-    verbose("\n");
-    printf("  application version: %d.%02d\n", hdr.major, hdr.minor);
-    verbose("  variant: %d\n", hdr.variant);
-    verbose("  languages section is at: %d\n", hdr.langoff);
-    verbose("  files section is at    : %d\n", hdr.fileoff);
+    fprintf(fp, "}\n");
+    if (loaded) sisFree(&pkg);
+    if (in) fclose(in);
+    free(xdir);
+    free(path);
+    return retval;
+}
 
-    /* Show epoc6 additional header info */
-    if (epocrelease == 6) {
-        verbose("  installed space (last installation): %d\n", hdr.instspace);
-        verbose("  max installed space: %d\n", hdr.maxinstspace);
+/* Write the 'len' bytes at 'buf' to 'fd' while holding the output token,
+ * so that lines of different workers are never mixed. */
+static void watchWrite(int *token, int fd, char *buf, size_t len)
+{
+    char err[SISOPEN_ERRLEN], c;
+
+    while (read(token[0], &c, 1) == -1 && errno == EINTR);
+    if (writeAll(fd, (unsigned char*)buf, len, err, sizeof(err)))
+        fprintf(stderr, "%s\n", err);
+    while (write(token[1], &c, 1) == -1 && errno == EINTR);
+}
+
+/* Process the packages whose names are received from 'sock', until the
+ * socket is closed by the parent or we are asked to stop. */
+static void watchWorker(int sock, int dirfd, char *dir, int donefd, int *token)
+{
+    FILE *manifest = manifestFp, *out;
+    char name[NAME_MAX+1], *buf, *mbuf = NULL;
+    size_t size, msize;
+    ssize_t n;
+    int retval;
+
+    while (!serveStop) {
+        if ((n = recv(sock, name, sizeof(name)-1, 0)) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (n == 0) break;
+        name[n] = '\0';
+        if ((out = open_memstream(&buf, &size)) == NULL ||
+            (manifest && (manifestFp = open_memstream(&mbuf, &msize)) == NULL))
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        retval = watchPackage(out, dirfd, dir, name);
+        fclose(out);
+        watchWrite(token, STDOUT_FILENO, buf, size);
+        free(buf);
+        if (manifest) {
+            fclose(manifestFp);
+            watchWrite(token, fileno(manifest), mbuf, msize);
+            free(mbuf);
+        }
+        /* Failed packages stay where they are, to be looked at. */
+        if (retval == 0 && donefd != -1 &&
+            renameat(dirfd, name, donefd, name) == -1)
+        {
+            fprintf(stderr, "%s: %s moving to the done directory\n", name,
+                strerror(errno));
+        }
     }
+    manifestFp = manifest;
+}
 
-    /* Languages */
-    if (langaugesSection(fp,&hdr,err,errlen)) return 1;
+struct watchPool {
+    int sock;                   /* workers end of the socket pair */
+    int dirfd;
+    char *dir;
+    int donefd;
+    int token[2];
+    int closefds[4];            /* parent descriptors, closed in workers */
+};
 
-    /* Files */
-    if (filesSection(fp,&hdr,err,errlen)) return 1;
+static pid_t watchFork(struct watchPool *wp)
+{
+    pid_t pid = fork();
+    int j;
 
-    return 0;
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        for (j = 0; j < 4; j++) close(wp->closefds[j]);
+        watchWorker(wp->sock, wp->dirfd, wp->dir, wp->donefd, wp->token);
+        exit(0);
+    }
+    if (pid == -1) fprintf(stderr, "fork: %s\n", strerror(errno));
+    return pid;
+}
+
+/* Queue the package 'name' for the workers. */
+static void watchQueue(int sock, char *name)
+{
+    while (send(sock, name, strlen(name), 0) == -1) {
+        if (errno == EINTR && !serveStop) continue;
+        if (errno != EINTR)
+            fprintf(stderr, "%s: %s queueing the file\n", name, strerror(errno));
+        return;
+    }
+}
+
+/* Watch 'dir' with 'workers' worker processes until SIGINT or SIGTERM.
+ * Processed packages are moved into 'done', if not NULL. */
+static int sisWatch(char *dir, char *done, int workers)
+{
+    struct watchPool wp;
+    struct watchStartup *startup = NULL, *w;
+    struct sigaction act;
+    struct pollfd pfd[2];
+    struct dirent *de;
+    struct stat sb;
+    DIR *d;
+    char *evbuf, *p, c;
+    pid_t *pids, pid;
+    ssize_t n;
+    int ifd, sv[2], j, status, numstartup = 0, retval = 0;
+
+    wp.dir = dir;
+    wp.donefd = -1;
+    if ((wp.dirfd = open(dir, O_RDONLY|O_DIRECTORY)) == -1) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    if (done && (wp.donefd = open(done, O_RDONLY|O_DIRECTORY)) == -1) {
+        fprintf(stderr, "%s: %s\n", done, strerror(errno));
+        return 1;
+    }
+    if ((ifd = inotify_init1(IN_CLOEXEC)) == -1 ||
+        inotify_add_watch(ifd, dir, IN_CLOSE_WRITE|IN_MOVED_TO) == -1)
+    {
+        fprintf(stderr, "%s: %s watching the directory\n", dir, strerror(errno));
+        return 1;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) == -1 ||
+        pipe(wp.token) == -1 || write(wp.token[1], "t", 1) != 1 ||
+        pipe2(watchChildPipe, O_CLOEXEC|O_NONBLOCK) == -1)
+    {
+        fprintf(stderr, "%s creating the worker pool\n", strerror(errno));
+        return 1;
+    }
+    evbuf = malloc(SIS_WATCH_EVBUF);
+    pids = calloc(workers, sizeof(pid_t));
+    if (evbuf == NULL || pids == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    wp.sock = sv[1];
+    wp.closefds[0] = sv[0];
+    wp.closefds[1] = ifd;
+    wp.closefds[2] = watchChildPipe[0];
+    wp.closefds[3] = watchChildPipe[1];
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = serveSignal;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    act.sa_handler = watchChild;
+    act.sa_flags = SA_RESTART|SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &act, NULL);
+    fflush(stdout);
+    if (manifestFp) fflush(manifestFp);
+    for (j = 0; j < workers; j++) pids[j] = watchFork(&wp);
+    fprintf(stderr, "Watching %s with %d workers\n", dir, workers);
+
+    /* The watch is already active: packages that were there before are
+     * queued now, the new ones as they arrive. Their identity is kept, so
+     * that the event of one completed just after the watch was added
+     * doesn't queue it twice. */
+    if ((d = fdopendir(dup(wp.dirfd))) != NULL) {
+        while ((de = readdir(d)) != NULL && !serveStop) {
+            if (!watchIsPackage(de->d_name) ||
+                fstatat(wp.dirfd, de->d_name, &sb, 0) == -1) continue;
+            if ((numstartup & (numstartup-1)) == 0) {
+                w = realloc(startup, sizeof(*w)*(numstartup ? numstartup*2 : 16));
+                if (w == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(1);
+                }
+                startup = w;
+            }
+            w = &startup[numstartup++];
+            if ((w->name = strdup(de->d_name)) == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+            w->size = sb.st_size;
+            w->mtime = sb.st_mtim;
+            w->seen = 0;
+            watchQueue(sv[0], de->d_name);
+        }
+        closedir(d);
+        if (numstartup)
+            qsort(startup, numstartup, sizeof(*startup), watchStartupCompare);
+    }
+    pfd[0].fd = ifd;
+    pfd[1].fd = watchChildPipe[0];
+    pfd[0].events = pfd[1].events = POLLIN;
+    while (!serveStop) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "%s: %s waiting for events\n", dir, strerror(errno));
+            retval = 1;
+            break;
+        }
+        /* Restart the workers that died. */
+        if (pfd[1].revents) {
+            while (read(watchChildPipe[0], &c, 1) == 1);
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (j = 0; j < workers; j++) {
+                    if (pids[j] != pid) continue;
+                    fprintf(stderr, "worker %d exited, restarting\n", (int) pid);
+                    if (!serveStop) pids[j] = watchFork(&wp);
+                }
+            }
+        }
+        if (pfd[0].revents == 0) continue;
+        if ((n = read(ifd, evbuf, SIS_WATCH_EVBUF)) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "%s: %s reading events\n", dir, strerror(errno));
+            retval = 1;
+            break;
+        }
+        for (p = evbuf; p < evbuf+n; p += sizeof(struct inotify_event)+((struct inotify_event*)p)->len) {
+            struct inotify_event *ev = (struct inotify_event*)p;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+                fprintf(stderr, "%s: too many events, some files were missed\n", dir);
+            if (ev->len && !(ev->mask & IN_ISDIR) && watchIsPackage(ev->name) &&
+                !watchSeen(startup, numstartup, wp.dirfd, ev->name))
+            {
+                watchQueue(sv[0], ev->name);
+            }
+        }
+    }
+
+    /* Workers exit once the packages already queued are processed. */
+    close(sv[0]);
+    close(sv[1]);
+    signal(SIGCHLD, SIG_DFL);
+    for (j = 0; j < workers; j++)
+        if (pids[j] > 0) waitpid(pids[j], NULL, 0);
+    for (j = 0; j < numstartup; j++) free(startup[j].name);
+    free(startup);
+    close(watchChildPipe[0]);
+    close(watchChildPipe[1]);
+    close(ifd);
+    free(evbuf);
+    free(pids);
+    return retval;
 }
 
 static void guessEndianess(void)
@@ -812,12 +7821,46 @@ static void guessEndianess(void)
     lendian = (*y == 1);
 }
 
-enum options {OPT_HELP, OPT_EXTRACT, OPT_VERBOSE};
+enum options {OPT_HELP, OPT_EXTRACT, OPT_VERBOSE, OPT_PREFETCH, OPT_MANIFEST,
+              OPT_DIFF, OPT_RECURSE, OPT_MAXDEPTH, OPT_SERVE, OPT_CLIENT,
+              OPT_WORKERS, OPT_TRIAGE, OPT_BENCH, OPT_GREP, OPT_JOBS,
+              OPT_DEVICE, OPT_FSYNC, OPT_WATCH, OPT_DONE, OPT_CAT, OPT_CARVE, OPT_CACHE, OPT_JOURNAL, OPT_MATRIX,
+              OPT_SHARD, OPT_SHARDBY, OPT_DEPS, OPT_SUMMARY,
+              OPT_TRUST, OPT_IOLIMIT, OPT_IOPSLIMIT, OPT_PROVIDED};
 
 static struct ago_optlist optList[] = {
     {'h', "help",       OPT_HELP,       AGO_NOARG},
     {'x', "extract",    OPT_EXTRACT,    AGO_NOARG},
     {'v', "verbose",    OPT_VERBOSE,    AGO_NOARG},
+    {'\0', "prefetch",  OPT_PREFETCH,   AGO_NEEDARG},
+    {'\0', "manifest",  OPT_MANIFEST,   AGO_NEEDARG},
+    {'\0', "diff",      OPT_DIFF,       AGO_NOARG},
+    {'r', "recurse",    OPT_RECURSE,    AGO_NOARG},
+    {'\0', "max-depth", OPT_MAXDEPTH,   AGO_NEEDARG},
+    {'\0', "serve",     OPT_SERVE,      AGO_NEEDARG},
+    {'\0', "client",    OPT_CLIENT,     AGO_NEEDARG},
+    {'\0', "workers",   OPT_WORKERS,    AGO_NEEDARG},
+    {'\0', "triage",    OPT_TRIAGE,     AGO_NOARG},
+    {'\0', "bench",     OPT_BENCH,      AGO_NOARG},
+    {'\0', "grep",      OPT_GREP,       AGO_NEEDARG},
+    {'j', "jobs",        OPT_JOBS,       AGO_NEEDARG},
+    {'\0', "device",    OPT_DEVICE,     AGO_NEEDARG},
+    {'\0', "fsync",     OPT_FSYNC,      AGO_NEEDARG},
+    {'\0', "watch",     OPT_WATCH,      AGO_NEEDARG},
+    {'\0', "done",      OPT_DONE,       AGO_NEEDARG},
+    {'\0', "cat",       OPT_CAT,        AGO_NEEDARG},
+    {'\0', "carve",     OPT_CARVE,      AGO_NEEDARG},
+    {'\0', "cache",     OPT_CACHE,      AGO_NEEDARG},
+    {'\0', "journal",   OPT_JOURNAL,    AGO_NEEDARG},
+    {'\0', "matrix",    OPT_MATRIX,     AGO_NEEDARG},
+    {'\0', "shard",     OPT_SHARD,      AGO_NEEDARG},
+    {'\0', "shard-by",  OPT_SHARDBY,    AGO_NEEDARG},
+    {'\0', "deps",      OPT_DEPS,       AGO_NOARG},
+    {'\0', "summary",   OPT_SUMMARY,    AGO_NOARG},
+    {'\0', "trust",     OPT_TRUST,      AGO_NEEDARG},
+    {'\0', "io-limit",  OPT_IOLIMIT,    AGO_NEEDARG},
+    {'\0', "iops-limit",OPT_IOPSLIMIT,  AGO_NEEDARG},
+    {'\0', "provided",  OPT_PROVIDED,   AGO_NEEDARG},
     AGO_LIST_TERM
 };
 
@@ -825,6 +7868,35 @@ static struct {int opt; char *descr;} optDescr[] = {
     {OPT_HELP, "Show this help"},
     {OPT_EXTRACT, "Extract files instead to just list file names"},
     {OPT_VERBOSE, "Show more information about the SIS file(s)"},
+    {OPT_PREFETCH, "Number of files to read ahead (default 4, 0 disables)"},
+    {OPT_MANIFEST, "Write SHA-256/CRC32 of every payload to <arg> (- for stdout)"},
+    {OPT_DIFF, "Show what changed between two packages (old.sis new.sis)"},
+    {OPT_RECURSE, "Also process component files that are SIS packages"},
+    {OPT_MAXDEPTH, "Nesting limit of --recurse (default 8)"},
+    {OPT_SERVE, "Serve requests on the Unix socket <arg>"},
+    {OPT_CLIENT, "Send the files to the server listening on <arg>"},
+    {OPT_WORKERS, "Number of --serve/--watch worker processes (default: CPUs)"},
+    {OPT_TRIAGE, "With --client, only ask for header and totals"},
+    {OPT_BENCH, "Show the speed of every decompression backend"},
+    {OPT_GREP, "Search payloads for <arg> (\\xNN escapes, can be repeated)"},
+    {OPT_JOBS, "Threads of --grep/--carve/--deps/--summary (default: CPUs)"},
+    {OPT_DEVICE, "Show and extract only files installed on a device (NAME=VALUE,...)"},
+    {OPT_FSYNC, "Sync extracted files: file, package or never (default)"},
+    {OPT_WATCH, "Process the packages landing in the directory <arg>"},
+    {OPT_DONE, "With --watch, move processed packages to <arg>"},
+    {OPT_CAT, "Write the file <arg> (name or #index) to the standard output"},
+    {OPT_CARVE, "Find and list (or extract) the packages inside the image <arg>"},
+    {OPT_CACHE, "Keep up to <arg> MB of fetched files in memory (default 0)"},
+    {OPT_JOURNAL, "Record processed packages in <arg>, skip them when run again"},
+    {OPT_MATRIX, "Show the files installed on every device of the CSV file <arg>"},
+    {OPT_SHARD, "Only process the files of shard <arg> (I/N, I from 1 to N)"},
+    {OPT_SHARDBY, "Assign files to shards by: name (default) or size"},
+    {OPT_DEPS, "Resolve requisites: missing ones, cycles, installation order"},
+    {OPT_SUMMARY, "Show totals by type, release, language, file type and ratio"},
+    {OPT_TRUST, "Trusted certificates (PEM or DER) for signatures, can be repeated"},
+    {OPT_IOLIMIT, "Limit reads and writes to MB/s (10% kept for metadata)"},
+    {OPT_IOPSLIMIT, "Limit reads and writes to operations per second"},
+    {OPT_PROVIDED, "With --deps, UIDs (0x...,...) provided by the device"},
     {0, NULL}
 };
 
@@ -869,12 +7941,20 @@ static void showHelp(void)
 
 int main(int argc, char **argv)
 {
-    FILE *fp;
-    char err[SISOPEN_ERRLEN];
+    struct prefetch *ring, *pf;
+    struct sisfile sf;
+    struct sisdevice device;
+    char err[SISOPEN_ERRLEN], *item, *end;
     int exitcode = 0;
     char **filenames = NULL;
     int numFilenames = 0;
-    int i, o;
+    int i, o, slots, opened = 0;
+    char *serveSock = NULL, *clientSock = NULL, *watchDir = NULL;
+    char *doneDir = NULL, *catName = NULL, *carveImage = NULL;
+    char *matrixCsv = NULL;
+    int workers = 0, triage = 0, bench = 0, jobs = 0, deps = 0;
+    int summary = 0;
+    double ioLimit = 0, iopsLimit = 0, cacheMB;
 
     /* Parse command line options */
     while ((o = antigetopt(argc, argv, optList)) != AGO_EOF) {
@@ -896,6 +7976,160 @@ int main(int argc, char **argv)
         case OPT_VERBOSE:
             optVerbose = 1;
             break;
+        case OPT_MANIFEST:
+            if (!strcmp(ago_optarg, "-")) {
+                manifestFp = stdout;
+            } else if ((manifestFp = fopen(ago_optarg, "w")) == NULL) {
+                fprintf(stderr, "%s: %s opening manifest\n", ago_optarg,
+                        strerror(errno));
+                exit(1);
+            }
+            fprintf(manifestFp, "# package\tindex\tname\tlanguage\tlength\t"
+                "original length\tsha256\tcrc32\tsha256 (as stored)\n");
+            break;
+        case OPT_DIFF:
+            optDiff = 1;
+            break;
+        case OPT_RECURSE:
+            optRecurse = 1;
+            break;
+        case OPT_MAXDEPTH:
+            optMaxDepth = atoi(ago_optarg);
+            break;
+        case OPT_SERVE:
+            serveSock = ago_optarg;
+            break;
+        case OPT_CLIENT:
+            clientSock = ago_optarg;
+            break;
+        case OPT_WORKERS:
+            workers = atoi(ago_optarg);
+            break;
+        case OPT_TRIAGE:
+            triage = 1;
+            break;
+        case OPT_BENCH:
+            bench = 1;
+            break;
+        case OPT_GREP:
+            if (grepAddPattern(ago_optarg)) {
+                fprintf(stderr, "Invalid --grep pattern: %s\n", ago_optarg);
+                exit(2);
+            }
+            break;
+        case OPT_JOBS:
+            jobs = atoi(ago_optarg);
+            break;
+        case OPT_WATCH:
+            watchDir = ago_optarg;
+            break;
+        case OPT_DONE:
+            doneDir = ago_optarg;
+            break;
+        case OPT_CAT:
+            catName = ago_optarg;
+            break;
+        case OPT_CARVE:
+            carveImage = ago_optarg;
+            break;
+        case OPT_MATRIX:
+            matrixCsv = ago_optarg;
+            break;
+        case OPT_DEPS:
+            deps = 1;
+            break;
+        case OPT_PROVIDED:
+            if (depsProvide(ago_optarg)) {
+                fprintf(stderr, "Invalid --provided: %s\n", ago_optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SUMMARY:
+            summary = 1;
+            break;
+        case OPT_TRUST:
+            if (trustLoad(ago_optarg, err, sizeof(err))) {
+                fprintf(stderr, "Invalid --trust: %s\n", err);
+                exit(1);
+            }
+            break;
+        case OPT_IOLIMIT:
+            ioLimit = strtod(ago_optarg, &end)*1e6;
+            if (end == ago_optarg || *end != '\0' || ioLimit <= 0) {
+                fprintf(stderr, "Invalid --io-limit: %s\n", ago_optarg);
+                exit(1);
+            }
+            break;
+        case OPT_IOPSLIMIT:
+            iopsLimit = strtod(ago_optarg, &end);
+            if (end == ago_optarg || *end != '\0' || iopsLimit <= 0) {
+                fprintf(stderr, "Invalid --iops-limit: %s\n", ago_optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SHARD:
+            if (sscanf(ago_optarg, "%d/%d", &shardIndex, &shardCount) != 2 ||
+                shardCount < 1 || shardIndex < 1 || shardIndex > shardCount)
+            {
+                fprintf(stderr, "Invalid --shard: %s (use I/N, I from 1 to N)\n",
+                    ago_optarg);
+                exit(1);
+            }
+            shardIndex--;
+            break;
+        case OPT_SHARDBY:
+            if (!strcasecmp(ago_optarg, "size")) {
+                shardBySize = 1;
+            } else if (!strcasecmp(ago_optarg, "name")) {
+                shardBySize = 0;
+            } else {
+                fprintf(stderr, "Invalid --shard-by: %s\n", ago_optarg);
+                exit(1);
+            }
+            break;
+        case OPT_CACHE:
+            cacheMB = strtod(ago_optarg, &end);
+            if (end == ago_optarg || *end != '\0' || cacheMB < 0 ||
+                cacheMB*1024*1024 > (double)SIZE_MAX/2)
+            {
+                fprintf(stderr, "Invalid --cache: %s\n", ago_optarg);
+                exit(1);
+            }
+            payloadCache.budget = (size_t)(cacheMB*1024*1024);
+            break;
+        case OPT_JOURNAL:
+            if (journalOpen(ago_optarg, err, sizeof(err))) {
+                fprintf(stderr, "Invalid --journal: %s\n", err);
+                exit(1);
+            }
+            break;
+        case OPT_FSYNC:
+            if (!strcasecmp(ago_optarg, "file")) {
+                optFsync = SIS_FSYNC_FILE;
+            } else if (!strcasecmp(ago_optarg, "package")) {
+                optFsync = SIS_FSYNC_PACKAGE;
+            } else if (!strcasecmp(ago_optarg, "never")) {
+                optFsync = SIS_FSYNC_NEVER;
+            } else {
+                fprintf(stderr, "Invalid --fsync policy: %s\n", ago_optarg);
+                exit(1);
+            }
+            break;
+        case OPT_DEVICE:
+            if (optDevice == NULL) {
+                memset(&device, 0, sizeof(device));
+                optDevice = &device;
+            }
+            for (item = strtok(ago_optarg, ","); item; item = strtok(NULL, ",")) {
+                if (deviceSet(optDevice, item, err, sizeof(err))) {
+                    fprintf(stderr, "Invalid --device: %s\n", err);
+                    exit(1);
+                }
+            }
+            break;
+        case OPT_PREFETCH:
+            optPrefetch = prefetchParse(ago_optarg);
+            break;
         case AGO_ALONE:
             filenames = realloc(filenames,(numFilenames+1)*sizeof(char*));
             if (!filenames) {
@@ -912,25 +8146,142 @@ int main(int argc, char **argv)
         }
     }
 
+    guessEndianess();
+    if (ioSetLimits(ioLimit, iopsLimit)) {
+        fprintf(stderr, "Can't set up the I/O limits: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (serveSock) {
+        if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers <= 0) workers = 1;
+        return sisServe(serveSock, workers);
+    }
+
+    if (watchDir) {
+        if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers <= 0) workers = 1;
+        return sisWatch(watchDir, doneDir, workers);
+    }
+
+    if (carveImage) {
+        if (jobs <= 0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs <= 0) jobs = 1;
+        return sisCarve(carveImage, jobs);
+    }
+
     if (numFilenames == 0) {
         showHelp();
         exit(1);
     }
+    if (!clientSock) numFilenames = archiveExpand(&filenames, numFilenames);
+    if (shardCount) numFilenames = shardFilter(filenames, numFilenames);
 
-    guessEndianess();
+    if (grepNumPatterns) {
+        if (jobs <= 0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs <= 0) jobs = 1;
+        exitcode = sisGrep(filenames, numFilenames, jobs);
+        free(filenames);
+        return exitcode;
+    }
+
+    if (summary) {
+        if (jobs <= 0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs <= 0) jobs = 1;
+        exitcode = sisSummarize(filenames, numFilenames, jobs);
+        free(filenames);
+        return exitcode;
+    }
+
+    if (deps) {
+        if (jobs <= 0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs <= 0) jobs = 1;
+        exitcode = sisDeps(filenames, numFilenames, jobs);
+        free(filenames);
+        return exitcode;
+    }
+
+    if (matrixCsv) {
+        exitcode = sisMatrix(matrixCsv, filenames, numFilenames);
+        free(filenames);
+        return exitcode;
+    }
+
+    if (catName) {
+        exitcode = sisCat(filenames, numFilenames, catName);
+        free(filenames);
+        return exitcode;
+    }
+
+    if (bench) {
+        exitcode = sisBench(filenames, numFilenames);
+        free(filenames);
+        return exitcode;
+    }
+
+    if (clientSock) {
+        exitcode = sisClient(clientSock, filenames, numFilenames, triage);
+        free(filenames);
+        return exitcode;
+    }
+
+    if (optDiff) {
+        if (numFilenames != 2) {
+            fprintf(stderr, "--diff requires exactly two file names\n");
+            exit(2);
+        }
+        exitcode = sisDiff(filenames[0], filenames[1]);
+        free(filenames);
+        return exitcode;
+    }
 
+    if (journalFd != -1) numFilenames = journalFilter(filenames, numFilenames);
+    slots = optPrefetch+1;
+    if ((ring = calloc(slots, sizeof(*ring))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
     for (i = 0; i < numFilenames; i++) {
-        if ((fp = fopen(filenames[i], "r")) == NULL) {
+        /* Keep files i .. i+optPrefetch open, the oldest slot in the ring
+         * is always the one of the file we are going to process. */
+        while (opened < numFilenames && opened <= i+optPrefetch) {
+            prefetchOpen(&ring[opened % slots], filenames[opened]);
+            opened++;
+        }
+        if (i+1 < opened) prefetchTable(&ring[(i+1) % slots]);
+
+        pf = &ring[i % slots];
+        if (pf->fp == NULL && pf->err == 0) {
+            if (sisInputOpen(&sf, filenames[i], err, SISOPEN_ERRLEN)) {
+                fprintf(stderr, "%s: %s\n", filenames[i], err);
+                exitcode = 1;
+                continue;
+            }
+        } else if (pf->fp == NULL) {
             fprintf(stderr, "%s: %s opening file\n", filenames[i],
-                    strerror(errno));
+                    strerror(pf->err));
             exitcode = 1;
             continue;
+        } else {
+            if (optExtract && optPrefetch)
+                sisAdvise(pf->fp, 0, 0, POSIX_FADV_SEQUENTIAL);
+            sisFileInit(&sf, pf->fp);
         }
-        if (sisopen(filenames[i], fp, err, SISOPEN_ERRLEN) != 0) {
+        journalBegin(filenames[i], sf.fp);
+        if (sisopen(filenames[i], NULL, &sf, 0, err, SISOPEN_ERRLEN) != 0) {
             fprintf(stderr, "%s: %s\n", filenames[i], err);
             exitcode = 1;
+            journalEnd(0);
+        } else {
+            journalEnd(1);
         }
-        fclose(fp);
+        if (pf->fp) prefetchClose(pf);
+        else sisInputClose(&sf);
+    }
+    free(ring);
+    if (manifestFp && manifestFp != stdout && fclose(manifestFp) == EOF) {
+        fprintf(stderr, "Error writing the manifest: %s\n", strerror(errno));
+        exitcode = 1;
     }
     free(filenames);
     return exitcode;